@@ -1,4 +1,5 @@
 // S1.c - Main Server Side Code // 
+#define _GNU_SOURCE  // splice(), pipe2() and friends used by protocol.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,18 +8,204 @@
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/stat.h>
 
+#include "protocol.h"
+#include "tarstream.h"
+#include "listing.h"
+#include "routing.h"
+#include "chunked.h"
+
 
 #define PORT 1221
 #define BUFFER_SIZE 4096
-#define MAX_CLIENTS 10
+#define WORKER_COUNT 32      // Default client worker threads (S1_WORKERS)
+#define QUEUE_SIZE 64        // Default requests (sessions with S1_EVENT_LOOP=threads) waiting for a worker (S1_QUEUE_SIZE)
+#define MAX_WORKERS 1024     // Upper bound for S1_WORKERS
+#define MAX_QUEUE 4096       // Upper bound for S1_QUEUE_SIZE
+#define QUEUE_WAIT_MS 5000   // Thread mode: longest a session waits for a worker (S1_QUEUE_WAIT_MS, 0: no limit)
+#define MAX_EVENT_LOOPS 64   // Upper bound for S1_EVENT_THREADS
+#define EVENT_BATCH 256      // Readiness events handled per epoll_wait() call
+#define SPOOL_MAX_BYTES (256LL * 1024 * 1024)  // Cap on uploads queued for an unreachable sub-server
+#define SPOOL_RETRY_SECONDS 5                  // How often spooled uploads are retried
+#define SPOOL_RESERVE_STEP (1024 * 1024)       // Spool space an upload reserves at a time
+#define POOL_SIZE 8              // Default idle connections kept per sub-server (S1_POOL_SIZE)
+#define POOL_MAX_IDLE 64         // Upper bound for S1_POOL_SIZE
+#define MAX_POOLS 16             // Distinct sub-server endpoints S1 can pool connections to
+#define POOL_HEALTH_SECONDS 15   // Idle pooled connections are pinged this often
+#define POOL_DOWN_SECONDS 5      // A sub-server that refused a connection is read from last this long
+#define REPLICA_QUEUE_MAX 10000  // Default replica copies/removals waiting (S1_REPLICA_QUEUE)
+#define REPLICA_THREADS 2        // Background replicator threads
+#define REPLICA_RETRY_SECONDS 5  // Pause before retrying a replica that was unreachable
+#define REPLICA_MAX_ATTEMPTS 720 // Give up on a replica after this many tries (an hour of retries)
+#define UPLOAD_PINS_MAX 256      // Chunked uploads whose backend S1 remembers
+#define UPLOAD_PIN_SECONDS 600   // A pin unused this long is dropped (its backend may be gone for good)
+#define LIST_CACHE_BYTES (64LL * 1024 * 1024)  // Default dispfnames cache budget (S1_LIST_CACHE_BYTES)
+#define LIST_CACHE_BUCKETS 1024  // Hash buckets for cached listings and directory versions
+#define LIST_VERSION_MAX 48      // Longest directory version string kept
+#define LIST_TARGETS_MAX (ROUTE_MAX * ROUTE_MAX_BACKENDS)  // Places one listing can fan out to
+#define LIST_CACHE_SLOTS (LIST_TARGETS_MAX + 1)  // Versions per listing: S1's own, then one per target
 
 #include <errno.h>
 #include <dirent.h>
-
-/* Function prototype for client processing thread */
-void *prcclient(void *socket_desc);  // Handles client requests in a separate thread
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/* Bytes S1 has relayed from sub-servers to clients, per relay mode (see "stats") */
+struct relay_counters relay_stats;
+
+/* Idle keep-alive connections to one sub-server */
+struct backend_pool {
+    char ip[64];                  // Sub-server address
+    int port;                     // Sub-server port (0 = unused slot)
+    pthread_mutex_t lock;         // Protects the idle stack below
+    int idle[POOL_MAX_IDLE];      // Idle connected sockets, most recently used last
+    time_t idle_since[POOL_MAX_IDLE];
+    int idle_count;
+    int busy;                     // Connections checked out (requests in flight), for replica reads
+    time_t failed_at;             // Last failed connect, 0 once one succeeds again
+};
+
+struct backend_pool pools[MAX_POOLS];
+pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards creation of pool slots
+int pool_capacity = POOL_SIZE;  // Idle connections kept per sub-server, from S1_POOL_SIZE
+
+/* Connection pool counters (see "stats") */
+unsigned long long pool_reused, pool_opened, pool_dropped;
+
+/* A copy (or removal) one replica is still owed, worked off by the replicator */
+struct replica_job {
+    int remove;                   // Remove the file instead of copying it
+    struct route_backend from;    // A replica that has the file (copies only)
+    struct route_backend to;      // The replica to bring up to date
+    char path[768];               // Sub-server path of the file (~S2/docs/a.pdf)
+    time_t not_before;            // Earliest retry after a failed attempt
+    int attempts;
+    struct replica_job *next;
+};
+
+/* Jobs waiting for a replicator thread, in arrival order */
+struct replica_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct replica_job *head, *tail;
+    int count, max;
+} replica_queue = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, REPLICA_QUEUE_MAX };
+
+/* Replication counters (see "stats") */
+unsigned long long replica_copied, replica_removed, replica_failed, replica_dropped, replica_reads;
+
+/* Uploads S1 itself refused because their checksum didn't match (see "stats") */
+unsigned long long checksum_mismatches;
+
+/* The sub-server a chunked upload is being assembled on: every step of the
+ * upload goes there, even if an earlier backend of the route comes back */
+struct upload_pin {
+    char id[UPLOAD_ID_MAX + 2];    // "" = free slot
+    struct route_backend backend;
+    long long used_ms;             // now_ms() of the last step
+};
+
+struct upload_pins {
+    pthread_mutex_t lock;
+    struct upload_pin pins[UPLOAD_PINS_MAX];
+} upload_pins = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Where a connection is in the epoll event loop (the default; S1_EVENT_LOOP=threads turns it off) */
+enum conn_state {
+    CONN_READ_HEADER,   // Collecting the 20-byte header of the next request
+    CONN_READ_REQUEST,  // Collecting the request's command text
+    CONN_DISPATCHED     // Request complete; a worker owns the socket until it re-arms it
+};
+
+/* Per-connection state for the epoll event loop. Idle sessions cost this
+ * struct and a socket, not a thread. */
+struct event_conn {
+    int fd;
+    int epfd;                               // Event loop the connection belongs to
+    enum conn_state state;
+    size_t got;                             // Bytes of the header or command read so far
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    struct frame_header req;
+    char buffer[BUFFER_SIZE];               // NUL-terminated command text
+};
+
+/* One unit of work for the pool: a whole client session (conn == NULL), or
+ * a single parsed request from an event-loop connection */
+struct client_job {
+    int sock;
+    struct event_conn *conn;
+    long long queued_ms;  // now_ms() when it was queued
+};
+
+/* Bounded queue of accepted clients waiting for a worker thread */
+struct client_queue {
+    struct client_job jobs[MAX_QUEUE];
+    int head, count, capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+} clients = { .lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER };
+
+/* Worker pool counters (see "stats") */
+int worker_total, workers_busy, queue_peak;
+long long queue_wait_ms = QUEUE_WAIT_MS;
+unsigned long long clients_accepted, clients_rejected;
+
+/* Event loop counters (see "stats"); event_loops is 0 in thread-per-session mode (S1_EVENT_LOOP=threads) */
+int event_loops, event_conns;
+
+/* Guards spool_reserved: bytes uploads still being spooled may write */
+pthread_mutex_t spool_lock = PTHREAD_MUTEX_INITIALIZER;
+long long spool_reserved;
+
+/* S1's version of each directory a client has uploaded to or removed from.
+ * Bumped by handle_uploadf/handle_removef; a cached listing filled under an
+ * older version is never served again. */
+struct dir_version {
+    char key[512];                 // Client-side directory path (see list_cache_key)
+    unsigned long long version;
+    struct dir_version *next;      // Hash chain
+};
+
+/* Bodies of merged dispfnames listings, shared with senders by reference count */
+struct listing_body {
+    int refs;
+    size_t len;
+    char data[];
+};
+
+/* One cached dispfnames listing */
+struct cached_listing {
+    char key[512];
+    unsigned long long s1_version;          // dir_version_get(key) when it was filled
+    unsigned routes;                        // Routing table generation it was filled under
+    int nversions;
+    char (*versions)[LIST_VERSION_MAX];     // S1's own, then each listing target's
+    struct listing_body *body;
+    long long checked_ms;                   // When the versions were last confirmed
+    struct cached_listing *next;            // Hash chain
+    struct cached_listing *newer, *older;   // LRU order
+};
+
+struct list_cache {
+    pthread_mutex_t lock;
+    struct dir_version *dirs[LIST_CACHE_BUCKETS];
+    unsigned long long generation;          // Last directory version handed out
+    struct cached_listing *buckets[LIST_CACHE_BUCKETS];
+    struct cached_listing *newest, *oldest;
+    long long bytes, max_bytes;             // Cached body bytes and the S1_LIST_CACHE_BYTES budget
+    long long trust_ms;                     // S1_LIST_CACHE_TRUST_MS: skip revalidation this long
+    int entries;
+} list_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Listing cache counters (see "stats") */
+unsigned long long list_cache_hits, list_cache_misses, list_cache_revalidated;
+
+/* Function prototype for client session processing */
+void prcclient(int sock);  // Handles one client's requests on a worker thread
 
 /* Create directory structure from a full file path */
 void make_directory_from_path(const char *full_file_path) {
@@ -80,160 +267,1266 @@ int connect_to_server(const char *ip, int port) {
         close(sock);  // Close socket if connection fails
         return -1;
     }
+    set_nodelay(sock);  // Request/response traffic; don't let Nagle hold back replies
     return sock;  // Return socket descriptor on successful connection
 }
 
+// Find (or create) the pool for one sub-server endpoint
+struct backend_pool *pool_for(const char *ip, int port) {
+    pthread_mutex_lock(&pools_lock);
+    struct backend_pool *free_slot = NULL;
+    for (int i = 0; i < MAX_POOLS; i++) {
+        if (pools[i].port == port && strcmp(pools[i].ip, ip) == 0) {
+            pthread_mutex_unlock(&pools_lock);
+            return &pools[i];
+        }
+        if (pools[i].port == 0 && !free_slot) free_slot = &pools[i];
+    }
+    if (free_slot) {
+        snprintf(free_slot->ip, sizeof(free_slot->ip), "%s", ip);
+        pthread_mutex_init(&free_slot->lock, NULL);
+        free_slot->idle_count = 0;
+        free_slot->busy = 0;
+        free_slot->failed_at = 0;
+        free_slot->port = port;  // Publish last: lookups match on port
+    }
+    pthread_mutex_unlock(&pools_lock);
+    return free_slot;
+}
+
+// Returns 1 if an idle connection has been closed or reset by the sub-server
+int pooled_conn_dead(int sock) {
+    char probe;
+    ssize_t n = recv(sock, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n == 0) return 1;                                       // Orderly close
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return 1;  // Reset
+    return n > 0;  // Unsolicited bytes on an idle connection mean it is out of sync
+}
+
+// Send a ping request and wait for the pong; returns 0 if the connection is healthy
+int pooled_conn_ping(int sock) {
+    struct frame_header h;
+    char reply[64];
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+    if (send_request(sock, 0, "ping") < 0) return -1;
+    if (poll(&pfd, 1, 2000) <= 0) return -1;  // Don't hang on a wedged sub-server
+    if (recv_frame_header(sock, &h) < 0 || h.opcode != OP_MSG) return -1;
+    return recv_text_payload(sock, h.length, reply, sizeof(reply));
+}
+
+// Function to open a new connection to a sub-server, counted against its pool
+// like one from pool_acquire (hand it back with pool_release)
+// Parameters:
+//   ip - IP address of the sub-server
+//   port - port number of the sub-server
+// Returns:
+//   socket file descriptor on success, -1 on failure
+int pool_open(const char *ip, int port) {
+    struct backend_pool *pool = pool_for(ip, port);
+    int sock = connect_to_server(ip, port);
+    if (sock != -1) __atomic_add_fetch(&pool_opened, 1, __ATOMIC_RELAXED);
+    if (pool) {
+        __atomic_store_n(&pool->failed_at, sock == -1 ? time(NULL) : 0, __ATOMIC_RELAXED);
+        if (sock != -1) __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+    }
+    return sock;
+}
+
+// Function to get a connection to a sub-server, reusing an idle pooled one when possible
+// Parameters:
+//   ip - IP address of the sub-server
+//   port - port number of the sub-server
+// Returns:
+//   socket file descriptor on success, -1 on failure
+int pool_acquire(const char *ip, int port) {
+    struct backend_pool *pool = pool_for(ip, port);
+    while (pool) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->idle_count == 0) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        int sock = pool->idle[--pool->idle_count];  // Most recently used first
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!pooled_conn_dead(sock)) {
+            __atomic_add_fetch(&pool_reused, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+            return sock;
+        }
+        close(sock);  // Sub-server restarted or dropped it; try the next one
+        __atomic_add_fetch(&pool_dropped, 1, __ATOMIC_RELAXED);
+    }
+    return pool_open(ip, port);
+}
+
+// Put a connection on a pool's idle stack
+// Returns 0, or -1 if the pool is full (the caller closes it)
+int pool_put_idle(struct backend_pool *pool, int sock) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->idle_count == pool_capacity) {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pool->idle_since[pool->idle_count] = time(NULL);
+    pool->idle[pool->idle_count++] = sock;
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Function to hand a sub-server connection back after a request
+// Parameters:
+//   ip, port - sub-server the connection belongs to
+//   sock - the connection
+//   reusable - nonzero only if the last response was read completely
+void pool_release(const char *ip, int port, int sock, int reusable) {
+    struct backend_pool *pool = pool_for(ip, port);
+    if (pool) __atomic_sub_fetch(&pool->busy, 1, __ATOMIC_RELAXED);
+    if (pool && reusable && pool_put_idle(pool, sock) == 0) return;
+    close(sock);  // Pool full or connection out of sync
+}
+
+// Background thread that pings idle pooled connections and drops dead ones
+void *pool_health_checker(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(POOL_HEALTH_SECONDS);
+        for (int i = 0; i < MAX_POOLS; i++) {
+            struct backend_pool *pool = &pools[i];
+            if (pool->port == 0) continue;
+
+            // Check out the connections that have sat idle for a full period
+            int stale[POOL_MAX_IDLE], count = 0;
+            time_t now = time(NULL);
+            pthread_mutex_lock(&pool->lock);
+            for (int j = 0; j < pool->idle_count; j++) {
+                if (now - pool->idle_since[j] >= POOL_HEALTH_SECONDS) {
+                    stale[count++] = pool->idle[j];
+                    pool->idle[j] = pool->idle[pool->idle_count - 1];
+                    pool->idle_since[j] = pool->idle_since[pool->idle_count - 1];
+                    pool->idle_count--;
+                    j--;
+                }
+            }
+            pthread_mutex_unlock(&pool->lock);
+
+            // Ping each one outside the lock; healthy connections go back in the pool
+            for (int j = 0; j < count; j++) {
+                if (pooled_conn_dead(stale[j]) || pooled_conn_ping(stale[j]) < 0) {
+                    close(stale[j]);
+                    __atomic_add_fetch(&pool_dropped, 1, __ATOMIC_RELAXED);
+                } else if (pool_put_idle(pool, stale[j]) < 0) {
+                    close(stale[j]);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Function to connect to the next reachable backend in r->order, starting
+// at position *next (advanced past it), so a caller can move on to another
+// replica when one can't serve the request
+// Returns:
+//   connected socket, or -1 once the order is exhausted
+int route_acquire_next(const struct route *r, int *next, const struct route_backend **used) {
+    while (*next < r->norder) {
+        const struct route_backend *b = &r->backends[r->order[(*next)++]];
+        int s_sock = pool_acquire(b->host, b->port);
+        if (s_sock != -1) {
+            *used = b;
+            return s_sock;
+        }
+    }
+    return -1;
+}
+
+// Function to connect to a route's sub-server, trying the backends route_find
+// picked for the file in order (for a sharded route, only the shards holding it)
+// Parameters:
+//   r - a route that is not local, as filled in by route_find
+//   used - receives the backend that answered (pass it to pool_release)
+// Returns:
+//   connected socket, or -1 if no backend is reachable
+int route_acquire(const struct route *r, const struct route_backend **used) {
+    int next = 0;
+    return route_acquire_next(r, &next, used);
+}
+
+// Function to send a request to a sub-server on a pooled connection. A pooled
+// connection can go stale between the liveness check and the send (the
+// sub-server restarted), so a failed send is retried once on a new connection.
+// Parameters:
+//   b - backend the connection belongs to
+//   s_sock - the connection; replaced by the new one on a retry, -1 if both failed
+//   req_id - request id to send
+//   cmd - request text
+// Returns:
+//   0 once sent, -1 if it couldn't be (the connection has been released)
+int pool_send_request(const struct route_backend *b, int *s_sock, uint32_t req_id, const char *cmd) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (attempt) *s_sock = pool_open(b->host, b->port);
+        if (*s_sock == -1) return -1;
+        if (send_request(*s_sock, req_id, cmd) == 0) return 0;
+        pool_release(b->host, b->port, *s_sock, 0);
+        *s_sock = -1;
+    }
+    return -1;
+}
+
+// Function to order a file's replicas for a read: sub-servers that recently
+// refused a connection last, then the fewest requests in flight first, so
+// hot files spread over every copy (ties rotate from one read to the next)
+// Parameters:
+//   r - route filled in by route_find; order[0..replicas) is reordered
+void replica_read_order(struct route *r) {
+    long long load[ROUTE_MAX_BACKENDS];
+    time_t now = time(NULL);
+    unsigned turn = __atomic_fetch_add(&replica_reads, 1, __ATOMIC_RELAXED) % r->replicas;
+    for (int i = 0; i < r->replicas; i++) {
+        const struct route_backend *b = &r->backends[r->order[i]];
+        struct backend_pool *pool = pool_for(b->host, b->port);
+        time_t failed = pool ? __atomic_load_n(&pool->failed_at, __ATOMIC_RELAXED) : 0;
+        long long busy = pool ? __atomic_load_n(&pool->busy, __ATOMIC_RELAXED) : 0;
+        int down = failed && now - failed < POOL_DOWN_SECONDS;
+        load[i] = ((long long)down << 40) + (busy << 8) + (i + r->replicas - turn) % r->replicas;
+    }
+    for (int i = 1; i < r->replicas; i++) {  // Insertion sort: a handful of replicas
+        int b = r->order[i];
+        long long l = load[i];
+        int j = i - 1;
+        for (; j >= 0 && load[j] > l; j--) {
+            r->order[j + 1] = r->order[j];
+            load[j + 1] = load[j];
+        }
+        r->order[j + 1] = b;
+        load[j + 1] = l;
+    }
+}
+
+// Function to queue a copy or removal for one replica; an older job for the
+// same file and replica is replaced, so the latest write or remove wins
+// Parameters:
+//   remove - 1 to remove the file from `to`, 0 to copy it there from `from`
+//   from - replica holding the file (ignored for removals)
+//   to - replica to update
+//   path - sub-server path of the file (~S2/docs/a.pdf)
+void replica_enqueue(int remove, const struct route_backend *from, const struct route_backend *to,
+                     const char *path) {
+    struct replica_job *job = calloc(1, sizeof(*job));
+    if (!job) return;
+    job->remove = remove;
+    if (from) job->from = *from;
+    job->to = *to;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+
+    struct replica_queue *q = &replica_queue;
+    pthread_mutex_lock(&q->lock);
+    for (struct replica_job **pp = &q->head, *prev = NULL; *pp; prev = *pp, pp = &(*pp)->next) {
+        struct replica_job *old = *pp;
+        if (strcmp(old->path, path) != 0 || old->to.port != to->port || strcmp(old->to.host, to->host) != 0)
+            continue;
+        *pp = old->next;
+        if (q->tail == old) q->tail = prev;
+        free(old);
+        q->count--;
+        break;
+    }
+    if (q->count >= q->max) {
+        pthread_mutex_unlock(&q->lock);
+        free(job);
+        __atomic_add_fetch(&replica_dropped, 1, __ATOMIC_RELAXED);
+        printf("[S1] Replica queue full; %s:%d will miss %s\n", to->host, to->port, path);
+        return;
+    }
+    if (q->tail) q->tail->next = job;
+    else q->head = job;
+    q->tail = job;
+    q->count++;
+    pthread_cond_signal(&q->ready);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Function to drop every queued job for a file (it is being removed everywhere)
+void replica_forget(const char *path) {
+    struct replica_queue *q = &replica_queue;
+    pthread_mutex_lock(&q->lock);
+    struct replica_job *prev = NULL;
+    for (struct replica_job *job = q->head, *next; job; job = next) {
+        next = job->next;
+        if (strcmp(job->path, path) != 0) {
+            prev = job;
+            continue;
+        }
+        if (prev) prev->next = next;
+        else q->head = next;
+        if (q->tail == job) q->tail = prev;
+        free(job);
+        q->count--;
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Function to read a sub-server's one-frame reply (OP_MSG or OP_ERROR)
+// Returns the opcode, or -1 if the connection failed
+int recv_reply(int s_sock, char *text, size_t size) {
+    struct frame_header h;
+    if (recv_frame_header(s_sock, &h) < 0) return -1;
+    if (h.opcode != OP_MSG && h.opcode != OP_ERROR) return -1;
+    if (recv_text_payload(s_sock, h.length, text, size) < 0) return -1;
+    return h.opcode;
+}
+
+// Function to carry out one replica job
+// Returns 0 when the job is finished (done, or pointless because the
+// source no longer has the file), -1 to retry later
+int replica_run(const struct replica_job *job) {
+    char cmd[1100], msg[256];
+    int to = pool_acquire(job->to.host, job->to.port);
+    if (to == -1) return -1;
+
+    if (job->remove) {
+        snprintf(cmd, sizeof(cmd), "removef %s", job->path);
+        int ok = send_request(to, 0, cmd) == 0 && recv_reply(to, msg, sizeof(msg)) > 0;
+        pool_release(job->to.host, job->to.port, to, ok);
+        if (ok) __atomic_add_fetch(&replica_removed, 1, __ATOMIC_RELAXED);
+        return ok ? 0 : -1;
+    }
+
+    int from = pool_acquire(job->from.host, job->from.port);
+    if (from == -1) {
+        pool_release(job->to.host, job->to.port, to, 1);
+        return -1;
+    }
+
+    // Download from the source replica and pipe the frames straight into an
+    // upload to the target: a downlf reply is the same DATA.../END stream
+    // (deflated between the two if the type is worth it, see compress.h)
+    struct frame_header h;
+    snprintf(cmd, sizeof(cmd), "downlf %s", job->path);
+    if (send_request_flags(from, 0, compress_accept_flag(), cmd) < 0 || recv_frame_header(from, &h) < 0) {
+        pool_release(job->from.host, job->from.port, from, 0);
+        pool_release(job->to.host, job->to.port, to, 1);
+        return -1;
+    }
+    if (h.opcode != OP_DATA && h.opcode != OP_END) {
+        // Gone from the source (removed since): nothing left to copy
+        int ok = skip_payload(from, h.length) == 0;
+        pool_release(job->from.host, job->from.port, from, ok);
+        pool_release(job->to.host, job->to.port, to, 1);
+        return 0;
+    }
+    const char *slash = strrchr(job->path, '/');
+    if (!slash) slash = job->path;  // Not a ~Sx path; route_path always yields one
+    snprintf(cmd, sizeof(cmd), "uploadf %s %.*s", slash + 1, (int)(slash - job->path), job->path);
+    long long bytes = send_request(to, 0, cmd) == 0 ? relay_stream_from(from, to, &relay_stats, &h) : -1;
+    int ok = bytes >= 0 && recv_reply(to, msg, sizeof(msg)) == OP_MSG;
+    pool_release(job->from.host, job->from.port, from, bytes >= 0);
+    pool_release(job->to.host, job->to.port, to, ok);
+    if (!ok) return -1;
+    __atomic_add_fetch(&replica_copied, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Background thread that works off the replica queue; a job whose replica
+// can't be reached goes to the back of the queue and waits
+// REPLICA_RETRY_SECONDS before it is tried again
+void *replicator(void *arg) {
+    (void)arg;
+    struct replica_queue *q = &replica_queue;
+    while (1) {
+        pthread_mutex_lock(&q->lock);
+        struct replica_job *job = NULL, *prev = NULL;
+        time_t now = time(NULL), wake = 0;
+        for (struct replica_job *j = q->head; j; prev = j, j = j->next) {
+            if (j->not_before <= now) {
+                job = j;
+                break;
+            }
+            if (!wake || j->not_before < wake) wake = j->not_before;
+        }
+        if (!job) {
+            if (wake) {
+                struct timespec until = { wake, 0 };
+                pthread_cond_timedwait(&q->ready, &q->lock, &until);
+            } else {
+                pthread_cond_wait(&q->ready, &q->lock);
+            }
+            pthread_mutex_unlock(&q->lock);
+            continue;
+        }
+        if (prev) prev->next = job->next;
+        else q->head = job->next;
+        if (q->tail == job) q->tail = prev;
+        q->count--;
+        pthread_mutex_unlock(&q->lock);
+
+        if (replica_run(job) == 0) {
+            free(job);
+            continue;
+        }
+        if (++job->attempts >= REPLICA_MAX_ATTEMPTS) {
+            __atomic_add_fetch(&replica_failed, 1, __ATOMIC_RELAXED);
+            printf("[S1] Gave up on %s for replica %s:%d\n", job->path, job->to.host, job->to.port);
+            free(job);
+            continue;
+        }
+        // Requeue unless a newer job for the same file and replica arrived meanwhile
+        pthread_mutex_lock(&q->lock);
+        int newer = 0;
+        for (struct replica_job *j = q->head; j && !newer; j = j->next)
+            newer = strcmp(j->path, job->path) == 0 && j->to.port == job->to.port &&
+                    strcmp(j->to.host, job->to.host) == 0;
+        if (newer) {
+            free(job);
+        } else {
+            job->not_before = time(NULL) + REPLICA_RETRY_SECONDS;
+            job->next = NULL;
+            if (q->tail) q->tail->next = job;
+            else q->head = job;
+            q->tail = job;
+            q->count++;
+        }
+        pthread_mutex_unlock(&q->lock);
+    }
+    return NULL;
+}
+
+// Function to compute the placement key (shard_key) of a file given as a
+// directory plus a name, as uploadf and the spool do
+void shard_key_of(const char *dir, const char *filename, char *key, size_t size) {
+    char path[768];
+    snprintf(path, sizeof(path), "%s/%s", dir, filename);
+    shard_key(path, key, size);
+}
+
+// Function to rewrite a client path for the server a route points at
+// ("~S1/docs/a.pdf" -> "~S2/docs/a.pdf"; other paths are passed through)
+// Parameters: r - route, path - client path, out/size - destination buffer
+// Returns: 0, or -1 if the rewritten path does not fit in out
+int route_path(const struct route *r, const char *path, char *out, size_t size) {
+    int n;
+    if (strncmp(path, "~S1", 3) == 0)
+        n = snprintf(out, size, "~%s%s", r->server, path + 3);
+    else
+        n = snprintf(out, size, "%s", path);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+// Directory (under ~/S1) where uploads wait while their sub-server is down
+void spool_dir(char *out, size_t size) {
+    char *home = getenv("HOME");
+    snprintf(out, size, "%s/S1/.spool", home ? home : ".");
+}
+
+// Total bytes currently queued in the spool directory (uploads still being
+// received, the .part files, are counted in spool_reserved instead)
+long long spool_usage(const char *dir) {
+    long long total = 0;
+    DIR *dp = opendir(dir);
+    if (!dp) return 0;
+    struct dirent *ep;
+    while ((ep = readdir(dp)) != NULL) {
+        char path[768];
+        struct stat st;
+        char *dot = strrchr(ep->d_name, '.');
+        if (dot && strcmp(dot, ".part") == 0) continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, ep->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) total += st.st_size;
+    }
+    closedir(dp);
+    return total;
+}
+
+// Function to reserve spool space for an upload being spooled
+// The cap covers both queued files and what uploads in progress have reserved,
+// so concurrent uploads can't overrun it; the lock is only held for the check.
+// Parameters:
+//   dir - spool directory
+//   limit - spool cap in bytes
+//   n - bytes to reserve (negative gives them back)
+// Returns:
+//   1 if reserved, 0 if the spool would exceed limit
+int spool_reserve(const char *dir, long long limit, long long n) {
+    pthread_mutex_lock(&spool_lock);
+    int ok = n <= 0 || spool_usage(dir) + spool_reserved + n <= limit;
+    if (ok) spool_reserved += n;
+    pthread_mutex_unlock(&spool_lock);
+    return ok;
+}
+
+// Function to queue an upload on disk because its sub-server is unreachable
+// Only used as a fallback: the spool is capped at S1_SPOOL_MAX bytes (default
+// SPOOL_MAX_BYTES) and spool_flusher() delivers queued files once the server is back.
+// The upload is received into a .part file without holding spool_lock (space
+// is reserved as it grows) and only appears as .data/.meta once complete.
+// Parameters:
+//   sock - socket connected to the client (the upload stream is read from it)
+//   req_id - request id of the client's uploadf frame
+//   port - sub-server the file belongs to (for the log; delivery re-resolves the route)
+//   filename - name of the file being uploaded
+//   dest_path - destination path already rewritten for the sub-server (~S2/...)
+void spool_upload(int sock, uint32_t req_id, int port, const char *filename, const char *dest_path) {
+    char dir[512], part_path[640], data_path[640], meta_path[640], temp_path[660];
+    static unsigned int spool_seq = 0;
+    long long limit = SPOOL_MAX_BYTES;
+    char *env_limit = getenv("S1_SPOOL_MAX");
+    if (env_limit) limit = atoll(env_limit);
+
+    spool_dir(dir, sizeof(dir));
+    mkdir(dir, 0700);
+    unsigned int seq = __atomic_fetch_add(&spool_seq, 1, __ATOMIC_RELAXED);
+    long stamp = (long)time(NULL);
+    snprintf(part_path, sizeof(part_path), "%s/%ld-%u.part", dir, stamp, seq);
+    snprintf(data_path, sizeof(data_path), "%s/%ld-%u.data", dir, stamp, seq);
+    snprintf(meta_path, sizeof(meta_path), "%s/%ld-%u.meta", dir, stamp, seq);
+
+    FILE *file = fopen(part_path, "wb");
+    struct frame_header h;
+    char buffer[BUFFER_SIZE];
+    long long total = 0, reserved = 0;
+    int overflow = (file == NULL);
+    int ok = 0, corrupt = 0;
+    uint32_t crc = 0, expected;
+
+    // Receive the upload stream, writing it to the spool while it fits; it is
+    // checked here because delivery later sends the spooled copy's checksum
+    while (recv_frame_header(sock, &h) == 0) {
+        if (h.opcode == OP_END) {
+            ok = recv_text_payload(sock, h.length, buffer, sizeof(buffer)) == 0;
+            corrupt = ok && checksum_parse(buffer, &expected) && expected != crc;
+            break;
+        }
+        if (h.opcode != OP_DATA) break;
+        if (!overflow && total + (long long)h.length > reserved) {
+            // Reserve a step at a time, or just what is needed if a step won't fit
+            long long need = total + (long long)h.length - reserved;
+            long long step = need > SPOOL_RESERVE_STEP ? need : SPOOL_RESERVE_STEP;
+            if (spool_reserve(dir, limit, step)) reserved += step;
+            else if (spool_reserve(dir, limit, need)) reserved += need;
+            else overflow = 1;
+        }
+        uint64_t remaining = h.length;
+        while (remaining > 0) {
+            size_t n = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+            if (recv_all(sock, buffer, n) < 0) break;
+            crc = crc32c(crc, buffer, n);
+            if (!overflow && fwrite(buffer, 1, n, file) != n) overflow = 1;  // Disk full: as if over the cap
+            remaining -= n;
+        }
+        if (remaining > 0) break;
+        total += h.length;
+    }
+    if (file && fclose(file) != 0) overflow = 1;
+
+    // Publish the complete upload: the data first, then the .meta that
+    // spool_flush() looks for (written aside and renamed, so never seen partial)
+    int queued = 0;
+    if (ok && !overflow && !corrupt && rename(part_path, data_path) == 0) {
+        snprintf(temp_path, sizeof(temp_path), "%s.part", meta_path);
+        FILE *meta = fopen(temp_path, "w");
+        if (meta) {
+            int written = fprintf(meta, "%d %s %s\n", port, filename, dest_path) > 0;
+            if (fclose(meta) != 0) written = 0;
+            queued = written && rename(temp_path, meta_path) == 0;
+            if (!queued) remove(temp_path);
+        }
+        if (!queued) remove(data_path);
+    }
+    remove(part_path);
+    spool_reserve(dir, limit, -reserved);  // Now counted by spool_usage() if it was queued
+
+    if (!ok) {
+        shutdown(sock, SHUT_RDWR);  // Stream broke off mid-transfer; drop the client
+        return;
+    }
+    if (corrupt) {
+        __atomic_add_fetch(&checksum_mismatches, 1, __ATOMIC_RELAXED);
+        send_error(sock, req_id, "Error: Checksum mismatch; the file was corrupted in transit.\n");
+        return;
+    }
+    if (!queued) {
+        send_error(sock, req_id, "Could not connect to secondary server.\n");
+        return;
+    }
+    printf("[S1] Port %d unavailable; spooled %s (%lld bytes)\n", port, filename, total);
+    send_msg(sock, req_id, "Secondary server unavailable; your file is queued for delivery.\n");
+}
+
+// Try to deliver every spooled upload to its sub-server
+// Runs without spool_lock: only complete uploads have a .meta file, and
+// spool_flusher() is the only caller, so no file is delivered twice.
+void spool_flush(void) {
+    char dir[512];
+    spool_dir(dir, sizeof(dir));
+    DIR *dp = opendir(dir);
+    if (!dp) return;
+
+    struct dirent *ep;
+    while ((ep = readdir(dp)) != NULL) {
+        char *dot = strrchr(ep->d_name, '.');
+        if (!dot || strcmp(dot, ".meta") != 0) continue;
+
+        // Read back the destination recorded when the upload was spooled
+        char meta_path[768], data_path[768], filename[256], dest_path[512];
+        int port;
+        snprintf(meta_path, sizeof(meta_path), "%s/%s", dir, ep->d_name);
+        snprintf(data_path, sizeof(data_path), "%s/%.*s.data", dir, (int)(dot - ep->d_name), ep->d_name);
+        FILE *meta = fopen(meta_path, "r");
+        if (!meta) continue;
+        int fields = fscanf(meta, "%d %255s %511s", &port, filename, dest_path);
+        fclose(meta);
+        if (fields != 3) continue;
+
+        // Deliver to wherever the file's route points now (backends may have
+        // moved since it was spooled); files from before routing go to localhost
+        struct route route;
+        struct route_backend fallback = { "127.0.0.1", port, 1 };
+        const struct route_backend *b = &fallback;
+        char key[768];
+        shard_key_of(dest_path, filename, key, sizeof(key));
+        int s_sock = (route_find(filename, key, &route) == 0 && !route.local)
+                         ? route_acquire(&route, &b) : pool_acquire(fallback.host, fallback.port);
+        if (s_sock == -1) continue;  // Still down; retry on the next pass
+
+        char forward_cmd[1024], msg[256];
+        snprintf(forward_cmd, sizeof(forward_cmd), "uploadf %s %s", filename, dest_path);
+        if (pool_send_request(b, &s_sock, 0, forward_cmd) < 0) continue;
+        FILE *file = fopen(data_path, "rb");
+        long long sent = file ? send_file_stream(s_sock, 0, file) : -1;
+        if (file) fclose(file);
+
+        // Only drop the spooled copy once the sub-server confirms it stored the file
+        struct frame_header reply;
+        int replied = sent >= 0 && recv_frame_header(s_sock, &reply) == 0 &&
+                      recv_text_payload(s_sock, reply.length, msg, sizeof(msg)) == 0;
+        if (replied && reply.opcode == OP_MSG) {
+            remove(meta_path);
+            remove(data_path);
+            printf("[S1] Delivered spooled %s to %s:%d\n", filename, b->host, b->port);
+            // The file's other replicas get it copied from this one
+            snprintf(key, sizeof(key), "%s/%s", dest_path, filename);
+            for (int i = 0; b != &fallback && i < route.replicas; i++)
+                if (&route.backends[route.order[i]] != b) replica_enqueue(0, b, &route.backends[route.order[i]], key);
+        }
+        pool_release(b->host, b->port, s_sock, replied);
+    }
+    closedir(dp);
+}
+
+// Background thread that retries spooled uploads every SPOOL_RETRY_SECONDS
+void *spool_flusher(void *arg) {
+    (void)arg;
+    while (1) {
+        sleep(SPOOL_RETRY_SECONDS);
+        spool_flush();
+    }
+    return NULL;
+}
+
+// Function to normalize a client-side directory path into a listing cache key
+// ("~S1/docs/" and "~S1/docs" are the same directory)
+// Parameters:
+//   path - directory path as the client wrote it
+//   key - receives the key (512 bytes)
+void list_cache_key(const char *path, char *key) {
+    snprintf(key, 512, "%s", path);
+    size_t len = strlen(key);
+    while (len > 1 && key[len - 1] == '/') key[--len] = '\0';
+}
+
+unsigned list_cache_hash(const char *key) {
+    unsigned h = 2166136261u;  // FNV-1a
+    for (const char *p = key; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    return h % LIST_CACHE_BUCKETS;
+}
+
+// Function to read S1's version of a directory (0 if it was never changed through S1)
+unsigned long long dir_version_get(const char *key) {
+    unsigned long long version = 0;
+    pthread_mutex_lock(&list_cache.lock);
+    for (struct dir_version *d = list_cache.dirs[list_cache_hash(key)]; d; d = d->next)
+        if (strcmp(d->key, key) == 0) version = d->version;
+    pthread_mutex_unlock(&list_cache.lock);
+    return version;
+}
+
+// Function to record that a directory's contents changed through S1
+// Parameters:
+//   path - directory as the client named it (the upload destination, or the
+//          directory part of a removed file)
+void dir_version_bump(const char *path) {
+    char key[512];
+    list_cache_key(path, key);
+    unsigned h = list_cache_hash(key);
+    pthread_mutex_lock(&list_cache.lock);
+    struct dir_version *d = list_cache.dirs[h];
+    while (d && strcmp(d->key, key) != 0) d = d->next;
+    if (!d && (d = calloc(1, sizeof(*d))) != NULL) {
+        snprintf(d->key, sizeof(d->key), "%s", key);
+        d->next = list_cache.dirs[h];
+        list_cache.dirs[h] = d;
+    }
+    if (d) d->version = ++list_cache.generation;
+    pthread_mutex_unlock(&list_cache.lock);
+}
+
+// Function to record that the file at filepath (client-side path) was removed
+void dir_version_bump_parent(const char *filepath) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s", filepath);
+    char *slash = strrchr(dir, '/');
+    if (slash) *slash = '\0';
+    else dir[0] = '\0';
+    dir_version_bump(dir);
+}
+
+// Function to drop a reference to a cached listing body
+void listing_body_release(struct listing_body *body) {
+    if (body && __atomic_sub_fetch(&body->refs, 1, __ATOMIC_ACQ_REL) == 0) free(body);
+}
+
+// Unlink an entry from the cache and drop its body (cache lock held)
+void list_cache_unlink(struct cached_listing *e) {
+    struct cached_listing **link = &list_cache.buckets[list_cache_hash(e->key)];
+    while (*link != e) link = &(*link)->next;
+    *link = e->next;
+    if (e->newer) e->newer->older = e->older; else list_cache.newest = e->older;
+    if (e->older) e->older->newer = e->newer; else list_cache.oldest = e->newer;
+    list_cache.bytes -= e->body->len;
+    list_cache.entries--;
+    listing_body_release(e->body);
+    free(e->versions);
+    free(e);
+}
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to look up a cached listing that S1's own checks still accept
+// Parameters:
+//   key - directory key (list_cache_key)
+//   s1_version - S1's current version of the directory
+//   routes - generation of the routing table in use
+//   local_version - current version of S1's own copy of the directory
+//   versions - receives the versions the entry was filled under
+//   trusted - set to 1 if the entry was confirmed within S1_LIST_CACHE_TRUST_MS
+// Returns:
+//   the body with a reference held (listing_body_release it), or NULL
+struct listing_body *list_cache_lookup(const char *key, unsigned long long s1_version, unsigned routes,
+                                       const char *local_version,
+                                       char versions[][LIST_VERSION_MAX], int *trusted) {
+    struct listing_body *body = NULL;
+    pthread_mutex_lock(&list_cache.lock);
+    struct cached_listing *e = list_cache.buckets[list_cache_hash(key)];
+    while (e && strcmp(e->key, key) != 0) e = e->next;
+    if (e && e->s1_version == s1_version && e->routes == routes &&
+        strcmp(e->versions[0], local_version) == 0) {
+        body = e->body;
+        __atomic_add_fetch(&body->refs, 1, __ATOMIC_ACQ_REL);
+        if (e != list_cache.newest) {
+            // Move to the front of the LRU order
+            e->newer->older = e->older;
+            if (e->older) e->older->newer = e->newer; else list_cache.oldest = e->newer;
+            e->newer = NULL;
+            e->older = list_cache.newest;
+            list_cache.newest->newer = e;
+            list_cache.newest = e;
+        }
+        memcpy(versions, e->versions, e->nversions * sizeof(*e->versions));
+        *trusted = now_ms() - e->checked_ms < list_cache.trust_ms;
+    }
+    pthread_mutex_unlock(&list_cache.lock);
+    return body;
+}
+
+// Function to note that a cached listing was just revalidated against the sub-servers
+void list_cache_confirm(const char *key, const struct listing_body *body) {
+    pthread_mutex_lock(&list_cache.lock);
+    struct cached_listing *e = list_cache.buckets[list_cache_hash(key)];
+    while (e && strcmp(e->key, key) != 0) e = e->next;
+    if (e && e->body == body) e->checked_ms = now_ms();
+    pthread_mutex_unlock(&list_cache.lock);
+}
+
+// Function to cache a freshly merged listing, evicting the least recently
+// used entries to stay within S1_LIST_CACHE_BYTES
+// Parameters:
+//   key - directory key (list_cache_key)
+//   s1_version - S1's version of the directory read before the listing started
+//   routes - generation of the routing table the listing was built from
+//   versions, nversions - S1's own and each listing target's version, also read before listing
+//   data, len - listing body (newline-separated names); ownership passes to the cache
+void list_cache_store(const char *key, unsigned long long s1_version, unsigned routes,
+                      char versions[][LIST_VERSION_MAX], int nversions, char *data, size_t len) {
+    struct cached_listing *e = calloc(1, sizeof(*e));
+    struct listing_body *body = malloc(sizeof(*body) + len);
+    char (*copy)[LIST_VERSION_MAX] = malloc(nversions * sizeof(*copy));
+    if (!e || !body || !copy) {
+        free(e);
+        free(body);
+        free(copy);
+        free(data);
+        return;
+    }
+    body->refs = 1;
+    body->len = len;
+    if (len > 0) memcpy(body->data, data, len);
+    free(data);
+    snprintf(e->key, sizeof(e->key), "%s", key);
+    e->s1_version = s1_version;
+    e->routes = routes;
+    memcpy(copy, versions, nversions * sizeof(*copy));
+    e->versions = copy;
+    e->nversions = nversions;
+    e->body = body;
+    e->checked_ms = now_ms();
+
+    unsigned h = list_cache_hash(key);
+    pthread_mutex_lock(&list_cache.lock);
+    for (struct cached_listing *old = list_cache.buckets[h]; old; old = old->next) {
+        if (strcmp(old->key, key) == 0) {
+            list_cache_unlink(old);
+            break;
+        }
+    }
+    e->next = list_cache.buckets[h];
+    list_cache.buckets[h] = e;
+    e->older = list_cache.newest;
+    if (list_cache.newest) list_cache.newest->newer = e; else list_cache.oldest = e;
+    list_cache.newest = e;
+    list_cache.bytes += len;
+    list_cache.entries++;
+    while (list_cache.bytes > list_cache.max_bytes && list_cache.oldest != e)
+        list_cache_unlink(list_cache.oldest);
+    pthread_mutex_unlock(&list_cache.lock);
+}
+
+// Function to store an upload on every replica of a replicated route
+// sync: the client's stream is copied to all reachable replicas as it
+// arrives and the upload succeeds once route->quorum of them confirm it.
+// async: it goes to the first reachable replica only and is answered from
+// there. Either way, replicas that missed the file are handed to the
+// replicator, which copies it over from one that has it.
+// Parameters:
+//   sock - socket connected to the client
+//   req_id - request id of the client's uploadf frame
+//   r - the file's route from route_find (its replicas are order[0..replicas))
+//   filename - name of the file being uploaded
+//   forward_dest - destination directory rewritten for the sub-servers (~S2/...)
+void upload_replicas(int sock, uint32_t req_id, const struct route *r, const char *filename,
+                     const char *forward_dest) {
+    int socks[ROUTE_MAX_BACKENDS], live[ROUTE_MAX_BACKENDS], stored[ROUTE_MAX_BACKENDS] = {0};
+    int reached = 0, acks = 0, first = -1;
+    char forward_cmd[1024], msg[256], reply[256] = "";
+    snprintf(forward_cmd, sizeof(forward_cmd), "uploadf %s %s", filename, forward_dest);
+
+    // Connect to the replicas before reading any file data
+    for (int i = 0; i < r->replicas; i++) {
+        const struct route_backend *b = &r->backends[r->order[i]];
+        socks[i] = (r->async && reached) ? -1 : pool_acquire(b->host, b->port);
+        if (socks[i] >= 0 && send_request(socks[i], req_id, forward_cmd) < 0) {
+            pool_release(b->host, b->port, socks[i], 0);
+            socks[i] = -1;
+        }
+        if (socks[i] >= 0) first = i;
+        reached += socks[i] >= 0;
+        live[i] = socks[i];
+    }
+    if (reached == 0) {
+        spool_upload(sock, req_id, r->backends[r->order[0]].port, filename, forward_dest);
+        return;
+    }
+
+    // One copy goes through the zero-copy relay; several are written side by side
+    long long bytes = reached == 1 ? relay_stream(sock, socks[first], &relay_stats)
+                                   : relay_stream_fanout(sock, live, r->replicas);
+    first = -1;
+    for (int i = 0; i < r->replicas; i++) {
+        if (socks[i] < 0) continue;
+        const struct route_backend *b = &r->backends[r->order[i]];
+        int op = bytes >= 0 && live[i] >= 0 ? recv_reply(socks[i], msg, sizeof(msg)) : -1;
+        if (op == OP_MSG) {
+            stored[i] = 1;
+            acks++;
+            if (first < 0) {
+                first = i;
+                snprintf(reply, sizeof(reply), "%s", msg);
+            }
+        }
+        pool_release(b->host, b->port, socks[i], op > 0);
+    }
+    if (bytes < 0) {
+        // The client's stream broke off (the replicas dropped their partial files)
+        shutdown(sock, SHUT_RDWR);
+        return;
+    }
+
+    if (acks >= r->quorum) {
+        send_msg(sock, req_id, reply);
+    } else if (acks > 0) {
+        snprintf(msg, sizeof(msg), "Error: Only %d of %d replicas stored the file (quorum is %d).\n",
+                 acks, r->replicas, r->quorum);
+        send_error(sock, req_id, msg);
+    } else {
+        send_error(sock, req_id, "Error: Secondary server failed to store the file.\n");
+    }
+
+    // Bring the replicas that missed it up to date in the background
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", forward_dest, filename);
+    for (int i = 0; i < r->replicas && acks > 0; i++)
+        if (!stored[i]) replica_enqueue(0, &r->backends[r->order[first]], &r->backends[r->order[i]], path);
+    printf("[S1] Stored %s (%lld bytes) on %d of %d replicas (%s)\n", filename, bytes, acks, r->replicas,
+           r->async ? "async" : "sync");
+}
+
 // Function to handle file upload from client to server
+// The routing table decides where the file goes: "local" types (.c) are stored
+// on S1; every other type is piped straight through to its sub-server without
+// touching S1's disk (unless that server is down, see spool_upload)
 // Parameters:
 //   sock - socket connected to the client
+//   req_id - request id of the client's uploadf frame
 //   filename - name of the file being uploaded
 //   dest_path - destination path where file should be stored
-void handle_uploadf(int sock, char *filename, char *dest_path) {
+void handle_uploadf(int sock, uint32_t req_id, char *filename, char *dest_path) {
+    char msg[256];  // Text of an OP_MSG/OP_ERROR reply from a peer
+
     // Get the user's home directory path
     char *home = getenv("HOME");
     if (!home) {
-        send(sock, "Error: Cannot get HOME environment.\n", 36, 0);
+        recv_stream_to_file(sock, NULL, msg, sizeof(msg));  // Drain the upload stream
+        send_error(sock, req_id, "Error: Cannot get HOME environment.\n");
         return;
     }
 
-    // Find the file extension in the filename
-    char *ext = strrchr(filename, '.');
-    if (!ext) {
-        send(sock, "Invalid file extension.\n", 25, 0);
-        send(sock, "ENDOFLIST\n", 10, 0);
+    // Find the route for the file's name (extension or glob) and, for a
+    // sharded type, the shard its path hashes to
+    struct route route;
+    char key[768];
+    shard_key_of(dest_path, filename, key, sizeof(key));
+    if (route_find(filename, key, &route) < 0) {
+        recv_stream_to_file(sock, NULL, msg, sizeof(msg));
+        send_error(sock, req_id, strrchr(filename, '.') ? "Unsupported file type.\n" : "Invalid file extension.\n");
         return;
     }
 
-    // Construct the full path where the file will be stored
-    char full_file_path[512];
-    if (strncmp(dest_path, "~S1", 3) == 0)
-        // If path starts with ~S1, replace it with home directory and S1 folder
-        snprintf(full_file_path, sizeof(full_file_path), "%s/S1%s/%s", home, dest_path + 3, filename);
-    else
-        // Otherwise, store directly in home directory
-        snprintf(full_file_path, sizeof(full_file_path), "%s/%s", home, filename);
-
-    // Create any necessary directories in the path
-    make_directory_from_path(full_file_path);
+    // Locally routed types (.c) are kept on this server (S1)
+    if (route.local) {
+        // Construct the full path where the file will be stored
+        char full_file_path[512];
+        if (strncmp(dest_path, "~S1", 3) == 0)
+            // If path starts with ~S1, replace it with home directory and S1 folder
+            snprintf(full_file_path, sizeof(full_file_path), "%s/S1%s/%s", home, dest_path + 3, filename);
+        else
+            // Otherwise, store directly in home directory
+            snprintf(full_file_path, sizeof(full_file_path), "%s/%s", home, filename);
+
+        // Create any necessary directories in the path
+        make_directory_from_path(full_file_path);
+
+        // Open the file for writing (deflated on the way in when it is
+        // stored compressed, see compress.h)
+        struct cas_writer store;
+        FILE *file = cas_create(&store, full_file_path);
+        if (!file) {
+            perror("Cannot create file");
+            recv_stream_to_file(sock, NULL, msg, sizeof(msg));
+            send_error(sock, req_id, "Error creating file.\n");
+            return;
+        }
 
-    // Open the file for writing in binary mode
-    FILE *file = fopen(full_file_path, "wb");
-    if (!file) {
-        perror("Cannot create file");
-        send(sock, "Error creating file.\n", 22, 0);
+        // Receive file data frames from client until the end-of-stream frame,
+        // hashing them on the way in to check against the client's checksum
+        uint32_t crc = 0;
+        long long bytes = recv_stream_checked(sock, file, msg, sizeof(msg), &crc);
+        int stored = cas_close(&store, file, bytes >= 0, crc, msg);
+        if (bytes < 0) return;  // Client went away mid-transfer; the partial file is dropped
+        if (stored == -2) {
+            if (access(full_file_path, F_OK) != 0) ns_index_forget(full_file_path);  // An older copy may have been listed
+            dir_version_bump(dest_path);
+            __atomic_add_fetch(&checksum_mismatches, 1, __ATOMIC_RELAXED);
+            send_error(sock, req_id, "Error: Checksum mismatch; the file was corrupted in transit.\n");
+            return;
+        }
+        if (stored < 0) {
+            send_error(sock, req_id, "Error creating file.\n");
+            return;
+        }
+        ns_index_file(full_file_path);  // Visible to listings immediately
+        dir_version_bump(dest_path);     // Cached listings of the directory are stale
+        if (store.z.zlen > 0)
+            printf("[S1] Received %s -> %s (%lld bytes, deflated to %lld)\n", filename, full_file_path, bytes,
+                   store.z.zlen);
+        else
+            printf("[S1] Received %s -> %s (%lld bytes)\n", filename, full_file_path, bytes);
+        send_msg(sock, req_id, "Your file has been uploaded successfully.\n");
         return;
     }
 
-    // Receive file data from client and write to file
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    while ((bytes = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        fwrite(buffer, 1, bytes, file);
-        if (bytes < BUFFER_SIZE) break;  // Last chunk of data received
+    // For other file types, forward to the route's secondary server
+    // Change destination from ~S1 to the secondary server's prefix
+    char forward_dest[512];
+    if (route_path(&route, dest_path, forward_dest, sizeof(forward_dest)) < 0) {
+        recv_stream_to_file(sock, NULL, msg, sizeof(msg));  // Drain the upload stream
+        send_error(sock, req_id, "Error: Path too long.\n");
+        return;
+    }
+    if (route.replicas > 1) {
+        upload_replicas(sock, req_id, &route, filename, forward_dest);
+        dir_version_bump(dest_path);
+        return;
     }
-    fclose(file);
-
-    printf("[S1] Received %s -> %s\n", filename, full_file_path);
 
-    // If file is a C source file, keep it on this server (S1)
-    if (strcmp(ext, ".c") == 0) {
-        send(sock, "Your file has been uploaded successfully.\n", 43, 0);
+    // Connect to the secondary server and send the upload command before
+    // reading any file data, then pipe the client's data frames straight through
+    const struct route_backend *backend;
+    char forward_cmd[1024];
+    snprintf(forward_cmd, sizeof(forward_cmd), "uploadf %s %s", filename, forward_dest);
+    int s_sock = route_acquire(&route, &backend);
+    if (s_sock == -1 || pool_send_request(backend, &s_sock, req_id, forward_cmd) < 0) {
+        spool_upload(sock, req_id, route.backends[route.order[0]].port, filename, forward_dest);
+        dir_version_bump(dest_path);
+        return;
+    }
+    long long bytes = relay_stream(sock, s_sock, &relay_stats);
+    if (bytes < 0) {
+        // One side failed mid-stream, so the client's frames can no longer be
+        // matched up with replies; drop the client rather than answer out of sync
+        pool_release(backend->host, backend->port, s_sock, 0);
+        shutdown(sock, SHUT_RDWR);
         return;
     }
 
-    // For other file types, forward to appropriate secondary server
-    const char *server_ip = "127.0.0.1";  // Localhost IP
-    int port = 0;
+    // Pass the secondary server's confirmation (or error) back to the client
+    long long rc = relay_stream(s_sock, sock, &relay_stats);
+    if (rc == -2)
+        send_error(sock, req_id, "Error: Secondary server failed to store the file.\n");
+    pool_release(backend->host, backend->port, s_sock, rc >= 0);  // Return connection to the pool
+    dir_version_bump(dest_path);
+    printf("[S1] Streamed %s (%lld bytes) to %s:%d\n", filename, bytes, backend->host, backend->port);
+}
 
-    // Determine which server to forward to based on file extension
-    if (strcmp(ext, ".pdf") == 0) {
-        port = 1202; // S2's port
-        if (strncmp(dest_path, "~S1", 3) == 0)
-            snprintf(dest_path, 512, "~S2%s", dest_path + 3);  // Change destination to S2
+// Function to find the backend a chunked upload is pinned to
+// Parameters:
+//   id - upload id
+//   r - the file's route (the pin only counts if it is still one of its backends)
+// Returns:
+//   the backend within r, or NULL if the upload isn't pinned (or its pin expired)
+const struct route_backend *upload_pin_find(const char *id, const struct route *r) {
+    const struct route_backend *found = NULL;
+    long long now = now_ms();
+    pthread_mutex_lock(&upload_pins.lock);
+    for (int i = 0; i < UPLOAD_PINS_MAX; i++) {
+        struct upload_pin *p = &upload_pins.pins[i];
+        if (strcmp(p->id, id) != 0) continue;
+        for (int j = 0; j < r->norder && !found; j++) {
+            const struct route_backend *b = &r->backends[r->order[j]];
+            if (b->port == p->backend.port && strcmp(b->host, p->backend.host) == 0) found = b;
+        }
+        if (found && now - p->used_ms <= UPLOAD_PIN_SECONDS * 1000LL) p->used_ms = now;
+        else found = NULL, p->id[0] = '\0';
+        break;
     }
-    else if (strcmp(ext, ".txt") == 0) {
-        port = 1203; // S3's port
-        if (strncmp(dest_path, "~S1", 3) == 0)
-            snprintf(dest_path, 512, "~S3%s", dest_path + 3);  // Change destination to S3
+    pthread_mutex_unlock(&upload_pins.lock);
+    return found;
+}
+
+// Function to pin a chunked upload to a backend (or unpin it with b == NULL)
+// A full table gives up the least recently used pin.
+void upload_pin_set(const char *id, const struct route_backend *b) {
+    pthread_mutex_lock(&upload_pins.lock);
+    struct upload_pin *slot = NULL;
+    for (int i = 0; i < UPLOAD_PINS_MAX; i++) {
+        struct upload_pin *p = &upload_pins.pins[i];
+        if (strcmp(p->id, id) == 0) {
+            slot = p;
+            break;
+        }
+        if (!slot || (slot->id[0] && (!p->id[0] || p->used_ms < slot->used_ms))) slot = p;
     }
-    else if (strcmp(ext, ".zip") == 0) {
-        port = 1206; // S4's port
-        if (strncmp(dest_path, "~S1", 3) == 0)
-            snprintf(dest_path, 512, "~S4%s", dest_path + 3);  // Change destination to S4
+    if (b) {
+        snprintf(slot->id, sizeof(slot->id), "%s", id);
+        slot->backend = *b;
+        slot->used_ms = now_ms();
+    } else if (strcmp(slot->id, id) == 0) {
+        slot->id[0] = '\0';
     }
-    else {
-        send(sock, "Unsupported file type.\n", 24, 0);
+    pthread_mutex_unlock(&upload_pins.lock);
+}
+
+// Function to handle one step of a resumable chunked upload (see chunked.h):
+// uploadstat, uploadchunk (followed by a data stream), uploadref or uploadcommit.
+// Every step is routed by the file's name and path like uploadf, so all the
+// chunks of an upload land on the server that will store the file. A
+// replicated file is assembled on the first replica that answers; the upload
+// stays pinned to it (upload_pin_find) so a failover mid-upload can't split
+// its parts. Once committed it is copied to the other replicas: before the
+// reply on a sync route (acknowledged once route->quorum hold it), in the
+// background on an async one.
+// Parameters:
+//   sock - socket connected to the client
+//   req_id - request id of the client's frame
+//   command - uploadstat, uploadchunk, uploadref or uploadcommit
+//   filename - name the file will be stored under
+//   dest_path - destination directory (~S1/...)
+//   args - rest of the request: "<id>", "<id> <offset> [parallel=<size>]", "<id> <offset> <chunks...>"
+//          or "<id> <size> [crc32c=...]"
+void handle_upload_part(int sock, uint32_t req_id, const char *command, char *filename, char *dest_path,
+                        const char *args) {
+    char msg[256], id[UPLOAD_ID_MAX + 2];
+    long long number, total;
+    int parallel;
+    int chunk = strcmp(command, "uploadchunk") == 0;
+    int commit = strcmp(command, "uploadcommit") == 0;
+    int ref = strcmp(command, "uploadref") == 0;
+    parse_upload_args(args, id, sizeof(id), &number, &parallel, &total);
+
+    // Find the route for the file's name and, for a sharded type, its shard
+    struct route route;
+    char key[768];
+    shard_key_of(dest_path, filename, key, sizeof(key));
+    int routed = route_find(filename, key, &route) == 0;
+    if (!routed || ((chunk || commit || ref) && number < 0)) {
+        if (chunk && recv_stream_to_file(sock, NULL, msg, sizeof(msg)) < 0) return;  // Drain the chunk
+        send_error(sock, req_id, !routed ? "Unsupported file type.\n" : "Error: Missing offset or size.\n");
         return;
     }
 
-    // Connect to the appropriate secondary server
-    int s_sock = connect_to_server(server_ip, port);
-    if (s_sock == -1) {
-        send(sock, "Could not connect to secondary server.\n", 39, 0);
+    // Locally routed types (.c) are assembled under ~/S1/.uploads
+    if (route.local) {
+        char *home = getenv("HOME");
+        char root[512], full_file_path[1024];
+        snprintf(root, sizeof(root), "%s/S1", home ? home : ".");
+        if (strncmp(dest_path, "~S1", 3) == 0)
+            snprintf(full_file_path, sizeof(full_file_path), "%s%s/%s", root, dest_path + 3, filename);
+        else
+            snprintf(full_file_path, sizeof(full_file_path), "%s/%s", home ? home : ".", filename);
+
+        if (chunk) {
+            if (serve_upload_chunk(sock, req_id, root, id, number, parallel, total) < 0) shutdown(sock, SHUT_RDWR);
+        } else if (ref) {
+            serve_upload_ref(sock, req_id, root, id, number, "");  // S1 keeps no chunk store: refused
+        } else if (!commit) {
+            serve_upload_stat(sock, req_id, root, id);
+        } else {
+            make_directory_from_path(full_file_path);
+            if (serve_upload_commit(sock, req_id, root, id, number, full_file_path, args) == 1) {
+                ns_index_file(full_file_path);  // Visible to listings immediately
+                dir_version_bump(dest_path);
+                printf("[S1] Committed chunked upload %s -> %s (%lld bytes)\n", filename, full_file_path, number);
+                send_msg(sock, req_id, "Your file has been uploaded successfully.\n");
+            }
+        }
         return;
     }
 
-    // Prepare and send the upload command to the secondary server
-    char forward_cmd[512];
-    snprintf(forward_cmd, sizeof(forward_cmd), "uploadf %s %s", filename, dest_path);
-    send(s_sock, forward_cmd, strlen(forward_cmd), 0);
-    sleep(1);  // Brief delay to ensure command is processed
-
-    // Open the file again and send its contents to the secondary server
-    file = fopen(full_file_path, "rb");
-    while ((bytes = fread(buffer, 1, BUFFER_SIZE, file)) > 0)
-        send(s_sock, buffer, bytes, 0);
-    fclose(file);
-    close(s_sock);  // Close connection to secondary server
+    // Forward the step to the route's sub-server with the path rewritten
+    char forward_dest[512], forward_cmd[MAX_REQUEST_SIZE + 1024];
+    if (route_path(&route, dest_path, forward_dest, sizeof(forward_dest)) < 0) {
+        if (chunk && recv_stream_to_file(sock, NULL, msg, sizeof(msg)) < 0) return;  // Drain the chunk
+        send_error(sock, req_id, "Error: Path too long.\n");
+        return;
+    }
+    snprintf(forward_cmd, sizeof(forward_cmd), "%s %s %s %s", command, filename, forward_dest, args);
+    const struct route_backend *backend = upload_pin_find(id, &route);
+    int s_sock = backend ? pool_acquire(backend->host, backend->port) : route_acquire(&route, &backend);
+    if (s_sock != -1) upload_pin_set(id, backend);
+    if (s_sock == -1 || pool_send_request(backend, &s_sock, req_id, forward_cmd) < 0) {
+        if (s_sock != -1) pool_release(backend->host, backend->port, s_sock, 0);
+        if (chunk && recv_stream_to_file(sock, NULL, msg, sizeof(msg)) < 0) return;
+        send_error(sock, req_id, "Error: Could not connect to secondary server.\n");
+        return;
+    }
+    if (chunk && relay_stream(sock, s_sock, &relay_stats) < 0) {
+        // Cut off mid-chunk: closing the sub-server connection makes it keep
+        // the bytes that did arrive, and the client resumes from there
+        pool_release(backend->host, backend->port, s_sock, 0);
+        shutdown(sock, SHUT_RDWR);
+        return;
+    }
 
-    // Remove the file from this server (S1) after forwarding
-    remove(full_file_path);
-     // Send end of list marker
-    printf("[S1] Forwarded %s to port %d and removed from S1\n", filename, port);
-    send(sock, "Your file has been uploaded successfully.\n", 43, 0);
+    // Pass the sub-server's reply back; a commit is only known to have
+    // succeeded from an OP_MSG, so read it here instead of relaying blindly
+    int op = recv_reply(s_sock, msg, sizeof(msg));
+    pool_release(backend->host, backend->port, s_sock, op > 0);
+    if (op != OP_MSG || !commit) {
+        if (op == OP_MSG) send_msg(sock, req_id, msg);
+        else if (op == OP_ERROR) send_error(sock, req_id, msg);
+        else send_error(sock, req_id, "Error: No response from secondary server.\n");
+        return;
+    }
+    upload_pin_set(id, NULL);
+    dir_version_bump(dest_path);
+
+    // Copy the committed file to the other replicas: a sync route waits for
+    // them (as upload_replicas does), the rest is left to the replicator
+    int acks = 1;
+    struct replica_job job = { .from = *backend };
+    int named = snprintf(job.path, sizeof(job.path), "%s/%s", forward_dest, filename) < (int)sizeof(job.path);
+    for (int i = 0; i < route.replicas && named; i++) {
+        const struct route_backend *b = &route.backends[route.order[i]];
+        if (b == backend) continue;
+        job.to = *b;
+        if (!route.async && replica_run(&job) == 0) acks++;
+        else replica_enqueue(0, backend, b, job.path);
+    }
+    if (route.async || acks >= route.quorum) {
+        send_msg(sock, req_id, msg);
+    } else {
+        snprintf(msg, sizeof(msg), "Error: Only %d of %d replicas stored the file (quorum is %d).\n",
+                 acks, route.replicas, route.quorum);
+        send_error(sock, req_id, msg);
+    }
+    printf("[S1] Committed chunked upload %s (%lld bytes) on %s:%d, %d of %d replicas (%s)\n", filename, number,
+           backend->host, backend->port, acks, route.replicas, route.async ? "async" : "sync");
 }
 
 // Function to handle file download requests from clients
 // Parameters:
 //   sock - socket connected to the client
+//   req_id - request id of the client's downlf frame
+//   flags - flags of that frame (FRAME_DEFLATE: the client takes a deflated reply)
 //   filepath - path of the file requested for download
-void handle_downlf(int sock, char *filepath) {
+//   range - rest of the request: optional "<offset> [length]" (see chunked.h)
+void handle_downlf(int sock, uint32_t req_id, uint16_t flags, char *filepath, const char *range) {
     // Get the user's home directory path
     char *home = getenv("HOME");
     if (!home) {
-        send(sock, "Error: Cannot get HOME environment.\n", 36, 0);
+        send_error(sock, req_id, "Error: Cannot get HOME environment.\n");
+        return;
+    }
+
+    // An optional byte range follows the path
+    long long offset, length;
+    if (parse_byte_range(range, &offset, &length) < 0) {
+        send_error(sock, req_id, "Error: Invalid byte range.\n");
         return;
     }
 
     // Extract file extension from the path
     char *ext = strrchr(filepath, '.'); // find last occurence .
     if (!ext) {
-        send(sock, "Error: File has no extension.\n", 30, 0);
-        return;
-    }
-
-    // Determine which server contains the file based on extension
-    int port = 0;  // 0 means local server (S1)
-    char server_prefix[4] = "S1";  // Default to S1 server
-    
-    // Set port and server prefix based on file type
-    if (strcmp(ext, ".pdf") == 0) {
-        port = 1202; // S2's port
-        strcpy(server_prefix, "S2");
-    } else if (strcmp(ext, ".txt") == 0) {
-        port = 1203; // S3's port
-        strcpy(server_prefix, "S3");
-    } else if (strcmp(ext, ".zip") == 0) {
-        port = 1206; // S4's port
-        strcpy(server_prefix, "S4");
-    } else if (strcmp(ext, ".c") != 0) {
+        send_error(sock, req_id, "Error: File has no extension.\n");
+        return;
+    }
+
+    // Determine which server (or shard) holds the file from the routing table
+    struct route route;
+    char key[768];
+    shard_key(filepath, key, sizeof(key));
+    if (route_find(filepath, key, &route) < 0) {
         // Reject unsupported file types
-        send(sock, "Error: Unsupported file type.\n", 30, 0);
+        send_error(sock, req_id, "Error: Unsupported file type.\n");
         return;
     }
 
-    // Handle .c files locally (port remains 0)
-    if (port == 0) {
+    // Handle locally routed files (.c) here
+    if (route.local) {
         char full_file_path[512];
         // Construct full path, handling ~S1 prefix if present
         if (strncmp(filepath, "~S1", 3) == 0) {
@@ -245,95 +1538,139 @@ void handle_downlf(int sock, char *filepath) {
         // Open the file for reading in binary mode
         FILE *file = fopen(full_file_path, "rb");
         if (!file) {
-            char err_msg[] = "Error: File not found on server.\n";
-            send(sock, err_msg, strlen(err_msg), 0);
-            // shutdown(sock, SHUT_WR);  // Ensure no more data is sent
+            send_error(sock, req_id, "Error: File not found on server.\n");
             return;
         }
 
-        // Read file contents and send to client
-        char buffer[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-            send(sock, buffer, bytes, 0);
-        }
+        // Send file contents (or the requested range) to client as a sized data frame (zero-copy via sendfile),
+        // deflated if the client takes that and the type is worth it (compress.h)
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long sent = send_file_part(sock, req_id, file, offset, length, compress_reply_wanted(flags, full_file_path));
         fclose(file);
-        printf("[S1] Sent .c file %s to client\n", full_file_path);
+        if (sent == -2) {
+            send_error(sock, req_id, "Error: Byte range starts past the end of the file.\n");
+            return;
+        }
+        double ms = elapsed_ms(&start);
+        printf("[S1] Sent %s file %s to client (%lld bytes, %.1f ms, %.1f MB/s, %s)\n", ext, full_file_path, sent,
+               ms, ms > 0 ? sent / 1048.576 / ms : 0.0, io_engine_name());
         return;
     }
 
-    // For non-.c files, forward request to appropriate secondary server
-    const char *server_ip = "127.0.0.1";  // Localhost IP
-    int s_sock = connect_to_server(server_ip, port);
+    // Modify the path to use the correct server prefix (~S1 -> ~S2, ~S3, etc.)
+    char modified_path[512];
+    if (route_path(&route, filepath, modified_path, sizeof(modified_path)) < 0) {
+        send_error(sock, req_id, "Error: Path too long.\n");
+        return;
+    }
+    char forward_cmd[600];
+    if (length >= 0)
+        snprintf(forward_cmd, sizeof(forward_cmd), "downlf %s %lld %lld", modified_path, offset, length);
+    else if (offset > 0)
+        snprintf(forward_cmd, sizeof(forward_cmd), "downlf %s %lld", modified_path, offset);
+    else
+        snprintf(forward_cmd, sizeof(forward_cmd), "downlf %s", modified_path);
+
+    // For other files, forward request to the route's secondary server. A
+    // replicated file is read from its least-loaded replica, moving on to the
+    // next if that one can't answer or doesn't have the file (yet). Whether
+    // the client takes a deflated reply goes along; deflated frames are
+    // relayed as they are.
+    if (route.replicas > 1) replica_read_order(&route);
+    // A replica's "not found" is kept, so it is what the client hears if no
+    // later replica can be reached either
+    const struct route_backend *backend;
+    struct frame_header first;
+    char refused[256] = "Error: Could not connect to secondary server.\n";
+    int next = 0, s_sock;
+    while ((s_sock = route_acquire_next(&route, &next, &backend)) != -1) {
+        if (send_request_flags(s_sock, req_id, flags & FRAME_DEFLATE, forward_cmd) < 0 ||
+            recv_frame_header(s_sock, &first) < 0) {
+            pool_release(backend->host, backend->port, s_sock, 0);
+            continue;
+        }
+        if (first.opcode != OP_ERROR || route.replicas == 1 || next == route.norder) break;
+        char text[256];
+        int read = recv_text_payload(s_sock, first.length, text, sizeof(text)) == 0;
+        if (read) snprintf(refused, sizeof(refused), "%s", text);
+        pool_release(backend->host, backend->port, s_sock, read);
+    }
     if (s_sock == -1) {
-        send(sock, "Error: Could not connect to secondary server.\n", 45, 0);
+        send_error(sock, req_id, refused);
         return;
     }
 
-    // Modify the path to use the correct server prefix
-    char modified_path[512];
-    if (strncmp(filepath, "~S1", 3) == 0) {
-        // Replace ~S1 with the appropriate server prefix (~S2, ~S3, etc.)
-        snprintf(modified_path, sizeof(modified_path), "~%s%s", server_prefix, filepath + 3);
-    } else {
-        // Keep original path if no server prefix was specified
-        strcpy(modified_path, filepath);
-    }
+    // Relay the secondary server's response frames to the client. If it
+    // breaks off mid-stream the client can't tell the reply is incomplete, so
+    // its connection is dropped and it resumes the download on a new one.
+    long long rc = relay_stream_from(s_sock, sock, &relay_stats, &first);
+    if (rc < 0) shutdown(sock, SHUT_RDWR);
 
-    // Send download command to secondary server
-    char forward_cmd[512];
-    snprintf(forward_cmd, sizeof(forward_cmd), "downlf %s", modified_path);
-    send(s_sock, forward_cmd, strlen(forward_cmd), 0);
+    pool_release(backend->host, backend->port, s_sock, rc >= 0);  // Return connection to the pool
+    printf("[S1] Forwarded %s file request to %s:%d\n", ext, backend->host, backend->port);
+}
 
-    // Relay file contents from secondary server to client
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    while ((bytes = recv(s_sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        send(sock, buffer, bytes, 0);
-        if (bytes < BUFFER_SIZE) break;  // Last chunk of data received
+// Function to remove a file from every replica of a replicated route
+// Replicas that can't be reached are left to the replicator; the client is
+// told the file is gone once any replica has removed it
+// Parameters:
+//   sock - socket connected to the client
+//   req_id - request id of the client's removef frame
+//   r - the file's route from route_find (its replicas are order[0..replicas))
+//   path - the file's path rewritten for the sub-servers (~S2/...)
+void remove_replicas(int sock, uint32_t req_id, const struct route *r, const char *path) {
+    char forward_cmd[600], msg[256], reply[256] = "Error: Could not connect to secondary server.\n";
+    int removed = 0;
+    snprintf(forward_cmd, sizeof(forward_cmd), "removef %s", path);
+    replica_forget(path);  // Pending copies would bring it back
+    for (int i = 0; i < r->replicas; i++) {
+        const struct route_backend *b = &r->backends[r->order[i]];
+        int s_sock = pool_acquire(b->host, b->port);
+        int op = s_sock == -1 || send_request(s_sock, req_id, forward_cmd) < 0 ? -1
+                                                                              : recv_reply(s_sock, msg, sizeof(msg));
+        if (s_sock != -1) pool_release(b->host, b->port, s_sock, op > 0);
+        if (op < 0) replica_enqueue(1, NULL, b, path);
+        if (op == OP_MSG && removed++ == 0) snprintf(reply, sizeof(reply), "%s", msg);
+        else if (op == OP_ERROR && !removed) snprintf(reply, sizeof(reply), "%s", msg);
     }
-
-    close(s_sock);  // Close connection to secondary server
-    printf("[S1] Forwarded %s file request to port %d\n", ext, port);
+    if (removed) send_msg(sock, req_id, reply);
+    else send_error(sock, req_id, reply);
+    printf("[S1] Removed %s from %d of %d replicas\n", path, removed, r->replicas);
 }
 
 // Function to handle file removal requests
 // Parameters:
 //   sock - socket connected to the client
+//   req_id - request id of the client's removef frame
 //   filepath - path of the file to be removed
-void handle_removef(int sock, char *filepath) {
+void handle_removef(int sock, uint32_t req_id, char *filepath) {
     // Get the user's home directory path
     char *home = getenv("HOME");
     if (!home) {
-        send(sock, "Error: Cannot get HOME environment.\n", 36, 0);
+        send_error(sock, req_id, "Error: Cannot get HOME environment.\n");
         return;
     }
 
     // Extract file extension from the path
     char *ext = strrchr(filepath, '.');
     if (!ext) {
-        send(sock, "Error: File has no extension.\n", 30, 0);
+        send_error(sock, req_id, "Error: File has no extension.\n");
         return;
     }
 
-    // Determine which server contains the file based on extension
-    int port = 0;  // 0 means local server (S1)
-    char server_prefix[4] = "S1";  // Default to S1 server
-    
-    // Set port and server prefix based on file type
-    if (strcmp(ext, ".pdf") == 0) {
-        port = 1202; // S2's port
-        strcpy(server_prefix, "S2");
-    } else if (strcmp(ext, ".txt") == 0) {
-        port = 1203; // S3's port
-        strcpy(server_prefix, "S3");
-    } else if (strcmp(ext, ".zip") == 0) {
-        port = 1206; // S4's port
-        strcpy(server_prefix, "S4");
+    // Determine which server (or shard) holds the file from the routing table
+    struct route route;
+    char key[768];
+    shard_key(filepath, key, sizeof(key));
+    if (route_find(filepath, key, &route) < 0) {
+        // Reject unsupported file types
+        send_error(sock, req_id, "Error: Unsupported file type.\n");
+        return;
     }
 
-    // Handle .c files locally (port remains 0)
-    if (port == 0 && strcmp(ext, ".c") == 0) {
+    // Handle locally routed files (.c) here
+    if (route.local) {
         char full_file_path[512];
         // Construct full path, handling ~S1 prefix if present
         if (strncmp(filepath, "~S1", 3) == 0) {
@@ -344,175 +1681,583 @@ void handle_removef(int sock, char *filepath) {
 
         // Attempt to remove the file
         if (remove(full_file_path) == 0) {
-            printf("[S1] Removed .c file: %s\n", full_file_path);
-            send(sock, "File removed successfully.\n", 28, 0);
+            ns_index_forget(full_file_path);  // Drop it from the listing index right away
+            dir_version_bump_parent(filepath);
+            printf("[S1] Removed %s file: %s\n", ext, full_file_path);
+            send_msg(sock, req_id, "File removed successfully.\n");
         } else {
             perror("Error removing file");
-            send(sock, "Error: File could not be removed.\n", 35, 0);
+            send_error(sock, req_id, "Error: File could not be removed.\n");
         }
         return;
-    } else if (port == 0) {
-        // Reject unsupported file types
-        send(sock, "Error: Unsupported file type.\n", 30, 0);
-        return;
     }
 
-    // For non-.c files, forward request to appropriate secondary server
-    const char *server_ip = "127.0.0.1";  // Localhost IP
-    int s_sock = connect_to_server(server_ip, port);
-    if (s_sock == -1) {
-        send(sock, "Error: Could not connect to secondary server.\n", 45, 0);
+    // Modify the path to use the correct server prefix (~S1 -> ~S2, ~S3, etc.)
+    char modified_path[512];
+    if (route_path(&route, filepath, modified_path, sizeof(modified_path)) < 0) {
+        send_error(sock, req_id, "Error: Path too long.\n");
+        return;
+    }
+    if (route.replicas > 1) {
+        remove_replicas(sock, req_id, &route, modified_path);
+        dir_version_bump_parent(filepath);
         return;
     }
 
-    // Modify the path to use the correct server prefix
-    char modified_path[512];
-    if (strncmp(filepath, "~S1", 3) == 0) {
-        // Replace ~S1 with the appropriate server prefix (~S2, ~S3, etc.)
-        snprintf(modified_path, sizeof(modified_path), "~%s%s", server_prefix, filepath + 3);
-    } else {
-        // Keep original path if no server prefix was specified
-        strcpy(modified_path, filepath);
+    // For other files, forward request to the route's secondary server
+    const struct route_backend *backend;
+    int s_sock = route_acquire(&route, &backend);
+    if (s_sock == -1) {
+        send_error(sock, req_id, "Error: Could not connect to secondary server.\n");
+        return;
     }
 
     // Send remove command to secondary server
-    char forward_cmd[512];
+    char forward_cmd[600];
     snprintf(forward_cmd, sizeof(forward_cmd), "removef %s", modified_path);
-    send(s_sock, forward_cmd, strlen(forward_cmd), 0);
+    if (pool_send_request(backend, &s_sock, req_id, forward_cmd) < 0) {
+        send_error(sock, req_id, "Error: Could not connect to secondary server.\n");
+        return;
+    }
 
     // Forward the server's response back to the client
-    char buffer[BUFFER_SIZE];
-    int bytes = recv(s_sock, buffer, BUFFER_SIZE, 0);
-    if (bytes > 0) {
-        send(sock, buffer, bytes, 0);
+    long long rc = relay_stream(s_sock, sock, &relay_stats);
+    if (rc == -2)
+        send_error(sock, req_id, "Error: No response from secondary server.\n");
+
+    pool_release(backend->host, backend->port, s_sock, rc >= 0);  // Return connection to the pool
+    dir_version_bump_parent(filepath);
+    printf("[S1] Forwarded remove request for %s to %s:%d\n", ext, backend->host, backend->port);
+}
+
+/* One archive feeding a joined downltar: a sub-server's reply, or S1's own files */
+struct tar_part {
+    const char *ext;                      // Type of the files
+    int local;                            // S1's own files (no sub-server)
+    int sock;                             // Connection to the sub-server, or -1
+    const struct route_backend *backend;  // Sub-server answering (for returning the connection)
+};
+
+// Function to build one archive out of the files of several routes: every
+// shard of a sharded route, one server of a failover route, and S1's own
+// files for a local route, joined in the order given
+// Parameters:
+//   sock - socket connected to the client
+//   req_id - request id of the client's downltar frame
+//   routes - routes of the types to include (resolved with route_find)
+//   exts - type of each route's files (e.g. .pdf)
+//   nroutes - number of routes
+//   scope - the request's options (dir=, glob=, since=, passed on to every server; gz)
+//   label - what the archive holds (for the log)
+void join_downltar(int sock, uint32_t req_id, const struct route *routes, char (*exts)[16], int nroutes,
+                   const struct tar_scope *scope, const char *label) {
+    // Ask every sub-server up front so they build their archives
+    // concurrently, then join the archives in turn (with replicas, a file
+    // several shards hold goes in once). The sub-servers send plain tars,
+    // since joining works on tar blocks; S1 gzips the combined archive.
+    struct tar_part parts[ROUTE_MAX * ROUTE_MAX_BACKENDS];
+    int nparts = 0, unique = 0;
+    char forward_cmd[1400], dir[600], opts[1200];
+    for (int i = 0; i < nroutes; i++) {
+        if (!routes[i].local && route_path(&routes[i], scope->dir, dir, sizeof(dir)) < 0) {
+            send_error(sock, req_id, "Error: Path too long.\n");
+            return;
+        }
+    }
+    for (int i = 0; i < nroutes; i++) {
+        const struct route *r = &routes[i];
+        if (r->sharded && r->replicas > 1) unique = 1;
+        route_path(r, scope->dir, dir, sizeof(dir));  // ~S1/sub -> ~S2/sub (fits: checked above)
+        tar_format_scope(scope, 0, dir, opts, sizeof(opts));
+        snprintf(forward_cmd, sizeof(forward_cmd), "downltar %s%s", exts[i], opts);
+        for (int j = 0; j < (r->sharded ? r->nbackends : 1); j++) {
+            struct tar_part *p = &parts[nparts++];
+            *p = (struct tar_part){ exts[i], r->local, -1, NULL };
+            if (r->local) continue;
+            if (r->sharded) {
+                p->backend = &r->backends[j];
+                p->sock = pool_acquire(p->backend->host, p->backend->port);
+            } else {
+                p->sock = route_acquire(r, &p->backend);  // First server of the route that answers
+            }
+            if (p->sock >= 0 && send_request(p->sock, req_id, forward_cmd) < 0) {
+                pool_release(p->backend->host, p->backend->port, p->sock, 0);
+                p->sock = -1;
+            }
+            if (p->sock < 0 && p->backend)
+                printf("[S1] %s:%d unavailable; %s tar will miss its files\n", p->backend->host, p->backend->port,
+                       label);
+            else if (p->sock < 0)
+                printf("[S1] No server for %s files available; %s tar will miss them\n", exts[i], label);
+        }
+    }
+
+    struct tar_concat cat;
+    char *home = getenv("HOME"), root[512];
+    snprintf(root, sizeof(root), "%s/S1", home ? home : ".");
+    int failed = tar_concat_init(&cat, sock, req_id, unique, scope->gzip) < 0;
+    for (int i = 0; i < nparts; i++) {
+        struct tar_part *p = &parts[i];
+        if (p->local) {
+            if (!failed && tar_concat_local(&cat, root, p->ext, scope) < 0) failed = 1;
+            continue;
+        }
+        if (p->sock < 0) continue;
+        int rc = failed ? -1 : tar_concat_relay(&cat, p->sock);
+        if (rc < 0) failed = 1;
+        pool_release(p->backend->host, p->backend->port, p->sock, rc >= 0);
+    }
+    if (failed) {
+        // Part of an archive may already be out; the client can't be resynchronized
+        tar_concat_free(&cat);
+        shutdown(sock, SHUT_RDWR);
+        return;
+    }
+    int streams = cat.streams;
+    tar_concat_finish(&cat, "Error: No files found.\n");
+    printf("[S1] Joined %s tar%s from %d of %d sources\n", label, scope->gzip ? ".gz" : "", streams, nparts);
+}
+
+// Function to handle a downltar of several types at once: one archive of
+// every type S1 routes ("all"), or of a comma-separated list such as .pdf,.zip
+// Parameters:
+//   sock - socket connected to the client
+//   req_id - request id of the client's downltar frame
+//   types - "all" or the list of types
+//   scope - the request's options
+void handle_downltar_types(int sock, uint32_t req_id, char *types, const struct tar_scope *scope) {
+    struct route routes[ROUTE_MAX];
+    char exts[ROUTE_MAX][16];
+    int n = 0, all = strcmp(types, "all") == 0;
+    if (all) {
+        // Every extension in the routing table, in table order
+        struct route_table *t = routes_acquire();
+        for (int i = 0; i < t->count && n < ROUTE_MAX; i++) {
+            const char *ext = t->routes[i].ext;
+            int dup = ext[0] == '\0';
+            for (int j = 0; j < n && !dup; j++) dup = strcmp(exts[j], ext) == 0;
+            if (!dup) snprintf(exts[n++], sizeof(exts[0]), "%s", ext);
+        }
+        routes_release(t);
     } else {
-        send(sock, "Error: No response from secondary server.\n", 42, 0);
+        char *save = NULL;
+        for (char *tok = strtok_r(types, ",", &save); tok && n < ROUTE_MAX; tok = strtok_r(NULL, ",", &save)) {
+            if (tok[0] != '.' || strlen(tok) >= sizeof(exts[0])) {
+                send_error(sock, req_id, "Error: Invalid filetype. No server stores that type.\n");
+                return;
+            }
+            int dup = 0;
+            for (int j = 0; j < n && !dup; j++) dup = strcmp(exts[j], tok) == 0;
+            if (!dup) snprintf(exts[n++], sizeof(exts[0]), "%s", tok);
+        }
     }
 
-    close(s_sock);  // Close connection to secondary server
-    printf("[S1] Forwarded remove request for %s to port %d\n", ext, port);
+    // Resolve each type as a single-type downltar would (a type only glob
+    // routes store has no archive of its own and is left out of "all")
+    int kept = 0;
+    for (int i = 0; i < n; i++) {
+        if (route_find(exts[i], NULL, &routes[kept]) == 0) {
+            if (kept != i) memcpy(exts[kept], exts[i], sizeof(exts[0]));
+            kept++;
+        } else if (!all) {
+            send_error(sock, req_id, "Error: Invalid filetype. No server stores that type.\n");
+            return;
+        }
+    }
+    if (kept == 0) {
+        send_error(sock, req_id, "Error: No files found.\n");
+        return;
+    }
+    join_downltar(sock, req_id, routes, exts, kept, scope, all ? "all" : "multi-type");
 }
 
 // Function to handle tar file download requests
 // Parameters:
 //   sock - socket connected to the client
-//   filetype - type of files to include in the tar archive (.c, .pdf, or .txt)
-void handle_downltar(int sock, char *filetype) {
-    // Verify requested filetype is supported
-    if (strcmp(filetype, ".c") != 0 && 
-        strcmp(filetype, ".pdf") != 0 && 
-        strcmp(filetype, ".txt") != 0) {
-        send(sock, "Error: Invalid filetype. Only .c, .pdf, or .txt supported.\n", 58, 0);
+//   req_id - request id of the client's downltar frame
+//   filetype - type of files to include in the tar archive (an extension with a route, e.g. .pdf),
+//              a comma-separated list of types, or "all"
+//   options - the words after the type: "gz" for a gzipped archive, and
+//             dir=, glob= and since= to narrow it (see tar_parse_scope)
+void handle_downltar(int sock, uint32_t req_id, char *filetype, const char *options) {
+    struct tar_scope scope;
+    if (tar_parse_scope(options, &scope) < 0) {
+        send_error(sock, req_id, TAR_OPTION_UNKNOWN);
         return;
     }
 
-    // Handle .c files locally
-    if (strcmp(filetype, ".c") == 0) {
+    // Several types make one archive joined from every server involved
+    if (strcmp(filetype, "all") == 0 || strchr(filetype, ',')) {
+        handle_downltar_types(sock, req_id, filetype, &scope);
+        return;
+    }
+
+    // Verify requested filetype has a route
+    struct route route;
+    if (filetype[0] != '.' || route_find(filetype, NULL, &route) < 0) {
+        send_error(sock, req_id, "Error: Invalid filetype. No server stores that type.\n");
+        return;
+    }
+
+    // Handle locally routed types (.c) here
+    if (route.local) {
         char *home = getenv("HOME");
         if (!home) {
-            send(sock, "Error: Cannot get HOME environment.\n", 36, 0);
-            return;
-        }
-
-        // Create tar command to bundle all .c files from S1 directory
-        char cmd[512];
-        snprintf(cmd, sizeof(cmd), "tar -cf - -C %s/S1 $(find %s/S1 -type f -name '*.c') 2>/dev/null", home, home);
-        
-        // Execute the tar command and get a file pointer to its output
-        FILE *tar = popen(cmd, "r");
-        if (!tar) {
-            send(sock, "Error: Failed to create tar file.\n", 34, 0);
+            send_error(sock, req_id, "Error: Cannot get HOME environment.\n");
             return;
         }
 
-        // Stream tar output directly to client
-        char buffer[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = fread(buffer, 1, BUFFER_SIZE, tar)) > 0) {
-            send(sock, buffer, bytes, 0);
+        // Walk ~/S1 (or the dir= under it) and stream every file of the type
+        // as a tar member (bodies via sendfile)
+        char root[512];
+        snprintf(root, sizeof(root), "%s/S1", home);
+        struct tar_stats stats;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (send_tar_stream(sock, req_id, root, filetype, &scope, "Error: No files found.\n", &stats) > 0) {
+            double ms = elapsed_ms(&start);
+            if (scope.gzip)
+                printf("[S1] Created and sent %s tar.gz (%lld files, %lld bytes gzipped to %lld, %.1f ms)\n",
+                       filetype, stats.files, stats.bytes, stats.packed, ms);
+            else
+                printf("[S1] Created and sent %s tar (%lld files, %lld bytes, %.1f ms)\n",
+                       filetype, stats.files, stats.bytes, ms);
         }
-        pclose(tar);  // Close the tar process
-        printf("[S1] Created and sent cfiles.tar\n");
+    } else if (route.sharded) {
+        // Every shard holds part of the files: one archive joined from all of them
+        char ext[1][16];
+        snprintf(ext[0], sizeof(ext[0]), "%s", filetype);
+        join_downltar(sock, req_id, &route, ext, 1, &scope, filetype);
     } else {
-        // Forward request for .pdf or .txt files to appropriate server
-        int port = (strcmp(filetype, ".pdf") == 0) ? 1202 : 1203;  // S2 or S3
-        
-        // Connect to the secondary server
-        int s_sock = connect_to_server("127.0.0.1", port);
+        // Forward the request to the route's secondary server
+        char forward_cmd[1400], dir[600], opts[1200];
+        if (route_path(&route, scope.dir, dir, sizeof(dir)) < 0) {  // ~S1/sub -> ~S2/sub
+            send_error(sock, req_id, "Error: Path too long.\n");
+            return;
+        }
+        const struct route_backend *backend;
+        int s_sock = route_acquire(&route, &backend);
         if (s_sock == -1) {
-            send(sock, "Error: No files found.\n", 24, 0);
+            send_error(sock, req_id, "Error: No files found.\n");
             return;
         }
 
-        // Send the downltar command to the secondary server
-        char forward_cmd[512];
-        snprintf(forward_cmd, sizeof(forward_cmd), "downltar %s", filetype);
-        send(s_sock, forward_cmd, strlen(forward_cmd), 0);
-
-        // Check if we actually get a tar file (peek at first bytes)
-        char buffer[BUFFER_SIZE];
-        int bytes = recv(s_sock, buffer, BUFFER_SIZE, MSG_PEEK);
-        if (bytes <= 0) {
-            send(sock, "Error: No files found.\n", 24, 0);
-            close(s_sock);
+        // Send the downltar command to the secondary server with the options:
+        // it filters the files and gzips the archive itself if asked to (the
+        // frames pass through unchanged)
+        tar_format_scope(&scope, scope.gzip, dir, opts, sizeof(opts));
+        snprintf(forward_cmd, sizeof(forward_cmd), "downltar %s%s", filetype, opts);
+        if (pool_send_request(backend, &s_sock, req_id, forward_cmd) < 0) {
+            send_error(sock, req_id, "Error: Could not connect to secondary server.\n");
             return;
         }
 
-        // Forward the actual tar data to client
-        while ((bytes = recv(s_sock, buffer, BUFFER_SIZE, 0)) > 0) {
-            send(sock, buffer, bytes, 0);
-            if (bytes < BUFFER_SIZE) break;  // Last chunk of data
+        // Forward the tar data frames (or the server's error) to client
+        long long rc = relay_stream(s_sock, sock, &relay_stats);
+        if (rc == -2)
+            send_error(sock, req_id, "Error: No files found.\n");
+        pool_release(backend->host, backend->port, s_sock, rc >= 0);  // Return connection to the pool
+        printf("[S1] Forwarded %s tar%s file from %s:%d\n", filetype, scope.gzip ? ".gz" : "", backend->host,
+               backend->port);
+    }
+}
+
+/* One input of the dispfnames/listf merge: S1's own sorted names of one
+ * local type, or a sub-server's sorted listing read incrementally off its socket */
+struct name_source {
+    int sock;                  // Sub-server connection, or -1 for the local list
+    const struct route_backend *backend;  // Sub-server answering (for returning the connection)
+    int target;                // Index in the listing's targets (listing_targets)
+    struct name_list *local;   // Local names when sock == -1
+    const char *dir;           // Local directory (for long-format columns)
+    int long_format;           // Local lines carry size/mtime columns
+    size_t next;               // Next local name
+    char buf[BUFFER_SIZE];     // Bytes of the current OP_DATA frame not yet consumed
+    size_t pos, len;
+    uint64_t frame_left;       // Payload bytes of the current frame still on the socket
+    int done;                  // No more names
+    int complete;              // Listing ended with its terminating frame (connection reusable)
+    int more;                  // listf: the server cut its page short
+    char version[LIST_VERSION_MAX];  // dispfnames: the server's directory version, if it sent one
+    char name[LIST_LINE_MAX];  // Current head of this source (one listing line)
+    size_t name_len;
+};
+
+// Function to advance a merge source to its next name
+// Parameters:
+//   src - source to advance
+// Returns:
+//   1 if src->name holds the next name, 0 once the source is exhausted
+int source_next(struct name_source *src) {
+    if (src->done) return 0;
+    if (src->sock < 0) {
+        if (src->next >= src->local->count) {
+            src->done = 1;
+            return 0;
+        }
+        src->name_len = format_list_line(src->name, sizeof(src->name), src->dir,
+                                         src->local->names[src->next++], src->long_format);
+        return 1;
+    }
+
+    // Assemble one line; names may be split across reads and frames
+    src->name_len = 0;
+    while (1) {
+        if (src->pos == src->len) {
+            if (src->frame_left == 0) {
+                struct frame_header h;
+                if (recv_frame_header(src->sock, &h) < 0) break;
+                if (h.opcode != OP_DATA) {  // OP_END (or an error) completes the listing
+                    char trailer[LIST_LINE_MAX];
+                    src->complete = h.length < sizeof(trailer) &&
+                                    recv_text_payload(src->sock, h.length, trailer, sizeof(trailer)) == 0;
+                    src->more = src->complete && h.opcode == OP_END && strncmp(trailer, "next=", 5) == 0;
+                    if (src->complete && h.opcode == OP_END && strncmp(trailer, "version=", 8) == 0) {
+                        size_t len = strcspn(trailer + 8, "\n");
+                        if (len < sizeof(src->version)) {
+                            memcpy(src->version, trailer + 8, len);
+                            src->version[len] = '\0';
+                        }
+                    }
+                    break;
+                }
+                src->frame_left = h.length;
+                continue;
+            }
+            size_t n = src->frame_left < sizeof(src->buf) ? src->frame_left : sizeof(src->buf);
+            if (recv_all(src->sock, src->buf, n) < 0) break;
+            src->frame_left -= n;
+            src->pos = 0;
+            src->len = n;
+        }
+        char c = src->buf[src->pos++];
+        if (c == '\n') {
+            src->name[src->name_len] = '\0';
+            return 1;
+        }
+        if (src->name_len < sizeof(src->name) - 1) src->name[src->name_len++] = c;
+    }
+    src->done = 1;
+    return 0;
+}
+
+/* One place a listing is read from: S1's own files of one type, a
+ * (failover) sub-server, or one shard of a sharded type */
+struct listing_target {
+    const struct route *route;
+    int shard;                 // Backend index of a shard, -1 to try the route's backends in order
+};
+
+// Function to pick what a listing fans out to under routing table t: one
+// target per extension S1 stores itself, one per remote server (several
+// routes may point at the same server; it is asked once), and one per shard
+// of a sharded type
+// Parameters:
+//   t - routing table
+//   targets - receives the targets (room for LIST_TARGETS_MAX)
+// Returns:
+//   number of targets
+int listing_targets(const struct route_table *t, struct listing_target *targets) {
+    int n = 0;
+    for (int i = 0; i < t->count; i++) {
+        const struct route *r = &t->routes[i];
+        if (r->local && r->ext[0] == '\0') continue;  // A local glob with no extension can't be listed
+        for (int shard = r->sharded ? 0 : -1; shard < (r->sharded ? r->nbackends : 0); shard++) {
+            int dup = 0;
+            for (int j = 0; j < n && !dup; j++) {
+                const struct listing_target *o = &targets[j];
+                if (r->local || o->route->local) {
+                    dup = r->local && o->route->local && strcmp(o->route->ext, r->ext) == 0;
+                } else if (strcmp(o->route->server, r->server) == 0 && (shard < 0) == (o->shard < 0)) {
+                    dup = shard < 0 ||
+                          (strcmp(o->route->backends[o->shard].host, r->backends[shard].host) == 0 &&
+                           o->route->backends[o->shard].port == r->backends[shard].port);
+                }
+            }
+            if (!dup) targets[n++] = (struct listing_target){ r, shard };
+        }
+    }
+    return n;
+}
+
+// Function to check that a directory can be rewritten (route_path) for every
+// remote listing target, so no sub-server is asked to list a truncated path
+// Parameters:
+//   targets/ntargets - listing targets
+//   pathname - directory as the client named it
+// Returns:
+//   1 if it fits for all of them, 0 otherwise
+int listing_path_fits(const struct listing_target *targets, int ntargets, const char *pathname) {
+    char dir[512];
+    for (int i = 0; i < ntargets; i++)
+        if (!targets[i].route->local && route_path(targets[i].route, pathname, dir, sizeof(dir)) < 0)
+            return 0;
+    return 1;
+}
+
+// Function to connect to a listing target's sub-server
+// Parameters:
+//   target - remote listing target
+//   used - receives the backend that answered (pass it to pool_release)
+// Returns:
+//   connected socket, or -1 if unreachable
+int target_acquire(const struct listing_target *target, const struct route_backend **used) {
+    const struct route *r = target->route;
+    for (int i = target->shard < 0 ? 0 : target->shard;
+         i < (target->shard < 0 ? r->nbackends : target->shard + 1); i++) {
+        int s_sock = pool_acquire(r->backends[i].host, r->backends[i].port);
+        if (s_sock != -1) {
+            *used = &r->backends[i];
+            return s_sock;
+        }
+    }
+    return -1;
+}
+
+// Function to send a listing request to a sub-server without waiting for the reply
+// Parameters:
+//   src - source to set up (left untouched if the sub-server is unreachable)
+//   target - listing target to ask
+//   cmd - request text
+// Returns:
+//   1 if the request was sent, 0 if the sub-server is unavailable
+int source_start(struct name_source *src, const struct listing_target *target, const char *cmd) {
+    const struct route_backend *backend;
+    int s_sock = target_acquire(target, &backend);
+    if (s_sock == -1) return 0;  // Sub-server down: list what the others have
+    if (send_request(s_sock, 0, cmd) < 0) {
+        pool_release(backend->host, backend->port, s_sock, 0);
+        return 0;
+    }
+    src->sock = s_sock;
+    src->backend = backend;
+    return 1;
+}
+
+// Function to merge sorted sources into out, smallest head first (k-way merge)
+// Parameters:
+//   sources - merge inputs; each must already hold its first name (or be done)
+//   nsources - number of inputs
+//   out - coalescing output buffer
+//   limit - stop after this many lines (0 = no limit)
+//   last - if non-NULL, receives the name of the last line written (LIST_LINE_MAX bytes)
+// Returns:
+//   number of lines written
+long merge_sources(struct name_source *sources, int nsources, struct name_writer *out, long limit,
+                   char *last) {
+    long emitted = 0;
+    while (limit == 0 || emitted < limit) {
+        int min = -1;
+        for (int i = 0; i < nsources; i++) {
+            if (sources[i].done) continue;
+            if (min < 0 || strcmp(sources[i].name, sources[min].name) < 0) min = i;
+        }
+        if (min < 0) break;
+        name_writer_add(out, sources[min].name, sources[min].name_len);
+        size_t len = strcspn(sources[min].name, "\t");  // Name without long-format columns
+        if (last) {
+            memcpy(last, sources[min].name, len);
+            last[len] = '\0';
         }
-        close(s_sock);  // Close connection to secondary server
-        printf("[S1] Forwarded %s tar file from port %d\n", filetype, port);
+        emitted++;
+        // Replicas list the same file; every source's copy of the name sorts next
+        for (int i = 0; i < nsources; i++) {
+            while (i != min && !sources[i].done && strncmp(sources[i].name, sources[min].name, len) == 0 &&
+                   (sources[i].name[len] == '\0' || sources[i].name[len] == '\t'))
+                source_next(&sources[i]);
+        }
+        source_next(&sources[min]);
     }
+    return emitted;
 }
 
-// compares the two strings
-int cmp_strings(const void *a, const void *b) {
-    const char *pa = *(const char **)a;
-    const char *pb = *(const char **)b;
-    return strcmp(pa, pb);
+// Function to read what's left of every source and return pooled connections
+void finish_sources(struct name_source *sources, int nsources) {
+    for (int i = 0; i < nsources; i++) {
+        while (source_next(&sources[i])) {}
+        if (sources[i].sock >= 0)
+            pool_release(sources[i].backend->host, sources[i].backend->port, sources[i].sock,
+                         sources[i].complete);
+    }
 }
 
-// Helper function to get local files matching a specific extension
+// Function to ask every remote listing target whether its copy of a directory
+// changed since a listing was cached; all requests go out before any reply is read
 // Parameters:
-//   base_path - directory path to search in
-//   file_ext - file extension to match (without dot)
-//   file_list - pointer to array of strings that will hold the results
-//   count - pointer to integer tracking number of files found
-void get_local_files(const char *base_path, const char *file_ext, char ***file_list, int *count) {
-    // Construct find command to locate files with given extension
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "find %s -type f -name '*.%s' -printf '%%f\\n' | sort", base_path, file_ext);
-    
-    // Execute the command and get output stream
-    FILE *fp = popen(cmd, "r");
-    if (!fp) return;
+//   t - routing table the listing was cached under
+//   pathname - directory as the client named it
+//   versions - versions the cached listing was filled under (slot 1 + target index)
+// Returns:
+//   1 if every sub-server answered with the same version, 0 otherwise
+int list_cache_revalidate(const struct route_table *t, const char *pathname,
+                          char versions[][LIST_VERSION_MAX]) {
+    struct listing_target targets[LIST_TARGETS_MAX];
+    const struct route_backend *used[LIST_TARGETS_MAX];
+    int socks[LIST_TARGETS_MAX], same = 1;
+    int ntargets = listing_targets(t, targets);
+    for (int i = 0; i < ntargets; i++) {
+        socks[i] = -1;
+        if (targets[i].route->local) continue;
+        char dir[512], cmd[600];
+        if (route_path(targets[i].route, pathname, dir, sizeof(dir)) < 0) {
+            same = 0;  // Can't ask: treat it as a changed copy
+            continue;
+        }
+        snprintf(cmd, sizeof(cmd), "dirversion %s", dir);
+        socks[i] = target_acquire(&targets[i], &used[i]);
+        if (socks[i] >= 0 && send_request(socks[i], 0, cmd) < 0) {
+            pool_release(used[i]->host, used[i]->port, socks[i], 0);
+            socks[i] = -1;
+        }
+        if (socks[i] < 0) same = 0;
+    }
+    for (int i = 0; i < ntargets; i++) {
+        if (socks[i] < 0) continue;
+        struct frame_header h;
+        char reply[LIST_VERSION_MAX + 16];
+        int ok = recv_frame_header(socks[i], &h) == 0 && h.length < sizeof(reply) &&
+                 recv_text_payload(socks[i], h.length, reply, sizeof(reply)) == 0;
+        if (!ok || h.opcode != OP_MSG || strncmp(reply, "version=", 8) != 0) {
+            same = 0;  // Down, or too old to report versions
+        } else {
+            reply[8 + strcspn(reply + 8, "\n")] = '\0';
+            if (strcmp(reply + 8, versions[i + 1]) != 0) same = 0;
+        }
+        pool_release(used[i]->host, used[i]->port, socks[i], ok);
+    }
+    return same;
+}
 
-    // Read command output line by line
-    char line[256];
-    while (fgets(line, sizeof(line), fp)) {
-        // Remove newline character
-        line[strcspn(line, "\n")] = 0;
-        
-        // Expand file list array and add new filename
-        *file_list = realloc(*file_list, (*count + 1) * sizeof(char*));
-        (*file_list)[*count] = strdup(line);
-        (*count)++;
+// Function to send a cached listing body as OP_DATA frames and OP_END
+void send_listing_body(int sock, uint32_t req_id, const struct listing_body *body) {
+    for (size_t off = 0; off < body->len; off += LIST_FRAME_BYTES) {
+        size_t n = body->len - off < LIST_FRAME_BYTES ? body->len - off : LIST_FRAME_BYTES;
+        if (send_frame(sock, OP_DATA, 0, req_id, body->data + off, n) < 0) return;
     }
-    pclose(fp);  // Close the command stream
+    send_frame(sock, OP_END, 0, req_id, NULL, 0);
 }
 
 // Main function to handle file listing requests
+// The dispfnames requests to every remote server in the routing table are
+// all sent before any reply is read, so the listings are produced
+// concurrently. Each server returns its names sorted; S1 merges the sorted
+// streams (and its own local types) as they arrive into a coalescing output
+// buffer, so memory stays bounded whatever the directory size.
+// Merged listings are cached by path. Before a cached copy is served, S1 checks
+// its own version of the directory (bumped on uploadf/removef) and the
+// version of its local copy, then asks each sub-server for the version of
+// its copy ("dirversion"). That check needs no directory scan and no new
+// connection. Any difference, or a reloaded routing table, counts as a miss
+// and the listing is rebuilt.
 // Parameters:
 //   sock - client connection socket
+//   req_id - request id of the client's dispfnames frame
 //   pathname - directory path to list files from (may contain ~S1 prefix)
-void handle_dispfnames(int sock, char *pathname) {
+void handle_dispfnames(int sock, uint32_t req_id, char *pathname) {
     // Get user's home directory
     char *home = getenv("HOME");
     if (!home) {
-        send(sock, "Error: Cannot get HOME environment\n", 34, 0);
+        send_error(sock, req_id, "Error: Cannot get HOME environment\n");
         return;
     }
 
@@ -526,208 +2271,639 @@ void handle_dispfnames(int sock, char *pathname) {
         snprintf(full_path, sizeof(full_path), "%s/%s", home, pathname);
     }
 
-    // Verify the directory exists
-    DIR *dir = opendir(full_path);
-    if (!dir) {
-        char err_msg1[] = "Error: Directory not found.\n";
-        send(sock, err_msg1, strlen(err_msg1), 0);
-        send(sock, "ENDOFLIST\n", 10, 0);  // Add end marker
+    // Versions are read before listing, so a change racing with the listing
+    // leaves the cached copy looking stale rather than current
+    struct route_table *routes = routes_acquire();
+    char key[512], versions[LIST_CACHE_SLOTS][LIST_VERSION_MAX];
+    memset(versions, 0, sizeof(versions));
+    list_cache_key(pathname, key);
+    unsigned long long s1_version = dir_version_get(key);
+    ns_dir_version(full_path, versions[0], LIST_VERSION_MAX);
+    if (list_cache.max_bytes > 0) {
+        char cached[LIST_CACHE_SLOTS][LIST_VERSION_MAX];
+        int trusted = 0;
+        struct listing_body *body = list_cache_lookup(key, s1_version, routes->generation,
+                                                      versions[0], cached, &trusted);
+        if (body && (trusted || list_cache_revalidate(routes, pathname, cached))) {
+            if (!trusted) {
+                list_cache_confirm(key, body);
+                __atomic_add_fetch(&list_cache_revalidated, 1, __ATOMIC_RELAXED);
+            }
+            __atomic_add_fetch(&list_cache_hits, 1, __ATOMIC_RELAXED);
+            send_listing_body(sock, req_id, body);
+            listing_body_release(body);
+            routes_release(routes);
+            return;
+        }
+        listing_body_release(body);
+        __atomic_add_fetch(&list_cache_misses, 1, __ATOMIC_RELAXED);
+    }
+
+    struct listing_target targets[LIST_TARGETS_MAX];
+    int ntargets = listing_targets(routes, targets);
+    struct name_source *sources = calloc(ntargets, sizeof(struct name_source));
+    struct name_list *locals = calloc(ntargets, sizeof(struct name_list));
+    const char *error = !sources || !locals ? "Error: Out of memory.\n"
+                      : !listing_path_fits(targets, ntargets, pathname) ? "Error: Path too long.\n" : NULL;
+    if (error) {
+        free(sources);
+        free(locals);
+        routes_release(routes);
+        send_error(sock, req_id, error);
         return;
     }
-    closedir(dir);
 
-    // Initialize file collection variables
-    int file_count = 0;
-    char *files[1024];  // Static array to hold up to 1024 filenames
+    // Fan out: send dispfnames to every remote server up front, and collect
+    // S1's own files of each local type (sorted) meanwhile
+    int nsources = 0, missing = 0;
+    for (int i = 0; i < ntargets; i++) {
+        if (targets[i].route->local) continue;
+        char dir[512], cmd[600];
+        route_path(targets[i].route, pathname, dir, sizeof(dir));  // Fits: checked above
+        snprintf(cmd, sizeof(cmd), "dispfnames %s", dir);
+        sources[nsources].target = i;
+        nsources += source_start(&sources[nsources], &targets[i], cmd);
+    }
+    for (int i = 0; i < ntargets; i++) {
+        if (!targets[i].route->local) continue;
+        // Verify the directory exists on S1
+        if (list_dir_sorted(full_path, targets[i].route->ext, &locals[i]) < 0) missing = 1;
+        sources[nsources].sock = -1;
+        sources[nsources].local = &locals[i];
+        sources[nsources].dir = full_path;
+        sources[nsources].target = i;
+        nsources++;
+    }
+    if (missing) {
+        finish_sources(sources, nsources);
+        send_error(sock, req_id, "Error: Directory not found.\n");
+    } else {
+        // k-way merge of the sorted streams, keeping a copy for the cache
+        struct name_writer out;
+        name_writer_init(&out, sock, req_id);
+        if (list_cache.max_bytes > 0) name_writer_tee(&out, list_cache.max_bytes / 4);
+        for (int i = 0; i < nsources; i++) source_next(&sources[i]);
+        merge_sources(sources, nsources, &out, 0, NULL);
+
+        // Send end of list marker (an empty listing is reported by the client)
+        int sent = name_writer_finish(&out);
+        finish_sources(sources, nsources);
+
+        // Only a listing every server contributed to (and versioned) is cacheable
+        int cacheable = sent == 0 && out.tee_max > 0 && nsources == ntargets;
+        for (int i = 0; i < nsources && cacheable; i++) {
+            if (sources[i].sock < 0) continue;  // Local: covered by versions[0]
+            if (!sources[i].complete || sources[i].version[0] == '\0') cacheable = 0;
+            else snprintf(versions[sources[i].target + 1], LIST_VERSION_MAX, "%s", sources[i].version);
+        }
+        if (cacheable)
+            list_cache_store(key, s1_version, routes->generation, versions, ntargets + 1, out.tee, out.tee_len);
+        else free(out.tee);
+    }
 
-    // 1. Get .c files from local S1 directory
-    DIR *dp;
-    struct dirent *ep;
-    dp = opendir(full_path);
-    if (dp) {
-        while ((ep = readdir(dp)) != NULL && file_count < 1023) {
-            if (ep->d_type == DT_REG) {  // Only regular files
-                char *ext = strrchr(ep->d_name, '.');
-                if (ext && strcmp(ext, ".c") == 0) {
-                    files[file_count++] = strdup(ep->d_name);  // Copy filename
-                }
-            }
+    for (int i = 0; i < ntargets; i++) name_list_free(&locals[i]);
+    free(locals);
+    free(sources);
+    routes_release(routes);
+}
+
+// Function to handle paginated, filtered listing requests (listf)
+// Filters and the page size are pushed down: every server returns at most one
+// page of its own matching names, already sorted, and S1 merges the first
+// `limit` of them. When anything was left over the OP_END payload carries
+// "next=<last name sent>" for the client's next request.
+// Parameters:
+//   sock - client connection socket
+//   req_id - request id of the client's listf frame
+//   pathname - directory path to list (may contain ~S1 prefix)
+//   opts - option words after the path (see listing.h)
+void handle_listf(int sock, uint32_t req_id, char *pathname, const char *opts) {
+    if (pathname[0] == '\0') {
+        send_error(sock, req_id, "Usage: listf <dir> [type=.c,.pdf] [prefix=p] [glob=g] [cursor=c] [limit=n] [long]\n");
+        return;
+    }
+    char *home = getenv("HOME");
+    if (!home) {
+        send_error(sock, req_id, "Error: Cannot get HOME environment\n");
+        return;
+    }
+
+    char full_path[512];
+    if (strncmp(pathname, "~S1", 3) == 0) {
+        snprintf(full_path, sizeof(full_path), "%s/S1%s", home, pathname + 3);
+    } else {
+        snprintf(full_path, sizeof(full_path), "%s/%s", home, pathname);
+    }
+
+    struct list_filter filter;
+    parse_list_filter(opts, &filter);
+    if (filter.limit <= 0) filter.limit = LIST_DEFAULT_LIMIT;
+    if (filter.limit > LIST_MAX_LIMIT) filter.limit = LIST_MAX_LIMIT;
+
+    struct route_table *routes = routes_acquire();
+    struct listing_target targets[LIST_TARGETS_MAX];
+    int ntargets = listing_targets(routes, targets);
+    struct name_source *sources = calloc(ntargets, sizeof(struct name_source));
+    struct name_list *locals = calloc(ntargets, sizeof(struct name_list));
+    const char *error = !sources || !locals ? "Error: Out of memory.\n"
+                      : !listing_path_fits(targets, ntargets, pathname) ? "Error: Path too long.\n" : NULL;
+    if (error) {
+        free(sources);
+        free(locals);
+        routes_release(routes);
+        send_error(sock, req_id, error);
+        return;
+    }
+
+    // Push the filters and page size down to the selected sub-servers
+    char sub_opts[1024];
+    format_list_filter(&filter, sub_opts, sizeof(sub_opts));
+    int nsources = 0;
+    for (int i = 0; i < ntargets; i++) {
+        if (targets[i].route->local || !list_type_selected(&filter, targets[i].route->ext)) continue;
+        char dir[512], cmd[1700];
+        route_path(targets[i].route, pathname, dir, sizeof(dir));  // Fits: checked above
+        snprintf(cmd, sizeof(cmd), "listf %s%s", dir, sub_opts);
+        nsources += source_start(&sources[nsources], &targets[i], cmd);
+    }
+
+    // Local files (a directory missing here may still exist on the sub-servers)
+    for (int i = 0; i < ntargets; i++) {
+        if (!targets[i].route->local || !list_type_selected(&filter, targets[i].route->ext)) continue;
+        if (list_dir_filtered(full_path, targets[i].route->ext, &filter, &locals[i]) < 0) continue;
+        sources[nsources].sock = -1;
+        sources[nsources].local = &locals[i];
+        sources[nsources].dir = full_path;
+        sources[nsources].long_format = filter.long_format;
+        nsources++;
+    }
+
+    struct name_writer out;
+    name_writer_init(&out, sock, req_id);
+    for (int i = 0; i < nsources; i++) source_next(&sources[i]);
+    char last[LIST_LINE_MAX] = "";
+    merge_sources(sources, nsources, &out, filter.limit, last);
+
+    // More pages exist if any source still has a head or cut its own page short
+    int more = 0;
+    for (int i = 0; i < nsources; i++)
+        if (!sources[i].done || sources[i].more) more = 1;
+    char trailer[LIST_LINE_MAX + 8];
+    snprintf(trailer, sizeof(trailer), "next=%s\n", last);
+    name_writer_finish_with(&out, more ? trailer : NULL);
+    finish_sources(sources, nsources);
+    for (int i = 0; i < ntargets; i++) name_list_free(&locals[i]);
+    free(locals);
+    free(sources);
+    routes_release(routes);
+}
+
+// Function to report S1's runtime counters to a client
+// Parameters:
+//   sock - client connection socket
+//   req_id - request id of the client's stats frame
+void handle_stats(int sock, uint32_t req_id) {
+    struct route_table *routes = routes_acquire();
+    char report[2048];
+    snprintf(report, sizeof(report),
+             "relay.spliced_bytes %llu\n"
+             "relay.copied_bytes %llu\n"
+             "pool.reused %llu\n"
+             "pool.opened %llu\n"
+             "pool.dropped %llu\n"
+             "workers.total %d\n"
+             "workers.busy %d\n"
+             "queue.depth %d\n"
+             "queue.capacity %d\n"
+             "queue.peak %d\n"
+             "clients.accepted %llu\n"
+             "clients.rejected %llu\n"
+             "event.loops %d\n"
+             "event.connections %d\n"
+             "index.files %llu\n"
+             "index.dirs %llu\n"
+             "index.events %llu\n"
+             "index.rescans %llu\n"
+             "listcache.hits %llu\n"
+             "listcache.misses %llu\n"
+             "listcache.revalidated %llu\n"
+             "listcache.entries %d\n"
+             "listcache.bytes %lld\n"
+             "routes.count %d\n"
+             "routes.generation %u\n"
+             "replica.pending %d\n"
+             "replica.copied %llu\n"
+             "replica.removed %llu\n"
+             "replica.failed %llu\n"
+             "replica.dropped %llu\n"
+             "replica.reads %llu\n"
+             "checksum.engine %s\n"
+             "checksum.mismatches %llu\n",
+             __atomic_load_n(&relay_stats.spliced, __ATOMIC_RELAXED),
+             __atomic_load_n(&relay_stats.copied, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool_reused, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool_opened, __ATOMIC_RELAXED),
+             __atomic_load_n(&pool_dropped, __ATOMIC_RELAXED),
+             worker_total,
+             __atomic_load_n(&workers_busy, __ATOMIC_RELAXED),
+             __atomic_load_n(&clients.count, __ATOMIC_RELAXED),
+             clients.capacity,
+             __atomic_load_n(&queue_peak, __ATOMIC_RELAXED),
+             __atomic_load_n(&clients_accepted, __ATOMIC_RELAXED),
+             __atomic_load_n(&clients_rejected, __ATOMIC_RELAXED),
+             event_loops,
+             __atomic_load_n(&event_conns, __ATOMIC_RELAXED),
+             __atomic_load_n(&ns.files, __ATOMIC_RELAXED),
+             __atomic_load_n(&ns.dirs, __ATOMIC_RELAXED),
+             __atomic_load_n(&ns.events, __ATOMIC_RELAXED),
+             __atomic_load_n(&ns.rescans, __ATOMIC_RELAXED),
+             __atomic_load_n(&list_cache_hits, __ATOMIC_RELAXED),
+             __atomic_load_n(&list_cache_misses, __ATOMIC_RELAXED),
+             __atomic_load_n(&list_cache_revalidated, __ATOMIC_RELAXED),
+             __atomic_load_n(&list_cache.entries, __ATOMIC_RELAXED),
+             __atomic_load_n(&list_cache.bytes, __ATOMIC_RELAXED),
+             routes->count, routes->generation,
+             __atomic_load_n(&replica_queue.count, __ATOMIC_RELAXED),
+             __atomic_load_n(&replica_copied, __ATOMIC_RELAXED),
+             __atomic_load_n(&replica_removed, __ATOMIC_RELAXED),
+             __atomic_load_n(&replica_failed, __ATOMIC_RELAXED),
+             __atomic_load_n(&replica_dropped, __ATOMIC_RELAXED),
+             __atomic_load_n(&replica_reads, __ATOMIC_RELAXED),
+             crc32c_engine(),
+             __atomic_load_n(&checksum_mismatches, __ATOMIC_RELAXED));
+    routes_release(routes);
+    send_msg(sock, req_id, report);
+}
+
+// Function to run one client request to completion
+// Parameters:
+//   sock - client socket file descriptor (blocking)
+//   req_id - request id from the request frame
+//   flags - flags from the request frame (see FRAME_DEFLATE)
+//   buffer - NUL-terminated command text
+void dispatch_request(int sock, uint32_t req_id, uint16_t flags, char *buffer) {
+    // Parse command and arguments
+    // (after1/after2: the text following each argument, for the options)
+    char command[20], arg1[256], arg2[256];
+    int end1 = 0, end2 = 0;
+    command[0] = arg1[0] = arg2[0] = '\0';
+    sscanf(buffer, "%19s %255s%n %255s%n", command, arg1, &end1, arg2, &end2);
+    const char *after1 = end1 ? buffer + end1 : "", *after2 = end2 ? buffer + end2 : "";
+
+    // Handle different commands by calling appropriate functions
+    if (strcmp(command, "uploadf") == 0) {
+        handle_uploadf(sock, req_id, arg1, arg2);  // Handle file upload
+    } else if (strcmp(command, "downlf") == 0) {
+        // Optional byte range follows the path
+        handle_downlf(sock, req_id, flags, arg1, arg1[0] ? after1 : NULL);
+    } else if (strcmp(command, "uploadstat") == 0 || strcmp(command, "uploadchunk") == 0 ||
+               strcmp(command, "uploadref") == 0 || strcmp(command, "uploadcommit") == 0) {
+        // Resumable chunked upload; the upload id and offset/size follow the directory
+        handle_upload_part(sock, req_id, command, arg1, arg2, after2);
+    } else if (strcmp(command, "removef") == 0) {
+        handle_removef(sock, req_id, arg1);        // Handle file removal
+    } else if (strcmp(command, "downltar") == 0) {
+        // Tar file download; options (gz, dir=, glob=, since=) follow the type
+        handle_downltar(sock, req_id, arg1, after1);
+    } else if (strcmp(command, "dispfnames") == 0) {
+        handle_dispfnames(sock, req_id, arg1);     // Handle file listing
+    } else if (strcmp(command, "listf") == 0) {
+        // Paginated/filtered listing; options follow the path
+        handle_listf(sock, req_id, arg1, after1);
+    } else if (strcmp(command, "stats") == 0) {
+        handle_stats(sock, req_id);                // Report server counters
+    } else {
+        // Unknown command response
+        send_error(sock, req_id, "Invalid or unimplemented command.\n");
+    }
+}
+
+// Function to serve one client session until it disconnects
+// Parameters:
+//   sock - client socket file descriptor
+void prcclient(int sock) {
+    char buffer[BUFFER_SIZE];
+    while (1) {
+        // Receive the next request frame from client
+        struct frame_header req;
+        if (recv_request(sock, &req, buffer, sizeof(buffer)) < 0) break;  // Connection closed or error
+        dispatch_request(sock, req.request_id, req.flags, buffer);
+    }
+
+    // Close client socket; the worker moves on to the next queued client
+    close(sock);
+}
+
+// Function to queue an accepted client for the worker pool
+// Parameters:
+//   sock - accepted client socket
+//   conn - event-loop connection holding one parsed request, or NULL to hand
+//          the worker the whole session
+// Returns:
+//   0 if queued, -1 if the queue is full (the caller rejects the client)
+int enqueue_client(int sock, struct event_conn *conn) {
+    pthread_mutex_lock(&clients.lock);
+    if (clients.count >= clients.capacity) {
+        pthread_mutex_unlock(&clients.lock);
+        return -1;
+    }
+    struct client_job *job = &clients.jobs[(clients.head + clients.count) % MAX_QUEUE];
+    job->sock = sock;
+    job->conn = conn;
+    job->queued_ms = now_ms();
+    clients.count++;
+    if (clients.count > queue_peak) queue_peak = clients.count;
+    pthread_cond_signal(&clients.ready);
+    pthread_mutex_unlock(&clients.lock);
+    return 0;
+}
+
+// Function to (re-)register an event-loop connection for its next readable event
+// EPOLLONESHOT guarantees only one thread - a loop or a worker - touches it at a time
+// Parameters:
+//   c - connection
+//   op - EPOLL_CTL_ADD for a new connection, EPOLL_CTL_MOD to re-arm
+// Returns:
+//   0 on success, -1 on failure
+int event_arm(struct event_conn *c, int op) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = c;
+    return epoll_ctl(c->epfd, op, c->fd, &ev);
+}
+
+// Function to drop an event-loop connection
+void event_close(struct event_conn *c) {
+    close(c->fd);  // Also removes it from the epoll set
+    free(c);
+    __atomic_sub_fetch(&event_conns, 1, __ATOMIC_RELAXED);
+}
+
+// Function to advance a connection's request-parsing state machine with
+// whatever bytes are available, without blocking. Reads stop exactly at the
+// end of the request frame so an upload body stays queued in the socket for
+// the worker that handles it.
+// Parameters:
+//   c - connection in CONN_READ_HEADER or CONN_READ_REQUEST
+// Returns:
+//   1 when a complete request is in c->req / c->buffer, 0 if more bytes are
+//   needed, -1 if the client disconnected or broke the protocol
+int event_read(struct event_conn *c) {
+    while (1) {
+        if (c->state == CONN_READ_REQUEST && c->got == c->req.length) {
+            c->buffer[c->got] = '\0';
+            return 1;
         }
-        closedir(dp);
-    }
-
-    // 2. Get .pdf files from S2 server (port 1202)
-    int s2_sock = connect_to_server("127.0.0.1", 1202);
-    if (s2_sock != -1) {
-        // Modify path to use S2 prefix
-        char s2_path[512];
-        snprintf(s2_path, sizeof(s2_path), "~S2%s", strstr(pathname, "~S1") ? pathname + 3 : pathname);
-        
-        // Send dispfnames command to S2
-        char cmd[512];
-        snprintf(cmd, sizeof(cmd), "dispfnames %s", s2_path);
-        send(s2_sock, cmd, strlen(cmd), 0);
-        
-        // Receive and process response
-        char response[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = recv(s2_sock, response, BUFFER_SIZE - 1, 0)) > 0 && file_count < 1023) {
-            response[bytes] = '\0';  // Null-terminate
-            // Parse response line by line
-            char *line = strtok(response, "\n");
-            while (line != NULL && file_count < 1023) {
-                if (strstr(line, ".pdf")) {  // Only take PDF files
-                    files[file_count++] = strdup(line); // Copy filename
-                }
-                line = strtok(NULL, "\n"); // split the strings into the tokens
-            }
+
+        void *dst;
+        size_t want;
+        if (c->state == CONN_READ_HEADER) {
+            dst = c->hdr + c->got;
+            want = FRAME_HEADER_SIZE - c->got;
+        } else {
+            dst = c->buffer + c->got;
+            want = c->req.length - c->got;
         }
-        close(s2_sock);
-    }
-
-    // 3. Get .txt files from S3 server (port 1203)
-    int s3_sock = connect_to_server("127.0.0.1", 1203);
-    if (s3_sock != -1) {
-        // Modify path to use S3 prefix
-        char s3_path[512];
-        snprintf(s3_path, sizeof(s3_path), "~S3%s", strstr(pathname, "~S1") ? pathname + 3 : pathname);
-        
-        // Send dispfnames command to S3
-        char cmd[512];
-        snprintf(cmd, sizeof(cmd), "dispfnames %s", s3_path);
-        send(s3_sock, cmd, strlen(cmd), 0);
-        
-        // Receive and process response
-        char response[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = recv(s3_sock, response, BUFFER_SIZE - 1, 0)) > 0 && file_count < 1023) {
-            response[bytes] = '\0';
-            char *line = strtok(response, "\n");
-            while (line != NULL && file_count < 1023) {
-                if (strstr(line, ".txt")) {  // Only take TXT files
-                    files[file_count++] = strdup(line);
-                }
-                line = strtok(NULL, "\n");
-            }
+
+        ssize_t n = recv(c->fd, dst, want, MSG_DONTWAIT);
+        if (n == 0) return -1;  // Client closed the session
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
         }
-        close(s3_sock);
-    }
-
-    // 4. Get .zip files from S4 server (port 1206)
-    int s4_sock = connect_to_server("127.0.0.1", 1206);
-    if (s4_sock != -1) {
-        // Modify path to use S4 prefix
-        char s4_path[512];
-        snprintf(s4_path, sizeof(s4_path), "~S4%s", strstr(pathname, "~S1") ? pathname + 3 : pathname);
-        
-        // Send dispfnames command to S4
-        char cmd[512];
-        snprintf(cmd, sizeof(cmd), "dispfnames %s", s4_path);
-        send(s4_sock, cmd, strlen(cmd), 0);
-        
-        // Receive and process response
-        char response[BUFFER_SIZE];
-        int bytes;
-        while ((bytes = recv(s4_sock, response, BUFFER_SIZE - 1, 0)) > 0 && file_count < 1023) {
-            response[bytes] = '\0';
-            char *line = strtok(response, "\n");
-            while (line != NULL && file_count < 1023) {
-                if (strstr(line, ".zip")) {  // Only take ZIP files
-                    files[file_count++] = strdup(line);
-                }
-                line = strtok(NULL, "\n");
+        c->got += n;
+
+        // Header complete: validate it and move on to the command text
+        if (c->state == CONN_READ_HEADER && c->got == FRAME_HEADER_SIZE) {
+            if (decode_frame_header(c->hdr, &c->req) < 0) return -1;
+            if (c->req.opcode != OP_REQUEST || c->req.length >= sizeof(c->buffer)) {
+                fprintf(stderr, "Protocol error: expected request frame\n");
+                return -1;
             }
+            c->state = CONN_READ_REQUEST;
+            c->got = 0;
         }
-        close(s4_sock);
     }
+}
 
-    // Sort all collected files alphabetically
-    qsort(files, file_count, sizeof(char *), (int (*)(const void *, const void *))strcmp);
+// Function to accept every pending connection on a non-blocking listen socket
+// Parameters:
+//   epfd - epoll instance of the calling event loop
+//   listen_fd - listening socket
+void event_accept(int epfd, int listen_fd) {
+    while (1) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            // Out of descriptors: back off instead of spinning on the ready listen socket
+            if (errno == EMFILE || errno == ENFILE) {
+                perror("accept");
+                usleep(100000);
+            }
+            return;  // EAGAIN: backlog drained (or another loop took the connection)
+        }
+        set_nodelay(fd);
+        __atomic_add_fetch(&clients_accepted, 1, __ATOMIC_RELAXED);
 
-    // Send sorted file list to client (one per line)
-    for (int i = 0; i < file_count; i++) {
-        send(sock, files[i], strlen(files[i]), 0);
-        send(sock, "\n", 1, 0);
-        free(files[i]);  // Free allocated filename strings
+        struct event_conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->epfd = epfd;
+        c->state = CONN_READ_HEADER;
+        __atomic_add_fetch(&event_conns, 1, __ATOMIC_RELAXED);
+        if (event_arm(c, EPOLL_CTL_ADD) < 0) event_close(c);
     }
+}
 
-    // Send end of list marker
-    send(sock, "ENDOFLIST\n", 10, 0);
+// Function to check whether a request is followed by a data stream (its body)
+// Parameters:
+//   request - request text ("<command> <args>")
+// Returns: 1 for uploadf and uploadchunk, 0 otherwise
+int request_has_body(const char *request) {
+    char command[32] = "";
+    sscanf(request, "%31s", command);
+    return strcmp(command, "uploadf") == 0 || strcmp(command, "uploadchunk") == 0;
+}
 
-    // Handle empty directory case
-    if (file_count == 0) {
-        send(sock, "(No files found)\n", 17, 0);
+// Function to hand a complete request to the worker pool
+// Parameters:
+//   c - connection whose request has been fully read
+void event_dispatch(struct event_conn *c) {
+    c->state = CONN_DISPATCHED;
+    if (enqueue_client(c->fd, c) == 0) return;
+
+    // Saturated: reject this request explicitly. An upload's body is already on
+    // its way, so that session cannot be resynchronised and is closed.
+    __atomic_add_fetch(&clients_rejected, 1, __ATOMIC_RELAXED);
+    send_error(c->fd, c->req.request_id, "Error: Server busy, try again later.\n");
+    if (request_has_body(c->buffer)) {
+        event_close(c);
+        return;
     }
+    c->state = CONN_READ_HEADER;
+    c->got = 0;
+    if (event_arm(c, EPOLL_CTL_MOD) < 0) event_close(c);
 }
 
-// Thread function to handle client connections
+// Function run by a worker for one event-loop request: the socket stays in
+// blocking mode, so the upload/download/list handlers run unchanged, and the
+// connection goes back to its loop as soon as the response is complete
 // Parameters:
-//   socket_desc - pointer to client socket file descriptor
-// Returns:
-//   NULL when thread exits
-void *prcclient(void *socket_desc) {
-    // Get socket descriptor from thread argument and free the allocated memory
-    int sock = *(int *)socket_desc;
-    free(socket_desc);
+//   c - connection in CONN_DISPATCHED
+void event_serve(struct event_conn *c) {
+    dispatch_request(c->fd, c->req.request_id, c->req.flags, c->buffer);
+    c->state = CONN_READ_HEADER;
+    c->got = 0;
+    if (event_arm(c, EPOLL_CTL_MOD) < 0) event_close(c);
+}
 
-    char buffer[BUFFER_SIZE];
+// Event loop thread (the default mode): multiplexes every client session on
+// one epoll instance and only occupies a worker while a request is running
+// Parameters:
+//   arg - pointer to the listening socket
+void *event_loop(void *arg) {
+    int listen_fd = *(int *)arg;
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return NULL;
+    }
+
+    // EPOLLEXCLUSIVE: with several loops only one is woken per new connection
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;  // NULL marks the listen socket
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    struct epoll_event events[EVENT_BATCH];
     while (1) {
-        // Clear buffer before receiving new data
-        memset(buffer, 0, sizeof(buffer));
-        
-        // Receive data from client
-        int bytes = recv(sock, buffer, sizeof(buffer), 0);
-        if (bytes <= 0) break;  // Connection closed or error
-
-        // Null-terminate received data
-        buffer[bytes] = '\0';
-        
-        // Parse command and arguments
-        char command[20], arg1[256], arg2[256];
-        sscanf(buffer, "%s %s %s", command, arg1, arg2);
-
-        // Handle different commands by calling appropriate functions
-        if (strcmp(command, "uploadf") == 0) {
-            handle_uploadf(sock, arg1, arg2);  // Handle file upload
-        } else if (strcmp(command, "downlf") == 0) {
-            handle_downlf(sock, arg1);         // Handle file download
-        } else if (strcmp(command, "removef") == 0) {
-            handle_removef(sock, arg1);        // Handle file removal
-        } else if (strcmp(command, "downltar") == 0) {
-            handle_downltar(sock, arg1);       // Handle tar file download
-        } else if (strcmp(command, "dispfnames") == 0) {
-            handle_dispfnames(sock, arg1);     // Handle file listing
-        } else {
-            // Unknown command response
-            send(sock, "Invalid or unimplemented command.\n", 35, 0);
+        int n = epoll_wait(epfd, events, EVENT_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            struct event_conn *c = events[i].data.ptr;
+            if (!c) {
+                event_accept(epfd, listen_fd);
+                continue;
+            }
+
+            int r = event_read(c);
+            if (r < 0) {
+                event_close(c);
+            } else if (r == 1) {
+                event_dispatch(c);
+            } else if (event_arm(c, EPOLL_CTL_MOD) < 0) {
+                event_close(c);  // Partial request: wait for the rest
+            }
         }
     }
+    close(epfd);
+    return NULL;
+}
 
-    // Close client socket and exit thread
-    close(sock);
-    pthread_exit(NULL);
+// Worker thread: takes jobs off the queue and serves each one in turn
+void *client_worker(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&clients.lock);
+        while (clients.count == 0)
+            pthread_cond_wait(&clients.ready, &clients.lock);
+        struct client_job job = clients.jobs[clients.head];
+        clients.head = (clients.head + 1) % MAX_QUEUE;
+        clients.count--;
+        pthread_mutex_unlock(&clients.lock);
+
+        __atomic_add_fetch(&workers_busy, 1, __ATOMIC_RELAXED);
+        if (job.conn)
+            event_serve(job.conn);  // One request from an event-loop session
+        else
+            prcclient(job.sock);    // A whole session (thread mode)
+        __atomic_sub_fetch(&workers_busy, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Reaper thread (S1_EVENT_LOOP=threads): a session keeps its worker until the
+// client disconnects, so that mode caps open sessions at S1_WORKERS plus
+// S1_QUEUE_SIZE, and queued clients could otherwise wait silently for as long
+// as the sessions ahead of them stay open. Sessions queued longer than
+// S1_QUEUE_WAIT_MS are rejected with the same busy error as a full queue.
+void *queue_reaper(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(queue_wait_ms < 1000 ? queue_wait_ms * 250 : 250000);
+        while (1) {
+            // The oldest job is at the head
+            pthread_mutex_lock(&clients.lock);
+            struct client_job *job = &clients.jobs[clients.head];
+            int expired = clients.count > 0 && !job->conn && now_ms() - job->queued_ms > queue_wait_ms;
+            int sock = job->sock;
+            if (expired) {
+                clients.head = (clients.head + 1) % MAX_QUEUE;
+                clients.count--;
+            }
+            pthread_mutex_unlock(&clients.lock);
+            if (!expired) break;
+
+            __atomic_add_fetch(&clients_rejected, 1, __ATOMIC_RELAXED);
+            send_error(sock, 0, "Error: Server busy, try again later.\n");
+            close(sock);
+        }
+    }
+    return NULL;
 }
 
 // Main server function
 int main() {
-    int server_fd, client_sock, *new_sock;
+    // sendfile() into a connection the peer dropped must fail with EPIPE (and
+    // leave the transfer resumable) rather than kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    int server_fd, client_sock;
     struct sockaddr_in server, client;
     socklen_t client_len = sizeof(client);
 
+    // Load the routing table (S1_ROUTES) before any thread starts, so every
+    // thread inherits the blocked SIGHUP that triggers a reload
+    if (routes_init() < 0) {
+        fprintf(stderr, "[S1] Unusable routing table; fix the routes file and restart\n");
+        return 1;
+    }
+
     // Create S1 directory in user's home folder at startup
     char *home = getenv("HOME");  // get environment
     if (home) {
         char s1_folder[512];
         snprintf(s1_folder, sizeof(s1_folder), "%s/S1", home);
         mkdir(s1_folder, 0755);  // Create with read/write/execute permissions for owner
+        upload_sweep(s1_folder);  // Drop chunked uploads abandoned long ago
+
+        // Index ~/S1 in memory; local listings and downltar .c are answered from it
+        if (ns_index_init(s1_folder) == 0)
+            printf("[S1] Indexed %llu files in %llu directories\n", ns.files, ns.dirs);
     }
 
+    // Uploads of compressible types stored deflated (DFS_COMPRESS_AT_REST=1, see compress.h)
+    if (compress_settings()->at_rest)
+        printf("[S1] Storing %s files compressed (zlib level %d)\n", compress_settings()->types,
+               compress_settings()->level);
+
     // Create server socket (IPv4, TCP)
     if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
         perror("Socket creation failed");
         return 1;
     }
 
+    // Allow an immediate restart while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Configure server address structure
     server.sin_family = AF_INET;          // IPv4
     server.sin_port = htons(PORT);        // Port number (converted to network byte order)
@@ -739,24 +2915,123 @@ int main() {
         return 1;
     }
 
+    // Read the connection pool size (idle keep-alive connections per sub-server)
+    char *env_pool = getenv("S1_POOL_SIZE");
+    if (env_pool) pool_capacity = atoi(env_pool);
+    if (pool_capacity < 0) pool_capacity = 0;
+    if (pool_capacity > POOL_MAX_IDLE) pool_capacity = POOL_MAX_IDLE;
+
+    // Size the dispfnames listing cache (S1_LIST_CACHE_BYTES=0 turns it off)
+    list_cache.max_bytes = LIST_CACHE_BYTES;
+    char *env_cache = getenv("S1_LIST_CACHE_BYTES");
+    char *env_trust = getenv("S1_LIST_CACHE_TRUST_MS");
+    if (env_cache) list_cache.max_bytes = atoll(env_cache);
+    if (env_trust) list_cache.trust_ms = atoll(env_trust);
+    if (list_cache.max_bytes < 0) list_cache.max_bytes = 0;
+
+    // Start the thread that keeps pooled sub-server connections healthy
+    pthread_t checker;
+    pthread_create(&checker, NULL, pool_health_checker, NULL);
+    pthread_detach(checker);
+
+    // Start the thread that delivers uploads spooled while a sub-server was down
+    pthread_t flusher;
+    pthread_create(&flusher, NULL, spool_flusher, NULL);
+    pthread_detach(flusher);
+
+    // Start the threads that bring lagging replicas up to date (S1_REPLICA_QUEUE caps their backlog)
+    char *env_replica_queue = getenv("S1_REPLICA_QUEUE");
+    if (env_replica_queue) replica_queue.max = atoi(env_replica_queue);
+    for (int i = 0; i < REPLICA_THREADS; i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, replicator, NULL);
+        pthread_detach(t);
+    }
+
+    // Size the worker pool and its queue (S1_WORKERS / S1_QUEUE_SIZE)
+    worker_total = WORKER_COUNT;
+    clients.capacity = QUEUE_SIZE;
+    char *env_workers = getenv("S1_WORKERS");
+    char *env_queue = getenv("S1_QUEUE_SIZE");
+    char *env_wait = getenv("S1_QUEUE_WAIT_MS");
+    if (env_workers) worker_total = atoi(env_workers);
+    if (env_queue) clients.capacity = atoi(env_queue);
+    if (env_wait) queue_wait_ms = atoll(env_wait);
+    if (worker_total < 1) worker_total = 1;
+    if (worker_total > MAX_WORKERS) worker_total = MAX_WORKERS;
+    if (clients.capacity < 1) clients.capacity = 1;
+    if (clients.capacity > MAX_QUEUE) clients.capacity = MAX_QUEUE;
+
+    // Pre-spawn the worker threads; memory use no longer grows with connection bursts
+    for (int i = 0; i < worker_total; i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, client_worker, NULL);
+        pthread_detach(t);
+    }
+
     // Start listening for incoming connections
-    listen(server_fd, MAX_CLIENTS);
-    printf("S1 server running on port %d...\n", PORT);
+    listen(server_fd, SOMAXCONN);
+
+    // Pick the I/O engine (DFS_IO_ENGINE=uring, else blocking sendfile/fwrite)
+    const char *engine = io_engine_init();
+
+    // Event loop mode (the default): idle sessions wait in epoll and only
+    // borrow a worker per request, so open sessions aren't limited by the pool
+    char *env_loop = getenv("S1_EVENT_LOOP");
+    if (!env_loop || strcmp(env_loop, "threads") != 0) {
+        event_loops = 1;
+        char *env_loops = getenv("S1_EVENT_THREADS");
+        if (env_loops) event_loops = atoi(env_loops);
+        if (event_loops < 1) event_loops = 1;
+        if (event_loops > MAX_EVENT_LOOPS) event_loops = MAX_EVENT_LOOPS;
+
+        // Long-lived idle sessions are bounded by descriptors, so lift the soft limit
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
+        }
 
-    // Main server loop - accept incoming connections
-    while ((client_sock = accept(server_fd, (struct sockaddr *)&client, &client_len))) {
+        // Several loops may race for one connection; the losers must not block in accept()
+        fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+        printf("S1 server running on port %d (epoll, %d event loops, %d workers, queue of %d, %s I/O)...\n",
+               PORT, event_loops, worker_total, clients.capacity, engine);
+
+        for (int i = 1; i < event_loops; i++) {
+            pthread_t t;
+            pthread_create(&t, NULL, event_loop, &server_fd);
+            pthread_detach(t);
+        }
+        event_loop(&server_fd);
+        close(server_fd);
+        return 1;
+    }
+
+    // Thread mode: every open session holds a worker
+    printf("S1 server running on port %d (threads, %d workers, queue of %d, %s I/O)...\n",
+           PORT, worker_total, clients.capacity, engine);
+
+    // Turn away sessions that have waited too long for a worker
+    if (queue_wait_ms > 0) {
         pthread_t t;
-        // Allocate memory for new client socket (passed to thread)
-        new_sock = malloc(sizeof(int));
-        *new_sock = client_sock;
-        
-        // Create new thread to handle client connection
-        pthread_create(&t, NULL, prcclient, (void *)new_sock);
-        
-        // Detach thread so resources are automatically freed on exit
+        pthread_create(&t, NULL, queue_reaper, NULL);
         pthread_detach(t);
     }
 
+    // Main server loop - accept incoming connections and queue them for the workers
+    while ((client_sock = accept(server_fd, (struct sockaddr *)&client, &client_len))) {
+        if (client_sock < 0) continue;
+        set_nodelay(client_sock);
+        __atomic_add_fetch(&clients_accepted, 1, __ATOMIC_RELAXED);
+
+        // Every worker busy and the queue full: reject explicitly instead of piling up
+        if (enqueue_client(client_sock, NULL) < 0) {
+            __atomic_add_fetch(&clients_rejected, 1, __ATOMIC_RELAXED);
+            send_error(client_sock, 0, "Error: Server busy, try again later.\n");
+            close(client_sock);
+        }
+    }
+
     // Close server socket (unreachable in normal operation)
     close(server_fd);
     return 0;
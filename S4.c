@@ -1,4 +1,5 @@
 // S4.c - Server Side for the .zip files //
+#define _GNU_SOURCE  // splice(), pipe2() and friends used by protocol.h
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,12 +8,33 @@
 #include <arpa/inet.h>
 #include <sys/stat.h>
 
+#include "protocol.h"
+#include "listing.h"
+#include "tarstream.h"
+#include "chunked.h"
+
 
 #define PORT 1206
 #define BUFFER_SIZE 4096
+#define MAX_CONNECTIONS 256  // Open connections (mostly S1's pool) served at once
+#define MAX_WORKERS 64       // Upper bound for DFS_WORKERS
 
 #include <errno.h>
 #include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+int port = PORT;  // Listening port (S4_PORT), so several S4 shards can share a host
+char s4_root[512];  // Files live here: S4_ROOT, default ~/S4
+
+/* Connections with a request waiting, handed from the poll loop to the workers */
+int work_queue[MAX_CONNECTIONS];
+int work_head, work_count;
+pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+int done_pipe[2];   // Workers write back connections that stay open
+int open_conns;     // Connections accepted and not yet closed
 
 // Creates a directory and all necessary parent directories in the given path.
  void make_directory(const char *path) {
@@ -42,24 +64,346 @@
     mkdir(tmp, 0755);
 }
 
+// Handles one request received on a connection
+// Parameters:
+//   client_sock - connection the request arrived on (usually a pooled S1 connection)
+//   req_id - request id to echo in every response frame
+//   flags - flags of the request frame (FRAME_DEFLATE: a deflated reply is welcome)
+//   buffer - command line text of the request (reused as scratch space)
+// Returns:
+//   0 if the connection can carry another request, -1 if it must be closed
+int handle_request(int client_sock, uint32_t req_id, uint16_t flags, char *buffer) {
+    // Parse command and arguments
+    // (after1: the text following the first argument, for the options)
+    char command[20], arg1[256], arg2[256];
+    int end1 = 0;
+    command[0] = arg1[0] = arg2[0] = '\0';
+    sscanf(buffer, "%19s %255s%n %255s", command, arg1, &end1, arg2);
+    const char *after1 = end1 ? buffer + end1 : "";
+
+    /* ========== Handle uploadf command (ZIP file upload) ========== */
+    if (strcmp(command, "uploadf") == 0) {
+        // Construct full destination path
+        char real_dest_path[512];
+        if (strncmp(arg2, "~S4", 3) == 0) {
+            snprintf(real_dest_path, sizeof(real_dest_path), "%s%s", s4_root, arg2 + 3);
+        } else {
+            snprintf(real_dest_path, sizeof(real_dest_path), "%s%s", s4_root, arg2);
+        }
+
+        // Create full file path (a truncated one would store another file)
+        char filepath[PATH_MAX];
+        int len = snprintf(filepath, sizeof(filepath), "%s/%s", real_dest_path, arg1);
+        if (len < 0 || (size_t)len >= sizeof(filepath)) {
+            recv_stream_to_file(client_sock, NULL, buffer, BUFFER_SIZE);  // Keep the connection in sync
+            send_error(client_sock, req_id, "Error: Path too long.\n");
+            return 0;
+        }
+
+        // Create any needed directories
+        make_directory(real_dest_path);
+
+        // Open file for writing (through the chunk store when deduplicating, see chunkstore.h)
+        struct cas_writer store;
+        FILE *f = cas_create(&store, filepath);
+        if (!f) {
+            perror("Error creating file");
+            // Drain the upload stream so the connection stays in sync
+            recv_stream_to_file(client_sock, NULL, buffer, BUFFER_SIZE);
+            send_error(client_sock, req_id, "Error: Could not create ZIP file.\n");
+            return 0;
+        }
+
+        // Receive and save file content until the end-of-stream frame,
+        // hashing it on the way in to check against the sender's checksum
+        uint32_t crc = 0;
+        long long bytes = recv_stream_checked(client_sock, f, buffer, BUFFER_SIZE, &crc);
+        int stored = cas_close(&store, f, bytes >= 0, crc, buffer);
+        if (bytes < 0) return -1;  // Stream broke off; no truncated file is left behind
+        if (stored == -2) {
+            // A listed older copy is gone, unless the chunk store kept it
+            if (access(filepath, F_OK) != 0) ns_index_forget(filepath);
+            send_error(client_sock, req_id, "Error: Checksum mismatch; the file was corrupted in transit.\n");
+            return 0;
+        }
+        if (stored < 0) {
+            send_error(client_sock, req_id, "Error: Could not store ZIP file.\n");
+            return 0;
+        }
+        ns_index_file(filepath);  // Visible to listings immediately
+        if (store.plain && store.z.zlen > 0)
+            printf("[S4] Saved %s to %s (%lld bytes, deflated to %lld)\n", arg1, filepath, bytes, store.z.zlen);
+        else if (store.plain)
+            printf("[S4] Saved %s to %s (%lld bytes)\n", arg1, filepath, bytes);
+        else
+            printf("[S4] Saved %s to %s (%lld bytes, %lld in new chunks)\n", arg1, filepath, bytes, store.fresh);
+        send_msg(client_sock, req_id, "Your file has been uploaded successfully.\n");
+    } 
+    /* ========== Handle downlf command (ZIP file download) ========== */
+    else if (strcmp(command, "downlf") == 0) {
+        char *filename = arg1;
+        char filepath[512];
+
+        // An optional byte range follows the path (see chunked.h)
+        long long offset, length;
+        if (parse_byte_range(arg1[0] ? after1 : NULL, &offset, &length) < 0) {
+            send_error(client_sock, req_id, "Error: Invalid byte range.\n");
+            return 0;
+        }
+
+        // Construct full file path
+        if (strncmp(filename, "~S4", 3) == 0) {
+            snprintf(filepath, sizeof(filepath), "%s%s", s4_root, filename + 3);
+        } else {
+            snprintf(filepath, sizeof(filepath), "%s/%s", s4_root, filename);
+        }
+
+        // Verify file is a ZIP (S4 only handles ZIPs)
+        char *ext = strrchr(filepath, '.');
+        if (!ext || strcmp(ext, ".zip") != 0) {
+            send_error(client_sock, req_id, "Error: Not a ZIP file.\n");
+            return 0;
+        }
+
+        // Open file for reading
+        FILE *f = fopen(filepath, "rb");
+        if (!f) {
+            send_error(client_sock, req_id, "Error: File not find on the Server.\n");
+            perror("Error opening file for download");
+            return 0;
+        }
+
+        // Send file content (or the requested range) as a sized data frame (zero-copy via sendfile),
+        // deflated if the requester takes that and the type is worth it (compress.h)
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long sent = send_file_part(client_sock, req_id, f, offset, length, compress_reply_wanted(flags, filepath));
+        fclose(f);
+        if (sent == -2) {
+            send_error(client_sock, req_id, "Error: Byte range starts past the end of the file.\n");
+            return 0;
+        }
+        if (sent < 0) return -1;  // A frame may be half sent (or a chunk missing): drop the connection
+        double ms = elapsed_ms(&start);
+        printf("[S4] Sent ZIP file %s (%lld bytes, %.1f ms, %.1f MB/s, %s)\n", filepath, sent,
+               ms, ms > 0 ? sent / 1048.576 / ms : 0.0, io_engine_name());
+    }
+    /* ========== Handle uploadstat / uploadchunk / uploadref / uploadcommit (resumable upload) ========== */
+    else if (strcmp(command, "uploadstat") == 0 || strcmp(command, "uploadchunk") == 0 ||
+             strcmp(command, "uploadcommit") == 0 || strcmp(command, "uploadref") == 0) {
+        // The upload id and the chunk offset (or the final size) follow the directory
+        char id[UPLOAD_ID_MAX + 2];
+        long long number, total;
+        int parallel, skip = 0;
+        sscanf(buffer, "%*s %*s %*s %n", &skip);
+        const char *args = skip ? buffer + skip : "";
+        parse_upload_args(args, id, sizeof(id), &number, &parallel, &total);
+        if (strcmp(command, "uploadstat") == 0) {
+            if (serve_upload_stat(client_sock, req_id, s4_root, id) < 0) return -1;
+        } else if (strcmp(command, "uploadchunk") == 0) {
+            return serve_upload_chunk(client_sock, req_id, s4_root, id, number, parallel, total);
+        } else if (strcmp(command, "uploadref") == 0) {
+            // The chunks named after the offset (see chunkstore.h)
+            int refs = 0;
+            sscanf(args, "%*s %*s %n", &refs);
+            if (serve_upload_ref(client_sock, req_id, s4_root, id, number, refs ? args + refs : "") < 0) return -1;
+        } else {
+            // Same destination as uploadf; the part is renamed into place whole
+            char real_dest_path[512], filepath[1024];
+            if (strncmp(arg2, "~S4", 3) == 0) {
+                snprintf(real_dest_path, sizeof(real_dest_path), "%s%s", s4_root, arg2 + 3);
+            } else {
+                snprintf(real_dest_path, sizeof(real_dest_path), "%s%s", s4_root, arg2);
+            }
+            make_directory(real_dest_path);
+            snprintf(filepath, sizeof(filepath), "%s/%s", real_dest_path, arg1);
+            int rc = serve_upload_commit(client_sock, req_id, s4_root, id, number, filepath, args);
+            if (rc < 0) return -1;
+            if (rc == 1) {
+                ns_index_file(filepath);  // Visible to listings immediately
+                printf("[S4] Committed chunked upload %s to %s (%lld bytes)\n", arg1, filepath, number);
+                send_msg(client_sock, req_id, "Your file has been uploaded successfully.\n");
+            }
+        }
+    }
+    /* ========== Handle removef command (ZIP file deletion) ========== */
+    else if (strcmp(command, "removef") == 0) {
+        char *filename = arg1;
+        char filepath[512];
+
+        // Construct full file path
+        if (strncmp(filename, "~S4", 3) == 0) {
+            snprintf(filepath, sizeof(filepath), "%s%s", s4_root, filename + 3);
+        } else {
+            snprintf(filepath, sizeof(filepath), "%s/%s", s4_root, filename);
+        }
+
+        // Verify file is a ZIP
+        char *ext = strrchr(filepath, '.');
+        if (!ext || strcmp(ext, ".zip") != 0) {
+            send_error(client_sock, req_id, "Error: Not a ZIP file.\n");
+            return 0;
+        }
+
+        // Attempt to remove file
+        if (cas_remove(filepath) == 0) {  // A manifest gives its chunks back
+            ns_index_forget(filepath);  // Drop it from the listing index right away
+            printf("[S4] Removed ZIP file: %s\n", filepath);
+            send_msg(client_sock, req_id, "ZIP file removed successfully.\n");
+        } else {
+            perror("Error removing file");
+            send_error(client_sock, req_id, "Error: Could not remove ZIP file.\n");
+        }
+    }
+    /* ========== Handle downltar command (zip files archive) ========== */
+    else if (strcmp(command, "downltar") == 0) {
+        // S4 only handles ZIP file archives
+        if (strcmp(arg1, ".zip") != 0) {
+            send_error(client_sock, req_id, "Error: S4 only handles .zip files.\n");
+            return 0;
+        }
+        // Options after the type: "gz", and dir=/glob=/since= to narrow
+        // the archive (tarstream.h); S1 has rewritten dir= for this server
+        struct tar_scope scope;
+        if (tar_parse_scope(after1, &scope) < 0) {
+            send_error(client_sock, req_id, TAR_OPTION_UNKNOWN);
+            return 0;
+        }
+
+        // Walk ~/S4 in-process and stream each zip as a tar member (bodies via
+        // sendfile), so exporting thousands of zips is one request, not one each
+        struct tar_stats stats;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long members = send_tar_stream(client_sock, req_id, s4_root, ".zip", &scope, "Error: No files found.\n",
+                                            &stats);
+        if (members < 0) return -1;  // Socket failed mid-archive
+        if (members > 0) {
+            double ms = elapsed_ms(&start);
+            if (scope.gzip)
+                printf("[S4] Created and sent zipfiles.tar.gz (%lld files, %lld bytes gzipped to %lld, %.1f ms)\n",
+                       stats.files, stats.bytes, stats.packed, ms);
+            else
+                printf("[S4] Created and sent zipfiles.tar (%lld files, %lld bytes, %.1f ms)\n", stats.files,
+                       stats.bytes, ms);
+        }
+    }
+    /* ========== Handle dispfnames / listf / dirversion commands (list ZIP files) ========== */
+    else if (strcmp(command, "dispfnames") == 0 || strcmp(command, "listf") == 0 ||
+             strcmp(command, "dirversion") == 0) {
+    
+        // Construct full directory path (a truncated one would list another directory)
+        char full_path[PATH_MAX];
+        int len;
+        if (strncmp(arg1, "~S4", 3) == 0) {
+            len = snprintf(full_path, sizeof(full_path), "%s%s", s4_root, arg1 + 3);
+        } else {
+            len = snprintf(full_path, sizeof(full_path), "%s/%s", s4_root, arg1);
+        }
+        if (len < 0 || (size_t)len >= sizeof(full_path)) {
+            send_error(client_sock, req_id, "Error: Path too long.\n");
+            return 0;
+        }
+    
+        // Send the .zip files sorted by name (S1 merges the sorted lists
+        // of all servers); a missing directory is just an empty listing
+        if (strcmp(command, "dirversion") == 0) {
+            // Just the directory's current version, so S1 can revalidate a cached listing
+            char version[64], reply[80];
+            ns_dir_version(full_path, version, sizeof(version));
+            snprintf(reply, sizeof(reply), "version=%s\n", version);
+            send_msg(client_sock, req_id, reply);
+        } else if (strcmp(command, "listf") == 0) {
+            // One page: filters and page size from S1 are applied here, next to the files
+            struct list_filter filter;
+            parse_list_filter(after1, &filter);
+            if (send_listing_page(client_sock, req_id, full_path, ".zip", &filter) < 0) return -1;
+        } else if (send_sorted_listing(client_sock, req_id, full_path, ".zip") < 0) {
+            return -1;
+        }
+    }
+    /* ========== Handle ping command (connection health check) ========== */
+    else if (strcmp(command, "ping") == 0) {
+        send_msg(client_sock, req_id, "pong\n");
+    }
+    else {
+        send_error(client_sock, req_id, "Invalid or unimplemented command.\n");
+    }
+    return 0;
+}
+
+// Worker thread: serves one request per queued connection, then hands the
+// connection back to the poll loop (or closes it)
+void *worker(void *arg) {
+    (void)arg;
+    char buffer[BUFFER_SIZE];  // Per-worker buffer for request text and scratch
+    while (1) {
+        pthread_mutex_lock(&work_lock);
+        while (work_count == 0)
+            pthread_cond_wait(&work_ready, &work_lock);
+        int client_sock = work_queue[work_head];
+        work_head = (work_head + 1) % MAX_CONNECTIONS;
+        work_count--;
+        pthread_mutex_unlock(&work_lock);
+
+        // Receive the client command frame and serve it
+        struct frame_header req;
+        int keep = recv_request(client_sock, &req, buffer, sizeof(buffer)) == 0 &&
+                   handle_request(client_sock, req.request_id, req.flags, buffer) == 0;
+        if (keep) {
+            write(done_pipe[1], &client_sock, sizeof(client_sock));
+        } else {
+            close(client_sock);
+            __atomic_sub_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
 int main() {
+    // sendfile() into a connection the peer dropped must fail with EPIPE (and
+    // leave the transfer resumable) rather than kill the process
+    signal(SIGPIPE, SIG_IGN);
+
     // Socket and network variables
     int server_fd, client_sock;  // File descriptors for server and client sockets
     struct sockaddr_in server, client;  // Server and client address structures
     socklen_t client_len = sizeof(client);  // Size of client address structure
-    char buffer[BUFFER_SIZE];  // Buffer for network communication
 
-    // Get home directory path from environment
-    char *home = getenv("HOME");
-    if (!home) {
-        perror("Cannot get HOME environment");
-        return 1;
+    // Port and storage root (S4_PORT / S4_ROOT) let one host run several
+    // S4 instances, e.g. as the shards of a hashed route in S1's routes.conf
+    char *env_port = getenv("S4_PORT");
+    if (env_port) port = atoi(env_port);
+    char *env_root = getenv("S4_ROOT");
+    if (env_root && *env_root) {
+        snprintf(s4_root, sizeof(s4_root), "%s", env_root);
+    } else {
+        // Default: ~/S4
+        char *home = getenv("HOME");
+        if (!home) {
+            perror("Cannot get HOME environment");
+            return 1;
+        }
+        snprintf(s4_root, sizeof(s4_root), "%s/S4", home);
     }
 
-    // Create S4 directory if it doesn't exist (~/S4)
-    char s4_folder[512];
-    snprintf(s4_folder, sizeof(s4_folder), "%s/S4", home);
-    mkdir(s4_folder, 0755);  // Create with rwxr-xr-x permissions
+    // Create the S4 directory if it doesn't exist
+    mkdir(s4_root, 0755);  // Create with rwxr-xr-x permissions
+    upload_sweep(s4_root);  // Drop chunked uploads abandoned long ago
+
+    // Index ~/S4 in memory; listings and downltar are answered from it
+    if (ns_index_init(s4_root) == 0)
+        printf("[S4] Indexed %llu files in %llu directories\n", ns.files, ns.dirs);
+
+    // Deduplicating chunk store (DFS_DEDUPE=fixed|cdc, see chunkstore.h)
+    if (cas_init(s4_root) != CAS_OFF)
+        printf("[S4] Deduplicating uploads into %s (%s chunks of %lld bytes)\n", cas.dir, cas_mode_name(cas.mode),
+               cas.avg);
+
+    // Uploads of compressible types stored deflated (DFS_COMPRESS_AT_REST=1, see compress.h)
+    if (compress_settings()->at_rest)
+        printf("[S4] Storing %s files compressed (zlib level %d)\n", compress_settings()->types,
+               compress_settings()->level);
 
     // Create server socket (IPv4, TCP)
     server_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -68,9 +412,13 @@ int main() {
         return 1;
     }
 
+    // Allow an immediate restart while old connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     // Configure server address structure
     server.sin_family = AF_INET;          // IPv4 address family
-    server.sin_port = htons(PORT);        // Port number in network byte order
+    server.sin_port = htons(port);        // Port number in network byte order
     server.sin_addr.s_addr = INADDR_ANY;  // Accept connections on all interfaces
 
     // Bind socket to the specified port
@@ -80,166 +428,79 @@ int main() {
         return 1;
     }
 
-    // Start listening for incoming connections with a backlog of 3
-    listen(server_fd, 3);
-    printf("S4 server running on port %d...\n", PORT);
-
-    // Main server loop - accept and handle client connections
-    while ((client_sock = accept(server_fd, (struct sockaddr *)&client, &client_len))) {
-        // Clear buffer before receiving new data
-        memset(buffer, 0, sizeof(buffer));
-        
-        // Receive command from client
-        int bytes_received = recv(client_sock, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) {
-            close(client_sock);
-            continue;
-        }
-
-        // Parse command and arguments (command, arg1, arg2)
-        char command[20], arg1[256], arg2[256];
-        sscanf(buffer, "%s %s %s", command, arg1, arg2);
-
-        /* ========== Handle uploadf command (ZIP file upload) ========== */
-        if (strcmp(command, "uploadf") == 0) {
-            // Construct full destination path
-            char real_dest_path[512];
-            if (strncmp(arg2, "~S4", 3) == 0) {
-                snprintf(real_dest_path, sizeof(real_dest_path), "%s/S4%s", home, arg2 + 3);
-            } else {
-                snprintf(real_dest_path, sizeof(real_dest_path), "%s/S4%s", home, arg2);
-            }
-
-            // Create any needed directories in the path
-            make_directory(real_dest_path);
-
-            // Create full file path
-            char filepath[512];
-            snprintf(filepath, sizeof(filepath), "%s/%s", real_dest_path, arg1);
-
-            // Open file for writing in binary mode
-            FILE *f = fopen(filepath, "wb");
-            if (!f) {
-                perror("Error creating file");
-                close(client_sock);
-                continue;
-            }
-
-            // Receive and save file content
-            while (1) {
-                int bytes = recv(client_sock, buffer, BUFFER_SIZE, 0);
-                if (bytes <= 0) break;  // Connection closed or error
-                fwrite(buffer, 1, bytes, f);
-                if (bytes < BUFFER_SIZE) break;  // Last chunk received
-            }
-            fclose(f);
-            printf("[S4] Saved %s to %s\n", arg1, filepath);
-        } 
-        /* ========== Handle downlf command (ZIP file download) ========== */
-        else if (strcmp(command, "downlf") == 0) {
-            char *filename = arg1;
-            char filepath[512];
-
-            // Construct full file path
-            if (strncmp(filename, "~S4", 3) == 0) {
-                snprintf(filepath, sizeof(filepath), "%s/S4%s", home, filename + 3);
-            } else {
-                snprintf(filepath, sizeof(filepath), "%s/S4/%s", home, filename);
-            }
+    // Start listening for connections
+    listen(server_fd, SOMAXCONN);  // Deep backlog so bursts from S1 aren't refused
+    // Pick the I/O engine (DFS_IO_ENGINE=uring, else blocking sendfile/fwrite)
+    const char *engine = io_engine_init();
+    printf("S4 server running on port %d, storing files in %s (%s I/O)...\n", port, s4_root, engine);
 
-            // Verify file is a ZIP file (S4 only handles ZIP files)
-            char *ext = strrchr(filepath, '.');
-            if (!ext || strcmp(ext, ".zip") != 0) {
-                send(client_sock, "Error: Not a ZIP file.\n", 24, 0);
-                close(client_sock);
-                continue;
-            }
+    // Start the worker threads (DFS_WORKERS, default one per CPU core)
+    int workers = sysconf(_SC_NPROCESSORS_ONLN);
+    char *env_workers = getenv("DFS_WORKERS");
+    if (env_workers) workers = atoi(env_workers);
+    if (workers < 1) workers = 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    pipe(done_pipe);
+    for (int i = 0; i < workers; i++) {
+        pthread_t t;
+        pthread_create(&t, NULL, worker, NULL);
+        pthread_detach(t);
+    }
+    printf("S4 serving requests with %d worker threads\n", workers);
 
-            // Open file for reading
-            FILE *f = fopen(filepath, "rb");
-            if (!f) {
-                send(client_sock, "Error: File not find on the Server.\n", 38, 0);
-                perror("Error opening file for download");
-                close(client_sock);
-                continue;
-            }
+    // Main server loop - S1 keeps a pool of long-lived connections open, so
+    // this thread polls every idle connection and queues the ones with a
+    // request waiting for the workers; slow transfers no longer block others
+    struct pollfd fds[MAX_CONNECTIONS + 2];
+    int nfds = 2;
+    fds[0].fd = server_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = done_pipe[0];
+    fds[1].events = POLLIN;
 
-            // Send file content to client
-            int bytes;
-            while ((bytes = fread(buffer, 1, BUFFER_SIZE, f)) > 0) {
-                send(client_sock, buffer, bytes, 0);
-            }
-            fclose(f);
-            printf("[S4] Sent ZIP file %s\n", filepath);
+    while (1) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            break;
         }
-        /* ========== Handle removef command (ZIP file deletion) ========== */
-        else if (strcmp(command, "removef") == 0) {
-            char *filename = arg1;
-            char filepath[512];
 
-            // Construct full file path
-            if (strncmp(filename, "~S4", 3) == 0) {
-                snprintf(filepath, sizeof(filepath), "%s/S4%s", home, filename + 3);
-            } else {
-                snprintf(filepath, sizeof(filepath), "%s/S4/%s", home, filename);
-            }
-
-            // Verify file is a ZIP file
-            char *ext = strrchr(filepath, '.');
-            if (!ext || strcmp(ext, ".zip") != 0) {
-                send(client_sock, "Error: Not a ZIP file.\n", 24, 0);
-                close(client_sock);
-                continue;
-            }
+        // Queue every idle connection that has a request (or a close) pending
+        for (int i = 2; i < nfds; i++) {
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            pthread_mutex_lock(&work_lock);
+            work_queue[(work_head + work_count) % MAX_CONNECTIONS] = fds[i].fd;
+            work_count++;
+            pthread_cond_signal(&work_ready);
+            pthread_mutex_unlock(&work_lock);
+            fds[i--] = fds[--nfds];  // A worker owns it until it is handed back
+        }
 
-            // Attempt to remove file
-            if (remove(filepath) == 0) {
-                send(client_sock, "ZIP file removed successfully.\n", 31, 0);
-                printf("[S4] Removed ZIP file: %s\n", filepath);
-            } else {
-                send(client_sock, "Error: Could not remove ZIP file.\n", 35, 0);
-                perror("Error removing file");
+        // Take back connections whose request a worker has finished
+        if (fds[1].revents & POLLIN) {
+            int back[64];
+            ssize_t n = read(done_pipe[0], back, sizeof(back));
+            for (int i = 0; i < n / (ssize_t)sizeof(int); i++) {
+                fds[nfds].fd = back[i];
+                fds[nfds].events = POLLIN;
+                nfds++;
             }
         }
-        /* ========== Handle dispfnames command (list ZIP files) ========== */
-        else if (strcmp(command, "dispfnames") == 0) {
-            char *home = getenv("HOME");
-            if (!home) {
-                close(client_sock);
-                continue;
-            }
-        
-            // Construct full directory path
-            char full_path[512];
-            if (strncmp(arg1, "~S4", 3) == 0) {
-                snprintf(full_path, sizeof(full_path), "%s/S4%s", home, arg1 + 3);
-            } else {
-                snprintf(full_path, sizeof(full_path), "%s/%s", home, arg1);
-            }
-        
-            // Open directory
-            DIR *dir = opendir(full_path);
-            if (!dir) {
-                close(client_sock);
+
+        // Accept a new connection
+        if (fds[0].revents & POLLIN) {
+            client_sock = accept(server_fd, (struct sockaddr *)&client, &client_len);
+            if (client_sock < 0) continue;
+            if (__atomic_load_n(&open_conns, __ATOMIC_RELAXED) >= MAX_CONNECTIONS) {
+                close(client_sock);  // Connection table full
                 continue;
             }
-        
-            // List all ZIP files in directory
-            struct dirent *entry;
-            while ((entry = readdir(dir)) != NULL) {
-                if (entry->d_type == DT_REG) {  // Only regular files
-                    char *ext = strrchr(entry->d_name, '.');
-                    if (ext && (strcmp(ext, ".zip") == 0)) {  // Only ZIP files
-                        send(client_sock, entry->d_name, strlen(entry->d_name), 0);
-                        send(client_sock, "\n", 1, 0);
-                    }
-                }
-            }
-            closedir(dir);
+            __atomic_add_fetch(&open_conns, 1, __ATOMIC_RELAXED);
+            set_nodelay(client_sock);
+            fds[nfds].fd = client_sock;
+            fds[nfds].events = POLLIN;
+            nfds++;
         }
-        
-        // Close client connection
-        close(client_sock);
     }
 
     // Close server socket (unreachable in normal operation)
@@ -0,0 +1,297 @@
+// checksum.h - CRC32C content checksums, verified end to end //
+//
+// Every file stream carries the CRC32C (Castagnoli) of the file's bytes in
+// its OP_END frame ("crc32c=1a2b3c4d"), and whoever receives the stream
+// computes the same CRC over the bytes that actually arrived:
+//   - uploads: the client (or S1's spool, or a replica source) sends it, the
+//     server storing the file checks it and refuses the file on a mismatch;
+//   - downloads: the server sends the stored checksum, w25clients checks it
+//     and discards the file on a mismatch;
+//   - chunked uploads: uploadcommit carries it and is checked against the
+//     assembled part before the rename.
+// Each server keeps a file's checksum in the CHECKSUM_XATTR extended
+// attribute together with the size and mtime it was computed for, so a
+// download never rereads the file (a file changed behind the server's back,
+// or one on a filesystem without user xattrs, is simply hashed again).
+//
+// The CRC runs on the SSE4.2 crc32 instruction (x86-64) or the ARMv8 CRC
+// extension when the CPU has it (checked at run time), otherwise on a
+// slicing-by-8 table; both give the same values. "hashbench" in w25clients
+// measures them.
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#define CHECKSUM_XATTR "user.dfs.crc32c"  // "<crc> <size> <mtime ns>" of the file's contents
+#define CHECKSUM_READ_SIZE (256 * 1024)   // Read size when a file has to be hashed from disk
+
+/* Slicing-by-8 tables for the software CRC, built once */
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static inline void crc32c_table_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78 & (0U - (c & 1)));  // Reflected Castagnoli polynomial
+        crc32c_table[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+}
+
+// Software CRC32C: continue `crc` (0 to start) over len bytes
+static inline uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_table_once, crc32c_table_init);
+    const unsigned char *p = buf;
+    uint32_t c = ~crc;
+    while (len >= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w = le64toh(w) ^ c;
+        c = crc32c_table[7][w & 0xff] ^ crc32c_table[6][(w >> 8) & 0xff] ^ crc32c_table[5][(w >> 16) & 0xff] ^
+            crc32c_table[4][(w >> 24) & 0xff] ^ crc32c_table[3][(w >> 32) & 0xff] ^
+            crc32c_table[2][(w >> 40) & 0xff] ^ crc32c_table[1][(w >> 48) & 0xff] ^ crc32c_table[0][w >> 56];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) c = (c >> 8) ^ crc32c_table[0][(c ^ *p++) & 0xff];
+    return ~c;
+}
+
+/* Operators that advance a raw CRC register over CRC32C_LONG or CRC32C_SHORT
+   zero bytes, as four byte-indexed tables. The hardware path runs three
+   independent crc32 chains over three adjacent blocks (the instruction's
+   latency is three times its throughput) and joins them with these. */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static pthread_once_t crc32c_shift_once = PTHREAD_ONCE_INIT;
+
+// Multiply a 32x32 GF(2) matrix by a vector
+static inline uint32_t crc32c_gf2_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+// Square a GF(2) matrix (applying it twice)
+static inline void crc32c_gf2_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) square[n] = crc32c_gf2_times(mat, mat[n]);
+}
+
+// Fill zeros[][] with the operator for `len` zero bytes (len a power of two)
+static inline void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+    uint32_t even[32], odd[32], *op = even;
+    odd[0] = 0x82F63B78;  // One zero bit
+    for (int n = 1; n < 32; n++) odd[n] = 1U << (n - 1);
+    crc32c_gf2_square(even, odd);  // Two zero bits
+    crc32c_gf2_square(odd, even);  // Four zero bits
+    for (len <<= 1;;) {            // Then eight per byte: square until len is used up
+        crc32c_gf2_square(even, odd);
+        op = even;
+        if ((len >>= 1) == 1) break;
+        crc32c_gf2_square(odd, even);
+        op = odd;
+        if ((len >>= 1) == 1) break;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = crc32c_gf2_times(op, n);
+        zeros[1][n] = crc32c_gf2_times(op, n << 8);
+        zeros[2][n] = crc32c_gf2_times(op, n << 16);
+        zeros[3][n] = crc32c_gf2_times(op, n << 24);
+    }
+}
+
+static inline void crc32c_shift_init(void) {
+    crc32c_zeros(crc32c_long, CRC32C_LONG);
+    crc32c_zeros(crc32c_short, CRC32C_SHORT);
+}
+
+// Advance a raw CRC register over the block length the table was built for
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+// Body of the hardware CRC: STEP64/STEP8 are the CPU's 8-byte and 1-byte
+// crc32c instructions. Three blocks of `block` bytes are hashed side by side
+// while at least that much is left.
+#define CRC32C_HW_BODY(STEP64, STEP8)                                                                  \
+    pthread_once(&crc32c_shift_once, crc32c_shift_init);                                              \
+    const unsigned char *p = buf;                                                                      \
+    uint64_t c0 = (uint32_t)~crc;                                                                      \
+    while (len && ((uintptr_t)p & 7)) {                                                                \
+        c0 = STEP8((uint32_t)c0, *p++);                                                                \
+        len--;                                                                                         \
+    }                                                                                                  \
+    for (int pass = 0; pass < 2; pass++) {                                                             \
+        size_t block = pass == 0 ? CRC32C_LONG : CRC32C_SHORT;                                        \
+        while (len >= 3 * block) {                                                                     \
+            uint64_t c1 = 0, c2 = 0;                                                                   \
+            for (const unsigned char *end = p + block; p < end; p += 8) {                              \
+                c0 = STEP64(c0, *(const uint64_t *)p);                                                 \
+                c1 = STEP64(c1, *(const uint64_t *)(p + block));                                       \
+                c2 = STEP64(c2, *(const uint64_t *)(p + 2 * block));                                   \
+            }                                                                                          \
+            uint32_t(*zeros)[256] = pass == 0 ? crc32c_long : crc32c_short;                           \
+            c0 = crc32c_shift(zeros, (uint32_t)c0) ^ (uint32_t)c1;                                     \
+            c0 = crc32c_shift(zeros, (uint32_t)c0) ^ (uint32_t)c2;                                     \
+            p += 2 * block;                                                                            \
+            len -= 3 * block;                                                                          \
+        }                                                                                              \
+    }                                                                                                  \
+    for (; len >= 8; p += 8, len -= 8) c0 = STEP64(c0, *(const uint64_t *)p);                          \
+    while (len--) c0 = STEP8((uint32_t)c0, *p++);                                                      \
+    return ~(uint32_t)c0;
+
+#if defined(__x86_64__)
+// SSE4.2 CRC32C: 8 bytes per crc32 instruction, three chains at once
+__attribute__((target("sse4.2"))) static inline uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    CRC32C_HW_BODY(_mm_crc32_u64, _mm_crc32_u8)
+}
+static inline int crc32c_hw_supported(void) { return __builtin_cpu_supports("sse4.2"); }
+#define CRC32C_HW_NAME "sse4.2"
+#elif defined(__aarch64__)
+// ARMv8 CRC extension: 8 bytes per crc32cx instruction, three chains at once
+__attribute__((target("+crc"))) static inline uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    CRC32C_HW_BODY(__crc32cd, __crc32cb)
+}
+static inline int crc32c_hw_supported(void) { return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0; }
+#define CRC32C_HW_NAME "armv8-crc"
+#else
+static inline uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) { return crc32c_sw(crc, buf, len); }
+static inline int crc32c_hw_supported(void) { return 0; }
+#define CRC32C_HW_NAME "table"
+#endif
+
+// 1 if the CPU has a CRC32C instruction (looked up once)
+static inline int crc32c_use_hw(void) {
+    static int use = -1;
+    int u = __atomic_load_n(&use, __ATOMIC_RELAXED);
+    if (u < 0) {
+        u = crc32c_hw_supported() ? 1 : 0;
+        __atomic_store_n(&use, u, __ATOMIC_RELAXED);
+    }
+    return u;
+}
+
+// Continue a CRC32C (0 to start) over len bytes, on the fastest engine available
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    return crc32c_use_hw() ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
+}
+
+// Name of the engine crc32c() runs on (for logs and stats)
+static inline const char *crc32c_engine(void) {
+    return crc32c_use_hw() ? CRC32C_HW_NAME : "table";
+}
+
+// CRC32C of `length` bytes of an open file from `offset`, read with pread()
+// (used where the bytes never pass through user space, e.g. after sendfile())
+// Returns 0, or -1 if the file could not be read
+static inline int crc32c_fd(int fd, off_t offset, long long length, uint32_t *crc) {
+    char *buffer = malloc(CHECKSUM_READ_SIZE);
+    uint32_t c = 0;
+    while (buffer && length > 0) {
+        ssize_t n = pread(fd, buffer, length < CHECKSUM_READ_SIZE ? length : CHECKSUM_READ_SIZE, offset);
+        if (n <= 0) break;
+        c = crc32c(c, buffer, n);
+        offset += n;
+        length -= n;
+    }
+    free(buffer);
+    if (length > 0) return -1;
+    *crc = c;
+    return 0;
+}
+
+// Text for an OP_END payload: "crc32c=<8 hex digits>" (appended to `out`)
+static inline void checksum_format(char *out, size_t size, uint32_t crc) {
+    size_t used = strlen(out);
+    if (used < size) snprintf(out + used, size - used, "%scrc32c=%08x\n", used ? " " : "", crc);
+}
+
+// Find "crc32c=..." in an OP_END payload or command; returns 1 and sets *crc if present
+static inline int checksum_parse(const char *text, uint32_t *crc) {
+    const char *p = text ? strstr(text, "crc32c=") : NULL;
+    unsigned int v;
+    if (!p || sscanf(p + 7, "%8x", &v) != 1) return 0;
+    *crc = v;
+    return 1;
+}
+
+// The file's checksum as stored in CHECKSUM_XATTR, if it is still current
+// Returns 0 and sets *crc, or -1 if there is none (or the file changed since)
+static inline int checksum_load(int fd, uint32_t *crc) {
+    char value[80];
+    struct stat st;
+    ssize_t n = fgetxattr(fd, CHECKSUM_XATTR, value, sizeof(value) - 1);
+    if (n <= 0 || fstat(fd, &st) < 0) return -1;
+    value[n] = '\0';
+    unsigned int v;
+    long long size, mtime;
+    if (sscanf(value, "%8x %lld %lld", &v, &size, &mtime) != 3) return -1;
+    if (size != (long long)st.st_size || mtime != st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec) return -1;
+    *crc = v;
+    return 0;
+}
+
+// Record a file's checksum in CHECKSUM_XATTR (call once it is fully written)
+// Returns 0, or -1 if the filesystem keeps no user xattrs (nothing lost: it's rehashed when needed)
+static inline int checksum_store(const char *path, uint32_t crc) {
+    char value[80];
+    struct stat st;
+    if (stat(path, &st) < 0) return -1;
+    snprintf(value, sizeof(value), "%08x %lld %lld", crc, (long long)st.st_size,
+             st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    return setxattr(path, CHECKSUM_XATTR, value, strlen(value), 0);
+}
+
+// A stored file's checksum: the recorded one, or hash the file now and record it
+// Returns 0, or -1 if the file could not be read
+static inline int checksum_of(int fd, uint32_t *crc) {
+    struct stat st;
+    if (checksum_load(fd, crc) == 0) return 0;
+    if (fstat(fd, &st) < 0 || crc32c_fd(fd, 0, st.st_size, crc) < 0) return -1;
+    char value[80];
+    snprintf(value, sizeof(value), "%08x %lld %lld", *crc, (long long)st.st_size,
+             st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+    fsetxattr(fd, CHECKSUM_XATTR, value, strlen(value), 0);
+    return 0;
+}
+
+// Accept or refuse a file just received from a stream: `crc` is what was
+// computed over the bytes that arrived, end_text the stream's OP_END payload.
+// A file whose sender named a different checksum is removed; an accepted one
+// gets its checksum recorded.
+// Returns 0 if accepted, -1 if the file was corrupted on the way (and removed)
+static inline int checksum_accept(const char *path, uint32_t crc, const char *end_text) {
+    uint32_t expected;
+    if (checksum_parse(end_text, &expected) && expected != crc) {
+        fprintf(stderr, "Checksum mismatch for %s: sent %08x, received %08x\n", path, expected, crc);
+        remove(path);
+        return -1;
+    }
+    checksum_store(path, crc);
+    return 0;
+}
+
+#endif
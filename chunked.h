@@ -0,0 +1,344 @@
+// chunked.h - Byte-range downloads and resumable chunked uploads //
+//
+// downlf takes an optional byte range after the path:
+//     downlf ~S1/big.zip 1048576 65536     (offset, then length; no length = to the end)
+// and answers with just those bytes; the OP_END frame gives the whole file's
+// "size=<bytes> crc32c=<hex>" (see checksum.h).
+// w25clients uses it to resume a download into <name>.part from where an
+// earlier attempt stopped, and to fetch one file over several connections.
+//
+// A large upload is sent in chunks under an upload id the client derives from
+// the file, so running the same upload again finds the chunks already stored:
+//     uploadstat   <name> <dir> <id>            -> "size=<bytes stored>[ dedupe=<mode>:<chunk>]\n"
+//     uploadchunk  <name> <dir> <id> <offset> [parallel=<size>]  + OP_DATA.../OP_END -> "size=<bytes stored>\n"
+//     uploadref    <name> <dir> <id> <offset> <sha256>:<len>...  -> "size=<bytes stored> have=<0/1 each>\n"
+//     uploadcommit <name> <dir> <id> <size> [crc32c=<hex>]  -> the usual upload reply
+// S1 routes them by <name> like uploadf, so every chunk reaches the server
+// that will store the file. Chunks are pwrite()n into <root>/.uploads/<id>.part
+// as they arrive, so a transfer cut off mid-chunk still keeps what got
+// through. A chunk may start anywhere up to the bytes already stored
+// (resending an overlap is harmless). With "parallel=<size>" (the whole
+// file's size) it may start anywhere before that size: several connections
+// then fill their own ranges of one part. The size must fit in the free
+// space of the server's filesystem, and a chunk running past it is cut back,
+// so a part never grows beyond the file it is for. Only the client knows
+// which ranges are done, so it gives such uploads an id of their own and a
+// sequential resume never trusts a part with holes in it.
+// uploadcommit checks the size and the checksum, syncs the part to disk and
+// rename()s it into place, so the file appears whole and intact or not at
+// all. Parts nobody has touched for UPLOAD_PART_TTL are swept at startup.
+// Chunk streams may come deflated (compress.h); they are inflated as they land.
+// On a server with a chunk store (chunkstore.h) uploadstat names its chunking,
+// uploadref lets the client skip chunks the store already holds (they are
+// copied into the part from there), and uploadcommit stores the part through
+// the store instead of renaming it.
+#ifndef CHUNKED_H
+#define CHUNKED_H
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#include "protocol.h"
+#include "chunkstore.h"
+
+#define UPLOADS_DIR ".uploads"                // Under each server's storage root
+#define UPLOAD_ID_MAX 64                      // Longest upload id ([A-Za-z0-9_-])
+#define UPLOAD_PART_TTL (7 * 24 * 60 * 60)    // Abandoned parts are removed after a week
+#define UPLOAD_PARALLEL "parallel"            // uploadchunk flag (=<file size>): the chunk may start past the bytes stored
+
+// Parse the "<id> [<offset or size>] [parallel=<size>]" that follows the
+// directory of an upload command (number and total stay -1 if missing; a
+// bare "parallel" sets *parallel with total -1, which serve_upload_chunk refuses)
+static inline void parse_upload_args(const char *args, char *id, size_t id_size, long long *number,
+                                     int *parallel, long long *total) {
+    char fmt[32], flag[32] = "";
+    id[0] = '\0';
+    *number = *total = -1;
+    snprintf(fmt, sizeof(fmt), "%%%zus %%lld %%31s", id_size - 1);
+    sscanf(args, fmt, id, number, flag);
+    *parallel = strcmp(flag, UPLOAD_PARALLEL) == 0 || sscanf(flag, UPLOAD_PARALLEL "=%lld", total) == 1;
+}
+
+// Parse the optional "<offset> [length]" after a downlf path
+// Returns 0 (offset 0 and length -1 when absent; -1 means "to the end"), or -1 if malformed
+static inline int parse_byte_range(const char *args, long long *offset, long long *length) {
+    *offset = 0;
+    *length = -1;
+    if (!args) return 0;
+    int n = sscanf(args, "%lld %lld", offset, length);
+    if (n == 0 || n == EOF) {
+        *offset = 0;
+        return strspn(args, " \t") == strlen(args) ? 0 : -1;
+    }
+    if (*offset < 0 || (n == 2 && *length < 0)) return -1;
+    return 0;
+}
+
+// Answer downlf for an open file, whole or one byte range
+// deflate: the requester takes a deflated reply and the file's type is worth
+// it (compress_reply_wanted() in compress.h)
+// Returns bytes sent, -1 on socket error, -2 if the range lies past the end
+// (nothing is sent then; the caller answers with an error)
+static inline long long send_file_part(int sock, uint32_t req_id, FILE *file, long long offset, long long length,
+                                       int deflate) {
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0) return -1;
+    if (offset > st.st_size) return -2;
+    if (length < 0 || length > st.st_size - offset) length = st.st_size - offset;
+    // The end frame gives the whole file's size and checksum, so a ranged
+    // reader can plan the rest and check the file once it has all of it
+    char end_text[64];
+    uint32_t crc;
+    struct cas_manifest m;
+    int plain = cas_manifest_load(fileno(file), &m);
+    if (plain < 0) return -1;
+    snprintf(end_text, sizeof(end_text), "size=%lld", (long long)st.st_size);
+    if (!plain) {
+        // Stored as chunks (chunkstore.h); the manifest carries the checksum
+        checksum_format(end_text, sizeof(end_text), m.crc);
+        long long sent = cas_send_range(sock, req_id, &m, offset, length, end_text);
+        cas_manifest_free(&m);
+        return sent;
+    }
+    long long zlen = compress_rest_len(fileno(file));
+    if (zlen > 0) {
+        // Stored compressed (compress.h)
+        if (compress_rest_checksum(fileno(file), zlen, st.st_size, &crc) < 0) return -1;
+        checksum_format(end_text, sizeof(end_text), crc);
+        return compress_rest_send(sock, req_id, file, zlen, st.st_size, offset, length, deflate, end_text);
+    }
+    if (checksum_of(fileno(file), &crc) == 0) checksum_format(end_text, sizeof(end_text), crc);
+    if (deflate) return compress_send_range(sock, req_id, file, offset, length, end_text);
+    return send_file_range(sock, req_id, file, offset, length, end_text);
+}
+
+// Build <root>/.uploads/<id>.part (creating the directory)
+// Returns 0, or -1 if the id isn't acceptable
+static inline int upload_part_path(const char *root, const char *id, char *out, size_t size) {
+    size_t len = strlen(id);
+    if (len == 0 || len > UPLOAD_ID_MAX || strspn(id, "abcdefghijklmnopqrstuvwxyz"
+                                                      "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != len)
+        return -1;
+    snprintf(out, size, "%s/%s", root, UPLOADS_DIR);
+    mkdir(out, 0755);
+    snprintf(out, size, "%s/%s/%s.part", root, UPLOADS_DIR, id);
+    return 0;
+}
+
+// Bytes stored so far for an upload (0 if none)
+static inline long long upload_part_size(const char *part) {
+    struct stat st;
+    return stat(part, &st) == 0 ? (long long)st.st_size : 0;
+}
+
+// Send "size=<n>\n" as the reply to uploadstat/uploadchunk
+static inline int send_upload_size(int sock, uint32_t req_id, long long size) {
+    char reply[64];
+    snprintf(reply, sizeof(reply), "size=%lld\n", size);
+    return send_msg(sock, req_id, reply);
+}
+
+// Answer uploadstat: how much of upload `id` this server holds, and how its
+// chunk store cuts files if it has one
+// Returns 0, or -1 if the connection failed
+static inline int serve_upload_stat(int sock, uint32_t req_id, const char *root, const char *id) {
+    char part[1024], reply[96];
+    if (upload_part_path(root, id, part, sizeof(part)) < 0)
+        return send_error(sock, req_id, "Error: Invalid upload id.\n");
+    if (cas.mode == CAS_OFF) return send_upload_size(sock, req_id, upload_part_size(part));
+    snprintf(reply, sizeof(reply), "size=%lld dedupe=%s:%lld\n", upload_part_size(part), cas_mode_name(cas.mode),
+             cas.avg);
+    return send_msg(sock, req_id, reply);
+}
+
+// Non-zero if a file of `size` bytes fits in the free space under root
+static inline int upload_size_fits(const char *root, long long size) {
+    struct statvfs fs;
+    if (size < 0) return 0;
+    if (statvfs(root, &fs) < 0) return 1;  // Can't tell: the writes will fail if it doesn't
+    return (unsigned long long)size <= (unsigned long long)fs.f_bavail * fs.f_frsize;
+}
+
+// Answer uploadchunk: pwrite() the chunk stream into the part at `offset`
+// (parallel: the offset may lie past the bytes stored so far, but not past
+// the file's declared size `total`)
+// Returns 0 if the connection can carry another request, -1 if it must be closed
+static inline int serve_upload_chunk(int sock, uint32_t req_id, const char *root, const char *id, long long offset,
+                                     int parallel, long long total) {
+    char part[1024], msg[256];
+    long long stored = 0;
+    int fd = -1;
+    if (upload_part_path(root, id, part, sizeof(part)) == 0) {
+        stored = upload_part_size(part);
+        int fits = parallel ? upload_size_fits(root, total) && offset < total && stored <= total : offset <= stored;
+        if (offset >= 0 && fits) fd = open(part, O_WRONLY | O_CREAT, 0644);
+    }
+    if (fd < 0) {
+        // Drain the chunk so the connection stays in sync
+        if (recv_stream_to_file(sock, NULL, msg, sizeof(msg)) < 0) return -1;
+        if (!parallel)
+            snprintf(msg, sizeof(msg), "Error: Chunk at %lld does not continue the %lld bytes stored.\n", offset,
+                     stored);
+        else if (total < 0)
+            snprintf(msg, sizeof(msg), "Error: A parallel chunk must give the file's size (parallel=<bytes>).\n");
+        else
+            snprintf(msg, sizeof(msg), "Error: Chunk at %lld lies outside a %lld-byte upload this server can hold.\n",
+                     offset, total);
+        return send_error(sock, req_id, msg) < 0 ? -1 : 0;
+    }
+
+    // Whatever arrives is kept, even if the stream breaks off: the client
+    // resumes from the stored size. A parallel chunk running past the
+    // declared size is cut back to it.
+    long long bytes = recv_stream_at(sock, fd, offset, NULL, msg, sizeof(msg));
+    struct stat st;
+    int overrun = parallel && fstat(fd, &st) == 0 && st.st_size > total;
+    if (overrun && ftruncate(fd, total) < 0) perror("Error trimming upload part");
+    close(fd);
+    if (bytes < 0) return -1;
+    if (overrun) {
+        snprintf(msg, sizeof(msg), "Error: Chunk at %lld runs past the declared %lld bytes.\n", offset, total);
+        return send_error(sock, req_id, msg) < 0 ? -1 : 0;
+    }
+    return send_upload_size(sock, req_id, upload_part_size(part)) < 0 ? -1 : 0;
+}
+
+// Copy `len` bytes of one file into another at `offset` (in the kernel when it can)
+// Returns 0, or -1 on error
+static inline int copy_into(int from, int to, long long offset, long long len) {
+    loff_t in = 0, out = offset;
+    while (len > 0) {
+        ssize_t n = copy_file_range(from, &in, to, &out, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len -= n;
+    }
+    char buffer[64 * 1024];
+    while (len > 0) {  // Across filesystems, or a kernel without copy_file_range
+        ssize_t n = pread(from, buffer, len < (long long)sizeof(buffer) ? len : (long long)sizeof(buffer), in);
+        if (n <= 0 || pwrite(to, buffer, n, out) != n) return -1;
+        in += n;
+        out += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Answer uploadref: `refs` names the chunks ("<sha256>:<length> ...", cut as
+// chunkstore.h cuts files) that continue upload `id` at `offset`. Those this
+// server's chunk store holds are copied into the part, up to the first it
+// doesn't, so the client needn't send them; it learns which of the others are
+// held as well and sends only the missing ones.
+// Replies "size=<bytes stored> have=<1 or 0 per chunk named>"
+// Returns 0, or -1 if the connection failed
+static inline int serve_upload_ref(int sock, uint32_t req_id, const char *root, const char *id, long long offset,
+                                   const char *refs) {
+    char part[1024], path[1200], hex[65], have[CAS_REF_BATCH + 1], reply[64 + CAS_REF_BATCH];
+    if (cas.mode == CAS_OFF) return send_error(sock, req_id, "Error: This server does not deduplicate.\n");
+    if (upload_part_path(root, id, part, sizeof(part)) < 0)
+        return send_error(sock, req_id, "Error: Invalid upload id.\n");
+
+    // Only a chunk that starts right at the bytes stored can be added
+    long long stored = upload_part_size(part), len;
+    int fd = offset == stored ? open(part, O_WRONLY | O_CREAT, 0644) : -1;
+    int n = 0, used, copying = fd >= 0;
+    while (n < CAS_REF_BATCH && sscanf(refs, " %64[0-9a-f]:%lld%n", hex, &len, &used) == 2) {
+        refs += used;
+        struct stat st;
+        cas_chunk_path(hex, path, sizeof(path));
+        int chunk = strlen(hex) == 64 ? open(path, O_RDONLY) : -1;  // Open, it outlives a concurrent removef
+        int held = chunk >= 0 && fstat(chunk, &st) == 0 && st.st_size == len;
+        if (copying && (!held || copy_into(chunk, fd, stored, len) < 0)) copying = 0;
+        else if (copying) stored += len;
+        if (chunk >= 0) close(chunk);
+        have[n++] = held ? '1' : '0';
+    }
+    have[n] = '\0';
+    if (fd >= 0) close(fd);
+    snprintf(reply, sizeof(reply), "size=%lld have=%s\n", upload_part_size(part), have);
+    return send_msg(sock, req_id, reply);
+}
+
+// Commit upload `id` as final_path once all `size` bytes are stored: check
+// the part against the "crc32c=" in args (if the client sent one), sync it
+// and rename() it into place, or store it through the chunk store if the
+// server has one, or deflated if it is stored compressed (the caller has
+// created the directory)
+// Errors are answered here; on success the caller indexes the file and replies
+// Returns 1 if the file was committed, 0 if an error was sent, -1 if the connection failed
+static inline int serve_upload_commit(int sock, uint32_t req_id, const char *root, const char *id, long long size,
+                                      const char *final_path, const char *args) {
+    char part[1024], msg[256];
+    if (upload_part_path(root, id, part, sizeof(part)) < 0)
+        return send_error(sock, req_id, "Error: Invalid upload id.\n") < 0 ? -1 : 0;
+    long long stored = upload_part_size(part);
+    if (stored != size) {
+        snprintf(msg, sizeof(msg), "Error: Upload has %lld of %lld bytes; send the rest first.\n", stored, size);
+        return send_error(sock, req_id, msg) < 0 ? -1 : 0;
+    }
+    // Chunks may have arrived over several connections and runs, so the part
+    // is hashed as a whole (one sequential read, mostly from the page cache)
+    uint32_t crc = 0, expected;
+    int fd = open(part, O_RDONLY);
+    int hashed = fd >= 0 && crc32c_fd(fd, 0, size, &crc) == 0;
+    if (hashed && checksum_parse(args, &expected) && expected != crc) {
+        close(fd);
+        remove(part);  // Resuming can't repair it; the client sends the file again
+        snprintf(msg, sizeof(msg), "Error: Checksum mismatch (sent %08x, stored %08x); upload discarded.\n",
+                 expected, crc);
+        return send_error(sock, req_id, msg) < 0 ? -1 : 0;
+    }
+    if (hashed && cas.mode != CAS_OFF) {
+        // Through the chunk store: only chunks it doesn't have yet are written
+        int ingested = cas_ingest(fd, size, crc, final_path, NULL) == 0;
+        close(fd);
+        if (ingested) {
+            remove(part);
+            return 1;
+        }
+        fprintf(stderr, "Error committing upload %s to the chunk store\n", id);
+        return send_error(sock, req_id, "Error: Could not store the uploaded file.\n") < 0 ? -1 : 0;
+    }
+    if (hashed && compress_rest_wanted(final_path)) {
+        // Stored compressed (compress.h): deflated into a file of its own
+        struct compress_writer w;
+        int deflated = compress_ingest(&w, fd, size, crc, final_path) == 0;
+        close(fd);
+        if (deflated && cas_rename(w.temp, final_path) == 0) {
+            remove(part);
+            return 1;
+        }
+        if (deflated) remove(w.temp);
+        perror("Error committing upload");
+        return send_error(sock, req_id, "Error: Could not store the uploaded file.\n") < 0 ? -1 : 0;
+    }
+    int synced = hashed && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!synced || cas_rename(part, final_path) < 0) {
+        perror("Error committing upload");
+        return send_error(sock, req_id, "Error: Could not store the uploaded file.\n") < 0 ? -1 : 0;
+    }
+    checksum_store(final_path, crc);
+    return 1;
+}
+
+// Remove parts of uploads abandoned for longer than UPLOAD_PART_TTL
+static inline void upload_sweep(const char *root) {
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s/%s", root, UPLOADS_DIR);
+    DIR *dp = opendir(dir);
+    if (!dp) return;
+    struct dirent *ep;
+    time_t now = time(NULL);
+    while ((ep = readdir(dp)) != NULL) {
+        char path[1280];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, ep->d_name);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime > UPLOAD_PART_TTL) remove(path);
+    }
+    closedir(dp);
+}
+
+#endif
@@ -0,0 +1,780 @@
+// chunkstore.h - Content-addressed, deduplicating storage for the sub-servers //
+//
+// With DFS_DEDUPE=fixed or DFS_DEDUPE=cdc a sub-server (S2/S3/S4) stores each
+// upload's body as chunks in <root>/.chunks/<xx>/<sha256>, one file per
+// distinct chunk, and the file's own path becomes a manifest listing its
+// chunks in order:
+//     dfs-manifest 1
+//     size 524288000 crc32c 1a2b3c4d chunks 500
+//     <sha256 hex> <length>
+//     ...
+// The same 500 MB zip uploaded into twenty directories is then stored once
+// plus twenty manifests of a few KB each.
+//   fixed - chunks of exactly DFS_DEDUPE_CHUNK bytes (default 1 MiB)
+//   cdc   - content-defined chunks (FastCDC-style gear hash, normalized to
+//           average DFS_DEDUPE_CHUNK, between a quarter and four times that),
+//           so an insertion only changes the chunks around it
+// Files smaller than CAS_MIN_FILE are stored as plain files either way.
+//
+// A manifest is marked by the CAS_MANIFEST_XATTR extended attribute (the
+// length of its text) and is extended to the file's real size as a sparse
+// file, so stat(), listings, size filters and the namespace index see the
+// size of the contents while the manifest holds no data blocks. downlf, ranges
+// and downltar read the chunks through cas_send_body().
+// Every chunk carries a reference count in CAS_REFS_XATTR, changed under
+// cas.lock: storing a manifest takes a reference per chunk, removef or
+// overwriting the file gives them back (the file is replaced under the same
+// lock), and a chunk whose count reaches zero is deleted. References are
+// taken before a manifest appears and given back after it is gone, so a
+// crash can leak a chunk but never lose one in use.
+//
+// A client re-uploading content the store already has needn't send it: the
+// uploadstat reply names the chunking ("dedupe=cdc:1048576"), the client cuts
+// its file the same way and names its chunks with uploadref (see chunked.h),
+// and the server copies those it holds into the upload.
+// DFS_DEDUPE is unset (off) by default; a filesystem without user xattrs
+// keeps it off. Manifests stored while it was on are still read when it is off.
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "protocol.h"
+#include "compress.h"
+
+#define CAS_DIR ".chunks"                       // Chunk store, under each server's storage root
+#define CAS_REFS_XATTR "user.dfs.refs"          // On a chunk: manifests referring to it
+#define CAS_MANIFEST_XATTR "user.dfs.manifest"  // On a manifest: length of its text
+#define CAS_MANIFEST_MAGIC "dfs-manifest 1\n"
+#define CAS_MIN_FILE (64 * 1024)                // Smaller files are stored plain
+#define CAS_DEFAULT_CHUNK (1024 * 1024)         // DFS_DEDUPE_CHUNK default (average for cdc)
+#define CAS_MIN_CHUNK (64 * 1024)               // Bounds for DFS_DEDUPE_CHUNK
+#define CAS_MAX_CHUNK (4 * 1024 * 1024)
+#define CAS_READ_SIZE (1024 * 1024)             // Read size when chunking a file on disk
+#define CAS_REF_BATCH 32                        // Chunks named per uploadref request
+
+enum { CAS_OFF, CAS_FIXED, CAS_CDC };
+
+/* ---------- SHA-256 (chunk names) ---------- */
+
+struct cas_sha256 {
+    uint32_t h[8];
+    uint64_t bytes;
+    unsigned char block[64];
+    size_t used;
+};
+
+static const uint32_t cas_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t cas_ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static inline void cas_sha256_init(struct cas_sha256 *s) {
+    static const uint32_t iv[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    memcpy(s->h, iv, sizeof(iv));
+    s->bytes = 0;
+    s->used = 0;
+}
+
+// Compress one 64-byte block into the state
+static inline void cas_sha256_block(uint32_t *h, const unsigned char *p) {
+    uint32_t w[64], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = cas_ror(w[i - 15], 7) ^ cas_ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = cas_ror(w[i - 2], 17) ^ cas_ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (cas_ror(e, 6) ^ cas_ror(e, 11) ^ cas_ror(e, 25)) + ((e & f) ^ (~e & g)) + cas_sha256_k[i] + w[i];
+        uint32_t t2 = (cas_ror(a, 2) ^ cas_ror(a, 13) ^ cas_ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+static inline void cas_sha256_update(struct cas_sha256 *s, const void *data, size_t len) {
+    const unsigned char *p = data;
+    s->bytes += len;
+    if (s->used > 0) {
+        size_t n = 64 - s->used < len ? 64 - s->used : len;
+        memcpy(s->block + s->used, p, n);
+        s->used += n;
+        p += n;
+        len -= n;
+        if (s->used < 64) return;
+        cas_sha256_block(s->h, s->block);
+        s->used = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) cas_sha256_block(s->h, p);
+    memcpy(s->block, p, len);
+    s->used = len;
+}
+
+// Finish the hash as 64 lowercase hex digits (out holds 65 bytes)
+static inline void cas_sha256_hex(struct cas_sha256 *s, char *out) {
+    uint64_t bits = s->bytes * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t n = (s->used < 56 ? 56 : 120) - s->used;
+    for (int i = 0; i < 8; i++) pad[n + i] = bits >> (56 - 8 * i);
+    cas_sha256_update(s, pad, n + 8);
+    for (int i = 0; i < 8; i++) snprintf(out + 8 * i, 9, "%08x", s->h[i]);
+}
+
+/* ---------- Store configuration ---------- */
+
+struct cas_store {
+    int mode;                  // CAS_OFF, CAS_FIXED or CAS_CDC
+    long long avg, min, max;   // Chunk sizes (fixed: all three are the chunk size)
+    uint64_t mask_small, mask_large;  // cdc: boundary masks below / above the average size
+    uint64_t gear[256];        // cdc: rolling hash table (the same on every host)
+    char dir[1024];            // <root>/.chunks (servers only)
+    pthread_mutex_t lock;      // Reference counts, chunk creation and deletion
+    unsigned long long chunks_new, chunks_shared;  // Counters (for logs)
+};
+
+static struct cas_store cas = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Name of a chunking mode ("off", "fixed", "cdc")
+static inline const char *cas_mode_name(int mode) {
+    return mode == CAS_FIXED ? "fixed" : mode == CAS_CDC ? "cdc" : "off";
+}
+
+// Set the chunking: `mode` by name and the (average) chunk size, rounded to a
+// power of two within CAS_MIN_CHUNK..CAS_MAX_CHUNK. Clients call this with what
+// the server's uploadstat reply names, so both cut files identically.
+static inline void cas_configure(const char *mode, long long avg) {
+    cas.mode = mode && strcmp(mode, "fixed") == 0 ? CAS_FIXED : mode && strcmp(mode, "cdc") == 0 ? CAS_CDC : CAS_OFF;
+    int bits = 16;
+    while (bits < 22 && (1LL << bits) < avg) bits++;
+    cas.avg = 1LL << bits;
+    cas.min = cas.mode == CAS_CDC ? cas.avg / 4 : cas.avg;
+    cas.max = cas.mode == CAS_CDC ? cas.avg * 4 : cas.avg;
+    // Normalized chunking: a boundary needs two more zero bits before the
+    // average size and two fewer after it, which narrows the size spread.
+    // The masks test the top bits, where the last 64 bytes all count.
+    cas.mask_small = ~0ULL << (64 - (bits + 2));
+    cas.mask_large = ~0ULL << (64 - (bits - 2));
+    uint64_t x = 0x9E3779B97F4A7C15ULL;  // splitmix64 from a fixed seed
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        cas.gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Turn the store on for root as DFS_DEDUPE / DFS_DEDUPE_CHUNK say (sub-servers call it once from main)
+// Returns the mode in use (CAS_OFF if disabled or the filesystem can't hold the reference counts)
+static inline int cas_init(const char *root) {
+    const char *size = getenv("DFS_DEDUPE_CHUNK");
+    cas_configure(getenv("DFS_DEDUPE"), size && atoll(size) > 0 ? atoll(size) : CAS_DEFAULT_CHUNK);
+    snprintf(cas.dir, sizeof(cas.dir), "%s/%s", root, CAS_DIR);  // Manifests stored earlier are read either way
+    if (cas.mode == CAS_OFF) return CAS_OFF;
+    mkdir(cas.dir, 0755);
+
+    // Reference counts live in xattrs: without them the store can't be kept
+    char probe[1100];
+    snprintf(probe, sizeof(probe), "%s/probe", cas.dir);
+    int fd = open(probe, O_WRONLY | O_CREAT, 0644);
+    int ok = fd >= 0 && fsetxattr(fd, CAS_REFS_XATTR, "0", 1, 0) == 0;
+    if (fd >= 0) close(fd);
+    remove(probe);
+    if (!ok) {
+        fprintf(stderr, "Deduplication disabled: %s keeps no user xattrs\n", cas.dir);
+        cas.mode = CAS_OFF;
+        return CAS_OFF;
+    }
+
+    // Chunks being written when the server last stopped
+    DIR *dp = opendir(cas.dir);
+    struct dirent *ep;
+    while (dp && (ep = readdir(dp)) != NULL) {
+        if (strncmp(ep->d_name, "incoming-", 9) == 0) unlinkat(dirfd(dp), ep->d_name, 0);
+    }
+    if (dp) closedir(dp);
+    return cas.mode;
+}
+
+/* ---------- Chunking ---------- */
+
+/* Cuts a byte stream into chunks and names each by its SHA-256 */
+struct cas_chunker {
+    long long len;      // Bytes in the current chunk
+    uint64_t fp;        // cdc: gear hash since the minimum size
+    struct cas_sha256 sha;
+};
+
+static inline void cas_chunker_reset(struct cas_chunker *c) {
+    c->len = 0;
+    c->fp = 0;
+    cas_sha256_init(&c->sha);
+}
+
+// Take bytes into the current chunk up to its end, if that lies within p[0..n)
+// Returns how many bytes belong to the current chunk; *boundary is set if it
+// ended there (its name is then cas_chunker_name(), and the next call starts a new one)
+static inline size_t cas_chunker_scan(struct cas_chunker *c, const unsigned char *p, size_t n, int *boundary) {
+    size_t i = 0;
+    *boundary = 0;
+    if (cas.mode == CAS_CDC) {
+        // Nothing can end before the minimum size: skip straight to it
+        if (c->len < cas.min) i = cas.min - c->len < (long long)n ? (size_t)(cas.min - c->len) : n;
+        for (; i < n; i++) {
+            long long at = c->len + (long long)i;
+            c->fp = (c->fp << 1) + cas.gear[p[i]];
+            if (at + 1 >= cas.max || !(c->fp & (at < cas.avg ? cas.mask_small : cas.mask_large))) {
+                *boundary = 1;
+                i++;
+                break;
+            }
+        }
+    } else {
+        i = cas.max - c->len < (long long)n ? (size_t)(cas.max - c->len) : n;
+        *boundary = c->len + (long long)i == cas.max;
+    }
+    cas_sha256_update(&c->sha, p, i);
+    c->len += i;
+    return i;
+}
+
+// Name of the chunk just ended (or of the tail at end of stream); resets for the next
+static inline void cas_chunker_name(struct cas_chunker *c, char *hex) {
+    cas_sha256_hex(&c->sha, hex);
+    cas_chunker_reset(c);
+}
+
+/* ---------- Chunks and reference counts ---------- */
+
+// Path of a chunk in the store
+static inline void cas_chunk_path(const char *hex, char *out, size_t size) {
+    snprintf(out, size, "%s/%.2s/%s", cas.dir, hex, hex);
+}
+
+// A chunk's reference count (cas.lock held)
+// Returns the count, or -1 if the chunk isn't there (or isn't `len` bytes long, len >= 0)
+static inline long long cas_refs(const char *path, long long len) {
+    struct stat st;
+    char value[32];
+    if (stat(path, &st) < 0 || (len >= 0 && st.st_size != len)) return -1;
+    ssize_t n = getxattr(path, CAS_REFS_XATTR, value, sizeof(value) - 1);
+    if (n <= 0) return 0;
+    value[n] = '\0';
+    return atoll(value);
+}
+
+// Set a chunk's reference count, deleting it at zero (cas.lock held)
+static inline void cas_set_refs(const char *path, long long refs) {
+    char value[32];
+    if (refs <= 0) {
+        remove(path);
+        return;
+    }
+    snprintf(value, sizeof(value), "%lld", refs);
+    setxattr(path, CAS_REFS_XATTR, value, strlen(value), 0);
+}
+
+// Take a reference on chunk `hex` of `len` bytes if the store has it
+// Returns 1 if it did, 0 if the chunk isn't there
+static inline int cas_chunk_ref(const char *hex, long long len) {
+    char path[1200];
+    cas_chunk_path(hex, path, sizeof(path));
+    pthread_mutex_lock(&cas.lock);
+    long long refs = cas_refs(path, len);
+    if (refs >= 0) cas_set_refs(path, refs + 1);
+    pthread_mutex_unlock(&cas.lock);
+    return refs >= 0;
+}
+
+// Store one chunk (or take another reference if it is already there)
+// The bytes are written to an incoming- file outside the lock and renamed
+// into place under it, so a reader never sees a partial chunk.
+// Returns 1 if it was new, 0 if it was already stored, -1 if it couldn't be written
+static inline int cas_chunk_put(const char *hex, const void *data, size_t len) {
+    if (cas_chunk_ref(hex, len)) {
+        __atomic_add_fetch(&cas.chunks_shared, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    char path[1200], temp[1200];
+    snprintf(temp, sizeof(temp), "%s/%.2s", cas.dir, hex);
+    mkdir(temp, 0755);
+    snprintf(temp, sizeof(temp), "%s/incoming-XXXXXX", cas.dir);
+    int fd = mkstemp(temp);
+    if (fd < 0) return -1;
+    const char *p = data;
+    size_t left = len;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        p += n;
+        left -= n;
+    }
+    int ok = left == 0 && fchmod(fd, 0644) == 0 && (!fsync_enabled() || fsync(fd) == 0);
+    close(fd);
+    if (!ok) {
+        remove(temp);
+        return -1;
+    }
+
+    // Another upload may have stored the same chunk meanwhile; a damaged copy
+    // (wrong length) is replaced but keeps its references
+    cas_chunk_path(hex, path, sizeof(path));
+    pthread_mutex_lock(&cas.lock);
+    long long refs = cas_refs(path, len);
+    int fresh = refs < 0;
+    if (fresh) {
+        char value[32];
+        long long old = cas_refs(path, -1);
+        snprintf(value, sizeof(value), "%lld", (old > 0 ? old : 0) + 1);
+        ok = setxattr(temp, CAS_REFS_XATTR, value, strlen(value), 0) == 0 && rename(temp, path) == 0;
+    } else {
+        cas_set_refs(path, refs + 1);
+    }
+    pthread_mutex_unlock(&cas.lock);
+    if (!fresh || !ok) remove(temp);
+    if (!ok) return -1;
+    __atomic_add_fetch(fresh ? &cas.chunks_new : &cas.chunks_shared, 1, __ATOMIC_RELAXED);
+    return fresh;
+}
+
+/* ---------- Manifests ---------- */
+
+struct cas_ref {
+    char hash[65];  // SHA-256, hex
+    long long len;
+};
+
+struct cas_manifest {
+    long long size;         // Bytes of file content
+    uint32_t crc;           // CRC32C of the content (checksum.h)
+    int count, capacity;
+    struct cas_ref *refs;   // Chunks in file order
+};
+
+static inline void cas_manifest_free(struct cas_manifest *m) {
+    free(m->refs);
+    memset(m, 0, sizeof(*m));
+}
+
+static inline int cas_manifest_add(struct cas_manifest *m, const char *hex, long long len) {
+    if (m->count == m->capacity) {
+        int capacity = m->capacity ? m->capacity * 2 : 64;
+        struct cas_ref *refs = realloc(m->refs, capacity * sizeof(*refs));
+        if (!refs) return -1;
+        m->refs = refs;
+        m->capacity = capacity;
+    }
+    snprintf(m->refs[m->count].hash, sizeof(m->refs[0].hash), "%s", hex);
+    m->refs[m->count++].len = len;
+    return 0;
+}
+
+// Read the manifest an open file holds, if it is one
+// Returns 0 (manifest read into m), 1 if it is a plain file, -1 if the manifest is damaged
+static inline int cas_manifest_load(int fd, struct cas_manifest *m) {
+    char value[32];
+    memset(m, 0, sizeof(*m));
+    ssize_t n = fgetxattr(fd, CAS_MANIFEST_XATTR, value, sizeof(value) - 1);
+    if (n <= 0) return 1;
+    value[n] = '\0';
+    long long text_len = atoll(value);
+    char *text = text_len > 0 && text_len < (64LL << 20) ? malloc(text_len + 1) : NULL;
+    if (!text || pread(fd, text, text_len, 0) != text_len) {
+        free(text);
+        return -1;
+    }
+    text[text_len] = '\0';
+
+    // Header, then one "<sha256> <length>" line per chunk
+    int count = -1, used = 0;
+    unsigned int crc = 0;
+    long long total = 0;
+    char *p = text + strlen(CAS_MANIFEST_MAGIC);
+    if (strncmp(text, CAS_MANIFEST_MAGIC, strlen(CAS_MANIFEST_MAGIC)) != 0 ||
+        sscanf(p, "size %lld crc32c %8x chunks %d\n%n", &m->size, &crc, &count, &used) != 3)
+        count = -1;
+    m->crc = crc;
+    for (p += used; count >= 0 && m->count < count;) {
+        char hex[65];
+        long long len;
+        if (sscanf(p, "%64[0-9a-f] %lld\n%n", hex, &len, &used) != 2 || len <= 0 ||
+            cas_manifest_add(m, hex, len) < 0)
+            break;
+        total += len;
+        p += used;
+    }
+    free(text);
+    if (count < 0 || m->count != count || total != m->size) {
+        cas_manifest_free(m);
+        return -1;
+    }
+    return 0;
+}
+
+// Give back the references a manifest holds (after it is gone; cas.lock held)
+static inline void cas_release_locked(const struct cas_manifest *m) {
+    char path[1200];
+    for (int i = 0; i < m->count; i++) {
+        cas_chunk_path(m->refs[i].hash, path, sizeof(path));
+        long long refs = cas_refs(path, -1);
+        if (refs >= 0) cas_set_refs(path, refs - 1);
+    }
+}
+
+// Give back the references a manifest holds (after it is gone)
+static inline void cas_release(const struct cas_manifest *m) {
+    pthread_mutex_lock(&cas.lock);
+    cas_release_locked(m);
+    pthread_mutex_unlock(&cas.lock);
+}
+
+// Write manifest m as the file at path: its text, then a hole up to the
+// content size, then the xattrs (the checksum one last, once the mtime is final)
+// Returns 0, or -1 on error (nothing is left at path)
+static inline int cas_manifest_write(const char *path, const struct cas_manifest *m) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    fprintf(f, "%ssize %lld crc32c %08x chunks %d\n", CAS_MANIFEST_MAGIC, m->size, m->crc, m->count);
+    for (int i = 0; i < m->count; i++) fprintf(f, "%s %lld\n", m->refs[i].hash, m->refs[i].len);
+    long long text_len = ftello(f);
+    char value[32];
+    snprintf(value, sizeof(value), "%lld", text_len);
+    int ok = fflush(f) == 0 && text_len <= m->size && ftruncate(fileno(f), m->size) == 0 &&
+             fsetxattr(fileno(f), CAS_MANIFEST_XATTR, value, strlen(value), 0) == 0 &&
+             (!fsync_enabled() || fsync(fileno(f)) == 0);
+    if (fclose(f) != 0) ok = 0;
+    if (ok) checksum_store(path, m->crc);
+    if (!ok) remove(path);
+    return ok ? 0 : -1;
+}
+
+// Replacing or removing a stored file and giving back its chunks happen as
+// one step under cas.lock, so two uploads (or removes) of the same path can't
+// both release the manifest they found there. The manifest released is read
+// through an fd opened before the rename or remove: the file actually replaced.
+
+// rename() a finished file over `to`, then give back the chunks of the
+// manifest it replaced (if it replaced one)
+static inline int cas_rename(const char *from, const char *to) {
+    struct cas_manifest old;
+    pthread_mutex_lock(&cas.lock);
+    int fd = open(to, O_RDONLY);
+    int rc = rename(from, to);
+    if (rc == 0 && fd >= 0 && cas_manifest_load(fd, &old) == 0) {
+        cas_release_locked(&old);
+        cas_manifest_free(&old);
+    }
+    pthread_mutex_unlock(&cas.lock);
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+// remove() a stored file, giving back its chunks if it is a manifest
+static inline int cas_remove(const char *path) {
+    struct cas_manifest m;
+    pthread_mutex_lock(&cas.lock);
+    int fd = open(path, O_RDONLY);
+    int rc = remove(path);
+    if (rc == 0 && fd >= 0 && cas_manifest_load(fd, &m) == 0) {
+        cas_release_locked(&m);
+        cas_manifest_free(&m);
+    }
+    pthread_mutex_unlock(&cas.lock);
+    if (fd >= 0) close(fd);
+    return rc;
+}
+
+/* ---------- Reading ---------- */
+
+// Send `length` bytes of a manifest's content from `offset` (the body of a
+// frame the caller has announced), chunk by chunk with send_file_body()
+// Returns 0, or -1 on socket error or a missing chunk (the frame can't be completed)
+static inline int cas_send_body(int sock, const struct cas_manifest *m, long long offset, long long length) {
+    long long at = 0;
+    char path[1200];
+    for (int i = 0; i < m->count && length > 0; at += m->refs[i++].len) {
+        if (offset >= at + m->refs[i].len) continue;
+        long long skip = offset - at, n = m->refs[i].len - skip < length ? m->refs[i].len - skip : length;
+        cas_chunk_path(m->refs[i].hash, path, sizeof(path));
+        FILE *chunk = fopen(path, "rb");
+        if (!chunk) {
+            fprintf(stderr, "Chunk store: missing chunk %s\n", m->refs[i].hash);
+            return -1;
+        }
+        int rc = fseeko(chunk, skip, SEEK_SET) == 0 ? send_file_body(sock, chunk, n, NULL) : -1;
+        fclose(chunk);
+        if (rc < 0) return -1;
+        offset += n;
+        length -= n;
+    }
+    return length > 0 ? -1 : 0;
+}
+
+// send_file_range() for a manifest: `length` bytes from `offset` as one
+// OP_DATA frame, then OP_END carrying end_text
+// Returns number of bytes sent, or -1 on error (the connection is then unusable)
+static inline long long cas_send_range(int sock, uint32_t request_id, const struct cas_manifest *m, long long offset,
+                                       long long length, const char *end_text) {
+    if (length > 0) {
+        if (send_frame_header(sock, OP_DATA, 0, request_id, length) < 0) return -1;
+        if (cas_send_body(sock, m, offset, length) < 0) return -1;
+    }
+    if (send_frame(sock, OP_END, 0, request_id, end_text, end_text ? strlen(end_text) : 0) < 0) return -1;
+    return length;
+}
+
+/* ---------- Writing ---------- */
+
+/* An upload on its way into the store (or into a plain file when the store is off) */
+struct cas_writer {
+    char path[1024];       // Where the file will appear
+    int plain;             // Store off: bytes go straight to path
+    int deflated;          // Store off and the file is stored compressed: bytes go through z (compress.h)
+    struct compress_writer z;
+    struct cas_chunker chunker;
+    unsigned char *buf;    // The current chunk (cas.max bytes)
+    long long total;       // Bytes written
+    long long fresh;       // Bytes that went into new chunks
+    int failed;            // A chunk could not be stored
+    struct cas_manifest m; // Chunks stored so far (each holds a reference)
+};
+
+// Store the chunk in w->buf
+static inline void cas_writer_cut(struct cas_writer *w) {
+    char hex[65];
+    long long len = w->chunker.len;
+    cas_chunker_name(&w->chunker, hex);
+    int rc = w->failed ? -1 : cas_chunk_put(hex, w->buf, len);
+    if (rc >= 0 && cas_manifest_add(&w->m, hex, len) < 0) {
+        // Out of memory: hand the stray reference back
+        struct cas_ref stray = { .len = len };
+        struct cas_manifest one = { .count = 1, .refs = &stray };
+        snprintf(stray.hash, sizeof(stray.hash), "%s", hex);
+        cas_release(&one);
+        rc = -1;
+    }
+    if (rc < 0) w->failed = 1;
+    if (rc == 1) w->fresh += len;
+}
+
+// Add bytes to the upload, storing each chunk as it completes
+static inline void cas_writer_write(struct cas_writer *w, const void *data, size_t n) {
+    const unsigned char *p = data;
+    w->total += n;
+    while (n > 0) {
+        int boundary;
+        long long at = w->chunker.len;
+        size_t used = cas_chunker_scan(&w->chunker, p, n, &boundary);
+        memcpy(w->buf + at, p, used);
+        if (boundary) cas_writer_cut(w);
+        p += used;
+        n -= used;
+    }
+}
+
+// fopencookie() write hook: the FILE* recv_stream_checked() writes to
+static inline ssize_t cas_cookie_write(void *cookie, const char *data, size_t n) {
+    cas_writer_write(cookie, data, n);
+    return n;
+}
+
+// Open the destination of an upload to path
+// With the store on, the returned stream chunks what is written to it into
+// the store and nothing appears at path until cas_close(). Otherwise it
+// deflates into a temporary file if the file is stored compressed
+// (compress.h), or else it is path itself (whatever manifest was there gives
+// its chunks back first, as the old contents are gone once it is truncated).
+// Returns the stream, or NULL (errno set)
+static inline FILE *cas_create(struct cas_writer *w, const char *path) {
+    memset(w, 0, sizeof(*w));
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    if (cas.mode == CAS_OFF) {
+        w->plain = 1;
+        if (compress_rest_wanted(path) && compress_writer_open(&w->z, path) == 0) {
+            static const cookie_io_functions_t deflate_io = { .write = compress_cookie_write };
+            FILE *f = fopencookie(&w->z, "w", deflate_io);
+            if (!f) compress_writer_abort(&w->z);
+            else setvbuf(f, NULL, _IOFBF, COMPRESS_READ);
+            w->deflated = f != NULL;
+            return f;
+        }
+        // The manifest is read before truncating and released only if the
+        // file truncated is the one it was read from (see cas_rename)
+        struct cas_manifest old;
+        pthread_mutex_lock(&cas.lock);
+        int fd = open(path, O_RDONLY);
+        int had = fd >= 0 && cas_manifest_load(fd, &old) == 0;
+        FILE *f = fopen(path, "wb");
+        if (f) fremovexattr(fileno(f), COMPRESS_REST_XATTR);  // Contents about to be plain
+        struct stat was, now;
+        if (f && had && fstat(fd, &was) == 0 && fstat(fileno(f), &now) == 0 &&
+            was.st_dev == now.st_dev && was.st_ino == now.st_ino) {
+            fremovexattr(fileno(f), CAS_MANIFEST_XATTR);
+            cas_release_locked(&old);
+        }
+        pthread_mutex_unlock(&cas.lock);
+        if (had) cas_manifest_free(&old);
+        if (fd >= 0) close(fd);
+        return f;
+    }
+    w->buf = malloc(cas.max);
+    if (!w->buf) return NULL;
+    cas_chunker_reset(&w->chunker);
+    static const cookie_io_functions_t io = { .write = cas_cookie_write };
+    FILE *f = fopencookie(w, "w", io);
+    if (!f) free(w->buf);
+    else setvbuf(f, NULL, _IOFBF, 256 * 1024);
+    return f;
+}
+
+// Give back everything an unfinished upload stored
+static inline void cas_abort(struct cas_writer *w) {
+    cas_release(&w->m);
+    cas_manifest_free(&w->m);
+    free(w->buf);
+    w->buf = NULL;
+}
+
+// Make the upload appear at w->path: a manifest, or a plain file if it is
+// smaller than CAS_MIN_FILE; either is written as an incoming- file in the
+// store (same filesystem) and renamed into place
+// Returns 0, or -1 if it could not be stored (everything is given back)
+static inline int cas_commit(struct cas_writer *w, uint32_t crc) {
+    char temp[1100];
+    int rc = -1;
+    snprintf(temp, sizeof(temp), "%s/incoming-XXXXXX", cas.dir);
+    int fd = w->failed ? -1 : mkstemp(temp);
+    if (fd >= 0) {
+        close(fd);
+        if (w->m.count == 0 && w->total < CAS_MIN_FILE) {
+            // Small file: not worth a manifest
+            FILE *f = fopen(temp, "wb");
+            rc = f && fwrite(w->buf, 1, w->total, f) == (size_t)w->total &&
+                         fflush(f) == 0 && (!fsync_enabled() || fsync(fileno(f)) == 0) ? 0 : -1;
+            if (f) fclose(f);
+            chmod(temp, 0644);
+            if (rc == 0) checksum_store(temp, crc);
+            cas_chunker_reset(&w->chunker);
+        } else {
+            if (w->chunker.len > 0) cas_writer_cut(w);  // The tail
+            w->m.size = w->total;
+            w->m.crc = crc;
+            rc = w->failed ? -1 : cas_manifest_write(temp, &w->m);
+            chmod(temp, 0644);
+        }
+        if (rc == 0 && cas_rename(temp, w->path) < 0) rc = -1;
+        if (rc < 0) remove(temp);
+    }
+    if (rc < 0) {
+        cas_abort(w);
+        return -1;
+    }
+    cas_manifest_free(&w->m);
+    free(w->buf);
+    w->buf = NULL;
+    return 0;
+}
+
+// Close an upload opened with cas_create(): keep it if the stream was
+// complete and its bytes match the checksum named in end_text, else drop it
+// crc is the CRC32C of the bytes received.
+// Returns 0 if stored, -1 if incomplete or not storable, -2 on a checksum mismatch
+static inline int cas_close(struct cas_writer *w, FILE *f, int complete, uint32_t crc, const char *end_text) {
+    fclose(f);
+    uint32_t expected;
+    if (w->deflated) {
+        // Renamed into place once complete and intact (the old file stays until then)
+        int mismatch = complete && checksum_parse(end_text, &expected) && expected != crc;
+        if (mismatch) fprintf(stderr, "Checksum mismatch for %s: sent %08x, received %08x\n", w->path, expected, crc);
+        if (!complete || mismatch) {
+            compress_writer_abort(&w->z);
+            return mismatch ? -2 : -1;
+        }
+        if (compress_writer_finish(&w->z, crc) < 0) return -1;
+        if (cas_rename(w->z.temp, w->path) < 0) {
+            remove(w->z.temp);
+            return -1;
+        }
+        return 0;
+    }
+    if (w->plain) {
+        if (!complete) {
+            remove(w->path);
+            return -1;
+        }
+        return checksum_accept(w->path, crc, end_text) < 0 ? -2 : 0;
+    }
+    if (complete && checksum_parse(end_text, &expected) && expected != crc) {
+        fprintf(stderr, "Checksum mismatch for %s: sent %08x, received %08x\n", w->path, expected, crc);
+        cas_abort(w);
+        return -2;
+    }
+    if (!complete) {
+        cas_abort(w);
+        return -1;
+    }
+    return cas_commit(w, crc);
+}
+
+// Store the first `size` bytes of an open file at path through the store
+// (an assembled chunked upload); crc is their CRC32C
+// Returns 0, or -1 if it could not be stored
+static inline int cas_ingest(int fd, long long size, uint32_t crc, const char *path, long long *fresh) {
+    struct cas_writer w;
+    memset(&w, 0, sizeof(w));
+    snprintf(w.path, sizeof(w.path), "%s", path);
+    w.buf = malloc(cas.max);
+    char *block = malloc(CAS_READ_SIZE);
+    if (!w.buf || !block) {
+        free(w.buf);
+        free(block);
+        return -1;
+    }
+    cas_chunker_reset(&w.chunker);
+    for (long long at = 0; at < size && !w.failed;) {
+        ssize_t n = pread(fd, block, size - at < CAS_READ_SIZE ? size - at : CAS_READ_SIZE, at);
+        if (n <= 0) w.failed = 1;
+        else cas_writer_write(&w, block, n);
+        at += n > 0 ? n : 0;
+    }
+    free(block);
+    if (fresh) *fresh = w.fresh;
+    return cas_commit(&w, crc);
+}
+
+#endif
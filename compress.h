@@ -0,0 +1,675 @@
+// compress.h - Deflate compression on the wire and at rest //
+//
+// Text (.txt, .c, logs) shrinks several times under deflate, so moving and
+// storing it compressed multiplies what the network and the disks carry.
+// zlib does the work (DFS_COMPRESS_LEVEL picks its level, 1-9, default 1:
+// the fastest, which keeps up with a fast network).
+//
+// On the wire (FRAME_DEFLATE, see protocol.h):
+//   - w25clients sets FRAME_DEFLATE on its downlf requests, S1 passes it on
+//     to the sub-server, and whoever holds the file deflates the reply if the
+//     file's type is listed in DFS_COMPRESS_TYPES (default ".txt .c");
+//   - w25clients deflates the uploads (uploadf and uploadchunk streams) of
+//     those types; S1 relays the frames untouched and the server storing the
+//     file inflates them.
+// Every receiver inflates deflated frames, so only what a reply may carry is
+// negotiated. DFS_COMPRESS=off stops a process deflating anything and asking
+// for deflated replies. Checksums and sizes are always of the plain bytes.
+//
+// At rest (DFS_COMPRESS_AT_REST=1 on a server): uploads of those types are
+// stored as their zlib stream followed by a hole up to the size of the
+// contents, with COMPRESS_REST_XATTR holding the stream's length. stat(),
+// listings and size filters still see the real size while the disk only holds
+// the compressed bytes (manifests in chunkstore.h use the same trick). A
+// whole-file download by a client that takes deflate gets the stored stream
+// as is, through sendfile(); anyone else, byte ranges and downltar get the
+// contents inflated. Files that don't shrink are stored plain, and with the
+// chunk store on, uploads go into the store instead.
+//
+// Archives (downltar <type> gz): the tar stream is gzipped by a pool of
+// DFS_COMPRESS_THREADS threads, each deflating GZIP_BLOCK pieces into gzip
+// members of their own, so exporting text runs at several cores' pace.
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <zlib.h>
+
+#include "protocol.h"
+
+#define COMPRESS_REST_XATTR "user.dfs.deflate"  // On a file stored compressed: length of its zlib stream
+#define COMPRESS_DEFAULT_TYPES ".txt .c"       // DFS_COMPRESS_TYPES default
+#define COMPRESS_DEFAULT_LEVEL 1               // DFS_COMPRESS_LEVEL default
+#define COMPRESS_FRAME (64 * 1024)             // Deflated bytes per OP_DATA frame (and per write at rest)
+#define COMPRESS_READ (256 * 1024)             // Bytes read from a file per deflate()/inflate() call
+#define GZIP_BLOCK (1024 * 1024)               // Input bytes per gzip member of a parallel stream
+#define COMPRESS_MAX_THREADS 32                // Bound for DFS_COMPRESS_THREADS
+
+/* ---------- Settings ---------- */
+
+struct compress_settings {
+    int wire;         // Deflate replies and uploads, ask for deflated replies (DFS_COMPRESS)
+    int level;        // zlib level (DFS_COMPRESS_LEVEL)
+    int at_rest;      // Store uploads of compressible types compressed (DFS_COMPRESS_AT_REST=1)
+    char types[256];  // Extensions worth compressing, space or comma separated (DFS_COMPRESS_TYPES)
+    int threads;      // Threads deflating one gzip archive (DFS_COMPRESS_THREADS, default: CPUs up to 8)
+};
+
+static struct compress_settings compress_conf;
+static pthread_once_t compress_once = PTHREAD_ONCE_INIT;
+
+static inline void compress_load_settings(void) {
+    const char *v = getenv("DFS_COMPRESS");
+    compress_conf.wire = !(v && (strcmp(v, "off") == 0 || strcmp(v, "0") == 0));
+    v = getenv("DFS_COMPRESS_LEVEL");
+    compress_conf.level = v && atoi(v) >= 1 && atoi(v) <= 9 ? atoi(v) : COMPRESS_DEFAULT_LEVEL;
+    v = getenv("DFS_COMPRESS_AT_REST");
+    compress_conf.at_rest = v && strcmp(v, "1") == 0;
+    v = getenv("DFS_COMPRESS_TYPES");
+    snprintf(compress_conf.types, sizeof(compress_conf.types), "%s", v ? v : COMPRESS_DEFAULT_TYPES);
+    v = getenv("DFS_COMPRESS_THREADS");
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    compress_conf.threads = v && atoi(v) >= 1 ? atoi(v) : cpus > 8 ? 8 : cpus > 1 ? (int)cpus : 1;
+    if (compress_conf.threads > COMPRESS_MAX_THREADS) compress_conf.threads = COMPRESS_MAX_THREADS;
+}
+
+// The settings, read from the environment on first use
+static inline const struct compress_settings *compress_settings(void) {
+    pthread_once(&compress_once, compress_load_settings);
+    return &compress_conf;
+}
+
+// Whether files named like `name` are worth compressing (extension in DFS_COMPRESS_TYPES)
+static inline int compress_type_ok(const char *name) {
+    const char *ext = strrchr(name, '.');
+    if (!ext || strchr(ext, '/')) return 0;
+    size_t len = strlen(ext);
+    for (const char *p = compress_settings()->types; *p;) {
+        size_t n = strcspn(p, " ,");
+        if (n == len && strncasecmp(p, ext, n) == 0) return 1;
+        p += n;
+        p += strspn(p, " ,");
+    }
+    return 0;
+}
+
+// Flags for a request whose reply may come back deflated
+static inline uint16_t compress_accept_flag(void) {
+    return compress_settings()->wire ? FRAME_DEFLATE : 0;
+}
+
+// Whether to deflate the reply to a request with `flags` for the file at path
+static inline int compress_reply_wanted(uint16_t flags, const char *path) {
+    return (flags & FRAME_DEFLATE) && compress_settings()->wire && compress_type_ok(path);
+}
+
+// Whether to deflate an upload of the file named `name`
+static inline int compress_upload_wanted(const char *name) {
+    return compress_settings()->wire && compress_type_ok(name);
+}
+
+// Whether an upload to path is stored compressed
+static inline int compress_rest_wanted(const char *path) {
+    return compress_settings()->at_rest && compress_type_ok(path);
+}
+
+/* ---------- Sending ---------- */
+
+/* Deflates the body of a response into FRAME_DEFLATE OP_DATA frames */
+struct compress_out {
+    int sock;
+    uint32_t request_id;
+    z_stream z;
+    unsigned char *buf;  // COMPRESS_FRAME bytes: the next frame's payload
+    size_t used;         // Bytes of it filled
+};
+
+static inline int compress_out_init(struct compress_out *c, int sock, uint32_t request_id) {
+    memset(c, 0, sizeof(*c));
+    c->sock = sock;
+    c->request_id = request_id;
+    c->buf = malloc(COMPRESS_FRAME);
+    if (c->buf && deflateInit(&c->z, compress_settings()->level) == Z_OK) return 0;
+    free(c->buf);
+    c->buf = NULL;
+    return -1;
+}
+
+// Run deflate() over the pending input (flush: Z_NO_FLUSH or Z_FINISH),
+// sending each frame as it fills (and the last one on Z_FINISH)
+static inline int compress_out_run(struct compress_out *c, int flush) {
+    while (1) {
+        c->z.next_out = c->buf + c->used;
+        c->z.avail_out = COMPRESS_FRAME - c->used;
+        int rc = deflate(&c->z, flush);
+        if (rc == Z_STREAM_ERROR) return -1;
+        c->used = COMPRESS_FRAME - c->z.avail_out;
+        int done = flush == Z_FINISH ? rc == Z_STREAM_END : c->z.avail_out > 0;
+        if (c->used == COMPRESS_FRAME || (done && flush == Z_FINISH && c->used > 0)) {
+            if (send_frame(c->sock, OP_DATA, FRAME_DEFLATE, c->request_id, c->buf, c->used) < 0) return -1;
+            c->used = 0;
+        }
+        if (done) return 0;
+    }
+}
+
+static inline int compress_out_write(struct compress_out *c, const void *data, size_t n) {
+    c->z.next_in = (unsigned char *)data;
+    c->z.avail_in = n;
+    return compress_out_run(c, Z_NO_FLUSH);
+}
+
+static inline int compress_out_finish(struct compress_out *c) {
+    return compress_out_run(c, Z_FINISH);
+}
+
+static inline void compress_out_end(struct compress_out *c) {
+    if (c->buf) deflateEnd(&c->z);
+    free(c->buf);
+    c->buf = NULL;
+}
+
+// Send `length` bytes of fd from `offset` as one deflated stream of
+// FRAME_DEFLATE OP_DATA frames (no OP_END); crc (may be NULL) is continued
+// over the plain bytes
+// Returns 0, or -1 on a read or socket error
+static inline int compress_send_fd(int sock, uint32_t request_id, int fd, long long offset, long long length,
+                                   uint32_t *crc) {
+    struct compress_out c;
+    char *block = malloc(COMPRESS_READ);
+    int rc = block && compress_out_init(&c, sock, request_id) == 0 ? 0 : -1;
+    if (rc < 0) {
+        free(block);
+        return -1;
+    }
+    while (rc == 0 && length > 0) {
+        ssize_t n = pread(fd, block, length < COMPRESS_READ ? length : COMPRESS_READ, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            rc = -1;  // Shrank underneath us
+            break;
+        }
+        if (crc) *crc = crc32c(*crc, block, n);
+        rc = compress_out_write(&c, block, n);
+        offset += n;
+        length -= n;
+    }
+    if (rc == 0) rc = compress_out_finish(&c);
+    compress_out_end(&c);
+    free(block);
+    return rc;
+}
+
+// send_file_range() with the bytes deflated
+// Returns number of bytes of the file sent, or -1 on error
+static inline long long compress_send_range(int sock, uint32_t request_id, FILE *file, long long offset,
+                                            long long length, const char *end_text) {
+    if (length > 0 && compress_send_fd(sock, request_id, fileno(file), offset, length, NULL) < 0) return -1;
+    if (send_frame(sock, OP_END, 0, request_id, end_text, end_text ? strlen(end_text) : 0) < 0) return -1;
+    return length;
+}
+
+// send_file_stream() with the bytes deflated (the CRC32C in OP_END is taken
+// while they are read)
+// Returns number of bytes of the file sent, or -1 on error
+static inline long long compress_send_stream(int sock, uint32_t request_id, FILE *file) {
+    struct stat st;
+    uint32_t crc = 0;
+    char end_text[32] = "";
+    if (fstat(fileno(file), &st) < 0) return -1;
+    if (st.st_size > 0 && compress_send_fd(sock, request_id, fileno(file), 0, st.st_size, &crc) < 0) return -1;
+    checksum_format(end_text, sizeof(end_text), crc);
+    if (send_frame(sock, OP_END, 0, request_id, end_text, strlen(end_text)) < 0) return -1;
+    return (long long)st.st_size;
+}
+
+/* ---------- Reading files stored compressed ---------- */
+
+// Length of the zlib stream a file stored compressed holds
+// Returns it, or -1 if the file is stored plain
+static inline long long compress_rest_len(int fd) {
+    char value[32];
+    ssize_t n = fgetxattr(fd, COMPRESS_REST_XATTR, value, sizeof(value) - 1);
+    if (n <= 0) return -1;
+    value[n] = '\0';
+    return atoll(value) > 0 ? atoll(value) : -1;
+}
+
+/* Passes on one window of an inflated stream */
+struct compress_window {
+    long long skip;    // Bytes still to drop before the window
+    long long length;  // Bytes of the window still to pass on
+    int (*put)(void *, const unsigned char *, size_t);
+    void *arg;
+};
+
+static inline int compress_window_put(void *arg, const unsigned char *p, size_t n) {
+    struct compress_window *w = arg;
+    if (w->skip >= (long long)n) {
+        w->skip -= n;
+        return 0;
+    }
+    p += w->skip;
+    n -= w->skip;
+    w->skip = 0;
+    if ((long long)n > w->length) n = w->length;
+    w->length -= n;
+    return n > 0 ? w->put(w->arg, p, n) : 0;
+}
+
+// Inflate the zlib stream of a file stored compressed, handing bytes
+// [offset, offset + length) of its contents to put(arg, bytes, len)
+// Returns 0, or -1 if the stream is damaged or ends early, or put failed
+static inline int compress_rest_read(int fd, long long zlen, long long offset, long long length,
+                                     int (*put)(void *, const unsigned char *, size_t), void *arg) {
+    struct frame_inflate f = { .started = 0 };
+    struct compress_window window = { offset, length, put, arg };
+    unsigned char *block = malloc(COMPRESS_READ);
+    int rc = block ? 0 : -1;
+    for (long long at = 0; rc == 0 && at < zlen && window.length > 0;) {
+        ssize_t n = pread(fd, block, zlen - at < COMPRESS_READ ? zlen - at : COMPRESS_READ, at);
+        if (n < 0 && errno == EINTR) continue;
+        rc = n > 0 ? frame_inflate(&f, block, n, compress_window_put, &window) : -1;
+        at += n;
+    }
+    frame_inflate_end(&f);
+    free(block);
+    return rc == 0 && window.length == 0 ? 0 : -1;
+}
+
+static inline int compress_sock_put(void *arg, const unsigned char *p, size_t n) {
+    return send_all(*(int *)arg, p, n);
+}
+
+static inline int compress_crc_put(void *arg, const unsigned char *p, size_t n) {
+    *(uint32_t *)arg = crc32c(*(uint32_t *)arg, p, n);
+    return 0;
+}
+
+// The CRC32C of a file stored compressed: the one kept with it, or else
+// computed over its inflated contents
+// Returns 0, or -1 if it couldn't be read
+static inline int compress_rest_checksum(int fd, long long zlen, long long size, uint32_t *crc) {
+    if (checksum_load(fd, crc) == 0) return 0;
+    *crc = 0;
+    return compress_rest_read(fd, zlen, 0, size, compress_crc_put, crc);
+}
+
+// send_file_range() for a file stored compressed: when the whole file goes to
+// a receiver that takes deflate (`deflate`), the stored stream as one
+// FRAME_DEFLATE frame straight from the page cache; otherwise the requested
+// bytes inflated, as one OP_DATA frame. Then OP_END carrying end_text.
+// Returns number of bytes of the contents sent, or -1 on error (the
+// connection is then unusable)
+static inline long long compress_rest_send(int sock, uint32_t request_id, FILE *file, long long zlen, long long size,
+                                           long long offset, long long length, int deflate, const char *end_text) {
+    int fd = fileno(file);
+    if (deflate && offset == 0 && length == size && size > 0) {
+        if (fseeko(file, 0, SEEK_SET) < 0 || send_frame_header(sock, OP_DATA, FRAME_DEFLATE, request_id, zlen) < 0 ||
+            send_file_body(sock, file, zlen, NULL) < 0)
+            return -1;
+    } else if (length > 0) {
+        if (send_frame_header(sock, OP_DATA, 0, request_id, length) < 0 ||
+            compress_rest_read(fd, zlen, offset, length, compress_sock_put, &sock) < 0)
+            return -1;
+    }
+    if (send_frame(sock, OP_END, 0, request_id, end_text, end_text ? strlen(end_text) : 0) < 0) return -1;
+    return length;
+}
+
+/* ---------- Storing files compressed ---------- */
+
+/* An upload being deflated into a temporary file beside its destination */
+struct compress_writer {
+    char temp[1100];     // <dir>/.<name>.deflate-XXXXXX
+    int fd;
+    z_stream z;
+    unsigned char *buf;  // COMPRESS_FRAME bytes of deflate output
+    long long total;     // Bytes of contents written
+    long long zlen;      // Bytes of zlib stream written (0 once stored plain)
+    int failed;          // A write failed
+};
+
+// Start deflating an upload to path
+// Returns 0, or -1 (nothing is left behind)
+static inline int compress_writer_open(struct compress_writer *w, const char *path) {
+    memset(w, 0, sizeof(*w));
+    const char *slash = strrchr(path, '/');
+    int dir_len = slash ? (int)(slash - path + 1) : 0;
+    snprintf(w->temp, sizeof(w->temp), "%.*s.%s.deflate-XXXXXX", dir_len, path, path + dir_len);
+    w->buf = malloc(COMPRESS_FRAME);
+    w->fd = w->buf ? mkstemp(w->temp) : -1;
+    if (w->fd >= 0 && deflateInit(&w->z, compress_settings()->level) == Z_OK) return 0;
+    if (w->fd >= 0) {
+        close(w->fd);
+        remove(w->temp);
+    }
+    free(w->buf);
+    w->buf = NULL;
+    return -1;
+}
+
+// Run deflate() over the pending input (flush: Z_NO_FLUSH or Z_FINISH) into the file
+static inline void compress_writer_run(struct compress_writer *w, int flush) {
+    int rc;
+    do {
+        w->z.next_out = w->buf;
+        w->z.avail_out = COMPRESS_FRAME;
+        rc = deflate(&w->z, flush);
+        size_t n = COMPRESS_FRAME - w->z.avail_out;
+        for (size_t off = 0; off < n && !w->failed;) {
+            ssize_t k = write(w->fd, w->buf + off, n - off);
+            if (k < 0 && errno == EINTR) continue;
+            if (k <= 0) w->failed = 1;
+            else off += k;
+        }
+        w->zlen += n;
+    } while (rc != Z_STREAM_ERROR && (flush == Z_FINISH ? rc != Z_STREAM_END : w->z.avail_out == 0));
+    if (rc == Z_STREAM_ERROR) w->failed = 1;
+}
+
+static inline void compress_writer_write(struct compress_writer *w, const void *data, size_t n) {
+    w->z.next_in = (unsigned char *)data;
+    w->z.avail_in = n;
+    w->total += n;
+    compress_writer_run(w, Z_NO_FLUSH);
+}
+
+// fopencookie() write hook: the FILE* recv_stream_checked() writes to
+static inline ssize_t compress_cookie_write(void *cookie, const char *data, size_t n) {
+    compress_writer_write(cookie, data, n);
+    return n;
+}
+
+// Drop an unfinished upload
+static inline void compress_writer_abort(struct compress_writer *w) {
+    if (w->buf) deflateEnd(&w->z);
+    free(w->buf);
+    w->buf = NULL;
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+    remove(w->temp);
+}
+
+// Replace the temporary file's stream with the contents inflated (a file
+// that didn't shrink, or a filesystem without user xattrs)
+static inline int compress_writer_unpack(struct compress_writer *w) {
+    char plain[sizeof(w->temp)];
+    snprintf(plain, sizeof(plain), "%s", w->temp);
+    memcpy(plain + strlen(plain) - 6, "XXXXXX", 6);
+    int fd = mkstemp(plain);
+    struct stream_at at = { fd, 0, NULL, 0 };  // pwrite() sink from protocol.h
+    int ok = fd >= 0 && compress_rest_read(w->fd, w->zlen, 0, w->total, stream_at_put, &at) == 0;
+    close(w->fd);
+    remove(w->temp);
+    w->fd = -1;
+    if (!ok) {
+        if (fd >= 0) close(fd);
+        remove(plain);
+        return -1;
+    }
+    w->fd = fd;
+    snprintf(w->temp, sizeof(w->temp), "%s", plain);
+    w->zlen = 0;
+    return 0;
+}
+
+// Finish the upload as the stored form of its contents, in w->temp: the
+// stream, a hole up to the size of the contents and COMPRESS_REST_XATTR (or
+// the contents plain if deflate didn't make them smaller), then the checksum
+// xattr once the mtime is final. The caller renames w->temp into place.
+// Returns 0, or -1 if it could not be written (nothing is left behind)
+static inline int compress_writer_finish(struct compress_writer *w, uint32_t crc) {
+    char value[32];
+    compress_writer_run(w, Z_FINISH);
+    deflateEnd(&w->z);
+    free(w->buf);
+    w->buf = NULL;
+    snprintf(value, sizeof(value), "%lld", w->zlen);
+    int ok = !w->failed;
+    if (ok && (w->zlen >= w->total || ftruncate(w->fd, w->total) < 0 ||
+               fsetxattr(w->fd, COMPRESS_REST_XATTR, value, strlen(value), 0) < 0))
+        ok = compress_writer_unpack(w) == 0;
+    ok = ok && fchmod(w->fd, 0644) == 0 && (!fsync_enabled() || fsync(w->fd) == 0);
+    if (w->fd >= 0) close(w->fd);
+    w->fd = -1;
+    if (ok) checksum_store(w->temp, crc);
+    else remove(w->temp);
+    return ok ? 0 : -1;
+}
+
+// Deflate the first `size` bytes of an open file (an assembled chunked
+// upload) for path; crc is their CRC32C. The caller renames w->temp into place.
+// Returns 0, or -1 if it could not be written
+static inline int compress_ingest(struct compress_writer *w, int fd, long long size, uint32_t crc, const char *path) {
+    if (compress_writer_open(w, path) < 0) return -1;
+    char *block = malloc(COMPRESS_READ);
+    if (!block) w->failed = 1;
+    for (long long at = 0; at < size && !w->failed;) {
+        ssize_t n = pread(fd, block, size - at < COMPRESS_READ ? size - at : COMPRESS_READ, at);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) w->failed = 1;
+        else compress_writer_write(w, block, n);
+        at += n;
+    }
+    free(block);
+    return compress_writer_finish(w, crc);
+}
+
+/* ---------- Parallel gzip streams (downltar archives) ---------- */
+
+enum { GZIP_FREE, GZIP_QUEUED, GZIP_DONE };
+
+/* One block of a parallel gzip stream */
+struct gzip_slot {
+    unsigned char *in, *out;
+    size_t in_len, out_len;
+    int state;   // GZIP_FREE, GZIP_QUEUED (waiting for or being deflated) or GZIP_DONE
+    int failed;  // deflate() didn't finish the member
+};
+
+/* A gzip stream deflated by several threads, the way pigz does it: the input
+ * is cut into GZIP_BLOCK pieces, each becomes a gzip member of its own (a
+ * series of members is one valid .gz, which gunzip and tar -z read through)
+ * and the members go out in order, one OP_DATA frame each. The thread
+ * writing the stream fills blocks and sends finished members; the workers
+ * only deflate, so the socket is never shared. */
+struct gzip_par {
+    int sock;
+    uint32_t request_id;
+    int level;
+    int nslots;                 // Blocks in flight at most
+    struct gzip_slot *slots;    // Block n lives in slots[n % nslots]
+    size_t out_cap;
+    size_t used;                // Bytes of the block being filled
+    long long filled;           // Blocks handed to the workers
+    long long taken;            // Blocks a worker has picked up
+    long long sent;             // Members sent
+    long long bytes_out;        // Compressed bytes sent
+    int nthreads;               // 0: the writer deflates each block itself
+    pthread_t threads[COMPRESS_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t work;        // A block was queued (or quit)
+    pthread_cond_t done;        // A block was deflated
+    int quit;
+};
+
+// Deflate one block into a complete gzip member
+static inline void gzip_block(struct gzip_slot *s, int level, size_t out_cap) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    s->failed = 1;
+    s->out_len = 0;
+    if (deflateInit2(&z, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return;  // 15 + 16: gzip wrapper
+    z.next_in = s->in;
+    z.avail_in = s->in_len;
+    z.next_out = s->out;
+    z.avail_out = out_cap;
+    s->failed = deflate(&z, Z_FINISH) != Z_STREAM_END;
+    s->out_len = out_cap - z.avail_out;
+    deflateEnd(&z);
+}
+
+static inline void *gzip_worker(void *arg) {
+    struct gzip_par *g = arg;
+    pthread_mutex_lock(&g->lock);
+    while (1) {
+        while (!g->quit && g->taken == g->filled) pthread_cond_wait(&g->work, &g->lock);
+        if (g->taken == g->filled) break;  // Quit with nothing left
+        struct gzip_slot *s = &g->slots[g->taken++ % g->nslots];
+        pthread_mutex_unlock(&g->lock);
+        gzip_block(s, g->level, g->out_cap);
+        pthread_mutex_lock(&g->lock);
+        s->state = GZIP_DONE;
+        pthread_cond_broadcast(&g->done);
+    }
+    pthread_mutex_unlock(&g->lock);
+    return NULL;
+}
+
+static inline void gzip_par_end(struct gzip_par *g);
+
+// Start a parallel gzip stream of OP_DATA frames to sock, deflated by up
+// to `threads` threads (1: all in the calling thread)
+// Returns 0, or -1 if out of memory
+static inline int gzip_par_init(struct gzip_par *g, int sock, uint32_t request_id, int threads) {
+    memset(g, 0, sizeof(*g));
+    g->sock = sock;
+    g->request_id = request_id;
+    g->level = compress_settings()->level;
+    g->out_cap = compressBound(GZIP_BLOCK) + 32;  // Room for the gzip header and trailer
+    g->nslots = threads > 1 ? threads + 2 : 1;      // Workers stay busy while the writer sends
+    pthread_mutex_init(&g->lock, NULL);
+    pthread_cond_init(&g->work, NULL);
+    pthread_cond_init(&g->done, NULL);
+    if (!(g->slots = calloc(g->nslots, sizeof(*g->slots)))) goto fail;
+    for (int i = 0; i < g->nslots; i++)
+        if (!(g->slots[i].in = malloc(GZIP_BLOCK)) || !(g->slots[i].out = malloc(g->out_cap))) goto fail;
+    for (int i = 0; i < threads && threads > 1; i++, g->nthreads++)
+        if (pthread_create(&g->threads[i], NULL, gzip_worker, g) != 0) break;
+    return 0;
+fail:
+    gzip_par_end(g);
+    return -1;
+}
+
+// Send finished members in order until `upto` have been sent (waiting for
+// the workers as needed), then any others already finished
+// Returns 0, or -1 on socket error or a failed block
+static inline int gzip_par_drain(struct gzip_par *g, long long upto) {
+    pthread_mutex_lock(&g->lock);
+    while (g->sent < g->filled) {
+        struct gzip_slot *s = &g->slots[g->sent % g->nslots];
+        if (s->state != GZIP_DONE) {
+            if (g->sent >= upto) break;
+            pthread_cond_wait(&g->done, &g->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&g->lock);
+        int rc = s->failed ? -1 : send_frame(g->sock, OP_DATA, 0, g->request_id, s->out, s->out_len);
+        pthread_mutex_lock(&g->lock);
+        if (rc < 0) {
+            pthread_mutex_unlock(&g->lock);
+            return -1;
+        }
+        g->bytes_out += s->out_len;
+        s->state = GZIP_FREE;
+        g->sent++;
+    }
+    pthread_mutex_unlock(&g->lock);
+    return 0;
+}
+
+// Hand the block being filled to the workers (or deflate it here)
+static inline void gzip_par_submit(struct gzip_par *g) {
+    struct gzip_slot *s = &g->slots[g->filled % g->nslots];
+    s->in_len = g->used;
+    g->used = 0;
+    if (g->nthreads == 0) {
+        gzip_block(s, g->level, g->out_cap);
+        s->state = GZIP_DONE;
+        g->filled++;
+        return;
+    }
+    pthread_mutex_lock(&g->lock);
+    s->state = GZIP_QUEUED;
+    g->filled++;
+    pthread_cond_signal(&g->work);
+    pthread_mutex_unlock(&g->lock);
+}
+
+// Add n bytes to the stream
+// Returns 0, or -1 once the stream has failed
+static inline int gzip_par_write(struct gzip_par *g, const void *data, size_t n) {
+    const unsigned char *p = data;
+    while (n > 0) {
+        // A fresh block needs its slot's previous member sent
+        if (g->used == 0 && gzip_par_drain(g, g->filled - g->nslots + 1) < 0) return -1;
+        size_t take = GZIP_BLOCK - g->used < n ? GZIP_BLOCK - g->used : n;
+        memcpy(g->slots[g->filled % g->nslots].in + g->used, p, take);
+        g->used += take;
+        p += take;
+        n -= take;
+        if (g->used == GZIP_BLOCK) gzip_par_submit(g);
+    }
+    return 0;
+}
+
+// compress_rest_read()-style sink writing into a gzip_par
+static inline int gzip_par_put(void *arg, const unsigned char *p, size_t n) {
+    return gzip_par_write(arg, p, n);
+}
+
+// Add `length` bytes of fd from `offset` to the stream
+// Returns 0, or -1 on a read error (or if the file shrank) or once the stream has failed
+static inline int gzip_par_file(struct gzip_par *g, int fd, long long offset, long long length) {
+    while (length > 0) {
+        if (g->used == 0 && gzip_par_drain(g, g->filled - g->nslots + 1) < 0) return -1;
+        size_t room = GZIP_BLOCK - g->used;
+        size_t take = length < (long long)room ? (size_t)length : room;
+        ssize_t n = pread(fd, g->slots[g->filled % g->nslots].in + g->used, take, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        g->used += n;
+        offset += n;
+        length -= n;
+        if (g->used == GZIP_BLOCK) gzip_par_submit(g);
+    }
+    return 0;
+}
+
+// Deflate what's left and send every member (no OP_END)
+// Returns 0, or -1 on error
+static inline int gzip_par_finish(struct gzip_par *g) {
+    if (g->used > 0) gzip_par_submit(g);
+    return gzip_par_drain(g, g->filled);
+}
+
+// Stop the workers and free the stream (after gzip_par_finish, or to give up)
+static inline void gzip_par_end(struct gzip_par *g) {
+    pthread_mutex_lock(&g->lock);
+    g->quit = 1;
+    pthread_cond_broadcast(&g->work);
+    pthread_mutex_unlock(&g->lock);
+    for (int i = 0; i < g->nthreads; i++) pthread_join(g->threads[i], NULL);
+    for (int i = 0; g->slots && i < g->nslots; i++) {
+        free(g->slots[i].in);
+        free(g->slots[i].out);
+    }
+    free(g->slots);
+    g->slots = NULL;
+    g->nthreads = 0;
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->work);
+    pthread_cond_destroy(&g->done);
+}
+
+#endif
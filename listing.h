@@ -0,0 +1,354 @@
+// listing.h - Sorted directory listings shared by S1 and the sub-servers //
+//
+// Every server answers dispfnames with its names already sorted (plain byte
+// order, strcmp), so S1 can produce the combined listing with a streaming
+// k-way merge instead of collecting and sorting everything itself.
+//
+// listf is the paginated form. Its options are "key=value" words after the
+// directory, and the filters are applied by every server on its own files:
+//   type=.c,.pdf   extensions to include (S1 only; default: all four)
+//   prefix=abc     names starting with abc
+//   glob=*2024*    names matching an fnmatch() pattern
+//   cursor=name    resume after this name (the previous page's last name)
+//   limit=100      page size
+//   long           add "\t<size>\t<mtime>" columns to every line
+// A page that was cut short ends with an OP_END frame whose payload is
+// "next=<cursor>\n": pass that cursor back to get the following page.
+//
+// When the server's namespace index (nsindex.h) covers the directory, names
+// come from memory: a page is a binary search to the cursor/prefix plus a scan
+// of at most limit + 1 entries.
+#ifndef LISTING_H
+#define LISTING_H
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "nsindex.h"
+
+#define LIST_FRAME_BYTES (64 * 1024)  // Names coalesced per OP_DATA frame
+#define LIST_DEFAULT_LIMIT 100        // listf page size when none is given
+#define LIST_MAX_LIMIT 10000          // Largest page a client may ask for
+#define LIST_LINE_MAX (NAME_MAX + 64) // Name plus the optional size/mtime columns
+
+/* Parsed listf options (see the top of this file) */
+struct list_filter {
+    char types[64];                 // Comma-separated extensions, "" = all
+    char prefix[NAME_MAX + 1];
+    char glob[NAME_MAX + 1];
+    char cursor[NAME_MAX + 1];      // Only names sorting after this are listed
+    long limit;                     // Page size, 0 = unlimited
+    int long_format;                // Append size and mtime columns
+};
+
+// Parse listf option words into f; unknown words are ignored
+static inline void parse_list_filter(const char *opts, struct list_filter *f) {
+    memset(f, 0, sizeof(*f));
+    char word[NAME_MAX + 16];
+    int used;
+    while (opts && sscanf(opts, "%270s%n", word, &used) == 1) {
+        opts += used;
+        char *eq = strchr(word, '=');
+        const char *val = eq ? eq + 1 : "";
+        if (eq) *eq = '\0';
+        if (strcmp(word, "type") == 0) snprintf(f->types, sizeof(f->types), "%s", val);
+        else if (strcmp(word, "prefix") == 0) snprintf(f->prefix, sizeof(f->prefix), "%s", val);
+        else if (strcmp(word, "glob") == 0) snprintf(f->glob, sizeof(f->glob), "%s", val);
+        else if (strcmp(word, "cursor") == 0) snprintf(f->cursor, sizeof(f->cursor), "%s", val);
+        else if (strcmp(word, "limit") == 0) f->limit = atol(val);
+        else if (strcmp(word, "long") == 0) f->long_format = 1;
+    }
+}
+
+// Format f back into option words for a sub-server (type is resolved by S1)
+static inline void format_list_filter(const struct list_filter *f, char *out, size_t size) {
+    int n = 0;
+    out[0] = '\0';
+    if (f->prefix[0]) n += snprintf(out + n, size - n, " prefix=%s", f->prefix);
+    if (f->glob[0] && n < (int)size) n += snprintf(out + n, size - n, " glob=%s", f->glob);
+    if (f->cursor[0] && n < (int)size) n += snprintf(out + n, size - n, " cursor=%s", f->cursor);
+    if (f->limit > 0 && n < (int)size) n += snprintf(out + n, size - n, " limit=%ld", f->limit);
+    if (f->long_format && n < (int)size) snprintf(out + n, size - n, " long");
+}
+
+// Non-zero if ext is selected by f's type list
+static inline int list_type_selected(const struct list_filter *f, const char *ext) {
+    if (!f->types[0]) return 1;
+    size_t len = strlen(ext);
+    for (const char *p = f->types; (p = strstr(p, ext)) != NULL; p += len)
+        if ((p == f->types || p[-1] == ',') && (p[len] == '\0' || p[len] == ','))
+            return 1;
+    return 0;
+}
+
+// Non-zero if name passes f's prefix, glob and cursor filters
+static inline int list_name_matches(const struct list_filter *f, const char *name) {
+    if (f->prefix[0] && strncmp(name, f->prefix, strlen(f->prefix)) != 0) return 0;
+    if (f->glob[0] && fnmatch(f->glob, name, 0) != 0) return 0;
+    if (f->cursor[0] && strcmp(name, f->cursor) <= 0) return 0;
+    return 1;
+}
+
+/* Names collected from one directory */
+struct name_list {
+    char **names;
+    size_t count, capacity;
+};
+
+static inline int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static inline void name_list_free(struct name_list *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->names[i]);
+    free(list->names);
+    list->names = NULL;
+    list->count = list->capacity = 0;
+}
+
+// Append a copy of name to list
+static inline int name_list_add(struct name_list *list, const char *name) {
+    if (list->count == list->capacity) {
+        size_t cap = list->capacity ? list->capacity * 2 : 64;
+        char **grown = realloc(list->names, cap * sizeof(char *));
+        if (!grown) return -1;
+        list->names = grown;
+        list->capacity = cap;
+    }
+    char *copy = strdup(name);
+    if (!copy) return -1;
+    list->names[list->count++] = copy;
+    return 0;
+}
+
+// Non-zero if name ends in the extension ext (".pdf" etc.)
+static inline int has_extension(const char *name, const char *ext) {
+    const char *dot = strrchr(name, '.');
+    return dot && strcmp(dot, ext) == 0;
+}
+
+// list_dir_filtered() answered from the namespace index
+// Collects at most limit + 1 names when the filter has a page size, which is
+// enough for the caller to tell whether more pages follow
+static inline int list_index_filtered(const char *dir, const char *ext, const struct list_filter *filter,
+                                      struct name_list *list) {
+    size_t max = filter && filter->limit > 0 ? (size_t)filter->limit + 1 : 0;
+    size_t prefix_len = filter ? strlen(filter->prefix) : 0;
+
+    pthread_rwlock_rdlock(&ns.lock);
+    struct ns_dir *d = ns_find_dir(dir, strlen(dir));
+    if (!d) {
+        pthread_rwlock_unlock(&ns.lock);
+        return -1;
+    }
+
+    // Start at whichever is later: just past the cursor, or the first name with the prefix
+    size_t start = 0;
+    if (filter && filter->cursor[0]) {
+        long i = ns_find_file(d, filter->cursor);
+        start = i >= 0 ? (size_t)i + 1 : (size_t)(-i - 1);
+    }
+    if (prefix_len > 0) {
+        long i = ns_find_file(d, filter->prefix);
+        size_t at = i >= 0 ? (size_t)i : (size_t)(-i - 1);
+        if (at > start) start = at;
+    }
+
+    for (size_t i = start; i < d->count; i++) {
+        const char *name = d->files[i].name;
+        if (prefix_len > 0 && strncmp(name, filter->prefix, prefix_len) > 0) break;  // Past the prefix range
+        if (!has_extension(name, ext)) continue;
+        if (filter && !list_name_matches(filter, name)) continue;
+        if (name_list_add(list, name) < 0) break;
+        if (max && list->count == max) break;
+    }
+    pthread_rwlock_unlock(&ns.lock);
+    return 0;
+}
+
+// Collect the regular files in dir whose name ends in ext and passes filter
+// (may be NULL), sorted with strcmp
+// Returns 0 on success, -1 if the directory doesn't exist
+static inline int list_dir_filtered(const char *dir, const char *ext, const struct list_filter *filter,
+                                    struct name_list *list) {
+    memset(list, 0, sizeof(*list));
+    if (ns_index_covers(dir)) return list_index_filtered(dir, ext, filter, list);
+
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_type != DT_REG) continue;  // Only regular files
+        if (!has_extension(entry->d_name, ext)) continue;
+        if (filter && !list_name_matches(filter, entry->d_name)) continue;
+        if (name_list_add(list, entry->d_name) < 0) break;
+    }
+    closedir(d);
+    qsort(list->names, list->count, sizeof(char *), cmp_names);
+    return 0;
+}
+
+// Collect the regular files in dir whose name ends in ext, sorted with strcmp
+// Returns 0 on success, -1 if the directory can't be opened
+static inline int list_dir_sorted(const char *dir, const char *ext, struct name_list *list) {
+    return list_dir_filtered(dir, ext, NULL, list);
+}
+
+// Format one listing line: the name, plus size and mtime columns in long format
+// Returns the line length
+static inline size_t format_list_line(char *line, size_t size, const char *dir, const char *name,
+                                      int long_format) {
+    if (!long_format) return snprintf(line, size, "%s", name);
+    long long fsize = 0, mtime = 0;
+    if (ns_index_covers(dir)) {
+        // Size and mtime straight from the index
+        pthread_rwlock_rdlock(&ns.lock);
+        struct ns_dir *d = ns_find_dir(dir, strlen(dir));
+        long i = d ? ns_find_file(d, name) : -1;
+        if (i >= 0) {
+            fsize = d->files[i].size;
+            mtime = d->files[i].mtime;
+        }
+        pthread_rwlock_unlock(&ns.lock);
+    } else {
+        char path[PATH_MAX];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        if (stat(path, &st) == 0) {
+            fsize = st.st_size;
+            mtime = st.st_mtime;
+        }
+    }
+    int n = snprintf(line, size, "%s\t%lld\t%lld", name, fsize, mtime);
+    return n < (int)size ? (size_t)n : size - 1;
+}
+
+/* Output buffer that coalesces newline-terminated names into large OP_DATA frames */
+struct name_writer {
+    int sock;
+    uint32_t req_id;
+    char *buf;
+    size_t used;
+    int failed;
+    char *tee;                 // Copy of everything sent (see name_writer_tee)
+    size_t tee_len, tee_cap;
+    size_t tee_max;            // Copy limit; 0 when not copying or the limit was hit
+};
+
+static inline void name_writer_init(struct name_writer *w, int sock, uint32_t req_id) {
+    w->sock = sock;
+    w->req_id = req_id;
+    w->buf = malloc(LIST_FRAME_BYTES);
+    w->used = 0;
+    w->failed = w->buf == NULL;
+    w->tee = NULL;
+    w->tee_len = w->tee_cap = w->tee_max = 0;
+}
+
+// Also keep a copy of the listing body in w->tee (the caller frees it), up to
+// max bytes; a longer listing gives up the copy and leaves tee_max at 0
+static inline void name_writer_tee(struct name_writer *w, size_t max) {
+    w->tee_max = max;
+}
+
+// Append the pending frame to the tee copy, giving the copy up if it outgrows tee_max
+static inline void name_writer_copy(struct name_writer *w) {
+    size_t need = w->tee_len + w->used;
+    if (need > w->tee_cap && need <= w->tee_max) {
+        size_t cap = w->tee_cap ? w->tee_cap : LIST_FRAME_BYTES;
+        while (cap < need) cap *= 2;
+        char *grown = realloc(w->tee, cap);
+        if (grown) {
+            w->tee = grown;
+            w->tee_cap = cap;
+        }
+    }
+    if (need > w->tee_max || need > w->tee_cap) {
+        free(w->tee);
+        w->tee = NULL;
+        w->tee_len = w->tee_cap = w->tee_max = 0;
+        return;
+    }
+    memcpy(w->tee + w->tee_len, w->buf, w->used);
+    w->tee_len = need;
+}
+
+static inline void name_writer_flush(struct name_writer *w) {
+    if (w->tee_max > 0 && w->used > 0) name_writer_copy(w);
+    if (w->used > 0 && !w->failed &&
+        send_frame(w->sock, OP_DATA, 0, w->req_id, w->buf, w->used) < 0)
+        w->failed = 1;
+    w->used = 0;
+}
+
+static inline void name_writer_add(struct name_writer *w, const char *name, size_t len) {
+    if (w->failed) return;
+    if (w->used + len + 1 > LIST_FRAME_BYTES) name_writer_flush(w);
+    memcpy(w->buf + w->used, name, len);
+    w->buf[w->used + len] = '\n';
+    w->used += len + 1;
+}
+
+// Flush what's left and terminate the listing with OP_END carrying trailer
+// (e.g. "next=<cursor>\n" when a page was cut short; NULL for none)
+// Returns 0 on success, -1 if the socket failed at any point
+static inline int name_writer_finish_with(struct name_writer *w, const char *trailer) {
+    name_writer_flush(w);
+    if (!w->failed && send_frame(w->sock, OP_END, 0, w->req_id, trailer,
+                                 trailer ? strlen(trailer) : 0) < 0)
+        w->failed = 1;
+    free(w->buf);
+    return w->failed ? -1 : 0;
+}
+
+static inline int name_writer_finish(struct name_writer *w) {
+    return name_writer_finish_with(w, NULL);
+}
+
+// Answer dispfnames: the sorted `ext` files of dir as newline-separated names
+// in OP_DATA frames, then OP_END (a missing directory is an empty listing)
+// OP_END carries "version=<v>\n", the directory's version (ns_dir_version) read
+// before the listing, which S1 uses to validate its listing cache
+// Returns 0 on success, -1 if the socket failed
+static inline int send_sorted_listing(int sock, uint32_t req_id, const char *dir, const char *ext) {
+    struct name_list list;
+    struct name_writer w;
+    char version[64], trailer[80];
+    ns_dir_version(dir, version, sizeof(version));
+    snprintf(trailer, sizeof(trailer), "version=%s\n", version);
+    list_dir_sorted(dir, ext, &list);
+    name_writer_init(&w, sock, req_id);
+    for (size_t i = 0; i < list.count; i++) name_writer_add(&w, list.names[i], strlen(list.names[i]));
+    name_list_free(&list);
+    return name_writer_finish_with(&w, trailer);
+}
+
+// Answer listf: one page of the sorted `ext` files of dir that pass filter
+// The page ends with "next=<last name>\n" in the OP_END payload if names were left out
+// Returns 0 on success, -1 if the socket failed
+static inline int send_listing_page(int sock, uint32_t req_id, const char *dir, const char *ext,
+                                    const struct list_filter *filter) {
+    struct name_list list;
+    struct name_writer w;
+    list_dir_filtered(dir, ext, filter, &list);
+    size_t count = list.count;
+    if (filter->limit > 0 && (size_t)filter->limit < count) count = filter->limit;
+
+    name_writer_init(&w, sock, req_id);
+    char line[LIST_LINE_MAX];
+    for (size_t i = 0; i < count; i++) {
+        size_t len = format_list_line(line, sizeof(line), dir, list.names[i], filter->long_format);
+        name_writer_add(&w, line, len);
+    }
+    char trailer[NAME_MAX + 8];
+    int more = count < list.count;
+    if (more) snprintf(trailer, sizeof(trailer), "next=%s\n", list.names[count - 1]);
+    name_list_free(&list);
+    return name_writer_finish_with(&w, more ? trailer : NULL);
+}
+
+#endif
@@ -0,0 +1,378 @@
+// nsindex.h - In-memory namespace index of a server's storage tree //
+//
+// Each server (S1 for ~/S1, S2 for ~/S2, ...) calls ns_index_init() at
+// startup. The tree is scanned once into a hash of directories, each holding
+// its files sorted by name with their size and mtime. Listings (listing.h)
+// and downltar membership (tarstream.h) are then answered from memory without
+// touching the disk.
+//
+// The index is kept current two ways:
+//   - the upload/remove handlers call ns_index_file()/ns_index_forget() as
+//     soon as they change a file, so a client sees its own writes at once;
+//   - an inotify thread watches every directory and applies out-of-band
+//     changes (files copied in by hand, directories created or moved). If
+//     the inotify queue overflows, the whole tree is rescanned.
+// Every directory also carries a version that changes whenever its file set
+// does; ns_dir_version() reports it so S1 can tell whether a cached listing is
+// still current without reading the directory again.
+// DFS_INDEX=0 turns the index off; everything then falls back to readdir().
+#ifndef NSINDEX_H
+#define NSINDEX_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define NS_BUCKETS 4096  // Directory hash buckets
+#define NS_WATCH_MASK (IN_CREATE | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE | \
+                       IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+/* One indexed file */
+struct ns_file {
+    char *name;
+    long long size;
+    long long mtime;
+};
+
+/* One indexed directory: its regular files, sorted by name */
+struct ns_dir {
+    char *path;                // Absolute path, no trailing slash
+    struct ns_file *files;
+    size_t count, capacity;
+    int wd;                    // inotify watch descriptor, -1 if not watched
+    unsigned long long version;  // Changes on every update (unique across the index)
+    struct ns_dir *next;       // Hash chain
+};
+
+/* The index of one storage root */
+struct ns_index {
+    int active;                // Built and in use
+    char root[PATH_MAX];
+    size_t root_len;
+    pthread_rwlock_t lock;     // Readers: listings/tar; writers: handlers and the watcher
+    struct ns_dir *buckets[NS_BUCKETS];
+    struct ns_dir **by_wd;     // inotify wd -> directory
+    int by_wd_size;
+    int inotify_fd;
+    long long boot;            // Start time (us), so versions never repeat across restarts
+    unsigned long long generation;  // Last version handed out
+    unsigned long long files, dirs, events, rescans;  // Counters (see "stats")
+};
+
+static struct ns_index ns = { .lock = PTHREAD_RWLOCK_INITIALIZER, .inotify_fd = -1 };
+
+static inline unsigned ns_hash(const char *s, size_t len) {
+    unsigned h = 2166136261u;  // FNV-1a
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 16777619u;
+    return h % NS_BUCKETS;
+}
+
+// Non-zero if the index is answering queries for paths under dir
+static inline int ns_index_covers(const char *dir) {
+    return ns.active && strncmp(dir, ns.root, ns.root_len) == 0 &&
+           (dir[ns.root_len] == '\0' || dir[ns.root_len] == '/');
+}
+
+// Find a directory; the caller holds the lock. len limits the path length compared.
+static inline struct ns_dir *ns_find_dir(const char *path, size_t len) {
+    while (len > 1 && path[len - 1] == '/') len--;  // "a/b/" is "a/b"
+    for (struct ns_dir *d = ns.buckets[ns_hash(path, len)]; d; d = d->next)
+        if (strlen(d->path) == len && memcmp(d->path, path, len) == 0) return d;
+    return NULL;
+}
+
+// Find or create a directory entry (write lock held)
+static inline struct ns_dir *ns_get_dir(const char *path, size_t len) {
+    while (len > 1 && path[len - 1] == '/') len--;
+    struct ns_dir *d = ns_find_dir(path, len);
+    if (d) return d;
+    d = calloc(1, sizeof(*d));
+    if (!d) return NULL;
+    d->path = strndup(path, len);
+    if (!d->path) {
+        free(d);  // Not linked in yet
+        return NULL;
+    }
+    d->wd = -1;
+    d->version = ++ns.generation;
+    unsigned h = ns_hash(path, len);
+    d->next = ns.buckets[h];
+    ns.buckets[h] = d;
+    ns.dirs++;
+    return d;
+}
+
+// Binary search for name in d; returns its index, or the insertion point as -(i + 1)
+static inline long ns_find_file(struct ns_dir *d, const char *name) {
+    size_t lo = 0, hi = d->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = strcmp(d->files[mid].name, name);
+        if (c == 0) return (long)mid;
+        if (c < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return -(long)lo - 1;
+}
+
+// Insert or refresh one file (write lock held)
+static inline void ns_put_file(struct ns_dir *d, const char *name, const struct stat *st) {
+    long i = ns_find_file(d, name);
+    if (i < 0) {
+        char *copy = strdup(name);
+        if (!copy) return;  // Out of memory: the file stays unlisted until the next rescan
+        if (d->count == d->capacity) {
+            size_t cap = d->capacity ? d->capacity * 2 : 16;
+            struct ns_file *grown = realloc(d->files, cap * sizeof(*grown));
+            if (!grown) {
+                free(copy);
+                return;
+            }
+            d->files = grown;
+            d->capacity = cap;
+        }
+        i = -i - 1;
+        memmove(&d->files[i + 1], &d->files[i], (d->count - i) * sizeof(*d->files));
+        d->files[i].name = copy;
+        d->count++;
+        ns.files++;
+    }
+    d->files[i].size = st->st_size;
+    d->files[i].mtime = st->st_mtime;
+    d->version = ++ns.generation;
+}
+
+// Drop one file (write lock held)
+static inline void ns_drop_file(struct ns_dir *d, const char *name) {
+    long i = ns_find_file(d, name);
+    if (i < 0) return;
+    free(d->files[i].name);
+    memmove(&d->files[i], &d->files[i + 1], (d->count - i - 1) * sizeof(*d->files));
+    d->count--;
+    ns.files--;
+    d->version = ++ns.generation;
+}
+
+// Remember a directory's watch descriptor (write lock held)
+static inline void ns_set_wd(struct ns_dir *d, int wd) {
+    if (wd < 0) return;
+    if (wd >= ns.by_wd_size) {
+        int size = ns.by_wd_size ? ns.by_wd_size : 64;
+        while (size <= wd) size *= 2;
+        struct ns_dir **grown = realloc(ns.by_wd, size * sizeof(*grown));
+        if (!grown) return;
+        memset(grown + ns.by_wd_size, 0, (size - ns.by_wd_size) * sizeof(*grown));
+        ns.by_wd = grown;
+        ns.by_wd_size = size;
+    }
+    ns.by_wd[wd] = d;
+    d->wd = wd;
+}
+
+// Directories a server keeps for itself at the top of its root: chunked.h's
+// upload parts and chunkstore.h's chunk store. They hold no listed files, so
+// they are neither indexed nor watched.
+static inline int ns_internal_name(const char *name) {
+    return strcmp(name, ".uploads") == 0 || strcmp(name, ".chunks") == 0;
+}
+
+// Scan a directory tree into the index and watch every directory in it (write lock held)
+// Watching before reading means a file created mid-scan is seen by one or the other
+static inline void ns_scan_tree(const char *path) {
+    if (strncmp(path, ns.root, ns.root_len) == 0 && path[ns.root_len] == '/' &&
+        ns_internal_name(path + ns.root_len + 1))
+        return;
+    struct ns_dir *d = ns_get_dir(path, strlen(path));
+    if (!d) return;
+    if (ns.inotify_fd >= 0 && d->wd < 0)
+        ns_set_wd(d, inotify_add_watch(ns.inotify_fd, path, NS_WATCH_MASK));
+
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    char child[PATH_MAX];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        if (snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child)) continue;
+        struct stat st;
+        if (lstat(child, &st) < 0) continue;
+        if (S_ISDIR(st.st_mode))
+            ns_scan_tree(child);
+        else if (S_ISREG(st.st_mode))
+            ns_put_file(d, entry->d_name, &st);
+    }
+    closedir(dir);
+}
+
+// Forget a directory and everything below it (write lock held)
+static inline void ns_drop_tree(const char *path) {
+    size_t len = strlen(path);
+    for (int b = 0; b < NS_BUCKETS; b++) {
+        struct ns_dir **link = &ns.buckets[b];
+        while (*link) {
+            struct ns_dir *d = *link;
+            if (strncmp(d->path, path, len) == 0 && (d->path[len] == '\0' || d->path[len] == '/')) {
+                *link = d->next;
+                if (d->wd >= 0) {
+                    if (d->wd < ns.by_wd_size) ns.by_wd[d->wd] = NULL;
+                    inotify_rm_watch(ns.inotify_fd, d->wd);
+                }
+                for (size_t i = 0; i < d->count; i++) free(d->files[i].name);
+                ns.files -= d->count;
+                ns.dirs--;
+                free(d->files);
+                free(d->path);
+                free(d);
+            } else {
+                link = &d->next;
+            }
+        }
+    }
+}
+
+// Record that the file at path was created or changed (handlers call this
+// right after writing, so listings reflect the upload before inotify catches up)
+static inline void ns_index_file(const char *path) {
+    if (!ns_index_covers(path)) return;
+    const char *slash = strrchr(path, '/');
+    struct stat st;
+    if (!slash || stat(path, &st) < 0 || !S_ISREG(st.st_mode)) return;
+    pthread_rwlock_wrlock(&ns.lock);
+    struct ns_dir *d = ns_find_dir(path, slash - path);
+    if (!d) {
+        // New directory (e.g. made by an upload): index the whole chain from the root
+        char dir[PATH_MAX];
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - path), path);
+        // Intermediate directories (none when the file is right under the root)
+        char *p = strlen(dir) > ns.root_len ? dir + ns.root_len + 1 : NULL;
+        for (; p && (p = strchr(p, '/')) != NULL; p++) {
+            *p = '\0';
+            if (!ns_find_dir(dir, strlen(dir))) ns_scan_tree(dir);
+            *p = '/';
+        }
+        ns_scan_tree(dir);
+        d = ns_find_dir(path, slash - path);
+    }
+    if (d) ns_put_file(d, slash + 1, &st);
+    pthread_rwlock_unlock(&ns.lock);
+}
+
+// Record that the file at path was removed
+static inline void ns_index_forget(const char *path) {
+    if (!ns_index_covers(path)) return;
+    const char *slash = strrchr(path, '/');
+    if (!slash) return;
+    pthread_rwlock_wrlock(&ns.lock);
+    struct ns_dir *d = ns_find_dir(path, slash - path);
+    if (d) ns_drop_file(d, slash + 1);
+    pthread_rwlock_unlock(&ns.lock);
+}
+
+// Apply one inotify event (write lock held)
+static inline void ns_apply_event(const struct inotify_event *ev) {
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost: rebuild from disk
+        ns_drop_tree(ns.root);
+        ns_scan_tree(ns.root);
+        ns.rescans++;
+        return;
+    }
+    if (ev->wd < 0 || ev->wd >= ns.by_wd_size || !ns.by_wd[ev->wd]) return;
+    struct ns_dir *d = ns.by_wd[ev->wd];
+    if (ev->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+        ns.by_wd[ev->wd] = NULL;
+        d->wd = -1;
+        return;
+    }
+    if (ev->len == 0) return;
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", d->path, ev->name) >= (int)sizeof(path)) return;
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) ns_scan_tree(path);
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) ns_drop_tree(path);
+        return;
+    }
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        ns_drop_file(d, ev->name);
+    } else {
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISREG(st.st_mode)) ns_put_file(d, ev->name, &st);
+    }
+}
+
+// Watcher thread: applies inotify events to the index
+static inline void *ns_watcher(void *arg) {
+    (void)arg;
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (1) {
+        ssize_t n = read(ns.inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        pthread_rwlock_wrlock(&ns.lock);
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            ns_apply_event(ev);
+            ns.events++;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+        pthread_rwlock_unlock(&ns.lock);
+    }
+    return NULL;
+}
+
+// Write the current version of directory dir into out, e.g. "i1760000000123456.42"
+// Without the index the directory's mtime stands in ("m<sec>.<nsec>"), which
+// also changes whenever a name is added or removed. A missing directory is "none".
+static inline void ns_dir_version(const char *dir, char *out, size_t size) {
+    if (ns_index_covers(dir)) {
+        pthread_rwlock_rdlock(&ns.lock);
+        struct ns_dir *d = ns_find_dir(dir, strlen(dir));
+        if (d) snprintf(out, size, "i%lld.%llu", ns.boot, d->version);
+        else snprintf(out, size, "none");
+        pthread_rwlock_unlock(&ns.lock);
+        return;
+    }
+    struct stat st;
+    if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode))
+        snprintf(out, size, "m%lld.%ld", (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+    else
+        snprintf(out, size, "none");
+}
+
+// Build the index for root and start watching it (call once from main)
+// Returns 0 if the index is active, -1 if disabled (DFS_INDEX=0) or unavailable
+static inline int ns_index_init(const char *root) {
+    const char *v = getenv("DFS_INDEX");
+    if (v && strcmp(v, "0") == 0) return -1;
+    if (snprintf(ns.root, sizeof(ns.root), "%s", root) >= (int)sizeof(ns.root)) return -1;
+    ns.root_len = strlen(ns.root);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    ns.boot = (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    mkdir(ns.root, 0755);
+
+    ns.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (ns.inotify_fd < 0) perror("inotify_init1 (index will not see out-of-band changes)");
+    pthread_rwlock_wrlock(&ns.lock);
+    ns_scan_tree(ns.root);
+    ns.active = 1;
+    pthread_rwlock_unlock(&ns.lock);
+
+    if (ns.inotify_fd >= 0) {
+        pthread_t t;
+        pthread_create(&t, NULL, ns_watcher, NULL);
+        pthread_detach(t);
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,723 @@
+// protocol.h - Framing protocol shared by w25clients, S1 and the sub-servers //
+//
+// Every message on every socket is a frame: a fixed 20-byte header followed
+// by exactly `length` payload bytes. Because the receiver always knows how
+// many bytes to expect, a short recv() no longer has to be read as "end of
+// file" and no side needs to sleep() before sending a payload.
+//
+// Header layout (all fields in network byte order):
+//   magic(2) version(1) opcode(1) flags(2) reserved(2) request_id(4) length(8)
+//
+// Response grammar:
+//   - a single OP_MSG or OP_ERROR frame, or
+//   - zero or more OP_DATA frames followed by one OP_END frame.
+//
+// FRAME_DEFLATE on an OP_REQUEST says the sender takes a deflated reply; on
+// OP_DATA it says the payload is the next piece of the one zlib stream the
+// frames of this response carry (compress.h). Every receiver here inflates
+// such frames, so sizes, checksums and byte counts are of the plain data.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <zlib.h>  // FRAME_DEFLATE payloads (link with -lz)
+
+#include "uring.h"
+#include "checksum.h"
+
+#define PROTO_MAGIC   0x4446  // "DF"
+#define PROTO_VERSION 1
+
+#define FRAME_HEADER_SIZE 20
+#define FRAME_CHUNK_SIZE  4096   // Payload size used for streams of unknown length
+#define MAX_REQUEST_SIZE  4096   // Largest accepted OP_REQUEST payload
+
+/* Frame opcodes */
+#define OP_REQUEST 1  // Command line text, e.g. "downlf ~S1/a.pdf"
+#define OP_DATA    2  // Chunk of file, archive or listing bytes
+#define OP_END     3  // Terminates a sequence of OP_DATA frames
+#define OP_MSG     4  // Status text; completes a response
+#define OP_ERROR   5  // Error text; completes a response
+
+/* Frame flags */
+#define FRAME_DEFLATE 0x0001  // OP_REQUEST: a deflated reply is welcome; OP_DATA: payload is deflated
+
+#define INFLATE_OUT (64 * 1024)  // Plain bytes produced per inflate() call when receiving
+
+/* Decoded frame header */
+struct frame_header {
+    uint8_t version;      // Protocol version of the sender
+    uint8_t opcode;       // One of the OP_* values
+    uint16_t flags;       // Reserved for per-opcode options
+    uint32_t request_id;  // Echoed back in every frame of the response
+    uint64_t length;      // Number of payload bytes that follow
+};
+
+// Disable Nagle's algorithm on a connection: frames are small and
+// request/response, so holding back the tail of a response until the peer's
+// delayed ACK arrives would add ~40 ms to every exchange
+static inline void set_nodelay(int sock) {
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Send exactly len bytes, retrying on short writes
+// extra_flags may carry MSG_MORE when more data follows immediately
+// Returns 0 on success, -1 if the peer went away
+static inline int send_all_flags(int sock, const void *buf, size_t len, int extra_flags) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL | extra_flags);  // Never raise SIGPIPE
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send exactly len bytes, retrying on short writes
+static inline int send_all(int sock, const void *buf, size_t len) {
+    return send_all_flags(sock, buf, len, 0);
+}
+
+// Receive exactly len bytes
+// Returns 0 on success, -1 on error or if the peer closed the connection early
+static inline int recv_all(int sock, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = recv(sock, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Serialize a frame header into hdr
+static inline void encode_frame_header(unsigned char *hdr, uint8_t opcode, uint16_t flags,
+                                       uint32_t request_id, uint64_t length) {
+    uint16_t magic = htobe16(PROTO_MAGIC);
+    uint16_t flags_be = htobe16(flags);
+    uint16_t reserved = 0;
+    uint32_t id_be = htobe32(request_id);
+    uint64_t len_be = htobe64(length);
+
+    memcpy(hdr, &magic, 2);
+    hdr[2] = PROTO_VERSION;
+    hdr[3] = opcode;
+    memcpy(hdr + 4, &flags_be, 2);
+    memcpy(hdr + 6, &reserved, 2);
+    memcpy(hdr + 8, &id_be, 4);
+    memcpy(hdr + 12, &len_be, 8);
+}
+
+// Serialize and send a frame header
+// A header announcing a payload is sent with MSG_MORE so it shares a packet
+// with the start of that payload
+static inline int send_frame_header(int sock, uint8_t opcode, uint16_t flags,
+                                    uint32_t request_id, uint64_t length) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+    encode_frame_header(hdr, opcode, flags, request_id, length);
+    return send_all_flags(sock, hdr, sizeof(hdr), length > 0 ? MSG_MORE : 0);
+}
+
+// Send a complete frame (header + payload)
+// Small frames are assembled in one buffer and leave in a single send()
+static inline int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t request_id,
+                             const void *payload, uint64_t length) {
+    if (length <= FRAME_CHUNK_SIZE) {
+        unsigned char frame[FRAME_HEADER_SIZE + FRAME_CHUNK_SIZE];
+        encode_frame_header(frame, opcode, flags, request_id, length);
+        if (length > 0) memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+        return send_all(sock, frame, FRAME_HEADER_SIZE + length);
+    }
+    if (send_frame_header(sock, opcode, flags, request_id, length) < 0) return -1;
+    return send_all(sock, payload, length);
+}
+
+// Decode a raw 20-byte header already read off the wire (non-blocking readers
+// collect the bytes themselves); returns -1 on bad magic or version
+static inline int decode_frame_header(const unsigned char *hdr, struct frame_header *h) {
+    uint16_t magic, flags;
+    uint32_t id;
+    uint64_t len;
+
+    memcpy(&magic, hdr, 2);
+    if (be16toh(magic) != PROTO_MAGIC || hdr[2] != PROTO_VERSION) {
+        fprintf(stderr, "Protocol error: bad frame magic or version\n");
+        return -1;
+    }
+    memcpy(&flags, hdr + 4, 2);
+    memcpy(&id, hdr + 8, 4);
+    memcpy(&len, hdr + 12, 8);
+
+    h->version = hdr[2];
+    h->opcode = hdr[3];
+    h->flags = be16toh(flags);
+    h->request_id = be32toh(id);
+    h->length = be64toh(len);
+    return 0;
+}
+
+// Receive and validate a frame header
+// Returns 0 on success, -1 on connection error or protocol mismatch
+static inline int recv_frame_header(int sock, struct frame_header *h) {
+    unsigned char hdr[FRAME_HEADER_SIZE];
+
+    if (recv_all(sock, hdr, sizeof(hdr)) < 0) return -1;
+    return decode_frame_header(hdr, h);
+}
+
+// Read and throw away len payload bytes
+static inline int skip_payload(int sock, uint64_t len) {
+    char buffer[FRAME_CHUNK_SIZE];
+    while (len > 0) {
+        size_t n = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (recv_all(sock, buffer, n) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read a text payload into buf (always NUL-terminated), dropping what doesn't fit
+static inline int recv_text_payload(int sock, uint64_t len, char *buf, size_t size) {
+    size_t keep = len < size - 1 ? len : size - 1;
+    if (recv_all(sock, buf, keep) < 0) return -1;
+    buf[keep] = '\0';
+    return skip_payload(sock, len - keep);
+}
+
+// Send a status message that completes a response
+static inline int send_msg(int sock, uint32_t request_id, const char *text) {
+    return send_frame(sock, OP_MSG, 0, request_id, text, strlen(text));
+}
+
+// Send an error message that completes a response
+static inline int send_error(int sock, uint32_t request_id, const char *text) {
+    return send_frame(sock, OP_ERROR, 0, request_id, text, strlen(text));
+}
+
+// Send a command line as an OP_REQUEST frame with flags (e.g. FRAME_DEFLATE)
+static inline int send_request_flags(int sock, uint32_t request_id, uint16_t flags, const char *command) {
+    return send_frame(sock, OP_REQUEST, flags, request_id, command, strlen(command));
+}
+
+// Send a command line as an OP_REQUEST frame
+static inline int send_request(int sock, uint32_t request_id, const char *command) {
+    return send_request_flags(sock, request_id, 0, command);
+}
+
+// Receive the next OP_REQUEST frame into buf
+// Returns 0 on success, -1 if the connection closed or sent something else
+static inline int recv_request(int sock, struct frame_header *h, char *buf, size_t size) {
+    if (recv_frame_header(sock, h) < 0) return -1;
+    if (h->opcode != OP_REQUEST || h->length >= size) {
+        fprintf(stderr, "Protocol error: expected request frame\n");
+        return -1;
+    }
+    return recv_text_payload(sock, h->length, buf, size);
+}
+
+// Zero-copy file sends are on unless DFS_ZEROCOPY=0 is set in the environment
+// (useful to compare throughput against the buffered path)
+static inline int zerocopy_enabled(void) {
+    const char *v = getenv("DFS_ZEROCOPY");
+    return !(v && strcmp(v, "0") == 0);
+}
+
+// Received files are fsync()ed before the upload is acknowledged when DFS_FSYNC=1
+static inline int fsync_enabled(void) {
+    const char *v = getenv("DFS_FSYNC");
+    return v && strcmp(v, "1") == 0;
+}
+
+// Name of the path send_file_body() uses for regular files (for transfer logs)
+static inline const char *io_engine_name(void) {
+    if (io_engine_uring()) return "io_uring";
+    return zerocopy_enabled() ? "sendfile" : "buffered";
+}
+
+// Milliseconds elapsed since start (used for transfer throughput logging)
+static inline double elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/* Inflates the FRAME_DEFLATE payloads of one response (a single zlib stream) */
+struct frame_inflate {
+    z_stream z;
+    int started;         // inflateInit() done
+    int ended;           // The stream's end has been seen
+    unsigned char *out;  // INFLATE_OUT bytes of plain output
+};
+
+// Inflate n received bytes, handing each block of plain output to put(arg, bytes, len)
+// (put returns 0, or -1 to give up)
+// Returns 0, or -1 if the stream is corrupt, runs on past its end or put failed
+static inline int frame_inflate(struct frame_inflate *f, const void *in, size_t n,
+                                int (*put)(void *, const unsigned char *, size_t), void *arg) {
+    if (!f->started) {
+        memset(&f->z, 0, sizeof(f->z));
+        f->out = malloc(INFLATE_OUT);
+        if (!f->out || inflateInit(&f->z) != Z_OK) {
+            free(f->out);
+            f->out = NULL;
+            return -1;
+        }
+        f->started = 1;
+    }
+    if (f->ended) return n > 0 ? -1 : 0;
+    f->z.next_in = (unsigned char *)in;
+    f->z.avail_in = n;
+    do {
+        f->z.next_out = f->out;
+        f->z.avail_out = INFLATE_OUT;
+        int rc = inflate(&f->z, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) return -1;
+        size_t got = INFLATE_OUT - f->z.avail_out;
+        if (got > 0 && put(arg, f->out, got) < 0) return -1;
+        if (rc == Z_STREAM_END) {
+            f->ended = 1;
+            return f->z.avail_in > 0 ? -1 : 0;
+        }
+        if (rc == Z_BUF_ERROR) break;  // Needs the next piece
+    } while (f->z.avail_in > 0 || f->z.avail_out == 0);
+    return 0;
+}
+
+// Release an inflater
+// Returns 0 if it saw a complete stream (or none at all), -1 if the stream was cut short
+static inline int frame_inflate_end(struct frame_inflate *f) {
+    int ok = !f->started || f->ended;
+    if (f->started) inflateEnd(&f->z);
+    free(f->out);
+    memset(f, 0, sizeof(*f));
+    return ok ? 0 : -1;
+}
+
+// Receive a FRAME_DEFLATE payload of len bytes and inflate it (see frame_inflate)
+static inline int recv_inflated(int sock, uint64_t len, struct frame_inflate *f,
+                                int (*put)(void *, const unsigned char *, size_t), void *arg) {
+    unsigned char buffer[FRAME_CHUNK_SIZE];
+    while (len > 0) {
+        size_t n = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (recv_all(sock, buffer, n) < 0 || frame_inflate(f, buffer, n, put, arg) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Send `length` bytes of an open file, starting at its current position
+// With DFS_IO_ENGINE=uring regular files are read and sent in batches on the
+// thread's io_uring; otherwise they go through sendfile() so the bytes never
+// leave the kernel; anything else (or a kernel that refuses) falls back to a
+// buffered loop. Sets *used_sendfile (if non-NULL) when sendfile() carried the data.
+// Returns 0 on success, -1 on error
+static inline int send_file_body(int sock, FILE *file, uint64_t length, int *used_sendfile) {
+    struct stat st;
+    int fd = fileno(file);
+    off_t offset = ftello(file);  // Nothing has been buffered yet, so this is the fd offset
+    if (used_sendfile) *used_sendfile = 0;
+
+    if (io_engine_uring() && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0) {
+        int rc = uring_send_file(sock, fd, offset, length);
+        if (rc < 0) return -1;
+        if (rc == 0) {
+            fseeko(file, offset + length, SEEK_SET);
+            return 0;
+        }
+    }
+
+    if (zerocopy_enabled() && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0) {
+        uint64_t remaining = length;
+        while (remaining > 0) {
+            ssize_t n = sendfile(sock, fd, &offset, remaining > 0x7ffff000 ? 0x7ffff000 : remaining);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && remaining == length && (errno == EINVAL || errno == ENOSYS))
+                break;  // sendfile unsupported here; use the buffered loop below
+            if (n <= 0) return -1;
+            remaining -= n;
+        }
+        if (remaining == 0) {
+            fseeko(file, offset, SEEK_SET);  // Keep the stream position consistent
+            if (used_sendfile) *used_sendfile = 1;
+            return 0;
+        }
+    }
+
+    // Buffered fallback: fread() + send() through a user-space buffer
+    char buffer[FRAME_CHUNK_SIZE];
+    while (length > 0) {
+        size_t want = length < sizeof(buffer) ? length : sizeof(buffer);
+        size_t got = fread(buffer, 1, want, file);
+        if (got == 0) return -1;  // File shrank underneath us; the frame can't be completed
+        if (send_all(sock, buffer, got) < 0) return -1;
+        length -= got;
+    }
+    return 0;
+}
+
+// Stream `length` bytes of an open file from `offset` as one OP_DATA frame, then
+// OP_END carrying end_text (NULL for an empty OP_END)
+// Returns number of bytes sent, or -1 on error (the connection is then unusable)
+static inline long long send_file_range(int sock, uint32_t request_id, FILE *file, long long offset,
+                                        long long length, const char *end_text) {
+    if (fseeko(file, offset, SEEK_SET) < 0) return -1;
+    if (length > 0) {
+        if (send_frame_header(sock, OP_DATA, 0, request_id, length) < 0) return -1;
+        if (send_file_body(sock, file, length, NULL) < 0) return -1;
+    }
+    if (send_frame(sock, OP_END, 0, request_id, end_text, end_text ? strlen(end_text) : 0) < 0) return -1;
+    return length;
+}
+
+// Stream an open file as one OP_DATA frame sized to the file, then OP_END
+// carrying the file's CRC32C so the receiver can check what arrived
+// (the CRC is taken from the page cache once sendfile() has sent the bytes)
+// Returns number of bytes sent, or -1 on error (the connection is then unusable)
+static inline long long send_file_stream(int sock, uint32_t request_id, FILE *file) {
+    struct stat st;
+    uint32_t crc;
+    char end_text[32] = "";
+    if (fstat(fileno(file), &st) < 0) return -1;
+    if (fseeko(file, 0, SEEK_SET) < 0) return -1;
+    if (st.st_size > 0) {
+        if (send_frame_header(sock, OP_DATA, 0, request_id, st.st_size) < 0) return -1;
+        if (send_file_body(sock, file, st.st_size, NULL) < 0) return -1;
+    }
+    if (crc32c_fd(fileno(file), 0, st.st_size, &crc) == 0) checksum_format(end_text, sizeof(end_text), crc);
+    if (send_frame(sock, OP_END, 0, request_id, end_text, strlen(end_text)) < 0) return -1;
+    return (long long)st.st_size;
+}
+
+// Send a stream read from any FILE* (e.g. a popen() pipe) as chunked OP_DATA frames plus OP_END
+static inline long long send_pipe_stream(int sock, uint32_t request_id, FILE *in) {
+    char buffer[FRAME_CHUNK_SIZE];
+    long long total = 0;
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (send_frame(sock, OP_DATA, 0, request_id, buffer, got) < 0) return -1;
+        total += got;
+    }
+    if (send_frame(sock, OP_END, 0, request_id, NULL, 0) < 0) return -1;
+    return total;
+}
+
+/* Where recv_stream_checked() puts what it receives */
+struct stream_sink {
+    struct uring_writer *w;  // The ring's writer, or NULL
+    FILE *file;              // Otherwise this stream (NULL: discard)
+    uint32_t *crc;           // Continued over every byte (may be NULL)
+    long long total;         // Bytes put so far
+};
+
+// frame_inflate() output callback for recv_stream_checked()
+static inline int stream_sink_put(void *arg, const unsigned char *p, size_t n) {
+    struct stream_sink *s = arg;
+    if (s->crc) *s->crc = crc32c(*s->crc, p, n);
+    s->total += n;
+    if (!s->w) return s->file && fwrite(p, 1, n, s->file) != n ? -1 : 0;
+    while (n > 0) {
+        size_t avail;
+        char *dst = uring_writer_space(s->w, &avail);
+        size_t k = n < avail ? n : avail;
+        memcpy(dst, p, k);
+        uring_writer_commit(s->w, k);
+        p += k;
+        n -= k;
+    }
+    return 0;
+}
+
+// Receive a response into a file: OP_DATA frames are written to `file` until OP_END
+// With the io_uring engine the file writes (and DFS_FSYNC's fsync) are queued
+// on the ring while the next bytes are received. FRAME_DEFLATE frames are
+// inflated on the way.
+// crc (may be NULL) is continued over every byte received, and the OP_END
+// payload (e.g. the sender's "crc32c=...") is copied into msg ("" if none).
+// If the response is OP_MSG/OP_ERROR its text is copied into msg instead
+// Returns bytes written, -1 on connection/protocol/write error, -2 if the peer sent a message
+static inline long long recv_stream_checked(int sock, FILE *file, char *msg, size_t msg_size, uint32_t *crc) {
+    struct frame_header h;
+    char buffer[FRAME_CHUNK_SIZE];
+    struct uring_writer w;
+    int use_uring = file && uring_writer_open(&w, file) == 0;
+    struct stream_sink sink = { use_uring ? &w : NULL, file, crc, 0 };
+    struct frame_inflate inflater = { .started = 0 };
+    long long result = -1;
+
+    while (1) {
+        if (recv_frame_header(sock, &h) < 0) break;
+        if (h.opcode == OP_END) {
+            if (recv_text_payload(sock, h.length, msg, msg_size) < 0) break;
+            if (frame_inflate_end(&inflater) == 0) result = sink.total;
+            break;
+        }
+        if (h.opcode == OP_MSG || h.opcode == OP_ERROR) {
+            if (recv_text_payload(sock, h.length, msg, msg_size) == 0) result = -2;
+            break;
+        }
+        if (h.opcode != OP_DATA) break;
+
+        if (h.flags & FRAME_DEFLATE) {
+            // Only a receiver that keeps or checks the bytes inflates them
+            if ((file || crc) ? recv_inflated(sock, h.length, &inflater, stream_sink_put, &sink) < 0
+                              : skip_payload(sock, h.length) < 0)
+                goto done;
+            continue;
+        }
+        uint64_t remaining = h.length;
+        while (remaining > 0) {
+            size_t n = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+            char *dst = buffer;
+            if (use_uring) {
+                size_t avail;
+                dst = uring_writer_space(&w, &avail);  // recv() straight into the ring's buffer
+                if (n > avail) n = avail;
+            }
+            if (recv_all(sock, dst, n) < 0) goto done;
+            if (crc) *crc = crc32c(*crc, dst, n);  // While the bytes are still in cache
+            if (use_uring)
+                uring_writer_commit(&w, n);
+            else if (file && fwrite(buffer, 1, n, file) != n)
+                goto done;  // Disk full or write error: the file is incomplete
+            remaining -= n;
+        }
+        sink.total += h.length;
+    }
+
+done:
+    frame_inflate_end(&inflater);
+    if (use_uring) {
+        if (uring_writer_close(&w, result >= 0 && fsync_enabled()) < 0 && result >= 0) result = -1;
+    } else if (file && result >= 0) {
+        // Buffered bytes that can't be written fail the transfer too
+        if (fflush(file) != 0 || (fsync_enabled() && fileno(file) >= 0 && fsync(fileno(file)) < 0)) result = -1;
+    }
+    return result;
+}
+
+// Receive a response into a file (see recv_stream_checked)
+static inline long long recv_stream_to_file(int sock, FILE *file, char *msg, size_t msg_size) {
+    return recv_stream_checked(sock, file, msg, msg_size, NULL);
+}
+
+#define RECV_AT_BUFFER (16 * FRAME_CHUNK_SIZE)  // recv_stream_at() reads this much per pwrite()
+
+/* Where recv_stream_at() puts inflated bytes */
+struct stream_at {
+    int fd;
+    off_t offset;         // Where the next byte goes
+    long long *written;   // Advanced as bytes land (may be NULL)
+    long long total;
+};
+
+// frame_inflate() output callback for recv_stream_at()
+static inline int stream_at_put(void *arg, const unsigned char *p, size_t n) {
+    struct stream_at *s = arg;
+    while (n > 0) {
+        ssize_t w = pwrite(s->fd, p, n, s->offset);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        n -= w;
+        s->offset += w;
+        s->total += w;
+        if (s->written) *s->written += w;
+    }
+    return 0;
+}
+
+// Receive a response into a file descriptor at `offset` with pwrite(), so several
+// streams can fill different ranges of one file at once
+// *written (may be NULL) is advanced as bytes land, so after a failure the
+// caller knows where to resume. FRAME_DEFLATE frames are inflated in place.
+// The OP_END payload (e.g. "size=N"), or the text of an OP_MSG/OP_ERROR, is
+// copied into msg ("" if none).
+// Returns bytes written, -1 on connection/protocol/write error, -2 if the peer sent a message
+static inline long long recv_stream_at(int sock, int fd, off_t offset, long long *written, char *msg,
+                                       size_t msg_size) {
+    struct frame_header h;
+    char *buffer = malloc(RECV_AT_BUFFER);
+    struct stream_at at = { fd, offset, written, 0 };
+    struct frame_inflate inflater = { .started = 0 };
+    long long result = -1;
+    msg[0] = '\0';
+
+    while (buffer && recv_frame_header(sock, &h) == 0) {
+        if (h.opcode == OP_END) {
+            if (recv_text_payload(sock, h.length, msg, msg_size) == 0 && frame_inflate_end(&inflater) == 0)
+                result = at.total;
+            break;
+        }
+        if (h.opcode == OP_MSG || h.opcode == OP_ERROR) {
+            if (recv_text_payload(sock, h.length, msg, msg_size) == 0) result = -2;
+            break;
+        }
+        if (h.opcode != OP_DATA) break;
+        if (h.flags & FRAME_DEFLATE) {
+            if (recv_inflated(sock, h.length, &inflater, stream_at_put, &at) < 0) break;
+            continue;
+        }
+
+        uint64_t remaining = h.length;
+        while (remaining > 0) {
+            ssize_t n = recv(sock, buffer, remaining < RECV_AT_BUFFER ? remaining : RECV_AT_BUFFER, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) goto done;
+            // Write whatever arrived before waiting for more
+            if (stream_at_put(&at, (unsigned char *)buffer, n) < 0) goto done;
+            remaining -= n;
+        }
+    }
+
+done:
+    frame_inflate_end(&inflater);
+    free(buffer);
+    return result;
+}
+
+/* Byte counters for relay_stream(), one per relay mode */
+struct relay_counters {
+    unsigned long long spliced;  // Payload bytes moved socket -> pipe -> socket with splice()
+    unsigned long long copied;   // Payload bytes moved through a user-space buffer
+};
+
+// Move len payload bytes from one socket to another without entering user space:
+// socket -> pipe with splice(), then pipe -> socket with splice()
+// Returns 0 on success, 1 if splice is unsupported and nothing was moved, -1 on error
+static inline int splice_payload(int from, int to, int pipefd[2], uint64_t len) {
+    int moved = 0;
+    while (len > 0) {
+        size_t want = len < 65536 ? len : 65536;  // Default pipe capacity
+        ssize_t in = splice(from, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) continue;
+        if (in < 0 && !moved && (errno == EINVAL || errno == ENOSYS)) return 1;
+        if (in <= 0) return -1;
+        moved = 1;
+        len -= in;
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, to, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) continue;
+            if (out <= 0) return -1;
+            in -= out;
+        }
+    }
+    return 0;
+}
+
+// Move len payload bytes from one socket to another through a user-space buffer
+static inline int copy_payload(int from, int to, uint64_t len) {
+    char buffer[FRAME_CHUNK_SIZE];
+    while (len > 0) {
+        size_t n = len < sizeof(buffer) ? len : sizeof(buffer);
+        if (recv_all(from, buffer, n) < 0) return -1;
+        if (send_all(to, buffer, n) < 0) return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// Relay one complete response from one socket to another, frame by frame,
+// starting with a header the caller already read off `from` (first; NULL if none)
+// OP_DATA payloads are spliced through a pipe when the kernel allows it (and
+// DFS_ZEROCOPY isn't 0); other frames and the fallback path copy through a buffer.
+// counters (may be NULL) accumulates the payload bytes moved by each mode.
+// Returns number of OP_DATA payload bytes relayed, -2 if `from` failed before
+// anything was forwarded (the caller may still answer), or -1 on a mid-stream error
+static inline long long relay_stream_from(int from, int to, struct relay_counters *counters,
+                                          const struct frame_header *first) {
+    struct frame_header h;
+    long long total = 0;
+    int forwarded = 0;
+    int pipefd[2] = {-1, -1};
+    int use_splice = zerocopy_enabled() && pipe2(pipefd, O_CLOEXEC) == 0;
+    long long result = -1;
+
+    while (1) {
+        if (first) {
+            h = *first;
+            first = NULL;
+        } else if (recv_frame_header(from, &h) < 0) {
+            result = forwarded ? -1 : -2;
+            break;
+        }
+        forwarded = 1;
+        if (send_frame_header(to, h.opcode, h.flags, h.request_id, h.length) < 0) break;
+
+        int rc = 1;
+        if (use_splice && h.opcode == OP_DATA && h.length > 0) {
+            rc = splice_payload(from, to, pipefd, h.length);
+            if (rc == 0 && counters) __atomic_add_fetch(&counters->spliced, h.length, __ATOMIC_RELAXED);
+            if (rc == 1) use_splice = 0;  // Not supported for these sockets; stop trying
+        }
+        if (rc == 1) {
+            rc = copy_payload(from, to, h.length);
+            if (rc == 0 && counters && h.opcode == OP_DATA)
+                __atomic_add_fetch(&counters->copied, h.length, __ATOMIC_RELAXED);
+        }
+        if (rc < 0) break;
+
+        if (h.opcode == OP_DATA) total += h.length;
+        if (h.opcode == OP_END || h.opcode == OP_MSG || h.opcode == OP_ERROR) {
+            result = total;
+            break;
+        }
+    }
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+    }
+    return result;
+}
+
+// Relay one complete response from one socket to another (see relay_stream_from)
+static inline long long relay_stream(int from, int to, struct relay_counters *counters) {
+    return relay_stream_from(from, to, counters, NULL);
+}
+
+// Relay one stream (OP_DATA frames up to OP_END) from one socket to several,
+// as when an upload is written to every replica at once. A destination that
+// fails is marked -1 in `to` and dropped; the others keep going.
+// Returns number of OP_DATA payload bytes read, or -1 if `from` failed or the
+// stream ended with something other than OP_END
+static inline long long relay_stream_fanout(int from, int *to, int nto) {
+    struct frame_header h;
+    char buffer[FRAME_CHUNK_SIZE];
+    long long total = 0;
+    while (recv_frame_header(from, &h) == 0) {
+        if (h.opcode != OP_DATA && h.opcode != OP_END) return -1;
+        for (int i = 0; i < nto; i++)
+            if (to[i] >= 0 && send_frame_header(to[i], h.opcode, h.flags, h.request_id, h.length) < 0) to[i] = -1;
+        uint64_t remaining = h.length;
+        while (remaining > 0) {
+            size_t n = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+            if (recv_all(from, buffer, n) < 0) return -1;
+            for (int i = 0; i < nto; i++)
+                if (to[i] >= 0 && send_all(to[i], buffer, n) < 0) to[i] = -1;
+            remaining -= n;
+        }
+        if (h.opcode == OP_END) return total;
+        total += h.length;
+    }
+    return -1;
+}
+
+#endif
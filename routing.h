@@ -0,0 +1,462 @@
+// routing.h - S1's routing table: which server stores which files //
+//
+// S1 decides where a file lives from its name alone. The rules are read at
+// startup from a config file (S1_ROUTES, default ./routes.conf; the built-in
+// table below is used when there is no file) with one route per line:
+//
+//     # pattern   server  backends
+//     .c          S1      local
+//     .pdf        S2      127.0.0.1:1202
+//     .txt        S3      127.0.0.1:1203,10.0.0.7:1203
+//     draft-*.pdf S5      10.0.0.9:1205
+//     .pdf        S2      127.0.0.1:1202,127.0.0.1:1212,10.0.0.8:1202*2  hash
+//     .zip        S4      127.0.0.1:1206,127.0.0.1:1216  replicas=2 sync
+//
+// pattern is an extension (".pdf") or a glob matched against the file's base
+// name ("draft-*.pdf"). server is the storage root a ~S1 path is rewritten
+// to (~S2/...). backends are host:port pairs tried in order until one
+// answers; "local" means S1 stores those files itself under ~/S1.
+//
+// With "hash" after the backends the route is sharded instead: each backend
+// is a separate instance holding its own part of the files, and a file's
+// path picks its instance on a consistent-hash ring (route_find). Every
+// backend gets ROUTE_VNODES points on the ring per unit of weight
+// ("host:port*2" doubles its share), so adding or removing an instance
+// moves only the files whose arc changed hands. Listings and downltar ask
+// every instance and merge the results.
+//
+// "replicas=N" keeps N copies of every file: on the first N backends of a
+// failover route, or on the owning shard and the next N-1 distinct shards
+// clockwise on the ring. "sync" (the default) streams an upload to all N at
+// once and reports success once a quorum has stored it (a majority, or
+// "quorum=W"); "async" answers after the first copy and lets S1's replicator
+// fill in the rest. Reads go to the least-loaded healthy replica.
+//
+// Extension routes sit in an open-addressed hash, so resolving a name is one
+// hash probe. Glob routes are tried first, in file order; none are configured
+// by default. Sending S1 SIGHUP re-reads the file (routes_reloader): requests
+// already in flight finish with the route they resolved, and a file with
+// errors leaves the current table in place.
+#ifndef ROUTING_H
+#define ROUTING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fnmatch.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define ROUTE_MAX 32             // Routes per table
+#define ROUTE_MAX_BACKENDS 8     // host:port pairs per route
+#define ROUTE_HASH_SIZE 64       // Extension hash slots (power of two, > 2 * ROUTE_MAX)
+#define ROUTE_VNODES 128         // Ring points per backend per unit of weight
+#define ROUTE_MAX_WEIGHT 64      // Largest "*weight" accepted
+#define ROUTES_FILE "routes.conf"
+
+/* One sub-server address */
+struct route_backend {
+    char host[64];
+    int port;
+    int weight;                  // Share of a sharded route's files (1 unless "*n" is given)
+};
+
+/* One virtual node of a sharded route on the hash ring */
+struct ring_point {
+    uint32_t hash;
+    int backend;                 // Index in the route's backends
+};
+
+/* One routing rule */
+struct route {
+    char pattern[64];            // ".pdf" or a glob such as "draft-*.pdf"
+    char ext[16];                // Extension the route's files carry (listings, downltar); may be ""
+    char server[16];             // Storage root name: "S2" -> paths under ~S2
+    int local;                   // Stored by S1 itself
+    int sharded;                 // "hash": backends are shards, not failover alternatives
+    int replicas;                // Copies kept of each file ("replicas=N", 1 = none)
+    int quorum;                  // Copies stored before an upload is acknowledged
+    int async;                   // Upload to one replica; S1's replicator copies it to the rest
+    int nbackends;
+    struct route_backend backends[ROUTE_MAX_BACKENDS];
+    int ring_first, ring_count;  // This route's points in the table's ring (sharded only)
+    // Filled in per request by route_find: backends to use for the file, in
+    // order of preference. A failover route lists all of them; a sharded route
+    // lists the shards holding the path: the owner, then its replicas.
+    int order[ROUTE_MAX_BACKENDS];
+    int norder;
+};
+
+/* An immutable, reference-counted set of routes; a reload swaps in a new one */
+struct route_table {
+    int refs;
+    unsigned generation;         // Changes on every reload
+    struct route routes[ROUTE_MAX];
+    int count;
+    int by_ext[ROUTE_HASH_SIZE]; // Extension route index + 1, 0 = empty slot
+    int globs[ROUTE_MAX];        // Glob route indexes, in file order
+    int nglobs;
+    struct ring_point *ring;     // Hash rings of all sharded routes, each sorted by hash
+    int ring_size;
+    char source[256];            // Where the table came from (for the log)
+};
+
+static struct route_table *routes_current;
+static pthread_rwlock_t routes_lock = PTHREAD_RWLOCK_INITIALIZER;
+static unsigned routes_generation;
+
+/* Used when no routes file exists: the original four-server layout */
+static const char *routes_builtin[] = {
+    ".c   S1 local",
+    ".pdf S2 127.0.0.1:1202",
+    ".txt S3 127.0.0.1:1203",
+    ".zip S4 127.0.0.1:1206",
+};
+
+static inline unsigned route_hash(const char *ext) {
+    unsigned h = 2166136261u;  // FNV-1a
+    for (const char *p = ext; *p; p++) h = (h ^ (unsigned char)*p) * 16777619u;
+    return h & (ROUTE_HASH_SIZE - 1);
+}
+
+// 32-bit position on the hash ring: FNV-1a 64 with a murmur3 finalizer, so
+// similar keys ("a/1.pdf", "a/2.pdf") still land far apart
+static inline uint32_t ring_hash(const char *s, size_t len) {
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)s[i]) * 1099511628211ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+// Write the placement key of a client or sub-server path into out: the path
+// below its "~Sx" root with duplicate slashes dropped, so "~S1/docs//a.pdf"
+// and "~S2/docs/a.pdf" both hash as "docs/a.pdf"
+static inline void shard_key(const char *path, char *out, size_t size) {
+    if (path[0] == '~') {
+        const char *slash = strchr(path, '/');
+        path = slash ? slash : "";
+    }
+    size_t n = 0;
+    for (const char *p = path; *p && n + 1 < size; p++) {
+        if (*p == '/' && (n == 0 || out[n - 1] == '/')) continue;
+        out[n++] = *p;
+    }
+    out[n] = '\0';
+}
+
+static inline int ring_point_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct ring_point *)a)->hash, y = ((const struct ring_point *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// Lay out the virtual nodes of a sharded route on the table's ring
+// Returns 0, or -1 if out of memory
+static inline int route_build_ring(struct route_table *t, struct route *r) {
+    int points = 0;
+    for (int i = 0; i < r->nbackends; i++) points += r->backends[i].weight * ROUTE_VNODES;
+    struct ring_point *grown = realloc(t->ring, (t->ring_size + points) * sizeof(*grown));
+    if (!grown) return -1;
+    t->ring = grown;
+    r->ring_first = t->ring_size;
+    r->ring_count = points;
+    struct ring_point *p = t->ring + t->ring_size;
+    for (int i = 0; i < r->nbackends; i++) {
+        for (int v = 0; v < r->backends[i].weight * ROUTE_VNODES; v++) {
+            char name[96];
+            int len = snprintf(name, sizeof(name), "%s:%d#%d", r->backends[i].host, r->backends[i].port, v);
+            p->hash = ring_hash(name, len);
+            p->backend = i;
+            p++;
+        }
+    }
+    qsort(t->ring + r->ring_first, points, sizeof(*t->ring), ring_point_cmp);
+    t->ring_size += points;
+    return 0;
+}
+
+// Fill r->order with r's backends in ring order from key's position: the
+// first is the shard that owns key, the rest are the next distinct shards
+static inline void route_walk_ring(const struct route_table *t, struct route *r, const char *key) {
+    const struct ring_point *ring = t->ring + r->ring_first;
+    uint32_t h = ring_hash(key, strlen(key));
+    int lo = 0, hi = r->ring_count;
+    while (lo < hi) {  // First point at or after h (wrapping to 0)
+        int mid = (lo + hi) / 2;
+        if (ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    int seen = 0;
+    r->norder = 0;
+    for (int i = 0; i < r->ring_count && r->norder < r->nbackends; i++) {
+        int b = ring[(lo + i) % r->ring_count].backend;
+        if (seen & (1 << b)) continue;
+        seen |= 1 << b;
+        r->order[r->norder++] = b;
+    }
+}
+
+// Parse the options after a route's backends: "hash", "replicas=N",
+// "sync", "async", "quorum=W" (a '#' ends the line)
+// Returns 0, or -1 with a reason in err
+static inline int route_parse_options(struct route *r, const char *opts, char *err, size_t err_size) {
+    char opt[32];
+    int used, async = 0, quorum = 0;
+    r->replicas = 1;
+    while (sscanf(opts, "%31s%n", opt, &used) == 1 && opt[0] != '#') {
+        opts += used;
+        if (strcmp(opt, "hash") == 0) r->sharded = 1;
+        else if (strcmp(opt, "sync") == 0) async = 0;
+        else if (strcmp(opt, "async") == 0) async = 1;
+        else if (strncmp(opt, "replicas=", 9) == 0) r->replicas = atoi(opt + 9);
+        else if (strncmp(opt, "quorum=", 7) == 0) quorum = atoi(opt + 7);
+        else {
+            snprintf(err, err_size, "unknown option \"%s\" (hash, replicas=N, sync, async, quorum=W)", opt);
+            return -1;
+        }
+    }
+    int most = r->local ? 1 : r->nbackends;
+    if (r->replicas < 1 || r->replicas > most) {
+        snprintf(err, err_size, "replicas=%d for %s (1 to %d)", r->replicas, r->pattern, most);
+        return -1;
+    }
+    if (quorum < 0 || quorum > r->replicas) {
+        snprintf(err, err_size, "quorum=%d for %s (0 for a majority, or 1 to replicas)", quorum, r->pattern);
+        return -1;
+    }
+    r->async = async;
+    r->quorum = async ? 1 : quorum ? quorum : r->replicas / 2 + 1;
+    return 0;
+}
+
+// Parse one "pattern server backends [options]" line into the table
+// Returns 0 on success (or for a blank/comment line), -1 with a reason in err
+static inline int route_parse_line(struct route_table *t, const char *line, char *err, size_t err_size) {
+    char pattern[64], server[16], backends[512];
+    int opts = 0;
+    const char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == '\0') return 0;
+    if (sscanf(p, "%63s %15s %511s%n", pattern, server, backends, &opts) < 3) {
+        snprintf(err, err_size, "expected \"pattern server backends [hash] [replicas=N]\"");
+        return -1;
+    }
+    if (t->count == ROUTE_MAX) {
+        snprintf(err, err_size, "more than %d routes", ROUTE_MAX);
+        return -1;
+    }
+
+    struct route *r = &t->routes[t->count];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->pattern, sizeof(r->pattern), "%s", pattern);
+    snprintf(r->server, sizeof(r->server), "%s", server);
+    int glob = strpbrk(pattern, "*?[") != NULL;
+    if (!glob && pattern[0] != '.') {
+        snprintf(err, err_size, "pattern \"%s\" is neither an extension nor a glob", pattern);
+        return -1;
+    }
+    if (!glob && strchr(pattern + 1, '.')) {
+        snprintf(err, err_size, "\"%s\": an extension has one dot (use a glob such as *%s)", pattern, pattern);
+        return -1;
+    }
+
+    // A glob's files still carry the extension it ends with ("draft-*.pdf" -> ".pdf")
+    const char *dot = strrchr(pattern, '.');
+    if (dot && !strpbrk(dot, "*?[")) snprintf(r->ext, sizeof(r->ext), "%s", dot);
+
+    if (strcmp(backends, "local") == 0) {
+        r->local = 1;
+    } else {
+        for (char *save = NULL, *tok = strtok_r(backends, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+            char *colon = strrchr(tok, ':');
+            if (!colon || r->nbackends == ROUTE_MAX_BACKENDS) {
+                snprintf(err, err_size, "bad backend \"%s\" (want host:port, at most %d)", tok, ROUTE_MAX_BACKENDS);
+                return -1;
+            }
+            struct route_backend *b = &r->backends[r->nbackends];
+            snprintf(b->host, sizeof(b->host), "%.*s", (int)(colon - tok), tok);
+            b->port = atoi(colon + 1);
+            char *star = strchr(colon, '*');
+            b->weight = star ? atoi(star + 1) : 1;
+            if (b->port <= 0 || b->port > 65535) {
+                snprintf(err, err_size, "bad port in \"%s\"", tok);
+                return -1;
+            }
+            if (b->weight < 1 || b->weight > ROUTE_MAX_WEIGHT) {
+                snprintf(err, err_size, "bad weight in \"%s\" (1 to %d)", tok, ROUTE_MAX_WEIGHT);
+                return -1;
+            }
+            r->nbackends++;
+        }
+        if (r->nbackends == 0) {
+            snprintf(err, err_size, "route %s has no backends", pattern);
+            return -1;
+        }
+    }
+    if (route_parse_options(r, p + opts, err, err_size) < 0) return -1;
+    if (r->local && r->sharded) {
+        snprintf(err, err_size, "local route %s can't be sharded", pattern);
+        return -1;
+    }
+    if (r->sharded && route_build_ring(t, r) < 0) {
+        snprintf(err, err_size, "out of memory for the hash ring of %s", pattern);
+        return -1;
+    }
+
+    if (glob) {
+        t->globs[t->nglobs++] = t->count;
+    } else {
+        unsigned h = route_hash(pattern);
+        while (t->by_ext[h] && strcmp(t->routes[t->by_ext[h] - 1].pattern, pattern) != 0)
+            h = (h + 1) & (ROUTE_HASH_SIZE - 1);
+        if (t->by_ext[h]) {
+            snprintf(err, err_size, "duplicate route for %s", pattern);
+            return -1;
+        }
+        t->by_ext[h] = t->count + 1;
+    }
+    t->count++;
+    return 0;
+}
+
+// Build a table from the routes file, or from routes_builtin if there is none
+// Returns the new table (one reference held), or NULL after printing why the file was rejected
+static inline struct route_table *route_table_load(void) {
+    const char *path = getenv("S1_ROUTES");
+    if (!path) path = ROUTES_FILE;
+    struct route_table *t = calloc(1, sizeof(*t));
+    if (!t) return NULL;
+    t->refs = 1;
+
+    char line[640], err[256];
+    FILE *f = fopen(path, "r");
+    if (f) {
+        int lineno = 0;
+        while (fgets(line, sizeof(line), f)) {
+            lineno++;
+            if (route_parse_line(t, line, err, sizeof(err)) < 0) {
+                fprintf(stderr, "[S1] %s:%d: %s\n", path, lineno, err);
+                fclose(f);
+                free(t->ring);
+                free(t);
+                return NULL;
+            }
+        }
+        fclose(f);
+        snprintf(t->source, sizeof(t->source), "%s", path);
+    } else {
+        for (size_t i = 0; i < sizeof(routes_builtin) / sizeof(routes_builtin[0]); i++)
+            route_parse_line(t, routes_builtin[i], err, sizeof(err));
+        snprintf(t->source, sizeof(t->source), "built-in defaults");
+    }
+    return t;
+}
+
+// Take a reference to the current table (for walking every route)
+static inline struct route_table *routes_acquire(void) {
+    pthread_rwlock_rdlock(&routes_lock);
+    struct route_table *t = routes_current;
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_ACQ_REL);
+    pthread_rwlock_unlock(&routes_lock);
+    return t;
+}
+
+static inline void routes_release(struct route_table *t) {
+    if (t && __atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(t->ring);
+        free(t);
+    }
+}
+
+// Find the route for a file name (or a bare extension such as ".pdf") in t
+// Returns the route, or NULL if no route matches
+static inline const struct route *route_lookup(const struct route_table *t, const char *name) {
+    const char *base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    for (int i = 0; i < t->nglobs; i++)
+        if (fnmatch(t->routes[t->globs[i]].pattern, base, 0) == 0) return &t->routes[t->globs[i]];
+
+    const char *ext = strrchr(base, '.');
+    if (!ext) return NULL;
+    for (unsigned h = route_hash(ext); t->by_ext[h]; h = (h + 1) & (ROUTE_HASH_SIZE - 1))
+        if (strcmp(t->routes[t->by_ext[h] - 1].pattern, ext) == 0) return &t->routes[t->by_ext[h] - 1];
+    return NULL;
+}
+
+// Fill in r->order/norder for one file (key from shard_key, or NULL when the
+// request isn't about one file). The file's replicas are order[0..replicas).
+static inline void route_place(const struct route_table *t, struct route *r, const char *key) {
+    if (r->sharded && key) {
+        route_walk_ring(t, r, key);
+        r->norder = r->replicas;  // Only the owner and its replicas have the file
+        return;
+    }
+    for (int i = 0; i < r->nbackends; i++) r->order[i] = i;
+    r->norder = r->nbackends;
+}
+
+// Resolve a file against the current table
+// Parameters:
+//   name - file name or path (or a bare extension such as ".pdf")
+//   key - placement key of the file's path (shard_key), or NULL
+//   out - receives a copy of the route with order/norder filled in
+// Returns 0, or -1 if no route matches
+static inline int route_find(const char *name, const char *key, struct route *out) {
+    pthread_rwlock_rdlock(&routes_lock);
+    const struct route *r = route_lookup(routes_current, name);
+    if (r) {
+        *out = *r;
+        route_place(routes_current, out, key);
+    }
+    pthread_rwlock_unlock(&routes_lock);
+    return r ? 0 : -1;
+}
+
+// Load the table, replacing the current one
+// Returns 0 on success, -1 if the file was rejected (the old table stays)
+static inline int routes_reload(void) {
+    struct route_table *t = route_table_load();
+    if (!t) return -1;
+    pthread_rwlock_wrlock(&routes_lock);
+    struct route_table *old = routes_current;
+    t->generation = ++routes_generation;
+    routes_current = t;
+    pthread_rwlock_unlock(&routes_lock);
+    routes_release(old);
+    printf("[S1] Loaded %d routes from %s\n", t->count, t->source);
+    return 0;
+}
+
+// Thread that reloads the routing table on every SIGHUP
+// SIGHUP must be blocked in all threads (see routes_init) so sigwait() sees it
+static inline void *routes_reloader(void *arg) {
+    (void)arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    while (1) {
+        int sig;
+        if (sigwait(&set, &sig) == 0 && sig == SIGHUP) routes_reload();
+    }
+    return NULL;
+}
+
+// Load the first table and start the SIGHUP reloader (call from main before
+// any other thread is created, so they all inherit the blocked signal)
+// Returns 0, or -1 if the routes file is unusable
+static inline int routes_init(void) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (routes_reload() < 0) return -1;
+    pthread_t t;
+    pthread_create(&t, NULL, routes_reloader, NULL);
+    pthread_detach(t);
+    return 0;
+}
+
+#endif
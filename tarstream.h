@@ -0,0 +1,758 @@
+// tarstream.h - In-process streaming tar writer used by downltar //
+//
+// Walks a storage directory and writes a POSIX ustar archive straight to a
+// socket as protocol frames: no shell, no find/tar processes, no command-line
+// length limits. Small members (header, body, padding) are packed into a
+// TAR_FRAME_BYTES buffer that goes out as one OP_DATA frame, so a tree of
+// many small files costs a few sends rather than several per file. Files of
+// TAR_INLINE_MAX bytes or more get a frame of their own whose body is sent
+// with send_file_body(), i.e. sendfile() or the io_uring engine (a manifest's,
+// chunk by chunk from the chunk store; a file stored compressed, inflated).
+// Names longer than ustar allows and files of 8 GiB or more get a pax
+// extended header ('x' member) in front of them. When the namespace index
+// (nsindex.h) covers the tree, membership comes from memory instead of a walk.
+// tar_concat joins the archives of several servers (S1 asking every shard of
+// a type) into one: each stream's end-of-archive blocks are held back and
+// dropped, and one pair closes the combined archive. When the servers are
+// replicas that may hold the same files, the joined streams are parsed
+// member by member instead and a name already in the archive is skipped.
+// The joining server's own files can go in between (tar_concat_local), so
+// one archive may span several types and servers.
+// Options after the type narrow an archive to a directory (dir=), file
+// names matching a pattern (glob=) and files modified since a time
+// (since=); the filters are applied by whichever server walks the files,
+// from its namespace index when it has one, so an incremental export reads
+// and sends only what changed.
+// Either kind of archive can go out gzipped ("downltar <type> gz"): every
+// byte then passes through a parallel gzip stream (compress.h) and the
+// frames carry .tar.gz bytes, which the client saves as they come.
+#ifndef TARSTREAM_H
+#define TARSTREAM_H
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "listing.h"
+#include "chunkstore.h"
+
+#define TAR_BLOCK 512
+#define TAR_MAX_OCTAL_SIZE 077777777777ULL  // Largest size an 11-digit octal field holds
+#define TAR_FRAME_BYTES (256 * 1024)         // Coalescing buffer: members packed per OP_DATA frame
+#define TAR_INLINE_MAX  (64 * 1024)          // Bodies this large or larger are sent with sendfile
+#define TAR_CONCAT_CHUNK (256 * 1024)        // Bytes relayed per OP_DATA frame when joining archives
+#define TAR_OPTION_UNKNOWN "Error: Unknown archive option (use gz, dir=, glob= or since=).\n"
+
+/* Totals for one archive (for logging) */
+struct tar_stats {
+    long long files;  // Members written
+    long long bytes;  // File body bytes written
+    long long packed; // Archive bytes sent after gzip (0 if not gzipped)
+};
+
+/* What a downltar archives: the options after the type (default: every
+ * file of the type in the server's tree, as a plain tar) */
+struct tar_scope {
+    int gzip;                 // "gz" (or "gzip", "tgz"): gzip the archive
+    char dir[512];            // "dir=~S1/sub": only files under this directory ("" = the whole tree)
+    char glob[NAME_MAX + 1];  // "glob=2026-*": only files whose name matches
+    time_t since;             // "since=...": only files modified at or after this time (0 = any)
+};
+
+// Parse a since= time: seconds since the epoch, or YYYY-MM-DD[THH:MM:SS] in UTC
+// Returns the time, or -1 if it isn't one
+static inline time_t tar_parse_time(const char *text) {
+    char *end;
+    long long seconds = strtoll(text, &end, 10);
+    if (end != text && *end == '\0') return seconds >= 0 ? (time_t)seconds : -1;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *rest = strptime(text, "%Y-%m-%d", &tm);
+    if (rest && *rest == 'T') rest = strptime(rest + 1, "%H:%M:%S", &tm);
+    return rest && *rest == '\0' ? timegm(&tm) : -1;
+}
+
+// Parse downltar's options (the words after the type) into s
+// Returns 0, or -1 on an unknown option, a bad time or a dir that climbs out with ".."
+// (zstd isn't built in, so gz is the only compression)
+static inline int tar_parse_scope(const char *opts, struct tar_scope *s) {
+    memset(s, 0, sizeof(*s));
+    char word[NAME_MAX + 16];
+    int used;
+    while (opts && sscanf(opts, "%270s%n", word, &used) == 1) {
+        opts += used;
+        char *eq = strchr(word, '=');
+        const char *val = eq ? eq + 1 : "";
+        if (eq) *eq = '\0';
+        if (!eq && (strcmp(word, "gz") == 0 || strcmp(word, "gzip") == 0 || strcmp(word, "tgz") == 0)) {
+            s->gzip = 1;
+        } else if (eq && strcmp(word, "dir") == 0) {
+            size_t len = strlen(val);
+            if (strcmp(val, "..") == 0 || strncmp(val, "../", 3) == 0 || strstr(val, "/../") ||
+                (len >= 3 && strcmp(val + len - 3, "/..") == 0) || len >= sizeof(s->dir))
+                return -1;
+            snprintf(s->dir, sizeof(s->dir), "%s", val);
+        } else if (eq && strcmp(word, "glob") == 0) {
+            snprintf(s->glob, sizeof(s->glob), "%s", val);
+        } else if (eq && strcmp(word, "since") == 0) {
+            if ((s->since = tar_parse_time(val)) < 0) return -1;
+        } else if (strcmp(word, "tar") != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Format s back into option words for a sub-server: dir (already rewritten
+// for that server, may be ""), glob and since, plus "gz" if gzip is set
+static inline void tar_format_scope(const struct tar_scope *s, int gzip, const char *dir, char *out, size_t size) {
+    int n = snprintf(out, size, "%s", gzip ? " gz" : "");
+    if (dir[0] && n < (int)size) n += snprintf(out + n, size - n, " dir=%s", dir);
+    if (s->glob[0] && n < (int)size) n += snprintf(out + n, size - n, " glob=%s", s->glob);
+    if (s->since > 0 && n < (int)size) snprintf(out + n, size - n, " since=%lld", (long long)s->since);
+}
+
+// Where a scoped archive starts: root plus s->dir without its "~Sx" server part
+static inline void tar_scope_top(const struct tar_scope *s, const char *root, char *out, size_t size) {
+    const char *sub = s ? s->dir : "";
+    if (sub[0] == '~') sub += strcspn(sub, "/");  // ~S1/sub, ~S3/sub -> /sub
+    while (sub[0] == '/') sub++;
+    size_t len = strlen(sub);
+    while (len > 0 && sub[len - 1] == '/') len--;
+    snprintf(out, size, "%s%s%.*s", root, len ? "/" : "", (int)len, sub);
+}
+
+/* Archive being streamed to one socket */
+struct tar_writer {
+    int sock;
+    uint32_t req_id;
+    char *buf;               // TAR_FRAME_BYTES of packed members not yet sent
+    size_t used;
+    struct tar_stats *stats;
+    struct gzip_par *gz;     // Gzip the archive on its way out (NULL: plain tar)
+    const struct tar_scope *scope;  // glob/since filters (NULL: every file)
+};
+
+// Whether a file named name passes the writer's glob filter
+static inline int tar_name_selected(const struct tar_writer *w, const char *name) {
+    return !w->scope || !w->scope->glob[0] || fnmatch(w->scope->glob, name, 0) == 0;
+}
+
+// Send the packed members as one OP_DATA frame (or into the gzip stream)
+static inline int tar_flush(struct tar_writer *w) {
+    if (w->used == 0) return 0;
+    if (w->gz) {
+        if (gzip_par_write(w->gz, w->buf, w->used) < 0) return -1;
+        w->used = 0;
+        return 0;
+    }
+    if (send_frame_header(w->sock, OP_DATA, 0, w->req_id, w->used) < 0) return -1;
+    if (send_all(w->sock, w->buf, w->used) < 0) return -1;
+    w->used = 0;
+    return 0;
+}
+
+// Write value as a zero-padded octal field of `width` bytes (NUL-terminated)
+// The digits are filled in from the right, so the field is never overrun
+// (callers keep values within width - 1 digits).
+static inline void tar_octal(char *field, size_t width, unsigned long long value) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i-- > 0; value >>= 3) field[i] = '0' + (value & 7);
+}
+
+// Fill in a ustar header block; name must already fit (see tar_split_name)
+static inline void tar_fill_header(unsigned char *block, const char *prefix, const char *name,
+                                   unsigned long long size, time_t mtime, mode_t mode, char type) {
+    memset(block, 0, TAR_BLOCK);
+    char *b = (char *)block;
+    strncpy(b, name, 100);                                      // Fields need no NUL when full
+    tar_octal(b + 100, 8, mode & 07777);
+    tar_octal(b + 108, 8, 0);                                   // uid
+    tar_octal(b + 116, 8, 0);                                   // gid
+    tar_octal(b + 124, 12, size <= TAR_MAX_OCTAL_SIZE ? size : 0);  // pax "size" carries big ones
+    tar_octal(b + 136, 12, mtime > 0 ? (unsigned long long)mtime : 0);
+    b[156] = type;
+    memcpy(b + 257, "ustar", 6);                                // magic "ustar\0"
+    memcpy(b + 263, "00", 2);                                   // version
+    strncpy(b + 345, prefix, 155);
+
+    // Checksum: byte sum of the block with the checksum field read as spaces
+    unsigned sum = 0;
+    memset(b + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) sum += block[i];
+    tar_octal(b + 148, 7, sum);
+    b[155] = ' ';
+}
+
+// Split a relative path into ustar prefix (<=155) and name (<=100) at a '/'
+// Returns 0 if it fits, -1 if the path needs a pax "path" record
+static inline int tar_split_name(const char *path, char *prefix, char *name) {
+    size_t len = strlen(path);
+    prefix[0] = '\0';
+    if (len <= 100) {
+        strcpy(name, path);
+        return 0;
+    }
+    for (const char *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        size_t plen = slash - path;
+        if (plen <= 155 && len - plen - 1 <= 100 && len - plen - 1 > 0) {
+            memcpy(prefix, path, plen);
+            prefix[plen] = '\0';
+            strcpy(name, slash + 1);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Append one pax record ("<len> <key>=<value>\n", len counting itself) to out
+// Returns the new length of out, or -1 if it doesn't fit
+static inline int tar_pax_record(char *out, int used, int size, const char *key, const char *value) {
+    int body = (int)(strlen(key) + strlen(value) + 3);  // ' ' '=' '\n'
+    int len = body + 1;
+    while ((int)snprintf(NULL, 0, "%d", len) + body > len) len++;
+    if (used + len >= size) return -1;
+    snprintf(out + used, size - used, "%d %s=%s\n", len, key, value);
+    return used + len;
+}
+
+// Add a manifest's content (size bytes, chunk by chunk) to a gzip stream
+// Returns 0, or -1 on a missing chunk or once the stream has failed
+static inline int tar_gzip_manifest(struct gzip_par *gz, const struct cas_manifest *m, long long size) {
+    char path[1200];
+    for (int i = 0; i < m->count && size > 0; i++) {
+        long long n = m->refs[i].len < size ? m->refs[i].len : size;
+        cas_chunk_path(m->refs[i].hash, path, sizeof(path));
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "Chunk store: missing chunk %s\n", m->refs[i].hash);
+            return -1;
+        }
+        int rc = gzip_par_file(gz, fd, 0, n);
+        close(fd);
+        if (rc < 0) return -1;
+        size -= n;
+    }
+    return size > 0 ? -1 : 0;
+}
+
+// Add one file as a tar member (pax header if needed, ustar header, body, padding)
+// rel is the member name; path is where to read it
+// Returns 0 on success, 1 if the file vanished or isn't readable (skipped), -1 on socket error
+static inline int tar_send_member(struct tar_writer *w, const char *path, const char *rel) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return 1;
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0 || !S_ISREG(st.st_mode) || (w->scope && st.st_mtime < w->scope->since)) {
+        fclose(file);
+        return 1;  // Gone, not a file, or older than the since= filter
+    }
+    // A manifest's body comes from the chunk store (chunkstore.h)
+    struct cas_manifest m;
+    int plain = cas_manifest_load(fileno(file), &m);
+    if (plain < 0) {
+        fclose(file);
+        return 1;  // Damaged manifest: leave it out
+    }
+    // A file stored compressed is inflated into the archive (compress.h)
+    long long zlen = plain ? compress_rest_len(fileno(file)) : -1;
+
+    unsigned char head[3 * TAR_BLOCK + PATH_MAX + 64];
+    size_t head_len = 0;
+    char prefix[156], name[101];
+    int need_path = tar_split_name(rel, prefix, name) < 0;
+    int need_size = (unsigned long long)st.st_size > TAR_MAX_OCTAL_SIZE;
+
+    // pax extended header for long names / huge files
+    if (need_path || need_size) {
+        char records[PATH_MAX + 64];
+        int used = 0;
+        if (need_path) used = tar_pax_record(records, used, sizeof(records), "path", rel);
+        if (used >= 0 && need_size) {
+            char size_text[32];
+            snprintf(size_text, sizeof(size_text), "%lld", (long long)st.st_size);
+            used = tar_pax_record(records, used, sizeof(records), "size", size_text);
+        }
+        if (used < 0) {
+            cas_manifest_free(&m);
+            fclose(file);
+            return 1;  // Can't describe it; leave it out rather than corrupt the archive
+        }
+        tar_fill_header(head, "", "PaxHeader", used, st.st_mtime, 0644, 'x');
+        memcpy(head + TAR_BLOCK, records, used);
+        size_t padded = (used + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        memset(head + TAR_BLOCK + used, 0, padded - used);
+        head_len = TAR_BLOCK + padded;
+
+        // Placeholders for the ustar fields the pax records override
+        if (need_path) {
+            prefix[0] = '\0';
+            snprintf(name, sizeof(name), "%.99s", rel);
+        }
+    }
+    tar_fill_header(head + head_len, prefix, name, st.st_size, st.st_mtime, st.st_mode, '0');
+    head_len += TAR_BLOCK;
+
+    static const char zeros[TAR_BLOCK];
+    uint64_t pad = (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK;
+    uint64_t member_len = head_len + st.st_size + pad;
+    int rc = -1;
+
+    if (st.st_size < TAR_INLINE_MAX && plain && zlen < 0) {
+        // Small file: pack header, body and padding into the frame buffer
+        if (w->used + member_len > TAR_FRAME_BYTES && tar_flush(w) < 0) goto out;
+        char *dst = w->buf + w->used;
+        memcpy(dst, head, head_len);
+        size_t got = st.st_size > 0 ? fread(dst + head_len, 1, st.st_size, file) : 0;
+        memset(dst + head_len + got, 0, st.st_size - got + pad);  // Shrunk underneath us: keep sizes consistent
+        w->used += member_len;
+    } else if (w->gz) {
+        // Large file, gzipped: the body is read straight into the gzip stream's blocks
+        if (tar_flush(w) < 0 || gzip_par_write(w->gz, head, head_len) < 0 ||
+            (!plain     ? tar_gzip_manifest(w->gz, &m, st.st_size)
+             : zlen > 0 ? compress_rest_read(fileno(file), zlen, 0, st.st_size, gzip_par_put, w->gz)
+                        : gzip_par_file(w->gz, fileno(file), 0, st.st_size)) < 0 ||
+            (pad > 0 && gzip_par_write(w->gz, zeros, pad) < 0))
+            goto out;
+    } else {
+        // Large file: its own frame, body via sendfile (or io_uring)
+        if (tar_flush(w) < 0) goto out;
+        if (send_frame_header(w->sock, OP_DATA, 0, w->req_id, member_len) < 0 ||
+            send_all_flags(w->sock, head, head_len, MSG_MORE) < 0 ||
+            (!plain     ? cas_send_body(w->sock, &m, 0, st.st_size)
+             : zlen > 0 ? compress_rest_read(fileno(file), zlen, 0, st.st_size, compress_sock_put, &w->sock)
+                        : send_file_body(w->sock, file, st.st_size, NULL)) < 0 ||
+            (pad > 0 && send_all(w->sock, zeros, pad) < 0))
+            goto out;
+    }
+    rc = 0;
+    w->stats->files++;
+    w->stats->bytes += st.st_size;
+out:
+    cas_manifest_free(&m);
+    fclose(file);
+    return rc;
+}
+
+// Recursively add every regular file under dir whose name ends in ext
+// rel_len is the length of the archive root prefix in dir (stripped from names)
+// Returns 0, or -1 once the socket has failed
+static inline int tar_walk(struct tar_writer *w, char *dir, size_t root_len, const char *ext) {
+    DIR *d = opendir(dir);
+    if (!d) return 0;
+    size_t dir_len = strlen(dir);
+    size_t ext_len = strlen(ext);
+    struct dirent *entry;
+    int rc = 0;
+
+    while (rc == 0 && (entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        size_t name_len = strlen(entry->d_name);
+        if (dir_len + 1 + name_len >= PATH_MAX) continue;
+        dir[dir_len] = '/';
+        memcpy(dir + dir_len + 1, entry->d_name, name_len + 1);
+
+        // Like find -type f: symlinks and special files are left out
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            if (lstat(dir, &st) == 0)
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_LNK;
+        }
+        if (type == DT_DIR) {
+            if (dir_len != root_len || !ns_internal_name(entry->d_name)) rc = tar_walk(w, dir, root_len, ext);
+        } else if (type == DT_REG && name_len > ext_len &&
+                   strcmp(entry->d_name + name_len - ext_len, ext) == 0 && tar_name_selected(w, entry->d_name)) {
+            if (tar_send_member(w, dir, dir + root_len + 1) < 0) rc = -1;
+        }
+        dir[dir_len] = '\0';
+    }
+    closedir(d);
+    return rc;
+}
+
+// Add every `ext` file the namespace index knows under top (root or a
+// directory below it), in path order, named relative to root. The scope's
+// glob and since filters are applied to the index entries, so files left
+// out are never opened. Paths are collected under the read lock, then sent
+// without holding it
+// Returns 0, -1 once the socket has failed, or -2 if the paths could not be
+// collected (out of memory; nothing was sent)
+static inline int tar_from_index(struct tar_writer *w, const char *root, const char *top, const char *ext) {
+    struct name_list paths = {0};
+    size_t root_len = strlen(root), top_len = strlen(top);
+    time_t since = w->scope ? w->scope->since : 0;
+    char rel[PATH_MAX];
+    int oom = 0;
+
+    pthread_rwlock_rdlock(&ns.lock);
+    for (int b = 0; b < NS_BUCKETS && !oom; b++) {
+        for (struct ns_dir *d = ns.buckets[b]; d && !oom; d = d->next) {
+            if (strncmp(d->path, top, top_len) != 0) continue;
+            if (d->path[top_len] != '\0' && d->path[top_len] != '/') continue;
+            const char *sub = d->path + root_len + (d->path[root_len] == '/');
+            for (size_t i = 0; i < d->count && !oom; i++) {
+                if (!has_extension(d->files[i].name, ext) || !tar_name_selected(w, d->files[i].name) ||
+                    d->files[i].mtime < since)
+                    continue;
+                snprintf(rel, sizeof(rel), "%s%s%s", sub, *sub ? "/" : "", d->files[i].name);
+                if (name_list_add(&paths, rel) < 0) oom = 1;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&ns.lock);
+    if (oom) {
+        name_list_free(&paths);
+        return -2;
+    }
+    qsort(paths.names, paths.count, sizeof(char *), cmp_names);
+
+    int rc = 0;
+    char path[PATH_MAX];
+    for (size_t i = 0; i < paths.count && rc == 0; i++) {
+        snprintf(path, sizeof(path), "%s/%s", root, paths.names[i]);
+        if (tar_send_member(w, path, paths.names[i]) < 0) rc = -1;
+    }
+    name_list_free(&paths);
+    return rc;
+}
+
+// Add every `ext` file in the writer's scope under root (the whole tree, or
+// the scope's dir=), from the namespace index when it covers that directory.
+// Member names stay relative to root, so a scoped export unpacks where a
+// full one would.
+// Returns 0, or -1 once the output has failed
+static inline int tar_add_tree(struct tar_writer *w, const char *root, const char *ext) {
+    char dir[PATH_MAX];
+    tar_scope_top(w->scope, root, dir, sizeof(dir));
+    if (ns_index_covers(dir)) {
+        int rc = tar_from_index(w, root, dir, ext);
+        if (rc != -2) return rc;  // -2: the index listing didn't fit in memory; walk the tree instead
+    }
+    return tar_walk(w, dir, strlen(root), ext);
+}
+
+// Stream a tar of every `ext` file under root as OP_DATA frames plus OP_END
+// (narrowed and gzipped as scope says; NULL: every file, plain). Member names
+// are relative to root. If nothing matches, an OP_ERROR with empty_msg is
+// sent instead so the caller's "No files found" contract holds.
+// Returns the number of members written (0 if none), or -1 on socket error
+static inline long long send_tar_stream(int sock, uint32_t req_id, const char *root, const char *ext,
+                                        const struct tar_scope *scope, const char *empty_msg,
+                                        struct tar_stats *stats) {
+    int gzip = scope && scope->gzip;
+    stats->files = stats->bytes = stats->packed = 0;
+
+    struct gzip_par gz;
+    struct tar_writer w = { sock, req_id, malloc(TAR_FRAME_BYTES), 0, stats, NULL, scope };
+    if (w.buf && gzip && gzip_par_init(&gz, sock, req_id, compress_settings()->threads) == 0) w.gz = &gz;
+    if (!w.buf || (gzip && !w.gz)) {
+        free(w.buf);
+        return send_error(sock, req_id, "Error: Out of memory.\n") < 0 ? -1 : 0;
+    }
+    long long rc = -1;
+
+    if (tar_add_tree(&w, root, ext) < 0) goto out;
+    if (stats->files == 0) {
+        rc = send_error(sock, req_id, empty_msg) < 0 ? -1 : 0;
+        goto out;
+    }
+
+    // End of archive: two zero blocks, then OP_END
+    if (w.used + 2 * TAR_BLOCK > TAR_FRAME_BYTES && tar_flush(&w) < 0) goto out;
+    memset(w.buf + w.used, 0, 2 * TAR_BLOCK);
+    w.used += 2 * TAR_BLOCK;
+    if (tar_flush(&w) < 0 || (w.gz && gzip_par_finish(w.gz) < 0)) goto out;
+    if (send_frame(sock, OP_END, 0, req_id, NULL, 0) < 0) goto out;
+    rc = stats->files;
+out:
+    if (w.gz) {
+        stats->packed = w.gz->bytes_out;
+        gzip_par_end(w.gz);
+    }
+    free(w.buf);
+    return rc;
+}
+
+/* Member names already in a joined archive (open-addressed hash set) */
+struct tar_names {
+    char **slots;
+    size_t cap, count;
+};
+
+static inline size_t tar_name_hash(const char *name) {
+    uint64_t h = 14695981039346656037ull;  // FNV-1a
+    for (const char *p = name; *p; p++) h = (h ^ (unsigned char)*p) * 1099511628211ull;
+    return (size_t)h;
+}
+
+// Add name to the set
+// Returns 1 if it was new, 0 if it was already there, -1 if out of memory
+static inline int tar_names_add(struct tar_names *s, const char *name) {
+    if ((s->count + 1) * 2 > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 1024;
+        char **slots = calloc(cap, sizeof(*slots));
+        if (!slots) return -1;
+        for (size_t i = 0; i < s->cap; i++) {
+            if (!s->slots[i]) continue;
+            size_t h = tar_name_hash(s->slots[i]) & (cap - 1);
+            while (slots[h]) h = (h + 1) & (cap - 1);
+            slots[h] = s->slots[i];
+        }
+        free(s->slots);
+        s->slots = slots;
+        s->cap = cap;
+    }
+    size_t h = tar_name_hash(name) & (s->cap - 1);
+    for (; s->slots[h]; h = (h + 1) & (s->cap - 1))
+        if (strcmp(s->slots[h], name) == 0) return 0;
+    if (!(s->slots[h] = strdup(name))) return -1;
+    s->count++;
+    return 1;
+}
+
+static inline void tar_names_free(struct tar_names *s) {
+    for (size_t i = 0; i < s->cap; i++) free(s->slots[i]);
+    free(s->slots);
+}
+
+/* One archive assembled from several servers' downltar replies */
+struct tar_concat {
+    int sock;                // Client receiving the combined archive
+    uint32_t req_id;
+    char *buf;               // Held-back tail of the current stream plus the chunk being read
+    size_t used;             // Bytes of buf waiting to be sent (unique mode)
+    int streams;             // Replies that contributed members
+    int unique;              // Skip members whose name is already in the archive
+    struct tar_names names;  // Names sent so far (unique mode)
+    struct gzip_par *gz;     // Gzip the combined archive (NULL: plain tar)
+};
+
+// unique: the servers may hold copies of the same files (replicas)
+// gzip: send the combined archive gzipped
+static inline int tar_concat_init(struct tar_concat *c, int sock, uint32_t req_id, int unique, int gzip) {
+    memset(c, 0, sizeof(*c));
+    c->sock = sock;
+    c->req_id = req_id;
+    c->unique = unique;
+    c->buf = malloc(TAR_CONCAT_CHUNK + 2 * TAR_BLOCK);
+    if (c->buf && gzip && (c->gz = malloc(sizeof(*c->gz))) &&
+        gzip_par_init(c->gz, sock, req_id, compress_settings()->threads) < 0) {
+        free(c->gz);
+        c->gz = NULL;
+    }
+    return c->buf && (!gzip || c->gz) ? 0 : -1;
+}
+
+// Send n bytes of the combined archive as an OP_DATA frame (or into the gzip stream)
+static inline int tar_concat_send(struct tar_concat *c, const void *data, size_t n) {
+    return c->gz ? gzip_par_write(c->gz, data, n) : send_frame(c->sock, OP_DATA, 0, c->req_id, data, n);
+}
+
+/* Reads the archive bytes of one downltar reply across its OP_DATA frames */
+struct tar_input {
+    int from;
+    uint64_t left;           // Unread payload of the current OP_DATA frame
+    int started;             // Some OP_DATA has been seen
+};
+
+// Read exactly n archive bytes into buf (NULL: read and drop them)
+// Returns 0, 1 if the reply ended with OP_END first, 2 if the server
+// answered with an error/message instead of an archive, -1 on failure
+static inline int tar_input_read(struct tar_input *in, char *buf, size_t n) {
+    char scratch[TAR_BLOCK * 8];
+    while (n > 0) {
+        if (in->left == 0) {
+            struct frame_header h;
+            if (recv_frame_header(in->from, &h) < 0) return -1;
+            if (h.opcode == OP_DATA) {
+                in->left = h.length;
+                in->started = 1;
+                continue;
+            }
+            if (skip_payload(in->from, h.length) < 0) return -1;
+            if (h.opcode == OP_END) return 1;
+            return (h.opcode == OP_ERROR || h.opcode == OP_MSG) && !in->started ? 2 : -1;
+        }
+        size_t take = n < in->left ? n : in->left;
+        if (!buf && take > sizeof(scratch)) take = sizeof(scratch);
+        if (recv_all(in->from, buf ? buf : scratch, take) < 0) return -1;
+        if (buf) buf += take;
+        in->left -= take;
+        n -= take;
+    }
+    return 0;
+}
+
+// Queue n bytes of the combined archive (unique mode), sending full chunks
+static inline int tar_concat_out(struct tar_concat *c, const void *data, size_t n) {
+    if (c->used + n > TAR_CONCAT_CHUNK) {
+        if (tar_concat_send(c, c->buf, c->used) < 0) return -1;
+        c->used = 0;
+    }
+    memcpy(c->buf + c->used, data, n);
+    c->used += n;
+    return 0;
+}
+
+// Relay one reply member by member, leaving out names already sent
+// Returns as tar_concat_relay
+static inline int tar_concat_relay_unique(struct tar_concat *c, int from) {
+    struct tar_input in = { from, 0, 0 };
+    char head[TAR_BLOCK], pax[TAR_BLOCK + PATH_MAX + 64], name[PATH_MAX + 1];
+    int added = 0;
+    while (1) {
+        int rc = tar_input_read(&in, head, TAR_BLOCK);
+        if (rc == 2 && !added) return 0;  // No files on this server
+        if (rc != 0) return -1;
+
+        // Two zero blocks end the archive; the reply's OP_END must follow
+        int zero = 1;
+        for (int i = 0; i < TAR_BLOCK && zero; i++) zero = head[i] == 0;
+        if (zero) {
+            if (tar_input_read(&in, head, TAR_BLOCK) != 0 || tar_input_read(&in, head, 1) != 1) return -1;
+            break;
+        }
+
+        // A pax header ('x') carries the real path/size for the member after it
+        size_t pax_len = 0;
+        unsigned long long size = strtoull(head + 124, NULL, 8);
+        name[0] = '\0';
+        if (head[156] == 'x') {
+            pax_len = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+            if (TAR_BLOCK + pax_len > sizeof(pax) - 1) return -1;
+            memcpy(pax, head, TAR_BLOCK);
+            if (tar_input_read(&in, pax + TAR_BLOCK, pax_len) != 0) return -1;
+            pax[TAR_BLOCK + size] = '\0';
+            if (tar_input_read(&in, head, TAR_BLOCK) != 0) return -1;
+            size = strtoull(head + 124, NULL, 8);
+            for (char *rec = pax + TAR_BLOCK; rec && *rec; rec = strchr(rec, '\n'), rec = rec ? rec + 1 : NULL) {
+                char *kv = strchr(rec, ' ');
+                if (!kv) break;
+                size_t vlen = strcspn(kv + 1, "\n");
+                if (strncmp(kv + 1, "path=", 5) == 0 && vlen - 5 < sizeof(name))
+                    snprintf(name, sizeof(name), "%.*s", (int)(vlen - 5), kv + 6);
+                else if (strncmp(kv + 1, "size=", 5) == 0)
+                    size = strtoull(kv + 6, NULL, 10);
+            }
+            pax_len += TAR_BLOCK;
+        }
+        if (name[0] == '\0') {
+            // ustar name: prefix (155 bytes at 345) + '/' + name (100 bytes at 0)
+            int plen = strnlen(head + 345, 155);
+            snprintf(name, sizeof(name), "%.*s%s%.*s", plen, head + 345, plen ? "/" : "",
+                     (int)strnlen(head, 100), head);
+        }
+
+        // Body and padding: copied if the name is new, read and dropped if not
+        uint64_t body = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+        int fresh = tar_names_add(&c->names, name);
+        if (fresh < 0) return -1;
+        if (!fresh) {
+            if (tar_input_read(&in, NULL, body) != 0) return -1;
+            continue;
+        }
+        if ((pax_len && tar_concat_out(c, pax, pax_len) < 0) || tar_concat_out(c, head, TAR_BLOCK) < 0)
+            return -1;
+        while (body > 0) {
+            if (c->used == TAR_CONCAT_CHUNK) {
+                if (tar_concat_send(c, c->buf, c->used) < 0) return -1;
+                c->used = 0;
+            }
+            size_t take = TAR_CONCAT_CHUNK - c->used;
+            if (take > body) take = body;
+            if (tar_input_read(&in, c->buf + c->used, take) != 0) return -1;
+            c->used += take;
+            body -= take;
+        }
+        added = 1;
+    }
+    if (added) c->streams++;
+    return added;
+}
+
+// Relay one server's downltar reply from `from` into the combined archive,
+// leaving out its two end-of-archive blocks
+// Returns 1 if the reply added members, 0 if the server had no files (it
+// answered with an error), -1 if either connection failed or the reply was not a tar
+static inline int tar_concat_relay(struct tar_concat *c, int from) {
+    if (c->unique) return tar_concat_relay_unique(c, from);
+    struct frame_header h;
+    size_t held = 0;  // The stream's latest bytes, at the front of c->buf
+    while (1) {
+        if (recv_frame_header(from, &h) < 0) return -1;
+        if (h.opcode == OP_ERROR || h.opcode == OP_MSG)
+            return held == 0 && skip_payload(from, h.length) == 0 ? 0 : -1;
+        if (h.opcode == OP_END) {
+            if (skip_payload(from, h.length) < 0) return -1;
+            break;
+        }
+        if (h.opcode != OP_DATA) return -1;
+        for (uint64_t left = h.length; left > 0;) {
+            size_t n = left < TAR_CONCAT_CHUNK ? left : TAR_CONCAT_CHUNK;
+            if (recv_all(from, c->buf + held, n) < 0) return -1;
+            left -= n;
+            held += n;
+            if (held > 2 * TAR_BLOCK) {
+                size_t out = held - 2 * TAR_BLOCK;
+                if (tar_concat_send(c, c->buf, out) < 0) return -1;
+                memmove(c->buf, c->buf + out, 2 * TAR_BLOCK);
+                held = 2 * TAR_BLOCK;
+            }
+        }
+    }
+    // What's held back must be the end-of-archive marker
+    if (held != 2 * TAR_BLOCK) return -1;
+    for (size_t i = 0; i < held; i++)
+        if (c->buf[i] != 0) return -1;
+    c->streams++;
+    return 1;
+}
+
+// Add every `ext` file in scope (may be NULL) under root (the joining
+// server's own files) to the combined archive, written straight out like
+// send_tar_stream's members
+// Returns 1 if it added members, 0 if none matched, -1 if the client's connection failed
+static inline int tar_concat_local(struct tar_concat *c, const char *root, const char *ext,
+                                   const struct tar_scope *scope) {
+    if (c->used > 0 && tar_concat_send(c, c->buf, c->used) < 0) return -1;  // Keep member order
+    c->used = 0;
+
+    struct tar_stats stats = {0};
+    struct tar_writer w = { c->sock, c->req_id, malloc(TAR_FRAME_BYTES), 0, &stats, c->gz, scope };
+    int rc = w.buf && tar_add_tree(&w, root, ext) == 0 && tar_flush(&w) == 0 ? 0 : -1;
+    free(w.buf);
+    if (rc < 0) return -1;
+    if (stats.files == 0) return 0;
+    c->streams++;
+    return 1;
+}
+
+static inline void tar_concat_free(struct tar_concat *c) {
+    if (c->gz) gzip_par_end(c->gz);
+    free(c->gz);
+    free(c->buf);
+    tar_names_free(&c->names);
+}
+
+// Close the combined archive (two zero blocks, then OP_END), or send
+// empty_msg if no stream contributed anything
+// Returns 0 on success, -1 on socket error
+static inline int tar_concat_finish(struct tar_concat *c, const char *empty_msg) {
+    int rc;
+    if (c->streams == 0) {
+        rc = send_error(c->sock, c->req_id, empty_msg);
+    } else {
+        memset(c->buf + c->used, 0, 2 * TAR_BLOCK);
+        rc = tar_concat_send(c, c->buf, c->used + 2 * TAR_BLOCK);
+        if (rc == 0 && c->gz) rc = gzip_par_finish(c->gz);
+        if (rc == 0) rc = send_frame(c->sock, OP_END, 0, c->req_id, NULL, 0);
+    }
+    tar_concat_free(c);
+    return rc < 0 ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,383 @@
+// uring.h - Minimal io_uring I/O engine shared by S1 and the sub-servers //
+//
+// Selected at startup with DFS_IO_ENGINE=uring; anything else (or a kernel
+// without io_uring) keeps the blocking sendfile()/fwrite() paths. liburing is
+// not required: the ring is set up with the raw syscalls and mmap().
+//
+// The engine batches the two hot loops of a transfer:
+//   - downloads: file reads and the socket sends that carry them are queued
+//     together, so a whole batch costs one io_uring_enter() instead of a
+//     read() + send() pair per chunk;
+//   - uploads: received chunks are queued as file writes at their offsets
+//     while the next chunk is still arriving, and the closing fsync (with
+//     DFS_FSYNC=1) rides on the same ring, ordered after the writes.
+//
+// Each thread lazily gets its own ring and buffers, so no locking is needed.
+#ifndef URING_H
+#define URING_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 64          // Submission queue depth per thread
+#define URING_CHUNK   (64 * 1024) // Bytes per read/send/write request
+#define URING_BATCH   4           // Chunks per batch; two batches are double-buffered
+#define URING_BUFS    (2 * URING_BATCH)
+
+/* One thread's ring plus its transfer buffers */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sqe_tail;            // Local tail, published on submit
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len, sqes_len;
+    char *buf;                    // URING_BUFS chunks of URING_CHUNK bytes
+};
+
+static int uring_engine = -1;     // -1 until io_engine_init(), then 0/1
+static pthread_key_t uring_key;
+static pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+static inline void uring_free(struct uring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_len);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_len);
+    if (r->fd >= 0) close(r->fd);
+    free(r->buf);
+    free(r);
+}
+
+// Thread exit: tear down that thread's ring
+static inline void uring_destroy(void *arg) {
+    if (arg) uring_free((struct uring *)arg);
+}
+
+static inline void uring_make_key(void) {
+    pthread_key_create(&uring_key, uring_destroy);
+}
+
+// Create a ring with the raw io_uring_setup() syscall and map its queues
+// Returns NULL if the kernel (or a seccomp policy) refuses
+static inline struct uring *uring_create(void) {
+    struct uring *r = calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    r->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_len > r->sq_len) r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+
+    r->buf = malloc((size_t)URING_BUFS * URING_CHUNK);
+    if (!r->buf) goto fail;
+    return r;
+
+fail:
+    uring_free(r);
+    return NULL;
+}
+
+// Pick the I/O engine from DFS_IO_ENGINE; call once from main()
+// Probes io_uring so an unsupported kernel falls back to the blocking path
+// Returns the name of the engine in use
+static inline const char *io_engine_init(void) {
+    const char *v = getenv("DFS_IO_ENGINE");
+    uring_engine = 0;
+    if (v && strcmp(v, "uring") == 0) {
+        struct uring *probe = uring_create();
+        if (probe) {
+            uring_free(probe);
+            pthread_once(&uring_key_once, uring_make_key);
+            uring_engine = 1;
+        } else {
+            fprintf(stderr, "io_uring unavailable (%s); using blocking I/O\n", strerror(errno));
+        }
+    }
+    return uring_engine ? "io_uring" : "blocking";
+}
+
+// Non-zero when the io_uring engine was selected and probed successfully
+static inline int io_engine_uring(void) {
+    return uring_engine == 1;
+}
+
+// The calling thread's ring, created on first use; NULL if it cannot be set up
+static inline struct uring *uring_get(void) {
+    struct uring *r = pthread_getspecific(uring_key);
+    if (!r) {
+        r = uring_create();
+        if (r) pthread_setspecific(uring_key, r);
+    }
+    return r;
+}
+
+// Reserve the next submission entry (the caller has checked the queue has room)
+static inline struct io_uring_sqe *uring_sqe(struct uring *r, uint8_t opcode, int fd,
+                                             void *addr, uint32_t len, uint64_t off,
+                                             uint64_t user_data) {
+    unsigned idx = r->sqe_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return sqe;
+}
+
+// Publish queued entries and submit them, waiting for at least wait_nr completions
+// Returns 0 on success, -1 on error
+static inline int uring_submit(struct uring *r, unsigned wait_nr) {
+    unsigned to_submit = r->sqe_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    while (1) {
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr,
+                               wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) return 0;
+        if (errno != EINTR) return -1;
+        // Interrupted: anything already consumed by the kernel is not resubmitted
+        to_submit = r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    }
+}
+
+// Wait for the next completion and return its user_data and result
+static inline int uring_reap(struct uring *r, uint64_t *user_data, int32_t *res) {
+    unsigned head = *r->cq_head;
+    while (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        int ret = (int)syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR) return -1;
+    }
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Queue reads of up to URING_BATCH chunks of the file into buffer set `set`
+// link chains each read to the next entry (used when the sends follow in the same chain)
+// Returns the number of chunks queued; sizes[] receives each chunk's length
+static inline unsigned uring_queue_reads(struct uring *r, int fd, uint64_t offset, uint64_t remaining,
+                                         int set, uint32_t *sizes, int link) {
+    unsigned k = 0;
+    while (k < URING_BATCH && remaining > 0) {
+        uint32_t n = remaining < URING_CHUNK ? (uint32_t)remaining : URING_CHUNK;
+        struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_READ, fd,
+                                             r->buf + (size_t)(set * URING_BATCH + k) * URING_CHUNK,
+                                             n, offset, ((uint64_t)set << 8) | k);
+        if (link) sqe->flags |= IOSQE_IO_LINK;
+        sizes[k++] = n;
+        offset += n;
+        remaining -= n;
+    }
+    return k;
+}
+
+// Queue the sends of buffer set `set` as one linked chain, so they reach the
+// socket in order; MSG_WAITALL makes the kernel finish short sends itself
+static inline void uring_queue_sends(struct uring *r, int sock, int set, const uint32_t *sizes,
+                                     unsigned count) {
+    for (unsigned k = 0; k < count; k++) {
+        struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_SEND, sock,
+                                             r->buf + (size_t)(set * URING_BATCH + k) * URING_CHUNK,
+                                             sizes[k], 0, (1ULL << 16) | ((uint64_t)set << 8) | k);
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+        if (k + 1 < count) sqe->flags |= IOSQE_IO_LINK;
+    }
+}
+
+// Collect `count` completions; reads and sends must each move exactly their chunk
+// Returns 0 if all succeeded, -1 otherwise
+static inline int uring_collect(struct uring *r, unsigned count, uint32_t sizes[2][URING_BATCH]) {
+    int failed = 0;
+    while (count-- > 0) {
+        uint64_t tag;
+        int32_t res;
+        if (uring_reap(r, &tag, &res) < 0) return -1;
+        unsigned set = (tag >> 8) & 1, k = tag & 0xff;
+        if (res < 0 || (uint32_t)res != sizes[set][k]) failed = 1;
+    }
+    return failed ? -1 : 0;
+}
+
+// Send `length` bytes of a file starting at `offset` through the calling thread's ring
+// While batch N is being sent, batch N+1 is already being read; a file that
+// fits in one batch goes out as a single read->send chain in one syscall.
+// Returns 0 on success, -1 on error, 1 if no ring is available (nothing sent)
+static inline int uring_send_file(int sock, int fd, uint64_t offset, uint64_t length) {
+    struct uring *r = uring_get();
+    if (!r) return 1;
+
+    uint32_t sizes[2][URING_BATCH];
+    if (length <= (uint64_t)URING_BATCH * URING_CHUNK) {
+        unsigned k = uring_queue_reads(r, fd, offset, length, 0, sizes[0], 1);
+        if (k == 0) return 0;
+        uring_queue_sends(r, sock, 0, sizes[0], k);
+        if (uring_submit(r, 2 * k) < 0) return -1;
+        return uring_collect(r, 2 * k, sizes);
+    }
+
+    // Prime the pipeline with the first batch of reads
+    int set = 0;
+    unsigned k = uring_queue_reads(r, fd, offset, length, set, sizes[set], 0);
+    uint64_t queued = 0;
+    for (unsigned i = 0; i < k; i++) queued += sizes[set][i];
+    if (uring_submit(r, k) < 0 || uring_collect(r, k, sizes) < 0) return -1;
+
+    while (k > 0) {
+        // Send this batch while reading the next one into the other buffer set
+        uring_queue_sends(r, sock, set, sizes[set], k);
+        unsigned next = uring_queue_reads(r, fd, offset + queued, length - queued, !set, sizes[!set], 0);
+        for (unsigned i = 0; i < next; i++) queued += sizes[!set][i];
+        if (uring_submit(r, k + next) < 0 || uring_collect(r, k + next, sizes) < 0) return -1;
+        set = !set;
+        k = next;
+    }
+    return 0;
+}
+
+/* Upload sink: received bytes are written to the file asynchronously */
+struct uring_writer {
+    struct uring *ring;
+    int fd;
+    uint64_t offset;            // File offset of the current buffer
+    int cur;                    // Buffer being filled
+    uint32_t fill;              // Bytes in the current buffer
+    int busy[URING_BUFS];       // Buffers with a write in flight
+    uint32_t want[URING_BUFS];  // Length of each in-flight write
+    unsigned inflight;
+    int failed;
+};
+
+// Start writing a stream to an open (still empty) FILE* through the ring
+// Returns 0 on success, -1 if the engine is off or no ring is available
+static inline int uring_writer_open(struct uring_writer *w, FILE *file) {
+    if (!io_engine_uring() || fileno(file) < 0) return -1;  // Not backed by a file (e.g. chunkstore.h's writer)
+    memset(w, 0, sizeof(*w));
+    w->ring = uring_get();
+    if (!w->ring) return -1;
+    fflush(file);
+    w->fd = fileno(file);
+    off_t pos = lseek(w->fd, 0, SEEK_CUR);
+    w->offset = pos > 0 ? (uint64_t)pos : 0;
+    return 0;
+}
+
+// Wait for one in-flight write to finish and free its buffer
+static inline int uring_writer_reap(struct uring_writer *w) {
+    uint64_t tag;
+    int32_t res;
+    if (uring_reap(w->ring, &tag, &res) < 0) return -1;
+    if (tag < URING_BUFS) {
+        if (res < 0 || (uint32_t)res != w->want[tag]) w->failed = 1;
+        w->busy[tag] = 0;
+    } else if (res < 0) {
+        w->failed = 1;  // fsync
+    }
+    w->inflight--;
+    return 0;
+}
+
+// Queue the current buffer as a write at its file offset
+static inline int uring_writer_flush(struct uring_writer *w) {
+    if (w->fill == 0) return 0;
+    uring_sqe(w->ring, IORING_OP_WRITE, w->fd, w->ring->buf + (size_t)w->cur * URING_CHUNK,
+              w->fill, w->offset, w->cur);
+    w->busy[w->cur] = 1;
+    w->want[w->cur] = w->fill;
+    w->inflight++;
+    w->offset += w->fill;
+    w->fill = 0;
+    if (uring_submit(w->ring, 0) < 0) return -1;
+
+    // Move to the next buffer, waiting for its previous write if still in flight
+    w->cur = (w->cur + 1) % URING_BUFS;
+    while (w->busy[w->cur])
+        if (uring_writer_reap(w) < 0) return -1;
+    return 0;
+}
+
+// Free space in the current buffer, for recv() to fill directly
+static inline char *uring_writer_space(struct uring_writer *w, size_t *avail) {
+    if (w->fill == URING_CHUNK && uring_writer_flush(w) < 0) w->failed = 1;
+    *avail = URING_CHUNK - w->fill;
+    return w->ring->buf + (size_t)w->cur * URING_CHUNK + w->fill;
+}
+
+// Account for n bytes placed at uring_writer_space()
+static inline void uring_writer_commit(struct uring_writer *w, size_t n) {
+    w->fill += n;
+}
+
+// Finish the stream: write the tail, optionally fsync (ordered after every
+// write with IOSQE_IO_DRAIN) and wait for everything in flight
+// Returns 0 if every write succeeded, -1 otherwise
+static inline int uring_writer_close(struct uring_writer *w, int do_fsync) {
+    if (uring_writer_flush(w) < 0) w->failed = 1;
+    if (do_fsync && !w->failed) {
+        struct io_uring_sqe *sqe = uring_sqe(w->ring, IORING_OP_FSYNC, w->fd, NULL, 0, 0, URING_BUFS);
+        sqe->flags |= IOSQE_IO_DRAIN;
+        w->inflight++;
+        if (uring_submit(w->ring, 0) < 0) w->failed = 1;
+    }
+    while (w->inflight > 0)
+        if (uring_writer_reap(w) < 0) return -1;
+    lseek(w->fd, w->offset, SEEK_SET);  // Leave the descriptor where a write() would have
+    return w->failed ? -1 : 0;
+}
+
+#endif
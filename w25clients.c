@@ -1,7 +1,8 @@
 // w25clients.c
 // Client-side implementation for COMP-8567 Distributed File System Project
-// Handles commands: uploadf, downlf, removef, downltar, dispfnames
+// Handles commands: uploadf, downlf, removef, downltar, dispfnames, listf, streams, stats, bench, hashbench
 // w25clients.c - Client-side code (Final Version)
+#define _GNU_SOURCE  // splice(), pipe2() and friends used by protocol.h
 #include <stdio.h>      // For input/output functions like printf(), scanf(), fopen(), etc.
 #include <stdlib.h>     // For memory allocation (malloc, free), exit(), and general utilities
 #include <string.h>     // For string operations like strcpy(), strcat(), strlen(), strcmp(), memset(), etc.
@@ -12,6 +13,8 @@
 #include <pthread.h>    // For working with threads: pthread_create(), pthread_exit(), etc.
 #include <errno.h>      // For error codes like EEXIST, EINVAL, etc.
 #include <sys/stat.h>   // For mkdir(), stat(), and other file/directory-related operations
+#include <fcntl.h>      // For open() flags used to resume downloads without truncating
+#include <signal.h>     // For ignoring SIGPIPE from sendfile()
 
 
 
@@ -19,50 +22,515 @@
 
 #include <dirent.h> // This header is for reading directories — listing files and folders inside a directory.
 
+#include "protocol.h"  // Frame format shared with S1 and the sub-servers
+#include "chunkstore.h"  // Chunking, to skip what a deduplicating server already stores
+#include "compress.h"    // Deflated transfers of text files
+
 #define SERVER_IP "127.0.0.1"  // Server IP Address 
 #define BUFFER_SIZE 4096
+#define UPLOAD_CHUNK_BYTES (8LL * 1024 * 1024)  // Files larger than this upload in resumable chunks (DFS_CHUNK_BYTES)
+#define TRANSFER_RETRIES 5                      // Reconnects tried when a transfer loses its connection
+#define MAX_STREAMS 16                          // Upper bound for DFS_STREAMS / the streams command
+
+uint32_t next_request_id = 1;  // Request id placed in the next command frame
+int transfer_streams = 1;      // Connections a large file is split over (DFS_STREAMS, streams command)
+
 /* Send a command string to the server through the socket */
 void send_command(int sock, char *command) {
-    // Send the complete command string to server
+    // Wrap the complete command string in an OP_REQUEST frame
     // sock: The connected socket descriptor
     // command: The command string to send
-    // strlen(command): Length of the command string
-    // 0: Default flags for send() 
-    send(sock, command, strlen(command), 0);
+    // next_request_id: Id echoed back in every frame of the reply
+    send_request(sock, next_request_id++, command);
+}
+
+/* Send a command whose reply may come back deflated (DFS_COMPRESS, see compress.h) */
+void send_command_deflate(int sock, char *command) {
+    send_request_flags(sock, next_request_id++, compress_accept_flag(), command);
+}
+
+/* Send bytes [offset, offset + n) of a file being uploaded as a data stream */
+/*
+  Files of a type worth compressing (DFS_COMPRESS_TYPES) go deflated; the
+  server inflates them as they arrive. Returns bytes sent or -1.
+*/
+long long send_upload_range(int sock, uint32_t req_id, FILE *file, const char *filename, long long offset,
+                            long long n) {
+    if (compress_upload_wanted(filename)) return compress_send_range(sock, req_id, file, offset, n, NULL);
+    return send_file_range(sock, req_id, file, offset, n, NULL);
 }
 
 /* Receive and print response from server until complete */
 /*
-  The recv() Function: receiving data from a socket
-    ssize_t recv(int sockfd, void *buf, size_t len, int flags);
-    sockfd: The socket descriptor
-    buf: Buffer to store received data
-    len: Maximum length of data to receive (BUFFER_SIZE in your case)
-    flags: Optional flags (0 means no special behavior)
+  Every reply is a frame: a header telling us the opcode and the exact number
+  of payload bytes, so we read until the reply is complete instead of guessing
+  from the size of a recv().
 */
 void receive_response(int sock) {
+    struct frame_header h;
     char buffer[BUFFER_SIZE];  // Buffer to store received data
-    int bytes;  // Number of bytes received
-    int expecting_more = 1;
-   
-    
-    // Continuously receive data until server closes connection
-    while ((bytes = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        buffer[bytes] = '\0';  // Null-terminate the received data
-        printf("%s", buffer);  // Print the received data
-        
-        // If received less than full buffer, we got all data
-        if (bytes < BUFFER_SIZE) break;
-    }
-    if (strstr(buffer, "ENDOFLIST")) {
-        expecting_more = 0;  // No more data after this
-        char *end = strstr(buffer, "ENDOFLIST");
-        *end = '\0';  // Terminate string before marker
+
+    while (recv_frame_header(sock, &h) == 0) {
+        if (h.opcode == OP_MSG || h.opcode == OP_ERROR) {
+            // Status text completes the response
+            if (recv_text_payload(sock, h.length, buffer, sizeof(buffer)) < 0) break;
+            printf("%s", buffer);  // Print the received message
+            return;
+        }
+        if (skip_payload(sock, h.length) < 0) break;
+        if (h.opcode == OP_END) return;
+    }
+    printf("Error: Connection to server lost.\n");
+}
+
+int connect_to_s1(void);
+
+/* Read a one-frame reply (OP_MSG or OP_ERROR) into text; returns the opcode or -1 */
+int recv_reply(int sock, char *text, size_t size) {
+    struct frame_header h;
+    if (recv_frame_header(sock, &h) < 0) return -1;
+    if (h.opcode != OP_MSG && h.opcode != OP_ERROR) return -1;
+    if (recv_text_payload(sock, h.length, text, size) < 0) return -1;
+    return h.opcode;
+}
+
+/* Replace a lost connection to S1, waiting a little longer on each attempt */
+/*
+  attempt counts from 1; returns 0 once reconnected, -1 after TRANSFER_RETRIES
+  attempts (the socket is then left at -1 and the next command reconnects)
+*/
+int reconnect(int *sock, int attempt) {
+    if (*sock != -1) close(*sock);
+    *sock = -1;
+    if (attempt > TRANSFER_RETRIES) return -1;
+    printf("Connection lost; reconnecting (attempt %d of %d)...\n", attempt, TRANSFER_RETRIES);
+    fflush(stdout);
+    sleep(attempt);  // 1 s, 2 s, 3 s, ... so a restarting S1 has time to come back
+    *sock = connect_to_s1();
+    return *sock == -1 ? reconnect(sock, attempt + 1) : 0;
+}
+
+/* A file being uploaded, cut into chunks the way the server's chunk store cuts them */
+struct file_chunk {
+    long long start, len;
+    char hash[65];
+};
+struct upload_chunks {
+    int fd;
+    long long size;
+    long long scanned;          // Bytes of the file cut so far
+    struct cas_chunker chunker;
+    struct file_chunk *list;
+    int count, capacity;
+    int next;                   // Where the last lookup ended
+};
+
+/* Cut the file until chunk number `want` exists or the file ends; returns 0, or -1 if it can't be read */
+int chunks_scan(struct upload_chunks *u, int want) {
+    unsigned char *buffer = NULL;
+    while (u->count <= want && u->scanned < u->size) {
+        if (!buffer && !(buffer = malloc(CAS_READ_SIZE))) return -1;
+        ssize_t n = pread(u->fd, buffer, u->size - u->scanned < CAS_READ_SIZE ? u->size - u->scanned : CAS_READ_SIZE,
+                          u->scanned);
+        if (n <= 0) break;
+        for (ssize_t i = 0; i < n;) {
+            int boundary;
+            i += cas_chunker_scan(&u->chunker, buffer + i, n - i, &boundary);
+            if (!boundary && u->scanned + i < u->size) continue;
+            if (u->count == u->capacity) {
+                u->capacity = u->capacity ? u->capacity * 2 : 256;
+                u->list = realloc(u->list, u->capacity * sizeof(*u->list));
+                if (!u->list) {
+                    free(buffer);
+                    return -1;
+                }
+            }
+            struct file_chunk *c = &u->list[u->count++];
+            c->len = u->chunker.len;
+            c->start = u->scanned + i - c->len;
+            cas_chunker_name(&u->chunker, c->hash);
+        }
+        u->scanned += n;
+    }
+    free(buffer);
+    return u->scanned < u->size && u->count <= want ? -1 : 0;
+}
+
+/* Ask the server to fill in the upload from `offset` with chunks it already stores (uploadref) */
+/*
+  The next CAS_REF_BATCH chunks are named; the server copies in those it
+  has up to the first it lacks, and says which of the rest it has.
+  *missing_end is set to where the run of chunks it lacks from `offset` ends.
+  Returns the bytes it now holds, -1 if the connection failed, -2 if it
+  doesn't deduplicate (or the file can't be read)
+*/
+long long upload_ref(int sock, struct upload_chunks *u, const char *prefix, long long offset, long long *missing_end) {
+    char command[MAX_REQUEST_SIZE], reply[BUFFER_SIZE], have[CAS_REF_BATCH + 1] = "";
+    int first = u->next < u->count && u->list[u->next].start <= offset ? u->next : 0;
+    while (1) {
+        if (first >= u->count && chunks_scan(u, first) < 0) return -2;
+        if (first >= u->count) return -2;  // Past the end: nothing to name
+        if (u->list[first].start + u->list[first].len > offset) break;
+        first++;
+    }
+    u->next = first;
+    struct file_chunk *c = &u->list[first];
+    if (c->start < offset) {
+        // Resumed inside a chunk: the rest of it is sent as data
+        *missing_end = c->start + c->len;
+        return offset;
+    }
+    if (chunks_scan(u, first + CAS_REF_BATCH - 1) < 0) return -2;
+    c = &u->list[first];  // The list may have moved
+
+    int named = u->count - first < CAS_REF_BATCH ? u->count - first : CAS_REF_BATCH;
+    int len = snprintf(command, sizeof(command), "%s %lld", prefix, offset);
+    for (int i = 0; i < named && len < (int)sizeof(command) - 100; i++)
+        len += snprintf(command + len, sizeof(command) - len, " %s:%lld", c[i].hash, c[i].len);
+    send_command(sock, command);
+    int op = recv_reply(sock, reply, sizeof(reply));
+    long long stored = -1;
+    if (op == OP_ERROR) return -2;
+    if (op != OP_MSG || sscanf(reply, "size=%lld have=%32[01]", &stored, have) < 1) return -1;
+
+    // The leading run of chunks the server lacks goes up as data next
+    int k = 0;
+    while (k < named && have[k] == '0') k++;
+    *missing_end = k < named ? c[k].start : c[named - 1].start + c[named - 1].len;
+    if (stored == offset && *missing_end <= offset) *missing_end = c->start + c->len;  // Held, yet not copied
+    return stored;
+}
+
+/* Upload a large file in chunks that survive a lost connection */
+/*
+  The upload id is a hash of the destination, name, size and modification
+  time, so running the same uploadf again (even from a new client) resumes
+  the upload: uploadstat says how many bytes the server already holds, the
+  rest goes up in pieces of `chunk` bytes, and uploadcommit (carrying the
+  file's checksum, `check`) makes the file appear whole. See chunked.h for the commands.
+  If the server keeps a chunk store, the uploadstat reply says how it cuts
+  files; the client then names its chunks (uploadref) before sending each
+  stretch, and only those the store lacks are sent.
+*/
+void upload_chunked(int *sock, FILE *file, char *filename, char *destination_path, const struct stat *st,
+                    long long chunk, const char *check) {
+    // FNV-1a over "<dest>/<name>:<size>:<mtime>"
+    char key[1024], id[32], command[1024], reply[BUFFER_SIZE];
+    snprintf(key, sizeof(key), "%s/%s:%lld:%lld", destination_path, filename, (long long)st->st_size,
+             (long long)st->st_mtime);
+    uint64_t hash = 1469598103934665603ULL;
+    for (const char *p = key; *p; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    snprintf(id, sizeof(id), "%016llx", (unsigned long long)hash);
+
+    // Chunks of the file, if the server deduplicates (cut as it asks)
+    struct upload_chunks chunks = { .fd = fileno(file), .size = st->st_size };
+    char ref_prefix[1024];
+    snprintf(ref_prefix, sizeof(ref_prefix), "uploadref %s %s %s", filename, destination_path, id);
+    int dedupe = -1;  // Not known yet
+    long long missing_end = 0, skipped = 0;
+
+    int attempt = 0;
+    while (1) {
+        // Ask how much of this upload the server already has
+        long long offset = -1;
+        snprintf(command, sizeof(command), "uploadstat %s %s %s", filename, destination_path, id);
+        send_command(*sock, command);
+        int op = recv_reply(*sock, reply, sizeof(reply));
+        if (op == OP_ERROR) {
+            printf("%s", reply);
+            break;
+        }
+        if (op == OP_MSG) sscanf(reply, "size=%lld", &offset);
+        if (offset > 0) printf("Resuming %s at %lld of %lld bytes.\n", filename, offset, (long long)st->st_size);
+        char mode[16];
+        long long avg;
+        const char *d = op == OP_MSG ? strstr(reply, "dedupe=") : NULL;
+        if (dedupe < 0 && op == OP_MSG) {
+            dedupe = d && sscanf(d, "dedupe=%15[a-z]:%lld", mode, &avg) == 2;
+            if (dedupe) {
+                cas_configure(mode, avg);
+                cas_chunker_reset(&chunks.chunker);
+                dedupe = cas.mode != CAS_OFF;
+            }
+        }
+
+        // Send the rest chunk by chunk; each reply gives the bytes stored
+        while (offset >= 0 && offset < st->st_size) {
+            long long n = st->st_size - offset < chunk ? st->st_size - offset : chunk;
+            if (dedupe > 0 && offset >= missing_end) {
+                // Let the server fill in what it stores already
+                long long stored = upload_ref(*sock, &chunks, ref_prefix, offset, &missing_end);
+                if (stored == -1) {
+                    op = -1;
+                    break;
+                }
+                if (stored == -2) {
+                    dedupe = 0;  // Refused: send everything
+                    continue;
+                }
+                if (stored != offset) {
+                    if (stored > offset) skipped += stored - offset;
+                    offset = stored;
+                    attempt = 0;
+                    continue;
+                }
+            }
+            if (dedupe > 0 && missing_end - offset < n) n = missing_end - offset;
+            snprintf(command, sizeof(command), "uploadchunk %s %s %s %lld", filename, destination_path, id, offset);
+            send_command(*sock, command);
+            if (send_upload_range(*sock, next_request_id - 1, file, filename, offset, n) < 0) {
+                op = -1;
+                break;
+            }
+            op = recv_reply(*sock, reply, sizeof(reply));
+            long long stored = -1;
+            if (op != OP_MSG || sscanf(reply, "size=%lld", &stored) != 1) break;
+            offset = stored;
+            attempt = 0;  // Progress was made; the retry budget starts over
+        }
+
+        // All bytes are there: make the file appear
+        if (offset == st->st_size) {
+            snprintf(command, sizeof(command), "uploadcommit %s %s %s %lld %s", filename, destination_path, id,
+                     (long long)st->st_size, check);
+            send_command(*sock, command);
+            op = recv_reply(*sock, reply, sizeof(reply));
+            if (op > 0) {
+                printf("%s", reply);
+                if (op == OP_MSG && skipped > 0)
+                    printf("(%lld of %lld bytes were already stored and not sent)\n", skipped,
+                           (long long)st->st_size);
+                break;
+            }
+        }
+
+        // A rejected chunk is retried from the size the server reports;
+        // a lost connection is replaced first
+        if (op == OP_ERROR && ++attempt <= TRANSFER_RETRIES) continue;
+        if (op == OP_ERROR) {
+            printf("%s", reply);
+            break;
+        }
+        if (reconnect(sock, ++attempt) < 0) {
+            printf("Error: Connection to server lost; run uploadf again to resume.\n");
+            break;
+        }
+    }
+    free(chunks.list);
+}
+
+/* Size of the pieces large files are moved in (DFS_CHUNK_BYTES) */
+long long chunk_bytes(void) {
+    char *env_chunk = getenv("DFS_CHUNK_BYTES");
+    return env_chunk && atoll(env_chunk) > 0 ? atoll(env_chunk) : UPLOAD_CHUNK_BYTES;
+}
+
+/* One range of a parallel transfer, moved over its own connection to S1 */
+struct lane {
+    const char *filename;   // Local file (uploads) or the name it is stored under
+    const char *path;       // Server path (downloads) or destination directory (uploads)
+    const char *id;         // Upload id (uploads only)
+    int fd;                 // Local file the range is pwrite()n into (downloads only)
+    long long start;        // First byte of the range
+    long long length;       // Bytes in the range
+    long long chunk;        // Largest uploadchunk sent at once
+    long long size;         // Whole file's size, declared with each chunk (uploads only)
+    long long done;         // Bytes of the range moved so far
+    int failed;             // Set if the range could not be moved
+    char msg[BUFFER_SIZE];  // Server's error, if that is why
+};
+
+/* Move one lane, reconnecting and carrying on from lane->done if the connection drops */
+void *lane_worker(void *arg) {
+    struct lane *lane = arg;
+    char command[1024];
+    int sock = -1, attempt = 0;
+    FILE *file = lane->fd < 0 ? fopen(lane->filename, "rb") : NULL;  // Own stream: send_file_range seeks it
+    if (lane->fd < 0 && !file) {
+        snprintf(lane->msg, sizeof(lane->msg), "Error: Could not read %s.\n", lane->filename);
+        lane->failed = 1;
+    }
+
+    while (!lane->failed && lane->done < lane->length) {
+        if (sock == -1 && (sock = connect_to_s1()) == -1) {
+            lane->failed = ++attempt > TRANSFER_RETRIES;
+            if (!lane->failed) sleep(attempt);
+            continue;
+        }
+        long long offset = lane->start + lane->done, rest = lane->length - lane->done;
+        long long got;
+        if (lane->fd >= 0) {
+            // Download: ask for the rest of the range and pwrite() it in place
+            snprintf(command, sizeof(command), "downlf %s %lld %lld", lane->path, offset, rest);
+            got = send_request_flags(sock, 1, compress_accept_flag(), command) < 0
+                      ? -1
+                      : recv_stream_at(sock, lane->fd, offset, &lane->done, lane->msg, sizeof(lane->msg));
+            if (got >= 0 && lane->done < lane->length) {
+                snprintf(lane->msg, sizeof(lane->msg), "Error: %s changed on the server during the download.\n",
+                         lane->path);
+                got = -2;
+            }
+        } else {
+            // Upload: one chunk, written by the server at its offset
+            long long n = rest < lane->chunk ? rest : lane->chunk;
+            long long stored = -1;
+            snprintf(command, sizeof(command), "uploadchunk %s %s %s %lld parallel=%lld", lane->filename,
+                     lane->path, lane->id, offset, lane->size);
+            got = send_request(sock, 1, command) < 0 || send_upload_range(sock, 1, file, lane->filename, offset, n) < 0
+                      ? -1
+                      : recv_reply(sock, lane->msg, sizeof(lane->msg));
+            if (got == OP_ERROR) got = -2;
+            else if (got == OP_MSG && sscanf(lane->msg, "size=%lld", &stored) == 1) lane->done += n;
+        }
+        if (got == -2) {
+            lane->failed = 1;
+        } else if (got < 0) {
+            close(sock);  // Lost: reconnect and send or fetch the rest of the range
+            sock = -1;
+            lane->failed = ++attempt > TRANSFER_RETRIES;
+            if (!lane->failed) sleep(attempt);
+        } else {
+            attempt = 0;
+        }
+    }
+    if (lane->failed && !lane->msg[0])
+        snprintf(lane->msg, sizeof(lane->msg), "Error: Connection to server lost.\n");
+    if (sock != -1) close(sock);
+    if (file) fclose(file);
+    return NULL;
+}
+
+/* Split [start, start + length) into transfer_streams lanes and move them at once */
+/*
+  Returns 0 if every lane finished, otherwise prints the first failure and returns -1
+*/
+int run_lanes(struct lane *proto, long long start, long long length) {
+    int n = transfer_streams;
+    struct lane *lanes = calloc(n, sizeof(struct lane));
+    pthread_t *threads = calloc(n, sizeof(pthread_t));
+    if (!lanes || !threads) {
+        free(lanes);
+        free(threads);
+        printf("Error: Out of memory.\n");
+        return -1;
+    }
+    long long each = (length + n - 1) / n;
+    for (int i = 0; i < n; i++) {
+        lanes[i] = *proto;
+        long long from = i * each;
+        lanes[i].start = start + from;
+        lanes[i].length = from >= length ? 0 : (length - from < each ? length - from : each);
+        pthread_create(&threads[i], NULL, lane_worker, &lanes[i]);
+    }
+    int failed = -1;
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+        if (lanes[i].failed && failed < 0) failed = i;
+    }
+    if (failed >= 0) printf("%s", lanes[failed].msg);
+    free(lanes);
+    free(threads);
+    return failed >= 0 ? -1 : 0;
+}
+
+/* Upload a large file over transfer_streams connections at once */
+/*
+  The file is cut into one range per stream; each stream sends its range as
+  "parallel=<size>" chunks (size: the whole file's) that the server
+  pwrite()s at their offset in the shared part, and when all are in,
+  uploadcommit makes the file appear. S1 gives
+  every client connection its own connection to the sub-server, so the
+  streams stay separate all the way to the disk. A stream that loses its
+  connection reconnects and resends the rest of its range; the id ends in
+  "-p" so an interrupted parallel upload is never resumed sequentially.
+*/
+void upload_parallel(int *sock, char *filename, char *destination_path, const struct stat *st, long long chunk,
+                     const char *check) {
+    char key[1024], id[40], command[1024], reply[BUFFER_SIZE];
+    snprintf(key, sizeof(key), "%s/%s:%lld:%lld", destination_path, filename, (long long)st->st_size,
+             (long long)st->st_mtime);
+    uint64_t hash = 1469598103934665603ULL;
+    for (const char *p = key; *p; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    snprintf(id, sizeof(id), "%016llx-p", (unsigned long long)hash);
+
+    struct lane proto = { .filename = filename, .path = destination_path, .id = id, .fd = -1, .chunk = chunk,
+                          .size = st->st_size };
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (run_lanes(&proto, 0, st->st_size) < 0) return;
+    double ms = elapsed_ms(&start);
+
+    // Every range is stored: make the file appear
+    snprintf(command, sizeof(command), "uploadcommit %s %s %s %lld %s", filename, destination_path, id,
+             (long long)st->st_size, check);
+    for (int attempt = 0;; attempt++) {
+        if (*sock != -1) {
+            send_command(*sock, command);
+            if (recv_reply(*sock, reply, sizeof(reply)) > 0) break;
+        }
+        if (reconnect(sock, attempt + 1) < 0) {
+            printf("Error: Connection to server lost before the upload was committed.\n");
+            return;
+        }
+    }
+    printf("%s", reply);
+    printf("(%lld bytes over %d streams, %.1f MB/s)\n", (long long)st->st_size, transfer_streams,
+           ms > 0 ? st->st_size / 1048.576 / ms : 0.0);
+}
+
+/* Download a file over transfer_streams connections at once */
+/*
+  The first chunk comes over the command connection, and its end frame says
+  how large the file is; the rest is split into one range per stream, each
+  fetched over its own connection and pwrite()n straight into place in
+  <name>.parallel, which is checked against the server's checksum and
+  renamed once every range is in.
+  Returns 1 if the sequential path should be used instead (the command
+  connection failed before anything was learned), otherwise 0
+*/
+int download_parallel(int *sock, char *filepath, char *filename) {
+    char temp[512], command[600], msg[BUFFER_SIZE];
+    snprintf(temp, sizeof(temp), "%s.parallel", filename);
+    int fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0644);  // Read back for the checksum
+    if (fd < 0) {
+        perror("Error creating file");
+        return 0;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long long chunk = chunk_bytes(), size = -1;
+    snprintf(command, sizeof(command), "downlf %s 0 %lld", filepath, chunk);
+    send_command_deflate(*sock, command);
+    long long first = recv_stream_at(*sock, fd, 0, NULL, msg, sizeof(msg));
+    if (first >= 0 && sscanf(msg, "size=%lld", &size) != 1) size = first;  // Server doesn't say: take what came
+    if (first >= 0 && size > first) {
+        struct lane proto = { .path = filepath, .fd = fd };
+        if (run_lanes(&proto, first, size - first) < 0) first = -3;
+    }
+    uint32_t crc, expected;
+    if (first >= 0 && checksum_parse(msg, &expected) && (crc32c_fd(fd, 0, size, &crc) < 0 || crc != expected)) {
+        printf("Error: Checksum mismatch; the download was corrupted and has been discarded.\n");
+        first = -3;
+    }
+    close(fd);
+    if (first >= 0 && rename(temp, filename) == 0) {
+        double ms = elapsed_ms(&start);
+        printf("File downloaded: %s (%lld bytes over %d streams, %.1f MB/s)\n", filename, size,
+               size > first ? transfer_streams : 1, ms > 0 ? size / 1048.576 / ms : 0.0);
+        return 0;
     }
+    remove(temp);
+    if (first == -2) printf("%s", msg);
+    if (first >= 0) printf("Error: Could not save the downloaded file.\n");
+    if (first != -1) return 0;
+    if (reconnect(sock, 1) == 0) return 1;
+    printf("Error: Connection to server lost.\n");
+    return 0;
 }
 
 /* Upload a file to the server */
-void upload_file(int sock, char *filename, char *destination_path) {
+void upload_file(int *sock, char *filename, char *destination_path) {
     // Open the file in binary read mode
     FILE *file = fopen(filename, "rb");
     if (!file) {
@@ -70,6 +538,24 @@ void upload_file(int sock, char *filename, char *destination_path) {
         return;
     }
 
+    // Large files go up in resumable chunks, over several connections at
+    // once in parallel mode
+    struct stat st;
+    long long chunk = chunk_bytes();
+    if (fstat(fileno(file), &st) == 0 && st.st_size > chunk) {
+        // The server checks the assembled file against this before committing it
+        char check[32] = "";
+        uint32_t crc;
+        if (crc32c_fd(fileno(file), 0, st.st_size, &crc) == 0) checksum_format(check, sizeof(check), crc);
+        check[strcspn(check, "\n")] = '\0';
+        if (transfer_streams > 1)
+            upload_parallel(sock, filename, destination_path, &st, chunk, check);
+        else
+            upload_chunked(sock, file, filename, destination_path, &st, chunk, check);
+        fclose(file);
+        return;
+    }
+
     /*
       snprintf() is a secure string formatting function that:
         Formats data into a string (like printf)
@@ -80,32 +566,32 @@ void upload_file(int sock, char *filename, char *destination_path) {
     char command[512];
     snprintf(command, sizeof(command), "uploadf %s %s", filename, destination_path);
     
-    // Send the upload command to server
-    send_command(sock, command);
-    sleep(1);  // Brief delay to ensure server is ready for file data
+    // Send the upload command to server, immediately followed by the file data
+    send_command(*sock, command);
 
-    // Read file contents and send to server in chunks
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    while ((bytes = fread(buffer, 1, BUFFER_SIZE, file)) > 0) {
-        send(sock, buffer, bytes, 0);  // Send each chunk
-    }
+    // Send file contents as a sized data frame (or deflated frames, for a
+    // type worth compressing) plus an end-of-stream frame carrying the file's
+    // checksum, which the server checks before keeping it
+    if (compress_upload_wanted(filename))
+        compress_send_stream(*sock, next_request_id - 1, file);
+    else
+        send_file_stream(*sock, next_request_id - 1, file);
     fclose(file);  // Close the file when done
    
     // Wait for and print server's response to upload
-    receive_response(sock);
+    receive_response(*sock);
 }
 
 /* Download a file from the server */
-void download_file(int sock, char *filepath) {
-    // Format the download command with full file path
-    char command[512];
-    snprintf(command, sizeof(command), "downlf %s", filepath);
-    
-    // Send download command to server
-    send_command(sock, command);
-    sleep(1);  // Brief delay to allow server to prepare file
-
+/*
+  The file is received into <name>.part, checked against the checksum the
+  server sends after the data, and renamed when complete. If the
+  connection drops, the client reconnects and asks for the rest with a byte
+  range; a .part left by an earlier run is resumed the same way. With an
+  explicit range ("downlf <path> <offset> [length]") just those bytes are
+  written at that offset of the local file.
+*/
+void download_file(int *sock, char *filepath, const char *range) {
     // Extract just the filename from the full path
     char *filename = strrchr(filepath, '/');
     if (filename == NULL) {
@@ -114,35 +600,76 @@ void download_file(int sock, char *filepath) {
         filename++;  // Skip the '/' character
     }
 
-    // Create a new file to store downloaded data
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
-        perror("Error creating file");
-        return;
-    }
+    char command[600], msg[BUFFER_SIZE], part[512];
+    long long offset = -1, length = -1;
+    if (range) sscanf(range, "%lld %lld", &offset, &length);
+    int ranged = offset >= 0;
+    if (!ranged && transfer_streams > 1 && download_parallel(sock, filepath, filename) == 0) return;
+    snprintf(part, sizeof(part), "%s%s", filename, ranged ? "" : ".part");
 
-    // Receive file data from server
-    char buffer[BUFFER_SIZE];
-    int bytes;
-    while ((bytes = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        // Check if server sent an error message instead of file data
-        if (bytes < BUFFER_SIZE && buffer[0] == 'E') {
-            printf("%s", buffer);  // Print error message
-            fclose(file);
-            remove(filename);  // Delete any partially downloaded file
+    int attempt = 0;
+    while (1) {
+        // Open the target without truncating it (before asking for the data,
+        // so a local failure doesn't leave an unread reply on the socket)
+        int fd = open(part, O_RDWR | O_CREAT, 0644);  // Readable: a resumed part is hashed first
+        FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!file) {
+            perror("Error creating file");
+            if (fd >= 0) close(fd);
+            return;
+        }
+        struct stat st;
+        long long have = ranged ? offset : (fstat(fd, &st) == 0 ? (long long)st.st_size : 0);
+
+        // The checksum covers the whole file, so a resumed download starts
+        // from the checksum of the bytes it already has
+        uint32_t crc = 0, expected;
+        if (!ranged && have > 0 && crc32c_fd(fd, 0, have, &crc) < 0) have = 0;
+        fseeko(file, have, SEEK_SET);
+
+        // Ask for everything not received yet
+        if (ranged && length >= 0)
+            snprintf(command, sizeof(command), "downlf %s %lld %lld", filepath, offset, length);
+        else if (have > 0)
+            snprintf(command, sizeof(command), "downlf %s %lld", filepath, have);
+        else
+            snprintf(command, sizeof(command), "downlf %s", filepath);
+        send_command_deflate(*sock, command);  // Text comes back deflated (compress.h)
+
+        // Receive file data frames from server until the end-of-stream frame
+        long long bytes = recv_stream_checked(*sock, file, msg, sizeof(msg), &crc);
+        fclose(file);
+        if (bytes >= 0 && ranged) {
+            printf("Wrote %lld bytes at offset %lld of %s\n", bytes, offset, filename);
+            return;
+        }
+        if (bytes >= 0 && checksum_parse(msg, &expected) && crc != expected) {
+            printf("Error: Checksum mismatch; the download was corrupted and has been discarded.\n");
+            remove(part);
+            return;
+        }
+        if (bytes >= 0 && rename(part, filename) == 0) {
+            printf("File downloaded: %s\n", filename);  // Confirm successful download
+            return;
+        }
+        if (bytes == -2 && !ranged && have > 0 && attempt++ == 0) {
+            remove(part);  // The .part doesn't fit the file on the server any more; start over
+            continue;
+        }
+        if (bytes == -2 || bytes >= 0) {
+            // Server sent an error message instead of file data
+            printf("%s", bytes == -2 ? msg : "Error: Could not save the downloaded file.\n");
+            if (!ranged) remove(part);
             return;
         }
-        
-        // Write received data to file
-        fwrite(buffer, 1, bytes, file);
-        
-        // If received less than full buffer, transfer is complete
-        if (bytes < BUFFER_SIZE) break;
-    }
-    fclose(file);
-    printf("File downloaded: %s\n", filename);  // Confirm successful download
-}
 
+        // Connection lost: keep what arrived and ask for the rest
+        if (ranged || reconnect(sock, ++attempt) < 0) {
+            printf("Error: Connection to server lost.%s\n", ranged ? "" : " Run downlf again to resume.");
+            return;
+        }
+    }
+}
 
 /* Request server to remove a file */
 void remove_file(int sock, char *filepath) {
@@ -154,49 +681,63 @@ void remove_file(int sock, char *filepath) {
     send_command(sock, command);
     
     // Wait for and display server's response
-    char response[BUFFER_SIZE];
-    int bytes = recv(sock, response, BUFFER_SIZE, 0);
-    if (bytes > 0) {
-        response[bytes] = '\0';  // Null-terminate the response
-        printf("%s", response);  // Print server's response
-    }
+    receive_response(sock);
 }
 
-/* Download a tar archive of specific file type from server */
-void download_tar(int sock, char *filetype) {
-    // Validate requested file type against supported types
-    if (strcmp(filetype, ".c") != 0 && 
-        strcmp(filetype, ".pdf") != 0 && 
-        strcmp(filetype, ".txt") != 0) {
-        printf("Error: Only .c, .pdf, or .txt file types are supported.\n");
+/* Download a tar archive of specific file type from server
+ * filetype: one type (.pdf), a comma-separated list (.pdf,.zip) or "all",
+ * the last two giving one archive that S1 joins from every server involved
+ * options: the words after the type: "gz" for a gzipped archive (gzipped by
+ * the servers in parallel and saved as it arrives, as <name>.tar.gz), and
+ * dir=~S1/sub, glob=<pattern> and since=<YYYY-MM-DD[THH:MM:SS] or epoch
+ * seconds> to archive only part of the files (the servers filter them) */
+void download_tar(int sock, char *filetype, const char *options) {
+    // Validate the file type(s); which types exist is up to S1's routing table
+    int all = strcmp(filetype, "all") == 0, valid = all;
+    for (const char *t = filetype; !all; t = strchr(t, ',') + 1) {
+        valid = t[0] == '.' && t[1] != '\0' && t[1] != ',';
+        if (!valid || !strchr(t, ',')) break;
+    }
+    if (!valid || strchr(filetype, '/')) {
+        printf("Error: Give a file type such as .c, .pdf or .txt (or several: .pdf,.zip, or all).\n");
         return;
     }
+    // gz picks the output name; the filters go to the server as given
+    char filters[400] = "", word[300];
+    int gzip = 0, used;
+    while (sscanf(options, "%299s%n", word, &used) == 1) {
+        options += used;
+        if (strcmp(word, "gz") == 0 || strcmp(word, "gzip") == 0 || strcmp(word, "tgz") == 0) {
+            gzip = 1;
+        } else if (strncmp(word, "dir=", 4) == 0 || strncmp(word, "glob=", 5) == 0 || strncmp(word, "since=", 6) == 0) {
+            if (strlen(filters) + strlen(word) + 2 > sizeof(filters)) break;
+            strcat(filters, " ");
+            strcat(filters, word);
+        } else {
+            printf("Error: Unknown archive option %.20s (use gz, dir=, glob= or since=).\n", word);
+            return;
+        }
+    }
 
     // Determine output tar filename based on file type
-    char tarname[20];  // Buffer for tar filename
+    char tarname[64];  // Buffer for tar filename
     if (strcmp(filetype, ".c") == 0)
         strcpy(tarname, "cfiles.tar");    // C files archive
     else if (strcmp(filetype, ".pdf") == 0)
         strcpy(tarname, "pdf.tar");       // PDF files archive
     else if (strcmp(filetype, ".txt") == 0)
         strcpy(tarname, "text.tar");      // Text files archive
-
-    // Format and send download command to server
-    char command[512];
-    snprintf(command, sizeof(command), "downltar %s", filetype);
-    send_command(sock, command);
-    sleep(1);  // Allow server time to prepare the tar file
-
-    // Check for error response from server (peek without removing from queue)
-    char response[BUFFER_SIZE];
-    int bytes = recv(sock, response, BUFFER_SIZE, MSG_PEEK | MSG_DONTWAIT);
-    if (bytes > 0 && response[0] == 'E') {
-        // Actually read the error message to clear buffer
-        bytes = recv(sock, response, BUFFER_SIZE, 0);
-        response[bytes] = '\0';
-        printf("%s", response);  // Display server error
-        return;
-    }
+    else if (all)
+        strcpy(tarname, "allfiles.tar");  // Every type S1 routes
+    else if (strchr(filetype, ',')) {
+        // Several types: e.g. pdf-zipfiles.tar for .pdf,.zip
+        size_t n = 0;
+        for (const char *p = filetype; *p && n < 40; p++)
+            if (*p != '.') tarname[n++] = *p == ',' ? '-' : *p;
+        strcpy(tarname + n, "files.tar");
+    } else
+        snprintf(tarname, sizeof(tarname), "%.40sfiles.tar", filetype + 1);  // e.g. zipfiles.tar
+    if (gzip) strcat(tarname, ".gz");
 
     // Create output file for the tar archive
     FILE *file = fopen(tarname, "wb");  // Open in binary write mode
@@ -205,26 +746,21 @@ void download_tar(int sock, char *filetype) {
         return;
     }
 
-    // Receive and save the tar file contents
-    char buffer[BUFFER_SIZE];
-    int total_bytes = 0;
-    while ((bytes = recv(sock, buffer, BUFFER_SIZE, 0)) > 0) {
-        // Check if server sent an error message instead of file data
-        if (bytes < BUFFER_SIZE && buffer[0] == 'E') {
-            printf("%.*s", bytes, buffer);  // Print error message
-            fclose(file);
-            remove(tarname);  // Delete incomplete/empty tar file
-            return;
-        }
-        
-        // Write received data to file
-        fwrite(buffer, 1, bytes, file);
-        total_bytes += bytes;  // Track total bytes received
-        
-        // If received less than full buffer, transfer is complete
-        if (bytes < BUFFER_SIZE) break;
-    }
+    // Format and send download command to server
+    char command[1024];
+    snprintf(command, sizeof(command), "downltar %s%s%s", filetype, gzip ? " gz" : "", filters);
+    send_command(sock, command);
+
+    // Receive and save the tar data frames until the end-of-stream frame
+    char msg[BUFFER_SIZE];
+    long long total_bytes = recv_stream_to_file(sock, file, msg, sizeof(msg));
     fclose(file);  // Close the tar file
+    if (total_bytes < 0) {
+        // Server sent an error message instead of tar data (or went away)
+        printf("%s", total_bytes == -2 ? msg : "Error: Connection to server lost.\n");
+        remove(tarname);  // Delete incomplete/empty tar file
+        return;
+    }
 
     // Verify we actually received data
     if (total_bytes == 0) {
@@ -234,7 +770,7 @@ void download_tar(int sock, char *filetype) {
     }
 
     // Success message with downloaded archive info
-    printf("Successfully downloaded %s containing all %s files.\n", tarname, filetype);
+    printf("Successfully downloaded %s containing all %s files.\n", tarname, all ? "routed" : filetype);
 }
 
 /* Display list of files in specified directory from server */
@@ -242,38 +778,43 @@ void display_filenames(int sock, char *pathname) {
     // Send directory listing request to server
     char command[512];
     snprintf(command, sizeof(command), "dispfnames %s", pathname);
-    send(sock, command, strlen(command), 0);
+    send_command(sock, command);
 
     // Print directory header
     printf("Files in %s:\n", pathname);
 
-    // Receive and process server response
+    // Receive and process server response: data frames of names, then end frame
+    struct frame_header h;
     char buffer[BUFFER_SIZE];
-    int bytes;
-    int expecting_more = 1;  // Flag to track if more data is coming
+    long long total = 0;  // Bytes of names received
     
-    while (expecting_more) {
-        bytes = recv(sock, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes <= 0) break;  // Connection closed or error
-        
-        buffer[bytes] = '\0';  // Null-terminate received data
-        
-        // Check for end-of-transmission marker
-        if (strstr(buffer, "ENDOFLIST")) {
-            expecting_more = 0;  // No more data after this
-            char *end = strstr(buffer, "ENDOFLIST");
-            *end = '\0';  // Terminate string before marker
+    while (recv_frame_header(sock, &h) == 0) {
+        if (h.opcode == OP_MSG || h.opcode == OP_ERROR) {
+            recv_text_payload(sock, h.length, buffer, sizeof(buffer));
+            printf("%s", buffer);  // Print server's error
+            return;
         }
-        
-        printf("%s", buffer);  // Print received filenames
+        if (h.opcode == OP_END) {
+            skip_payload(sock, h.length);
+            if (total == 0) printf("(No files found)\n");  // Handle empty directory case
+            return;
+        }
+
+        uint64_t remaining = h.length;
+        while (remaining > 0) {
+            size_t n = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+            if (recv_all(sock, buffer, n) < 0) break;
+            fwrite(buffer, 1, n, stdout);  // Print received filenames
+            remaining -= n;
+        }
+        total += h.length;
         fflush(stdout);       // Ensure immediate display
     }
-    
-    // printf("\n");  // Final newline for clean output
+    printf("Error: Connection to server lost.\n");
 }
 
-/* Main client program entry point */
-int main() {
+/* Open a new TCP connection to S1; returns the socket or -1 */
+int connect_to_s1(void) {
     int sock;  // Socket file descriptor for server connection
     struct sockaddr_in server_addr;  // Server address structure
 
@@ -281,7 +822,7 @@ int main() {
     sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
         perror("Socket creation failed");  // Print system error if socket creation fails
-        return 1;  // Exit with error code
+        return -1;
     }
 
     /* Configure server address structure */
@@ -293,8 +834,205 @@ int main() {
     /* Establish connection to the server */
     if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         perror("Connection failed");  // Print system error if connection fails
-        return 1;  // Exit with error code
+        close(sock);
+        return -1;
+    }
+    set_nodelay(sock);  // Commands are small; send them without delay
+    return sock;
+}
+
+/* One benchmark connection: issues `requests` commands back to back */
+struct bench_job {
+    const char *command;   // Full command line sent for every request
+    int requests;          // Requests to issue on this connection
+    double *latencies;     // Per-request latency in ms (filled in)
+    long long bytes;       // Payload bytes received
+    int failures;          // Requests answered with an error
+};
+
+void *bench_worker(void *arg) {
+    struct bench_job *job = arg;
+    char msg[BUFFER_SIZE];
+    int sock = connect_to_s1();
+    for (int i = 0; i < job->requests; i++) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long long got = -1;
+        if (sock != -1 && send_request(sock, i + 1, job->command) == 0)
+            got = recv_stream_to_file(sock, NULL, msg, sizeof(msg));  // Discard the data
+        job->latencies[i] = elapsed_ms(&start);
+        if (got < 0) job->failures++;
+        else job->bytes += got;
+    }
+    if (sock != -1) close(sock);
+    return NULL;
+}
+
+int cmp_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Load-test S1 (and the sub-server behind it) with concurrent connections */
+/*
+  bench <downlf|dispfnames|downltar> <path> <requests> <connections>
+  Every connection issues requests/connections commands back to back; the
+  report gives throughput plus median and p99 latency, so runs with
+  different DFS_WORKERS / DFS_ZEROCOPY settings can be compared.
+*/
+void run_benchmark(char *op, char *path, int requests, int connections) {
+    if (requests < 1 || connections < 1 || connections > 1024) {
+        printf("Usage: bench <downlf|dispfnames|downltar> <path> <requests> <connections>\n");
+        return;
+    }
+    char command[512];
+    snprintf(command, sizeof(command), "%s %s", op, path);
+
+    int per_conn = (requests + connections - 1) / connections;
+    double *latencies = calloc((size_t)per_conn * connections, sizeof(double));
+    struct bench_job *jobs = calloc(connections, sizeof(struct bench_job));
+    pthread_t *threads = calloc(connections, sizeof(pthread_t));
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < connections; i++) {
+        jobs[i].command = command;
+        jobs[i].requests = per_conn;
+        jobs[i].latencies = latencies + (size_t)i * per_conn;
+        pthread_create(&threads[i], NULL, bench_worker, &jobs[i]);
+    }
+    long long bytes = 0;
+    int failures = 0;
+    for (int i = 0; i < connections; i++) {
+        pthread_join(threads[i], NULL);
+        bytes += jobs[i].bytes;
+        failures += jobs[i].failures;
+    }
+    double total_ms = elapsed_ms(&start);
+
+    int n = per_conn * connections;
+    qsort(latencies, n, sizeof(double), cmp_doubles);
+    printf("%d requests over %d connections in %.1f ms\n", n, connections, total_ms);
+    printf("  %.1f ops/sec, %.1f MB/s, %d failed\n", n / (total_ms / 1000.0),
+           bytes / 1048.576 / total_ms, failures);
+    printf("  latency p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+           latencies[n / 2], latencies[(n * 99) / 100 < n ? (n * 99) / 100 : n - 1], latencies[n - 1]);
+
+    free(latencies);
+    free(jobs);
+    free(threads);
+}
+
+/* Measure CRC32C throughput on each engine */
+/*
+  hashbench [MB]
+  Hashes an MB-sized buffer (default 256) several times with the hardware
+  and the table CRC32C and prints GB/s next to a memcpy of the same buffer,
+  plus the share of one core checksumming takes at 10 Gbit/s line rate.
+*/
+void run_hashbench(int mb) {
+    if (mb < 1 || mb > 4096) mb = 256;
+    size_t len = (size_t)mb << 20;
+    unsigned char *buf = malloc(len), *copy = malloc(len);
+    if (!buf || !copy) {
+        printf("Error: Out of memory.\n");
+        free(buf);
+        free(copy);
+        return;
     }
+    for (size_t i = 0; i < len; i++) buf[i] = (unsigned char)(i * 2654435761u >> 13);
+    memcpy(copy, buf, len);  // Fault the pages in before timing
+
+    // Same answers on every engine (and the standard check value)
+    if (crc32c_sw(0, "123456789", 9) != 0xE3069283 || crc32c(0, buf, 4099) != crc32c_sw(0, buf, 4099)) {
+        printf("Error: CRC32C self-test failed.\n");
+        free(buf);
+        free(copy);
+        return;
+    }
+
+    const char *names[3] = { crc32c_engine(), "table", "memcpy" };
+    double gbps[3];
+    for (int e = 0; e < 3; e++) {
+        int rounds = e == 1 ? 1 : 4;
+        volatile uint32_t sink = 0;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int r = 0; r < rounds; r++) {
+            if (e == 0) sink ^= crc32c(0, buf, len);
+            else if (e == 1) sink ^= crc32c_sw(0, buf, len);
+            else memcpy(copy, buf, len);
+        }
+        double ms = elapsed_ms(&start);
+        gbps[e] = ms > 0 ? (double)len * rounds / ms / 1e6 : 0.0;
+        (void)sink;
+    }
+    for (int e = 0; e < 3; e++)
+        printf("  %-10s %7.2f GB/s\n", names[e], gbps[e]);
+    printf("  at 10 Gbit/s line rate, crc32c (%s) keeps %.1f%% of one core busy\n", names[0],
+           gbps[0] > 0 ? 1.25 / gbps[0] * 100 : 0.0);
+    free(buf);
+    free(copy);
+}
+
+/* Main client program entry point */
+// Function to request one page of a filtered listing (listf)
+// Parameters:
+//   sock - connected socket to S1
+//   pathname - directory to list
+//   options - option words (type=, prefix=, glob=, cursor=, limit=, long)
+void list_files(int sock, const char *pathname, const char *options) {
+    char command[1024];
+    snprintf(command, sizeof(command), "listf %s%s", pathname, options);
+    send_command(sock, command);
+
+    struct frame_header h;
+    char buffer[BUFFER_SIZE];
+    long long total = 0;  // Bytes of names received
+
+    while (recv_frame_header(sock, &h) == 0) {
+        if (h.opcode == OP_MSG || h.opcode == OP_ERROR) {
+            recv_text_payload(sock, h.length, buffer, sizeof(buffer));
+            printf("%s", buffer);  // Print server's error
+            return;
+        }
+        if (h.opcode == OP_END) {
+            // A cut-short page names the cursor for the next one
+            if (recv_text_payload(sock, h.length, buffer, sizeof(buffer)) < 0) break;
+            if (total == 0) printf("(No files found)\n");
+            if (strncmp(buffer, "next=", 5) == 0) {
+                buffer[strcspn(buffer, "\n")] = '\0';
+                printf("(more: add cursor=%s for the next page)\n", buffer + 5);
+            }
+            return;
+        }
+
+        uint64_t remaining = h.length;
+        while (remaining > 0) {
+            size_t n = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+            if (recv_all(sock, buffer, n) < 0) break;
+            fwrite(buffer, 1, n, stdout);  // Print received lines
+            remaining -= n;
+        }
+        total += h.length;
+        fflush(stdout);
+    }
+    printf("Error: Connection to server lost.\n");
+}
+
+int main() {
+    // sendfile() into a connection the peer dropped must fail with EPIPE (and
+    // leave the transfer resumable) rather than kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    io_engine_init();  // DFS_IO_ENGINE=uring also batches the writes of downloaded files
+
+    char *env_streams = getenv("DFS_STREAMS");  // Parallel transfer mode from the start
+    if (env_streams && atoi(env_streams) >= 1 && atoi(env_streams) <= MAX_STREAMS)
+        transfer_streams = atoi(env_streams);
+
+    int sock = connect_to_s1();  // Socket file descriptor for server connection
+    if (sock == -1) return 1;  // Exit with error code
 
     /* Connection established - print welcome message */
     printf("Connected to S1 server. Enter commands below:\n");
@@ -313,25 +1051,52 @@ int main() {
 
         /* Get user input */
         // fgets - It is commonly used for reading input from a file or from standard input (stdin).
-        fgets(input, sizeof(input), stdin);
+        if (!fgets(input, sizeof(input), stdin)) break;  // End of input
         /* Remove trailing newline character from input */
         // The strcspn() function searches for the first occurrence in a string of any of the specified characters
         input[strcspn(input, "\n")] = 0;
 
         /* Parse input into command and arguments */
         // sscanf - function reads formatted input from a string and stores the result in the provided variables.
-        if (sscanf(input, "%s %s %s", command, arg1, arg2) >= 1) {
+        // (after1: the text following the first argument, e.g. a byte range)
+        arg1[0] = arg2[0] = '\0';  // Don't let a previous command's arguments leak in
+        int end1 = 0;
+        if (sscanf(input, "%s %s%n %s", command, arg1, &end1, arg2) >= 1) {
+            const char *after1 = end1 ? input + end1 : "";
             /* Execute appropriate command based on user input */
+            if (sock == -1 && strcmp(command, "exit") != 0 && (sock = connect_to_s1()) == -1)
+                continue;                            // A transfer gave up on S1 earlier; try again
             if (strcmp(command, "uploadf") == 0)
-                upload_file(sock, arg1, arg2);       // Handle file upload
+                upload_file(&sock, arg1, arg2);      // Handle file upload
             else if (strcmp(command, "downlf") == 0)
-                download_file(sock, arg1);           // Handle file download
+                // Optional byte range after the path
+                download_file(&sock, arg1, arg2[0] ? after1 : NULL);
             else if (strcmp(command, "removef") == 0)
                 remove_file(sock, arg1);             // Handle file removal
             else if (strcmp(command, "downltar") == 0)
-                download_tar(sock, arg1);            // Handle tar file download
+                // Tar file download; gz and filters (dir=, glob=, since=) follow the type
+                download_tar(sock, arg1, after1);
             else if (strcmp(command, "dispfnames") == 0)
                 display_filenames(sock, arg1);       // Handle directory listing
+            else if (strcmp(command, "listf") == 0 && arg1[0])
+                list_files(sock, arg1, after1);  // Paginated listing
+            else if (strcmp(command, "streams") == 0) {
+                // Parallel mode: large files move over this many connections
+                int n = atoi(arg1);
+                if (n >= 1 && n <= MAX_STREAMS) transfer_streams = n;
+                printf("Large transfers use %d stream%s.\n", transfer_streams, transfer_streams == 1 ? "" : "s");
+            }
+            else if (strcmp(command, "stats") == 0) {
+                send_command(sock, "stats");         // Show S1's runtime counters
+                receive_response(sock);
+            }
+            else if (strcmp(command, "hashbench") == 0)
+                run_hashbench(atoi(arg1));           // Checksum throughput, no server involved
+            else if (strcmp(command, "bench") == 0) {
+                int requests = 0, connections = 1;
+                sscanf(input, "%*s %*s %*s %d %d", &requests, &connections);
+                run_benchmark(arg1, arg2, requests, connections);  // Load test
+            }
             else if (strcmp(command, "exit") == 0)
                 return 0;
             else